@@ -1,12 +1,32 @@
 #include "kv_engine.h"
+#include "fault_env.h"
+#include "segment.h"
+#include "key_prefix.h"
+#include "cuckoo_table.h"
 #include <iostream>
 #include <chrono>
 #include <thread>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 using namespace std;
 using Clock = chrono::high_resolution_clock;
 
+// Options shared by every benchmark; the second argument picks the Env:
+// "mem" measures pure engine overhead, "slow" adds a degraded disk on top.
+static Options bench_options;
+
 long long elapsed_ms(Clock::time_point s, Clock::time_point e) {
     return chrono::duration_cast<chrono::milliseconds>(e - s).count();
 }
@@ -15,7 +35,7 @@ long long elapsed_ms(Clock::time_point s, Clock::time_point e) {
 void bench_put() {
     cout << "[BENCH] PUT throughput\n";
 
-    KVEngine* e = CreateKVEngine();
+    KVEngine* e = CreateKVEngine(bench_options);
     const int N = 100000;
 
     auto start = Clock::now();
@@ -38,7 +58,7 @@ void bench_put() {
 void bench_get() {
     cout << "[BENCH] GET throughput\n";
 
-    KVEngine* e = CreateKVEngine();
+    KVEngine* e = CreateKVEngine(bench_options);
     const int N = 100000;
 
     for (int i = 0; i < N; i++) {
@@ -63,7 +83,7 @@ void bench_get() {
 void bench_concurrent_get() {
     cout << "[BENCH] Concurrent GET throughput\n";
 
-    KVEngine* e = CreateKVEngine();
+    KVEngine* e = CreateKVEngine(bench_options);
     const int N = 100000;
     const int THREADS = 100;
 
@@ -95,6 +115,771 @@ void bench_concurrent_get() {
     delete e;
 }
 
+// put latency distribution
+void bench_put_latency() {
+    cout << "[BENCH] PUT latency percentiles\n";
+
+    KVEngine* e = CreateKVEngine(bench_options);
+    const int N = 2000;
+
+    vector<long long> lat;
+    lat.reserve(N);
+    for (int i = 0; i < N; i++) {
+        auto s = Clock::now();
+        e->put("k" + to_string(i), "v" + to_string(i));
+        lat.push_back(chrono::duration_cast<chrono::microseconds>(Clock::now() - s).count());
+    }
+    sort(lat.begin(), lat.end());
+
+    cout << "Ops      : " << N << "\n";
+    cout << "p50(us)  : " << lat[N / 2] << "\n";
+    cout << "p99(us)  : " << lat[N * 99 / 100] << "\n";
+    cout << "p999(us) : " << lat[N * 999 / 1000] << "\n";
+    cout << "max(us)  : " << lat.back() << "\n";
+
+    delete e;
+}
+
+// change feed read rate vs. re-scanning the whole keyspace
+void bench_updates() {
+    cout << "[BENCH] get_updates_since vs full scan\n";
+
+    Options opts = bench_options;
+    opts.mem_limit = 10000;
+    opts.wal_ttl_seconds = 3600;
+    KVEngine* e = CreateKVEngine(opts);
+    const int N = 100000;
+
+    WriteBatch b;
+    for (int i = 0; i < N; i++) {
+        b.put("k" + to_string(i), "v" + to_string(i));
+        if (b.count() == 1000) {
+            e->write(b);
+            b.clear();
+        }
+    }
+
+    auto start = Clock::now();
+    UpdateIterator* it = nullptr;
+    long long n = 0;
+    if (e->get_updates_since(1, &it).ok()) {
+        for (; it->valid(); it->next()) n++;
+    }
+    delete it;
+    long long tail_ms = elapsed_ms(start, Clock::now());
+
+    start = Clock::now();
+    vector<pair<string, string>> rows;
+    e->scan("", N, &rows);
+    long long scan_ms = elapsed_ms(start, Clock::now());
+
+    cout << "Records  : " << n << "\n";
+    cout << "Tail(ms) : " << tail_ms << "\n";
+    cout << "Scan(ms) : " << scan_ms << "\n";
+
+    delete e;
+}
+
+// reopen time after a clean close, with and without the memtable image
+void bench_reopen() {
+    cout << "[BENCH] Reopen after clean close\n";
+
+    const int N = 200000;
+    for (bool image : {false, true}) {
+        Options opts = bench_options;
+        opts.path = image ? "reopen_image" : "reopen_replay";
+        opts.mem_limit = N + 1;
+        opts.memtable_image_on_close = image;
+
+        KVEngine* e = CreateKVEngine(opts);
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            b.put("k" + to_string(i), "v" + to_string(i));
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+        delete e;
+
+        auto start = Clock::now();
+        e = CreateKVEngine(opts);
+        long long ms = elapsed_ms(start, Clock::now());
+        cout << (image ? "Image(ms)  : " : "Replay(ms) : ") << ms << "\n";
+        delete e;
+    }
+}
+
+// log replay time at open, single-threaded vs one thread per core
+void bench_recovery() {
+    cout << "[BENCH] Parallel log recovery\n";
+
+    const int N = 200000;
+    Options opts = bench_options;
+    opts.path = "recovery_db";
+    opts.mem_limit = N + 1;
+    opts.memtable_image_on_close = false;
+
+    KVEngine* e = CreateKVEngine(opts);
+    WriteBatch b;
+    for (int i = 0; i < N; i++) {
+        b.put("k" + to_string(i), "v" + to_string(i));
+        if (b.count() == 1000) {
+            e->write(b);
+            b.clear();
+        }
+    }
+    delete e;
+
+    int cores = max(1u, thread::hardware_concurrency());
+    for (int threads : {1, cores}) {
+        opts.recovery_threads = threads;
+        auto start = Clock::now();
+        e = CreateKVEngine(opts);
+        long long ms = elapsed_ms(start, Clock::now());
+        cout << "Threads " << threads << " (ms) : " << ms << "\n";
+        delete e;
+    }
+}
+
+// the same load, random point reads and range scans against each engine
+void bench_engines() {
+    cout << "[BENCH] Engine comparison\n";
+
+    const int N = 100000;
+    const int GETS = 2000;
+    const int SCANS = 200;
+    vector<pair<string, EngineType>> engines = {
+        {"lsm", EngineType::LSM},
+        {"bitcask", EngineType::BITCASK},
+        {"btree", EngineType::BTREE},
+    };
+    auto per_sec = [](int n, Clock::time_point start) {
+        double s = chrono::duration<double>(Clock::now() - start).count();
+        return (long long)(n / max(s, 1e-9));
+    };
+    for (const auto& [name, type] : engines) {
+        Options opts = bench_options;
+        opts.engine = type;
+        opts.path = "engines_" + name;
+        opts.mem_limit = 10000;
+        opts.compaction_threshold = 1000;
+
+        KVEngine* e = CreateKVEngine(opts);
+        auto start = Clock::now();
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            b.put("k" + to_string(i), string(100, 'v'));
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+        long long load_ms = elapsed_ms(start, Clock::now());
+
+        string v;
+        unsigned x = 12345;
+        start = Clock::now();
+        for (int i = 0; i < GETS; i++) {
+            x = x * 1103515245 + 12345;
+            e->get("k" + to_string(x % N), &v);
+        }
+        long long gets = per_sec(GETS, start);
+
+        vector<pair<string, string>> rows;
+        start = Clock::now();
+        for (int i = 0; i < SCANS; i++) {
+            x = x * 1103515245 + 12345;
+            e->scan("k" + to_string(x % N), 100, &rows);
+        }
+        long long scans = per_sec(SCANS, start);
+
+        cout << name << "\tload(ms) " << load_ms << "\tget ops/sec " << gets
+             << "\tscan(100) ops/sec " << scans << "\n";
+        delete e;
+    }
+}
+
+// cache engine against the durable LSM engine, and hit rate per eviction
+// policy for a read-through cache under a Zipf(0.99) key distribution
+void bench_cache() {
+    cout << "[BENCH] Cache engine\n";
+
+    const int N = 20000;
+    auto per_sec = [](int n, Clock::time_point start) {
+        double s = chrono::duration<double>(Clock::now() - start).count();
+        return (long long)(n / max(s, 1e-9));
+    };
+    for (EngineType type : {EngineType::LSM, EngineType::CACHE}) {
+        Options opts = bench_options;
+        opts.engine = type;
+        opts.path = "cache_vs_lsm";
+        opts.mem_limit = N + 1;
+        opts.memtable_image_on_close = false;
+        KVEngine* e = CreateKVEngine(opts);
+
+        auto start = Clock::now();
+        for (int i = 0; i < N; i++) e->put("k" + to_string(i), string(100, 'v'));
+        long long puts = per_sec(N, start);
+        string v;
+        start = Clock::now();
+        for (int i = 0; i < N; i++) e->get("k" + to_string(i), &v);
+        long long gets = per_sec(N, start);
+        cout << (type == EngineType::CACHE ? "cache" : "lsm") << "\tput ops/sec " << puts
+             << "\tget ops/sec " << gets << "\n";
+        delete e;
+    }
+
+    const int KEYS = 100000;
+    const int OPS = 1000000;
+    vector<double> cdf(KEYS);
+    double sum = 0;
+    for (int i = 0; i < KEYS; i++) cdf[i] = sum += 1.0 / pow(i + 1, 0.99);
+    vector<int> trace(OPS);
+    unsigned x = 1;
+    for (int i = 0; i < OPS; i++) {
+        x = x * 1103515245 + 12345;
+        double r = (x >> 8) / double(1 << 24) * sum;
+        trace[i] = lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+    }
+
+    const char* names[] = {"lru", "clock", "s3fifo"};
+    for (EvictionPolicy policy : {EvictionPolicy::LRU, EvictionPolicy::CLOCK, EvictionPolicy::S3FIFO}) {
+        Options opts;
+        opts.engine = EngineType::CACHE;
+        opts.cache_eviction = policy;
+        opts.cache_capacity_bytes = KEYS / 10 * 250;
+        KVEngine* e = CreateKVEngine(opts);
+        string v;
+        auto start = Clock::now();
+        for (int k : trace) {
+            string key = "k" + to_string(k);
+            if (!e->get(key, &v).ok()) e->put(key, string(100, 'v'));
+        }
+        long long ops = per_sec(OPS, start);
+        EngineStats st = e->stats();
+        cout << names[static_cast<int>(policy)] << "\thit rate " << st.cache_hit_rate()
+             << "\tevictions " << st.cache_evictions << "\tops/sec " << ops << "\n";
+        delete e;
+    }
+}
+
+// segment bytes per raw record byte for small JSON values, compacted into
+// one segment, by block size and codec
+void bench_compression() {
+    cout << "[BENCH] Segment compression\n";
+
+    const int N = 50000;
+    const int GETS = 20000;
+    auto json = [](int i) {
+        return "{\"id\":" + to_string(i) + ",\"user\":\"u" + to_string(i * 7919 % 100000) +
+               "\",\"active\":" + (i % 3 ? "true" : "false") + ",\"score\":" + to_string(i * 31 % 1000) + "}";
+    };
+    uint64_t raw = 0;
+    for (int i = 0; i < N; i++) raw += 8 + 7 + json(i).size();
+
+    struct Variant {
+        const char* name;
+        CompressionType type;
+        size_t dict;
+    };
+    vector<Variant> variants = {
+        {"none", CompressionType::NONE, 0},
+        {"zlib", CompressionType::ZLIB, 0},
+        {"zlib+dict", CompressionType::ZLIB, 4 << 10},
+    };
+    for (size_t block : {256, 4096}) {
+        for (const auto& var : variants) {
+            Options opts = bench_options;
+            opts.path = "compression_bench";
+            opts.mem_limit = N / 2;
+            opts.compaction_threshold = 2;
+            opts.segment_block_size = block;
+            opts.segment_compression = var.type;
+            opts.segment_dictionary_bytes = var.dict;
+            // holds the index, not the data
+            opts.block_cache_bytes = 512 << 10;
+            opts.memtable_image_on_close = false;
+            Env* env = opts.env ? opts.env : DefaultEnv();
+
+            KVEngine* e = CreateKVEngine(opts);
+            for (int i = 0; i < N; i++) e->put("k" + to_string(100000 + i), json(i));
+            vector<string> names;
+            env->getChildren(opts.path + "/segments", &names);
+            uint64_t bytes = 0;
+            for (const auto& name : names) {
+                uint64_t size = 0;
+                env->getFileSize(opts.path + "/segments/" + name, &size);
+                bytes += size;
+            }
+
+            string v;
+            unsigned x = 12345;
+            auto start = Clock::now();
+            for (int i = 0; i < GETS; i++) {
+                x = x * 1103515245 + 12345;
+                e->get("k" + to_string(100000 + x % N), &v);
+            }
+            double s = chrono::duration<double>(Clock::now() - start).count();
+            cout << "block " << block << "\t" << var.name << "\tratio " << (double)raw / bytes
+                 << "\tget ops/sec " << (long long)(GETS / max(s, 1e-9)) << "\n";
+            delete e;
+
+            for (const string dir : {"/segments", "/wal"}) {
+                env->getChildren(opts.path + dir, &names);
+                for (const auto& name : names) env->deleteFile(opts.path + dir + "/" + name);
+            }
+            env->deleteFile(opts.path + "/MANIFEST");
+        }
+    }
+}
+
+// Counts this thread's data TLB load misses, where perf events are
+// available; read() returns -1 where they are not.
+class TlbMissCounter {
+    int fd_ = -1;
+
+    public:
+        TlbMissCounter() {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        ~TlbMissCounter() {
+            if (fd_ >= 0) close(fd_);
+        }
+        void start() {
+            if (fd_ < 0) return;
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        long long read() {
+            if (fd_ < 0) return -1;
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            long long n = 0;
+            return ::read(fd_, &n, sizeof(n)) == sizeof(n) ? n : -1;
+        }
+};
+
+// Gets served from a block cache far larger than the TLB reaches with
+// 4 KiB pages, with its blocks on the heap and then in huge pages.
+void bench_huge_pages() {
+    cout << "[BENCH] Block cache on huge pages\n";
+
+    const int N = 200000;
+    const int GETS = 200000;
+    for (bool huge : {false, true}) {
+        Options opts = bench_options;
+        opts.path = "hugepage_bench";
+        opts.mem_limit = N / 4;
+        opts.block_cache_bytes = 128 << 20;
+        opts.block_cache_huge_pages = huge;
+        opts.memtable_image_on_close = false;
+        Env* env = opts.env ? opts.env : DefaultEnv();
+
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < N; i++) e->put("k" + to_string(100000 + i), string(100, 'a' + i % 26));
+        // every block cached before the timed run
+        string v;
+        for (int i = 0; i < N; i += 10) e->get("k" + to_string(100000 + i), &v);
+
+        TlbMissCounter tlb;
+        unsigned x = 12345;
+        auto start = Clock::now();
+        tlb.start();
+        for (int i = 0; i < GETS; i++) {
+            x = x * 1103515245 + 12345;
+            e->get("k" + to_string(100000 + x % N), &v);
+        }
+        long long misses = tlb.read();
+        double s = chrono::duration<double>(Clock::now() - start).count();
+        EngineStats st = e->stats();
+        cout << (huge ? "huge pages" : "heap") << "\tget ops/sec " << (long long)(GETS / max(s, 1e-9))
+             << "\tdTLB misses/get ";
+        if (misses < 0) cout << "n/a";
+        else cout << (double)misses / GETS;
+        cout << "\thit rate " << (double)st.block_cache_hits / max<uint64_t>(1, st.block_cache_hits + st.block_cache_misses);
+        if (huge) {
+            cout << "\tchunks " << st.block_cache_chunks << " (" << st.block_cache_hugetlb_chunks << " reserved, "
+                 << st.block_cache_advised_chunks << " transparent)";
+        }
+        cout << "\n";
+        delete e;
+
+        vector<string> names;
+        for (const string dir : {"/segments", "/wal"}) {
+            env->getChildren(opts.path + dir, &names);
+            for (const auto& name : names) env->deleteFile(opts.path + dir + "/" + name);
+        }
+        env->deleteFile(opts.path + "/MANIFEST");
+    }
+}
+
+// the general LSM engine against the fixed-width one on the workload the
+// latter is for: 8-byte integer keys and 16-byte values
+void bench_fixed() {
+    cout << "[BENCH] Fixed-width engine\n";
+
+    const int N = 200000;
+    const int GETS = 200000;
+    const int SCANS = 20;
+    auto key = [](uint64_t k) {
+        string s(8, '\0');
+        for (int i = 0; i < 8; i++) s[i] = static_cast<char>(k >> (56 - 8 * i));
+        return s;
+    };
+    auto per_sec = [](int n, Clock::time_point start) {
+        double s = chrono::duration<double>(Clock::now() - start).count();
+        return (long long)(n / max(s, 1e-9));
+    };
+    vector<pair<string, EngineType>> engines = {
+        {"lsm", EngineType::LSM},
+        {"fixed", EngineType::FIXED},
+    };
+    for (const auto& [name, type] : engines) {
+        Options opts = bench_options;
+        opts.engine = type;
+        opts.path = "fixed_" + name;
+        opts.mem_limit = 20000;
+        opts.compaction_threshold = 4;
+
+        KVEngine* e = CreateKVEngine(opts);
+        unsigned x = 12345;
+        auto start = Clock::now();
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            x = x * 1103515245 + 12345;
+            b.put(key(x % (4 * N)), string(16, 'v'));
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+        e->write(b);
+        long long load_ms = elapsed_ms(start, Clock::now());
+
+        string v;
+        int found = 0;
+        start = Clock::now();
+        for (int i = 0; i < GETS; i++) {
+            x = x * 1103515245 + 12345;
+            found += e->get(key(x % (4 * N)), &v).ok();
+        }
+        long long gets = per_sec(GETS, start);
+
+        vector<pair<string, string>> rows;
+        start = Clock::now();
+        for (int i = 0; i < SCANS; i++) {
+            x = x * 1103515245 + 12345;
+            e->scan(key(x % (4 * N)), 100, &rows);
+        }
+        long long scans = per_sec(SCANS, start);
+
+        cout << name << "\tload(ms) " << load_ms << "\tget ops/sec " << gets << " (" << found << " hits)"
+             << "\tscan(100) ops/sec " << scans << "\n";
+        delete e;
+    }
+}
+
+// searching sorted keys: a binary search over the keys themselves against
+// one over their prefix column, with and without vector compares; then
+// whole segment lookups with and without index prefixes
+void bench_prefix_search() {
+    cout << "[BENCH] Prefix search\n";
+
+    const int KEYS = 1 << 14;
+    const int PROBES = 2000000;
+    vector<string> keys;
+    char buf[32];
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(buf, sizeof(buf), "user%012d", i * 37);
+        keys.push_back(buf);
+    }
+    // as an index block stores them: after the shared "user0000"
+    vector<uint64_t> column;
+    for (const auto& k : keys) column.push_back(KeyPrefix(string_view(k).substr(8)));
+    const char* prefixes = reinterpret_cast<const char*>(column.data());
+    vector<string> probes;
+    unsigned x = 12345;
+    for (int i = 0; i < 4096; i++) {
+        x = x * 1103515245 + 12345;
+        snprintf(buf, sizeof(buf), "user%012u", x % (KEYS * 37));
+        probes.push_back(buf);
+    }
+
+    auto run = [&](const char* name, auto search) {
+        size_t sum = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < PROBES; i++) sum += search(probes[i & 4095]);
+        double ns = chrono::duration<double, nano>(Clock::now() - start).count() / PROBES;
+        cout << name << "\t" << ns << " ns/search (" << sum % 1000 << ")\n";
+    };
+    run("keys   ", [&](const string& k) {
+        return lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+    });
+    // every probe's prefix is unique here, so no ties to resolve
+    run("scalar ", [&](const string& k) {
+        return PrefixLowerBoundScalar(prefixes, KEYS, KeyPrefix(string_view(k).substr(8)));
+    });
+    run("simd   ", [&](const string& k) {
+        return PrefixLowerBound(prefixes, KEYS, KeyPrefix(string_view(k).substr(8)));
+    });
+
+    Options opts = bench_options;
+    Env* env = opts.env ? opts.env : DefaultEnv();
+    env->createDir("prefix_bench");
+    unordered_map<string, string> data;
+    for (int i = 0; i < 200000; i++) {
+        snprintf(buf, sizeof(buf), "user%012d", i * 7);
+        data[buf] = string(16, 'v');
+    }
+    for (bool prefixed : {false, true}) {
+        SegmentWriteOptions wo;
+        wo.block_size = 256;
+        wo.index_prefixes = prefixed;
+        string path = string("prefix_bench/") + (prefixed ? "with" : "without");
+        write_segment(env, path, data, nullptr, wo);
+        unique_ptr<BlockCache> cache(NewBlockCache(64 << 20, nullptr));
+        SegmentReadOptions ro;
+        ro.cache = cache.get();
+        ro.file_id = 1;
+        string v;
+        const int GETS = 200000;
+        auto start = Clock::now();
+        for (int i = 0; i < GETS; i++) {
+            x = x * 1103515245 + 12345;
+            snprintf(buf, sizeof(buf), "user%012u", x % (200000 * 7));
+            search_segment(env, path, buf, &v, ro);
+        }
+        double us = chrono::duration<double, micro>(Clock::now() - start).count() / GETS;
+        cout << (prefixed ? "segment, prefixed index" : "segment, plain index") << "\t" << us << " us/get\n";
+        env->deleteFile(path);
+    }
+}
+
+// ns per key of 1000-key multi_get batches against a get per key, with the
+// data in memory: the LSM engine's memtable, bitcask's keydir, the cache
+void bench_multi_get() {
+    cout << "[BENCH] MultiGet\n";
+
+    const int N = 500000;
+    const int BATCH = 1000;
+    const int BATCHES = 500;
+    vector<pair<string, EngineType>> engines = {
+        {"lsm", EngineType::LSM},
+        {"bitcask", EngineType::BITCASK},
+        {"cache", EngineType::CACHE},
+    };
+    for (const auto& [name, type] : engines) {
+        Options opts = bench_options;
+        opts.engine = type;
+        opts.path = "multiget_" + name;
+        opts.mem_limit = 2 * N;
+        opts.memtable_image_on_close = false;
+        opts.cache_capacity_bytes = 512 << 20;
+
+        KVEngine* e = CreateKVEngine(opts);
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            b.put("key" + to_string(i), string(16, 'v'));
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+
+        // a tenth of the keys are missing
+        unsigned x = 12345;
+        vector<vector<string>> batches(BATCHES);
+        for (auto& keys : batches) {
+            for (int i = 0; i < BATCH; i++) {
+                x = x * 1103515245 + 12345;
+                keys.push_back("key" + to_string((x >> 4) % (N + N / 9)));
+            }
+        }
+
+        string v;
+        vector<string> values;
+        size_t found = 0;
+        auto start = Clock::now();
+        for (const auto& keys : batches) {
+            for (const auto& k : keys) found += e->get(k, &v).ok();
+        }
+        double get_ns = chrono::duration<double, nano>(Clock::now() - start).count() / (BATCHES * BATCH);
+        start = Clock::now();
+        for (const auto& keys : batches) {
+            for (const auto& s : e->multi_get(keys, &values)) found += s.ok();
+        }
+        double multi_ns = chrono::duration<double, nano>(Clock::now() - start).count() / (BATCHES * BATCH);
+
+        cout << name << "\tget " << get_ns << " ns/key\tmulti_get " << multi_ns << " ns/key\t("
+             << found / 2 << " hits)\n";
+        delete e;
+    }
+}
+
+static size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+// memtable kinds: footprint of the table alone, then engine gets alone
+// and against a writer
+void bench_memtable() {
+    cout << "[BENCH] Memtable\n";
+
+    const int N = 500000;
+    const int READERS = 4;
+    const int GETS = 1000000;
+    auto key = [](int i) { return "key" + to_string(i); };
+    string value(16, 'v');
+
+    {
+        size_t before = heap_in_use();
+        auto* data = new unordered_map<string, string>();
+        auto* deleted = new unordered_set<string>();
+        for (int i = 0; i < N; i++) data->emplace(key(i), value);
+        for (int i = N; i < N + N / 10; i++) deleted->insert(key(i));
+        size_t bytes = heap_in_use() - before;
+        cout << "hash\t" << bytes / (N + N / 10) << " bytes/key\tload " << data->load_factor() << "\n";
+        delete data;
+        delete deleted;
+    }
+    {
+        size_t before = heap_in_use();
+        auto* table = new CuckooTable();
+        for (int i = 0; i < N; i++) table->put(key(i), value);
+        for (int i = N; i < N + N / 10; i++) table->del(key(i));
+        size_t bytes = heap_in_use() - before;
+        cout << "cuckoo\t" << bytes / (N + N / 10) << " bytes/key\tload " << table->load_factor()
+             << "\t(" << table->memory_usage() / (N + N / 10) << " counted)\n";
+        delete table;
+    }
+
+    for (MemtableType type : {MemtableType::HASH, MemtableType::CUCKOO}) {
+        string name = type == MemtableType::HASH ? "hash" : "cuckoo";
+        Options opts = bench_options;
+        opts.path = "memtable_" + name;
+        opts.memtable = type;
+        opts.mem_limit = 4 * N;
+        opts.memtable_image_on_close = false;
+        KVEngine* e = CreateKVEngine(opts);
+
+        auto start = Clock::now();
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            b.put(key(i), value);
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+        double load_ns = chrono::duration<double, nano>(Clock::now() - start).count() / N;
+
+        // a tenth of the lookups miss
+        auto gets = [&](unsigned seed, size_t* found) {
+            string v;
+            unsigned x = seed;
+            for (int i = 0; i < GETS; i++) {
+                x = x * 1103515245 + 12345;
+                *found += e->get(key((x >> 4) % (N + N / 9)), &v).ok();
+            }
+        };
+        size_t found = 0;
+        start = Clock::now();
+        gets(1, &found);
+        double get_ns = chrono::duration<double, nano>(Clock::now() - start).count() / GETS;
+
+        // readers against a writer updating keys as fast as it can
+        atomic<bool> stop{false};
+        long long writes = 0;
+        thread writer([&] {
+            for (int i = 0; !stop.load(); i++) {
+                e->put(key(i % N), value);
+                writes++;
+            }
+        });
+        vector<thread> readers;
+        vector<size_t> hits(READERS);
+        start = Clock::now();
+        for (int r = 0; r < READERS; r++) readers.emplace_back(gets, r + 2, &hits[r]);
+        for (auto& t : readers) t.join();
+        double secs = chrono::duration<double>(Clock::now() - start).count();
+        stop = true;
+        writer.join();
+
+        cout << name << "\tload " << load_ns << " ns/key\tget " << get_ns << " ns\t" << READERS
+             << " readers " << (long long)(READERS * GETS / secs) << " gets/s with "
+             << (long long)(writes / secs) << " puts/s (" << found << " hits)\n";
+        delete e;
+    }
+}
+
+// block segments with every block cached against plain ones, data all in
+// segments
+void bench_plain_segment() {
+    cout << "[BENCH] Plain segments\n";
+
+    const int N = 500000;
+    const int GETS = 500000;
+    const int BATCH = 1000;
+    for (SegmentFormat format : {SegmentFormat::BLOCK, SegmentFormat::PLAIN}) {
+        string name = format == SegmentFormat::BLOCK ? "block" : "plain";
+        Options opts = bench_options;
+        opts.path = "plainseg_" + name;
+        opts.segment_format = format;
+        opts.mem_limit = N / 4;
+        opts.compaction_threshold = 100;
+        opts.block_cache_bytes = 256 << 20;
+        opts.memtable_image_on_close = false;
+
+        KVEngine* e = CreateKVEngine(opts);
+        WriteBatch b;
+        for (int i = 0; i < N; i++) {
+            b.put("key" + to_string(i), string(16, 'v'));
+            if (b.count() == 1000) {
+                e->write(b);
+                b.clear();
+            }
+        }
+        delete e;
+        // plain segments are mapped and indexed here
+        auto start = Clock::now();
+        e = CreateKVEngine(opts);
+        double open_ms = chrono::duration<double, milli>(Clock::now() - start).count();
+
+        // a tenth of the lookups miss
+        vector<string> keys;
+        unsigned x = 12345;
+        for (int i = 0; i < GETS; i++) {
+            x = x * 1103515245 + 12345;
+            keys.push_back("key" + to_string((x >> 4) % (N + N / 9)));
+        }
+        string v;
+        size_t found = 0;
+        for (const auto& k : keys) found += e->get(k, &v).ok();     // warms the block cache
+        start = Clock::now();
+        for (const auto& k : keys) found += e->get(k, &v).ok();
+        double get_ns = chrono::duration<double, nano>(Clock::now() - start).count() / GETS;
+
+        vector<string> values;
+        start = Clock::now();
+        for (int i = 0; i + BATCH <= GETS / 10; i += BATCH) {
+            vector<string> batch(keys.begin() + i, keys.begin() + i + BATCH);
+            for (const auto& s : e->multi_get(batch, &values)) found += s.ok();
+        }
+        double multi_ns = chrono::duration<double, nano>(Clock::now() - start).count() / (GETS / 10);
+
+        cout << name << "\topen " << open_ms << " ms\tget " << get_ns << " ns\tmulti_get " << multi_ns
+             << " ns/key\t(" << found << " hits)\n";
+        delete e;
+    }
+}
 
 int main(int argc, char** argv) {
     if (argc < 2) {
@@ -102,15 +887,68 @@ int main(int argc, char** argv) {
         cout << "  ./kv_bench put\n";
         cout << "  ./kv_bench get\n";
         cout << "  ./kv_bench concurrent\n";
+        cout << "  ./kv_bench latency\n";
+        cout << "  ./kv_bench updates\n";
+        cout << "  ./kv_bench reopen\n";
+        cout << "  ./kv_bench recovery\n";
+        cout << "  ./kv_bench engines\n";
+        cout << "  ./kv_bench cache\n";
+        cout << "  ./kv_bench compression\n";
+        cout << "  ./kv_bench hugepages\n";
+        cout << "  ./kv_bench fixed\n";
+        cout << "  ./kv_bench prefixsearch\n";
+        cout << "  ./kv_bench multiget\n";
+        cout << "  append 'mem' to run against an in-memory Env,\n";
+        cout << "  or 'slow' for an in-memory Env with a degraded disk profile\n";
         return 0;
     }
 
     string mode = argv[1];
 
+    Env* mem_env = nullptr;
+    FaultInjectionEnv* slow_env = nullptr;
+    string env_name = argc > 2 ? argv[2] : "";
+    if (env_name == "mem" || env_name == "slow") {
+        mem_env = NewMemEnv();
+        bench_options.env = mem_env;
+    }
+    if (env_name == "slow") {
+        // ~SATA SSD under contention: heavy-tailed fsync, 200 MB/s writes
+        FaultOptions fo;
+        fo.sync.latency.dist = LatencyDist::PARETO;
+        fo.sync.latency.micros = 200;
+        fo.sync.latency.max_micros = 50000;
+        fo.write.bytes_per_sec = 200ull << 20;
+        fo.read.latency.dist = LatencyDist::EXPONENTIAL;
+        fo.read.latency.micros = 20;
+        slow_env = NewFaultInjectionEnv(mem_env, fo);
+        bench_options.env = slow_env;
+    }
+
     if (mode == "put") bench_put();
     else if (mode == "get") bench_get();
     else if (mode == "concurrent") bench_concurrent_get();
+    else if (mode == "latency") bench_put_latency();
+    else if (mode == "updates") bench_updates();
+    else if (mode == "reopen") bench_reopen();
+    else if (mode == "recovery") bench_recovery();
+    else if (mode == "engines") bench_engines();
+    else if (mode == "cache") bench_cache();
+    else if (mode == "compression") bench_compression();
+    else if (mode == "hugepages") bench_huge_pages();
+    else if (mode == "fixed") bench_fixed();
+    else if (mode == "prefixsearch") bench_prefix_search();
+    else if (mode == "multiget") bench_multi_get();
+    else if (mode == "memtable") bench_memtable();
+    else if (mode == "plainsegment") bench_plain_segment();
     else cout << "Unknown benchmark\n";
 
+    if (slow_env) {
+        FaultStats st = slow_env->stats();
+        cout << "Injected : " << st.delayed_ops << " delays, "
+             << st.delay_micros / 1000 << " ms total\n";
+    }
+    delete slow_env;
+    delete mem_env;
     return 0;
 }
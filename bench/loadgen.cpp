@@ -0,0 +1,145 @@
+#include "kv_client.h"
+#include "kv_protocol.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+using namespace std;
+using Clock = chrono::high_resolution_clock;
+
+/*
+    Closed-loop load generator for kv_server's binary protocol. Every
+    connection keeps `pipeline` requests in flight: it sends a window,
+    waits for all replies, and records the window latency per request.
+*/
+
+struct LoadConfig {
+    string host = "127.0.0.1";
+    int port = 7379;
+    int threads = 4;
+    int conns_per_thread = 4;
+    int pipeline = 16;
+    long long ops = 200000;
+    int read_pct = 80;
+    int keys = 100000;
+    int value_size = 100;
+};
+
+static void usage(){
+    cout << "Usage: ./kv_loadgen [options]\n";
+    cout << "  --host H --port N        server (default 127.0.0.1:7379)\n";
+    cout << "  --threads N              client threads (default 4)\n";
+    cout << "  --conns N                connections per thread (default 4)\n";
+    cout << "  --pipeline N             requests in flight per connection (default 16)\n";
+    cout << "  --ops N                  total requests (default 200000)\n";
+    cout << "  --read-pct N             percent GETs, rest PUTs (default 80)\n";
+    cout << "  --keys N                 key space (default 100000)\n";
+    cout << "  --value-size N           PUT value bytes (default 100)\n";
+}
+
+int main(int argc, char** argv){
+    LoadConfig cfg;
+    for(int i = 1; i < argc; i++){
+        string a = argv[i];
+        if(a == "--help" || i + 1 >= argc){
+            usage();
+            return a == "--help" ? 0 : 1;
+        }
+        string v = argv[++i];
+        if(a == "--host") cfg.host = v;
+        else if(a == "--port") cfg.port = atoi(v.c_str());
+        else if(a == "--threads") cfg.threads = max(1, atoi(v.c_str()));
+        else if(a == "--conns") cfg.conns_per_thread = max(1, atoi(v.c_str()));
+        else if(a == "--pipeline") cfg.pipeline = max(1, atoi(v.c_str()));
+        else if(a == "--ops") cfg.ops = atoll(v.c_str());
+        else if(a == "--read-pct") cfg.read_pct = atoi(v.c_str());
+        else if(a == "--keys") cfg.keys = max(1, atoi(v.c_str()));
+        else if(a == "--value-size") cfg.value_size = atoi(v.c_str());
+        else{
+            usage();
+            return 1;
+        }
+    }
+
+    atomic<long long> remaining(cfg.ops);
+    atomic<long long> errors(0);
+    vector<vector<long long>> lat(cfg.threads);
+
+    auto worker = [&](int t){
+        vector<KVClient*> conns;
+        for(int c = 0; c < cfg.conns_per_thread; c++){
+            KVClient* cl = CreateKVClient(cfg.host, cfg.port);
+            if(cl == nullptr){
+                cerr << "connect to " << cfg.host << ":" << cfg.port << " failed\n";
+                exit(1);
+            }
+            conns.push_back(cl);
+        }
+
+        mt19937 rng(t * 7919 + 1);
+        string value(cfg.value_size, 'x');
+        KVResponse resp;
+        while(true){
+            // one window per connection, all windows in flight together
+            vector<int> sent(conns.size(), 0);
+            bool any = false;
+            auto start = Clock::now();
+            for(size_t c = 0; c < conns.size(); c++){
+                long long want = cfg.pipeline;
+                long long left = remaining.fetch_sub(want);
+                if(left <= 0) break;
+                if(left < want) want = left;
+                for(long long i = 0; i < want; i++){
+                    string key = "key" + to_string(rng() % cfg.keys);
+                    if(static_cast<int>(rng() % 100) < cfg.read_pct) conns[c]->sendGet(key);
+                    else conns[c]->sendPut(key, value);
+                }
+                conns[c]->flush();
+                sent[c] = want;
+                any = true;
+            }
+            if(!any) break;
+
+            for(size_t c = 0; c < conns.size(); c++){
+                for(int i = 0; i < sent[c]; i++){
+                    if(!conns[c]->recv(&resp).ok() || resp.code == kvproto::CODE_ERROR) errors++;
+                }
+            }
+            long long us = chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count();
+            for(size_t c = 0; c < conns.size(); c++){
+                for(int i = 0; i < sent[c]; i++) lat[t].push_back(us);
+            }
+        }
+        for(KVClient* cl : conns) delete cl;
+    };
+
+    auto start = Clock::now();
+    vector<thread> ts;
+    for(int t = 0; t < cfg.threads; t++) ts.emplace_back(worker, t);
+    for(auto &t : ts) t.join();
+    auto end = Clock::now();
+
+    vector<long long> all;
+    for(auto &l : lat) all.insert(all.end(), l.begin(), l.end());
+    sort(all.begin(), all.end());
+    if(all.empty()){
+        cout << "no requests completed\n";
+        return 1;
+    }
+
+    double secs = chrono::duration_cast<chrono::microseconds>(end - start).count() / 1e6;
+    cout << "[LOADGEN] " << cfg.threads * cfg.conns_per_thread << " connections, pipeline "
+         << cfg.pipeline << ", " << cfg.read_pct << "% reads\n";
+    cout << "Ops      : " << all.size() << "\n";
+    cout << "Errors   : " << errors.load() << "\n";
+    cout << "Ops/sec  : " << (long long)(all.size() / secs) << "\n";
+    cout << "p50(us)  : " << all[all.size() / 2] << "\n";
+    cout << "p99(us)  : " << all[all.size() * 99 / 100] << "\n";
+    cout << "p999(us) : " << all[all.size() * 999 / 1000] << "\n";
+    return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "status.h"
+#include "env.h"
+#include "kv_engine.h"
+
+using namespace std;
+
+/*
+    Incremental backups into a directory that belongs to one database:
+
+    backup_dir/shared/seg_<N>_<size>_<crc>.sst   segments, stored once
+    backup_dir/private/<id>/...                 logs and MANIFEST of one backup
+    backup_dir/meta/<id>                        files making up backup <id>
+
+    Each backup starts from a checkpoint, copies the segments the backup
+    directory does not already have intact, and copies the small private
+    files.
+*/
+
+struct BackupInfo {
+    uint32_t id;
+    uint64_t timestamp_micros;
+    uint64_t size;              // bytes across all files, shared included
+    uint32_t num_files;
+};
+
+class BackupEngine {
+    public:
+        virtual ~BackupEngine() = default;
+
+        // Backs up db while it keeps serving reads and writes. *id (if
+        // given) receives the new backup's id.
+        virtual Status createBackup(KVEngine* db, uint32_t* id = nullptr) = 0;
+
+        // Oldest first.
+        virtual Status getBackupInfo(vector<BackupInfo>* out) = 0;
+
+        // Deletes the backup and any shared segment no other backup uses.
+        virtual Status deleteBackup(uint32_t id) = 0;
+
+        // Replaces the database at db_path, which must not be open, with
+        // the contents of the backup.
+        virtual Status restoreBackup(uint32_t id, const string &db_path) = 0;
+};
+
+// Returns nullptr if backup_dir cannot be created.
+BackupEngine* OpenBackupEngine(Env* env, const string &backup_dir);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+    Looks many keys up in a std::unordered_map or unordered_set, a group of
+    BATCH_FIND_GROUP at a time, in three passes over the group: every key
+    is hashed to its bucket and the bucket's slot prefetched, then each
+    slot is followed to the bucket's first entry and that is prefetched,
+    and only then are the buckets walked. The cache misses of a group
+    overlap instead of each lookup waiting out its own.
+*/
+
+static const size_t BATCH_FIND_GROUP = 16;
+
+// Where bucket b's slot lives, to prefetch; nullptr if not known. With
+// libstdc++ the table starts with a pointer to its array of slots. This
+// is only ever prefetched, never read, so a table laid out otherwise
+// costs a wasted hint, not a wrong result.
+template <typename Table>
+const void* batch_find_slot(const Table &table, size_t b){
+#if defined(__GLIBCXX__)
+    const void* const* slots;
+    memcpy(&slots, &table, sizeof(slots));
+    return slots + b;
+#else
+    (void)table;
+    (void)b;
+    return nullptr;
+#endif
+}
+
+template <typename K, typename V>
+const K &batch_find_key(const pair<const K, V> &entry){ return entry.first; }
+template <typename K>
+const K &batch_find_key(const K &key){ return key; }
+
+// Calls found(i, entry) for each i < n whose key(i) is in table, entry
+// pointing at its element, and found(i, nullptr) for the rest, in order.
+template <typename Table, typename KeyFn, typename FoundFn>
+void BatchFind(const Table &table, size_t n, KeyFn key, FoundFn found){
+    typedef typename Table::value_type Entry;
+    typedef typename Table::const_local_iterator Iter;
+    size_t buckets[BATCH_FIND_GROUP];
+    Iter firsts[BATCH_FIND_GROUP];
+    for(size_t start = 0; start < n; start += BATCH_FIND_GROUP){
+        size_t group = min(BATCH_FIND_GROUP, n - start);
+        if(table.empty()){
+            for(size_t j = 0; j < group; j++) found(start + j, static_cast<const Entry*>(nullptr));
+            continue;
+        }
+        for(size_t j = 0; j < group; j++){
+            buckets[j] = table.bucket(key(start + j));
+            if(const void* slot = batch_find_slot(table, buckets[j])) __builtin_prefetch(slot);
+        }
+        for(size_t j = 0; j < group; j++){
+            firsts[j] = table.begin(buckets[j]);
+            if(firsts[j] != table.end(buckets[j])) __builtin_prefetch(&*firsts[j]);
+        }
+        for(size_t j = 0; j < group; j++){
+            const auto &k = key(start + j);
+            const Entry* entry = nullptr;
+            for(Iter it = firsts[j]; it != table.end(buckets[j]); ++it){
+                if(table.key_eq()(batch_find_key(*it), k)){
+                    entry = &*it;
+                    break;
+                }
+            }
+            found(start + j, entry);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "kv_engine.h"
+
+/*
+    Bitcask-style engine for point-lookup workloads. Every write is appended
+    to the active data file under path; an in-memory keydir maps each live
+    key to the (file, offset, size) of its newest record, so a get is one
+    pread. Data files are sealed at bitcask_max_file_size, and once enough
+    of the sealed bytes are dead the live records are merged into fresh
+    files, each with a hint file that lets the next open rebuild the keydir
+    without reading values.
+
+    Files under path:
+        NNNNNN.data   records, appended
+        NNNNNN.hint   keydir entries for a merged data file
+        LOCK
+*/
+
+// Selected by CreateKVEngine when options.engine is BITCASK. Returns
+// nullptr if the directory cannot be opened or is locked, or if options
+// ask for something this engine lacks (replication, secondaries).
+KVEngine* CreateBitcaskEngine(const Options &options);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <cstdint>
+#include "env.h"
+
+using namespace std;
+
+/*
+    Caches of segment blocks, keyed by a file id the engine gives each
+    segment it reads and the block's offset in that file. Blocks are cached
+    only once checked against their crc.
+
+    BlockCache keeps blocks in memory in LRU order, in up to two tiers: a
+    compressed one that takes every compressed block read from a segment,
+    and an uncompressed one for blocks hit again (and for blocks stored
+    uncompressed). Blocks the uncompressed tier evicts may be handed to a
+    SecondaryCache, consulted after both memory tiers and before the
+    segment file; a secondary hit is promoted back into memory.
+*/
+
+// A block's bytes, valid for as long as the pointer is held.
+typedef shared_ptr<const string_view> BlockRef;
+
+// A BlockRef owning bytes.
+BlockRef MakeBlockRef(string bytes);
+
+struct SecondaryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t inserts = 0;
+    uint64_t bytes = 0;     // stored, after compression
+};
+
+class SecondaryCache {
+    public:
+        virtual ~SecondaryCache() = default;
+
+        // Keeps a copy of block unless it is already there; may drop it
+        // (too large, write error) without telling anyone.
+        virtual void insert(uint64_t file, uint64_t offset, string_view block) = 0;
+        virtual bool lookup(uint64_t file, uint64_t offset, string* block) = 0;
+        virtual SecondaryCacheStats stats() = 0;
+};
+
+// Flash tier: blocks are appended to a ring of region files under dir and
+// indexed in memory; once capacity bytes are used, the oldest region is
+// emptied and rewritten. With compress, blocks that deflate are stored
+// deflated. Anything already in dir is discarded. Returns nullptr if dir
+// cannot be created.
+SecondaryCache* NewFileSecondaryCache(Env* env, const string &dir, uint64_t capacity, bool compress);
+
+struct BlockCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t bytes = 0;
+    uint64_t compressed_hits = 0;
+    uint64_t compressed_misses = 0;
+    uint64_t compressed_bytes = 0;      // charged, as compressed
+    uint64_t compressed_raw_bytes = 0;  // the same blocks decompressed
+    uint64_t decompressions = 0;        // of cached or just-read blocks
+    uint64_t decompress_nanos = 0;
+    // with huge_pages (huge_pages.h)
+    uint64_t chunks = 0;
+    uint64_t hugetlb_chunks = 0;
+    uint64_t advised_chunks = 0;
+};
+
+class BlockCache {
+    public:
+        virtual ~BlockCache() = default;
+
+        // The uncompressed tier; nullptr on a miss.
+        virtual BlockRef lookup(uint64_t file, uint64_t offset) = 0;
+        // spill: the block may go to the secondary tier when evicted.
+        // Drops any compressed copy of it.
+        virtual void insert(uint64_t file, uint64_t offset, BlockRef block, bool spill) = 0;
+
+        // The compressed tier holds blocks as the segment stores them; the
+        // caller decompresses. *hot is set if the block was hit there
+        // before, which is the caller's cue to insert() it uncompressed.
+        virtual bool hasCompressedTier() const = 0;
+        virtual BlockRef lookupCompressed(uint64_t file, uint64_t offset, bool* hot) = 0;
+        virtual void insertCompressed(uint64_t file, uint64_t offset, BlockRef block, size_t raw_size) = 0;
+        virtual void recordDecompression(uint64_t nanos) = 0;
+
+        // The secondary tier; a hit is inserted uncompressed.
+        virtual BlockRef lookupSecondary(uint64_t file, uint64_t offset) = 0;
+
+        virtual BlockCacheStats stats() = 0;
+};
+
+// In-memory LRU tiers of capacity bytes of uncompressed blocks and
+// compressed_capacity bytes of compressed ones (0 = no compressed tier).
+// secondary may be nullptr; otherwise it must outlive the cache. With
+// huge_pages, blocks are copied into a SlabAllocator's huge-page chunks as
+// they are inserted and charged by slot size; a block no slot can take
+// stays where it is.
+BlockCache* NewBlockCache(size_t capacity, SecondaryCache* secondary, size_t compressed_capacity = 0,
+                          bool huge_pages = false);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "kv_engine.h"
+
+/*
+    Copy-on-write B+tree engine for read-mostly workloads with range scans,
+    in the manner of LMDB. The whole database is one file (path/btree.db)
+    mapped into memory. A write transaction never modifies a page that a
+    committed tree can reach: it copies the path from leaf to root into free
+    pages and then publishes the new root through one of two alternating
+    meta pages. Readers take no locks; they register the transaction they
+    read in a reader slot, and the writer reuses a freed page only once no
+    reader can still reach it. Nothing is ever compacted.
+
+    One writer at a time; puts, deletes and batches each commit with two
+    syncs (data pages, then the meta page).
+*/
+
+// Selected by CreateKVEngine when options.engine is BTREE. Returns nullptr
+// if the file cannot be opened or mapped (options.env must support
+// newMmapFile), if it is locked, or if options ask for replication, a
+// secondary or a comparator other than the bytewise one.
+KVEngine* CreateBTreeEngine(const Options &options);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "kv_engine.h"
+
+/*
+    Non-durable cache engine: no WAL, no segments, nothing on disk. Keys
+    live in cache_shards hash shards, each with its own lock and an equal
+    share of cache_capacity_bytes; once a shard is full, cache_eviction
+    picks what to drop:
+
+    LRU      exact recency order; every hit relinks the entry, so hits take
+             the shard lock exclusively
+    CLOCK    FIFO with a reference bit, evicted entries that were hit get a
+             second pass; hits only set the bit under a shared lock
+    S3FIFO   a small FIFO for new keys, a main FIFO for keys hit while in
+             the small one, and a ghost list that sends recently evicted
+             keys straight to main; scan- and one-hit-wonder-resistant
+
+    Hit, miss and eviction counts are reported through stats().
+*/
+
+// Selected by CreateKVEngine when options.engine is CACHE.
+KVEngine* CreateCacheEngine(const Options &options);
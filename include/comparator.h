@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/*
+    Orders keys for segments and scans. A database is bound to the
+    comparator it was created with: its name is kept in the MANIFEST, and
+    opening the database with a comparator of another name fails.
+*/
+class Comparator {
+    public:
+        virtual ~Comparator() = default;
+
+        // < 0, 0 or > 0 as a sorts before, with or after b. 0 only for the
+        // same bytes: memtables find keys by hash.
+        virtual int compare(string_view a, string_view b) const = 0;
+
+        // Stored in the MANIFEST; no whitespace.
+        virtual const char* name() const = 0;
+
+        // Index keys only have to fall between blocks, so these may shorten
+        // them. Sets *start to some k with start <= k < limit, given
+        // start < limit; leaving it alone is always correct.
+        virtual void findShortestSeparator(string* start, string_view limit) const = 0;
+        // Sets *key to some k >= key; leaving it alone is always correct.
+        virtual void findShortSuccessor(string* key) const = 0;
+};
+
+// Lexicographic unsigned bytes, as memcmp orders them. The default.
+const Comparator* BytewiseComparator();
+
+// For ordered standard containers.
+struct ComparatorLess {
+    const Comparator* cmp;
+    bool operator()(const string &a, const string &b) const {
+        return cmp->compare(a, b) < 0;
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+/*
+    A hash table of string keys to values or tombstones, for a memtable
+    that is only ever looked up by key. Readers take no lock; writers are
+    serialized by one table-wide mutex rather than per-bucket locks, since
+    the engine already serializes its writers on the log.
+
+    Every key lives in one of two buckets of SLOTS slots: its hash picks
+    the first, and the second is the first xor a mix of the key's one-byte
+    tag, so either is found from the other without the key. Each slot holds
+    a tag and an entry pointer; a lookup compares tags and reads only the
+    entries whose tag matches. When both buckets are full, a breadth-first
+    search finds a path of moves to an alternate bucket that frees a slot,
+    and failing that the bucket array doubles. Full tables reach about 95%
+    of their slots.
+
+    Entries are bump-allocated and never change once published: replacing
+    a key's value publishes a new entry. Nothing is freed before the table
+    is, old bucket arrays included, so a reader may always follow whatever
+    pointer it loaded. Memory therefore grows with writes(), not size():
+    an owner bounding it should count writes.
+
+    A reader instead checks that what it read is consistent. Buckets map
+    onto STRIPES version counters, which a writer makes odd while it moves
+    entries in or out of a bucket and even again after. A reader notes the
+    versions of its two buckets, probes, and starts over if either was odd
+    or has moved. A growth fills the new bucket array aside and publishes
+    it whole; the old one is left as it was.
+*/
+class CuckooTable {
+    public:
+        // Room for about expected keys before the first growth.
+        explicit CuckooTable(size_t expected = 0);
+        CuckooTable(const CuckooTable &) = delete;
+        CuckooTable &operator=(const CuckooTable &) = delete;
+
+        void put(string_view key, string_view value);
+        // Replaces any value with a tombstone.
+        void del(string_view key);
+
+        // False if the key has no entry. Otherwise *deleted tells a
+        // tombstone from a value, which is copied to *value.
+        bool find(string_view key, string* value, bool* deleted) const;
+
+        // Keys with an entry, tombstones included.
+        size_t size() const { return count_.load(memory_order_relaxed); }
+        // Puts and deletes taken, overwrites included; each holds an entry.
+        uint64_t writes() const { return writes_.load(memory_order_relaxed); }
+        // Key and value bytes of those entries.
+        uint64_t bytes() const { return bytes_.load(memory_order_relaxed); }
+        // Everything allocated, replaced entries and old bucket arrays too.
+        uint64_t memory_usage() const;
+        // Share of the bucket array's slots in use.
+        double load_factor() const;
+
+        // Calls fn(key, value, tombstone) for every key, in no order.
+        // Writers wait until it returns.
+        template <typename Fn>
+        void for_each(Fn fn) const {
+            lock_guard<mutex> lock(write_mu_);
+            const Table* t = table_.load(memory_order_relaxed);
+            for(size_t b = 0; b <= t->mask; b++){
+                for(int s = 0; s < SLOTS; s++){
+                    const Entry* e = t->buckets[b].entries[s].load(memory_order_relaxed);
+                    if(e) fn(e->key(), e->value(), e->deleted);
+                }
+            }
+        }
+
+    private:
+        static const int SLOTS = 4;
+        // a power of two no larger than the smallest bucket array
+        static const size_t STRIPES = 256;
+        // buckets a search for a cuckoo path may visit
+        static const size_t MAX_SEARCH = 512;
+        static const size_t ARENA_BLOCK = 64 << 10;
+
+        // followed by the key and value bytes
+        struct Entry {
+            uint64_t hash;
+            uint32_t key_size;
+            uint32_t value_size;
+            bool deleted;
+
+            string_view key() const {
+                return string_view(reinterpret_cast<const char*>(this + 1), key_size);
+            }
+            string_view value() const {
+                return string_view(reinterpret_cast<const char*>(this + 1) + key_size, value_size);
+            }
+        };
+
+        // tag 0 marks an empty slot
+        struct Bucket {
+            atomic<uint8_t> tags[SLOTS];
+            atomic<const Entry*> entries[SLOTS];
+        };
+
+        struct Table {
+            size_t mask;
+            unique_ptr<Bucket[]> buckets;
+        };
+
+        mutable mutex write_mu_;
+        atomic<const Table*> table_;
+        // every bucket array made, the current one last
+        vector<unique_ptr<Table>> tables_;
+        atomic<uint32_t> versions_[STRIPES];
+
+        vector<unique_ptr<char[]>> arena_;
+        char* arena_ptr_ = nullptr;
+        size_t arena_left_ = 0;
+        uint64_t arena_bytes_ = 0;
+
+        atomic<size_t> count_{0};
+        atomic<uint64_t> bytes_{0};
+        atomic<uint64_t> writes_{0};
+
+        static uint8_t tag_of(uint64_t hash);
+        static size_t alt_bucket(size_t b, uint8_t tag, size_t mask);
+        static const Entry* probe(const Bucket &bucket, uint8_t tag, string_view key);
+        static unique_ptr<Table> make_table(size_t buckets);
+
+        void write(string_view key, string_view value, bool deleted);
+        const Entry* make_entry(uint64_t hash, string_view key, string_view value, bool deleted);
+        // The rest need write_mu_. visible: readers may be in t.
+        bool insert(Table* t, const Entry* e, bool visible);
+        void grow();
+        // Bracket a change to buckets a and b of the current array.
+        void begin_write(size_t a, size_t b);
+        void end_write(size_t a, size_t b);
+};
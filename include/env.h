@@ -0,0 +1,195 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "status.h"
+
+using namespace std;
+
+/*
+    Env is the engine's only window onto the operating system: files,
+    directories, locks and clocks all go through it, so the same engine code
+    can run on a real disk, in memory, or behind a test wrapper.
+*/
+
+class SequentialFile {
+    public:
+        virtual ~SequentialFile() = default;
+
+        // Reads up to n bytes into scratch; *bytes_read == 0 means EOF.
+        virtual Status read(size_t n, char* scratch, size_t* bytes_read) = 0;
+        virtual Status skip(uint64_t n) = 0;
+};
+
+class RandomAccessFile {
+    public:
+        virtual ~RandomAccessFile() = default;
+
+        // Safe for concurrent use from multiple threads.
+        virtual Status pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const = 0;
+};
+
+class WritableFile {
+    public:
+        virtual ~WritableFile() = default;
+
+        virtual Status append(const void* data, size_t len) = 0;
+        virtual Status sync() = 0;
+        virtual Status close() = 0;
+};
+
+// A file mapped read-write at a fixed address. The mapping reserves
+// map_size bytes up front so base() never moves; only the first size()
+// bytes are backed by the file, and grow() extends it with zeroes.
+// Writes through base() reach the file; sync() makes a range durable.
+class MmapFile {
+    public:
+        virtual ~MmapFile() = default;
+
+        virtual char* base() const = 0;
+        virtual uint64_t size() const = 0;
+        // Fails with MAP_FULL beyond the reserved map_size.
+        virtual Status grow(uint64_t size) = 0;
+        virtual Status sync(uint64_t offset, uint64_t len) = 0;
+};
+
+// The first size() bytes of a file, mapped read-only and private, so
+// nothing written through base() can reach the file.
+class ReadOnlyMmapFile {
+    public:
+        virtual ~ReadOnlyMmapFile() = default;
+
+        virtual const char* base() const = 0;
+        virtual uint64_t size() const = 0;
+};
+
+class FileLock {
+    public:
+        virtual ~FileLock() = default;
+};
+
+class Env {
+    public:
+        virtual ~Env() = default;
+
+        virtual Status newSequentialFile(const string &path, SequentialFile** out) = 0;
+        virtual Status newRandomAccessFile(const string &path, RandomAccessFile** out) = 0;
+        // Creates or truncates.
+        virtual Status newWritableFile(const string &path, WritableFile** out) = 0;
+        // Creates or appends to the existing contents.
+        virtual Status newAppendableFile(const string &path, WritableFile** out) = 0;
+        // Creates the file if missing. The file must not be written through
+        // other handles while it is mapped.
+        virtual Status newMmapFile(const string &, uint64_t, MmapFile**){
+            return Status::NotSupported();
+        }
+        // Maps the first size bytes of an existing file. Fails with
+        // FILE_TOO_SHORT rather than map past the end of a shorter file.
+        virtual Status newReadOnlyMmapFile(const string &, uint64_t, ReadOnlyMmapFile**){
+            return Status::NotSupported();
+        }
+
+        virtual bool fileExists(const string &path) = 0;
+        virtual Status getChildren(const string &dir, vector<string>* names) = 0;
+        virtual Status getFileSize(const string &path, uint64_t* size) = 0;
+        // Time of the last write, in the same clock as nowMicros().
+        virtual Status getFileModificationTime(const string &path, uint64_t* micros) = 0;
+        virtual Status deleteFile(const string &path) = 0;
+        virtual Status renameFile(const string &from, const string &to) = 0;
+        // Makes to another name for the contents of from. Fails with
+        // LINK_FAILED where that is not possible (e.g. across filesystems).
+        virtual Status linkFile(const string &from, const string &to) = 0;
+        // Succeeds if the directory already exists.
+        virtual Status createDir(const string &path) = 0;
+        // The directory must be empty.
+        virtual Status deleteDir(const string &path) = 0;
+
+        // Fails with LOCK_HELD if another owner (process or engine) holds it.
+        virtual Status lockFile(const string &path, FileLock** lock) = 0;
+        virtual Status unlockFile(FileLock* lock) = 0;
+
+        virtual uint64_t nowMicros() = 0;
+        virtual void sleepForMicros(uint64_t micros) = 0;
+};
+
+// Forwards every call to a base Env; subclass it to intercept a few calls.
+class EnvWrapper : public Env {
+
+    protected:
+        Env* base_;
+
+    public:
+        explicit EnvWrapper(Env* base) : base_(base) {}
+
+        Env* base() const { return base_; }
+
+        Status newSequentialFile(const string &path, SequentialFile** out) override{
+            return base_->newSequentialFile(path, out);
+        }
+        Status newRandomAccessFile(const string &path, RandomAccessFile** out) override{
+            return base_->newRandomAccessFile(path, out);
+        }
+        Status newWritableFile(const string &path, WritableFile** out) override{
+            return base_->newWritableFile(path, out);
+        }
+        Status newAppendableFile(const string &path, WritableFile** out) override{
+            return base_->newAppendableFile(path, out);
+        }
+        Status newMmapFile(const string &path, uint64_t map_size, MmapFile** out) override{
+            return base_->newMmapFile(path, map_size, out);
+        }
+        Status newReadOnlyMmapFile(const string &path, uint64_t size, ReadOnlyMmapFile** out) override{
+            return base_->newReadOnlyMmapFile(path, size, out);
+        }
+        bool fileExists(const string &path) override{
+            return base_->fileExists(path);
+        }
+        Status getChildren(const string &dir, vector<string>* names) override{
+            return base_->getChildren(dir, names);
+        }
+        Status getFileSize(const string &path, uint64_t* size) override{
+            return base_->getFileSize(path, size);
+        }
+        Status getFileModificationTime(const string &path, uint64_t* micros) override{
+            return base_->getFileModificationTime(path, micros);
+        }
+        Status deleteFile(const string &path) override{
+            return base_->deleteFile(path);
+        }
+        Status renameFile(const string &from, const string &to) override{
+            return base_->renameFile(from, to);
+        }
+        Status linkFile(const string &from, const string &to) override{
+            return base_->linkFile(from, to);
+        }
+        Status createDir(const string &path) override{
+            return base_->createDir(path);
+        }
+        Status deleteDir(const string &path) override{
+            return base_->deleteDir(path);
+        }
+        Status lockFile(const string &path, FileLock** lock) override{
+            return base_->lockFile(path, lock);
+        }
+        Status unlockFile(FileLock* lock) override{
+            return base_->unlockFile(lock);
+        }
+        uint64_t nowMicros() override{
+            return base_->nowMicros();
+        }
+        void sleepForMicros(uint64_t micros) override{
+            base_->sleepForMicros(micros);
+        }
+};
+
+// Copies the first size bytes of from (all of it by default) to a new
+// file at to, syncing it before returning.
+Status CopyFile(Env* env, const string &from, const string &to, uint64_t size = UINT64_MAX);
+
+// Process-wide POSIX environment. Never delete it.
+Env* DefaultEnv();
+
+// Self-contained in-memory environment; caller owns it and must keep it
+// alive for as long as any engine opened on it.
+Env* NewMemEnv();
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include "env.h"
+
+using namespace std;
+
+/*
+    Env wrapper that makes a fast device look like a slow or failing one,
+    so stall behaviour and tail latency can be reproduced on any machine.
+    Every knob is per operation class and can be changed while running.
+*/
+
+enum class LatencyDist {
+    NONE,
+    FIXED,        // always micros
+    UNIFORM,      // uniform in [micros, max_micros]
+    EXPONENTIAL,  // mean micros, capped at max_micros when set
+    PARETO        // heavy tail: scale micros, shape pareto_alpha, capped at max_micros when set
+};
+
+struct LatencyProfile {
+    LatencyDist dist = LatencyDist::NONE;
+    uint64_t micros = 0;
+    uint64_t max_micros = 0;
+    double pareto_alpha = 1.5;
+};
+
+struct IOProfile {
+    LatencyProfile latency;
+
+    // Device throughput for this operation class; 0 = unlimited. Transfers
+    // queue behind each other, like requests on a single disk.
+    uint64_t bytes_per_sec = 0;
+
+    // Probability that an operation fails with INJECTED_IO_ERROR.
+    double error_rate = 0;
+};
+
+struct FaultOptions {
+    IOProfile read;
+    IOProfile write;
+    IOProfile sync;
+
+    // Probability that an append persists only a random prefix of its data
+    // and then fails with INJECTED_TORN_WRITE.
+    double torn_write_rate = 0;
+
+    uint64_t seed = 42;
+};
+
+struct FaultStats {
+    uint64_t delayed_ops = 0;
+    uint64_t delay_micros = 0;
+    uint64_t injected_errors = 0;
+    uint64_t torn_writes = 0;
+};
+
+class FaultInjectionEnv : public EnvWrapper {
+    public:
+        explicit FaultInjectionEnv(Env* base) : EnvWrapper(base) {}
+
+        virtual void setOptions(const FaultOptions &options) = 0;
+        virtual FaultStats stats() = 0;
+};
+
+// Wraps base, which must outlive the returned Env. Caller owns the result.
+FaultInjectionEnv* NewFaultInjectionEnv(Env* base, const FaultOptions &options = FaultOptions());
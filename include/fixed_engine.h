@@ -0,0 +1,41 @@
+#pragma once
+
+#include "kv_engine.h"
+
+/*
+    LSM engine for datasets whose keys are fixed_key_size-byte big-endian
+    unsigned integers (4 or 8) and whose values are all fixed_value_size
+    bytes (8, 16 or 32). Each supported layout is its own instantiation of
+    one template over key and value traits, so record sizes are constants,
+    keys are compared and hashed as machine integers, and nothing is
+    length-prefixed.
+
+    The memtable is an integer hash map logged through the usual WAL. It is
+    flushed, sorted, to a segment of three columns:
+
+    | keys       | count big-endian keys, ascending |
+    | values     | count values, in key order       |
+    | tombstones | ceil(count / 8) bytes, a bit per record |
+    | footer     | uint64 count | uint32 key_size | uint32 value_size |
+    |            | uint32 crc of everything above | uint32 0 | uint64 magic |
+
+    The key column of every segment is held in memory as integers, so a
+    get is a branchless binary search per segment and at most one pread of
+    the value. Once compaction_threshold segments exist they are merged
+    into one, dropping tombstones.
+
+    Files under path: NNNNNN.log, NNNNNN.fix, MANIFEST (whose comparator
+    field records the layout, so the database opens only as it was
+    created) and LOCK.
+*/
+
+// Selected by CreateKVEngine when options.engine is FIXED. Returns nullptr
+// for a layout not listed above, a comparator other than the bytewise one
+// (which big-endian integers already follow), a database created with
+// another layout, an unopenable or locked directory, or options asking
+// for replication or a secondary. Writes of keys and values of the wrong
+// size fail with KEY_SIZE_MISMATCH / VALUE_SIZE_MISMATCH, while get() and
+// del() report such keys as not found; scan() takes an empty start or a
+// full-width key. get_updates_since() and checkpoints are
+// not supported.
+KVEngine* CreateFixedEngine(const Options &options);
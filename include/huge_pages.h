@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+    Memory for caches of many small blocks, carved out of 2 MiB chunks. A
+    read touching a block costs a TLB entry for each 4 KiB page it lands
+    on; a chunk backed by one huge page needs a single entry for all of it.
+
+    A chunk is mapped with MAP_HUGETLB when the system has huge pages
+    reserved, else mapped 2 MiB-aligned and madvise(MADV_HUGEPAGE)'d so the
+    kernel can back it with a transparent huge page, else left as it is.
+    Each chunk serves one size class; freed slots go back to their class
+    and chunks are unmapped only when the allocator is destroyed.
+*/
+
+struct HugePageStats {
+    uint64_t chunks = 0;
+    uint64_t hugetlb_chunks = 0;    // reserved huge pages
+    uint64_t advised_chunks = 0;    // transparent huge pages asked for
+    uint64_t bytes_in_use = 0;      // slots handed out, counted by slot size
+};
+
+class SlabAllocator {
+    public:
+        static const size_t CHUNK_SIZE = 2 << 20;
+        // Larger requests are not served.
+        static const size_t MAX_SLOT = CHUNK_SIZE / 4;
+
+        SlabAllocator() = default;
+        ~SlabAllocator();
+        SlabAllocator(const SlabAllocator &) = delete;
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        // n rounded up to its size class: 64 bytes, then powers of two
+        // and the midpoints between them.
+        static size_t slot_size(size_t n);
+
+        // Memory for n bytes; nullptr if n > MAX_SLOT or no chunk could be
+        // mapped. Thread-safe.
+        char* allocate(size_t n);
+        void release(char* p, size_t n);
+
+        HugePageStats stats();
+
+    private:
+        struct SizeClass {
+            vector<char*> free;
+            char* next = nullptr;   // unused tail of the newest chunk
+            char* end = nullptr;
+        };
+
+        mutex mu_;
+        unordered_map<size_t, SizeClass> classes_;
+        vector<char*> chunks_;
+        HugePageStats stats_;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+using namespace std;
+
+/*
+    Fixed-size key prefixes for searching sorted keys without reading them.
+    A key's prefix is its first 8 bytes, zero-padded, read big-endian, so
+    a <= b bytewise implies KeyPrefix(a) <= KeyPrefix(b): a key whose
+    prefix is below (above) the probe's sorts below (above) it, and only
+    keys with an equal prefix need a full compare.
+
+    Prefix columns are arrays of native uint64s at any alignment. The
+    search narrows by branchless binary search to a window of
+    PREFIX_WINDOW prefixes and counts within it with AVX2 (checked at run
+    time) or NEON compares, else a scalar loop.
+*/
+
+static const size_t PREFIX_WINDOW = 16;
+
+uint64_t KeyPrefix(string_view key);
+
+// Index of the first of the n ascending prefixes that is >= q, n if none.
+size_t PrefixLowerBound(const char* prefixes, size_t n, uint64_t q);
+
+// The same without vector instructions, for comparison.
+size_t PrefixLowerBoundScalar(const char* prefixes, size_t n, uint64_t q);
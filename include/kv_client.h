@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include "status.h"
+
+using namespace std;
+
+struct KVResponse {
+    uint32_t id = 0;
+    uint8_t code = 0;   // kvproto::Code
+    string value;   // GET value, ERROR message, or raw SCAN payload
+};
+
+/*
+    Client for kv_server's binary protocol. send*() only queue a request
+    and return its id; flush() puts everything queued on the wire at once,
+    and recv() returns replies in request order. Keeping many requests in
+    flight lets the server coalesce them into batched engine calls.
+
+    Not thread-safe: use one client per thread.
+*/
+class KVClient {
+    public:
+        virtual ~KVClient() = default;
+
+        virtual uint32_t sendGet(const string &key) = 0;
+        virtual uint32_t sendPut(const string &key, const string &value) = 0;
+        virtual uint32_t sendDel(const string &key) = 0;
+        virtual uint32_t sendScan(const string &start, uint32_t limit) = 0;
+        virtual Status flush() = 0;
+        virtual Status recv(KVResponse* resp) = 0;
+
+        // Blocking one-request round trips.
+        virtual Status get(const string &key, string* value) = 0;
+        virtual Status put(const string &key, const string &value) = 0;
+        virtual Status del(const string &key) = 0;
+        virtual Status scan(const string &start, uint32_t limit, vector<pair<string,string>>* out) = 0;
+};
+
+// Connects to host:port over TCP. Returns nullptr if the connection fails.
+KVClient* CreateKVClient(const string &host, int port);
@@ -1,17 +1,92 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <utility>
 #include "status.h"
+#include "options.h"
+#include "write_batch.h"
+#include "wal.h"
 
 using namespace std;
 
+// Counters since open. Each engine fills in the ones that apply to it.
+struct EngineStats {
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t cache_inserts = 0;
+    uint64_t cache_evictions = 0;
+    uint64_t cache_entries = 0;
+    uint64_t cache_bytes = 0;
+
+    // LSM block cache and its flash tier
+    uint64_t block_cache_hits = 0;
+    uint64_t block_cache_misses = 0;
+    uint64_t block_cache_bytes = 0;
+    uint64_t compressed_cache_hits = 0;
+    uint64_t compressed_cache_misses = 0;
+    uint64_t compressed_cache_bytes = 0;
+    uint64_t compressed_cache_raw_bytes = 0;
+    uint64_t decompressions = 0;
+    uint64_t decompress_nanos = 0;
+    uint64_t block_cache_chunks = 0;            // with block_cache_huge_pages
+    uint64_t block_cache_hugetlb_chunks = 0;
+    uint64_t block_cache_advised_chunks = 0;
+    uint64_t secondary_cache_hits = 0;
+    uint64_t secondary_cache_misses = 0;
+    uint64_t secondary_cache_inserts = 0;
+    uint64_t secondary_cache_bytes = 0;
+
+    double cache_hit_rate() const {
+        uint64_t lookups = cache_hits + cache_misses;
+        return lookups ? static_cast<double>(cache_hits) / lookups : 0;
+    }
+    // How many times more block data the compressed tier holds than the
+    // memory it is charged.
+    double compressed_cache_gain() const {
+        return compressed_cache_bytes ? static_cast<double>(compressed_cache_raw_bytes) / compressed_cache_bytes : 0;
+    }
+    double decompress_micros_per_block() const {
+        return decompressions ? decompress_nanos / 1000.0 / decompressions : 0;
+    }
+};
+
 class KVEngine {
     public:
         virtual ~KVEngine() = default;
         virtual Status put(const string &key, const string &value) = 0;
         virtual Status get(const string &key, string* value) = 0;
         virtual Status del(const string &key) = 0;
+
+        // Applies every operation in order with a single WAL sync.
+        virtual Status write(const WriteBatch &batch) = 0;
+
+        // Looks up all keys in one pass; values[i] is valid when statuses[i].ok().
+        virtual vector<Status> multi_get(const vector<string> &keys, vector<string>* values) = 0;
+
+        // Returns up to limit live pairs with key >= start, in comparator order.
+        virtual Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) = 0;
+
+        // Iterates the logged puts and deletes from seq onwards, across
+        // flushed logs kept by the wal_ttl_seconds / wal_size_limit_bytes
+        // options. Returns UPDATES_NOT_RETAINED if some of them are gone.
+        // The caller deletes *iter.
+        virtual Status get_updates_since(uint64_t seq, UpdateIterator** iter) = 0;
+
+        // Writes an openable copy of the database to dir, which must not
+        // exist. Segments are hard-linked where the Env allows it, so only
+        // the unflushed logs and the MANIFEST are actually copied.
+        virtual Status create_checkpoint(const string &dir) = 0;
+
+        // Secondary instances only: reloads the primary's MANIFEST and the
+        // log records appended since the last call.
+        virtual Status catch_up_with_primary() = 0;
+
+        virtual EngineStats stats(){
+            return EngineStats();
+        }
 };
 
-// Factory method to create a KVEngine instance
-KVEngine* CreateKVEngine();
\ No newline at end of file
+// Factory method to create a KVEngine instance.
+// Returns nullptr if the directory cannot be opened or is locked by another engine.
+KVEngine* CreateKVEngine(const Options &options = Options());
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+/*
+    Length-prefixed binary protocol shared by kv_server and KVClient.
+    All integers are little-endian.
+
+    request  | uint32 len | uint8 op     | uint32 id | payload |
+    response | uint32 len | uint8 status | uint32 id | payload |
+
+    len counts everything after itself. Strings in payloads are a uint32
+    length followed by the bytes.
+
+    GET   key          -> value
+    PUT   key value    -> (empty)
+    DEL   key          -> (empty)
+    SCAN  start limit  -> uint32 count, count x (key, value)
+    PING               -> (empty)
+
+    Responses come back in request order; id is echoed so clients can
+    check. An ERROR response carries the message as its payload.
+*/
+
+namespace kvproto {
+
+enum Op : uint8_t {
+    OP_GET = 1,
+    OP_PUT = 2,
+    OP_DEL = 3,
+    OP_SCAN = 4,
+    OP_PING = 5
+};
+
+enum Code : uint8_t {
+    CODE_OK = 0,
+    CODE_NOT_FOUND = 1,
+    CODE_ERROR = 2
+};
+
+static const size_t kHeaderSize = 4 + 1 + 4;
+static const uint32_t kMaxFrame = 512u << 20;
+
+inline void put_u32(string &out, uint32_t v){
+    out.append(reinterpret_cast<const char*>(&v), 4);
+}
+
+inline void put_str(string &out, const string &s){
+    put_u32(out, s.size());
+    out.append(s);
+}
+
+inline uint32_t get_u32(const char* p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Reads a string at *p without running past end; false if truncated.
+inline bool get_str(const char** p, const char* end, string* out){
+    if(end - *p < 4) return false;
+    uint32_t n = get_u32(*p);
+    if(static_cast<size_t>(end - *p - 4) < n) return false;
+    out->assign(*p + 4, n);
+    *p += 4 + n;
+    return true;
+}
+
+// Appends a frame header for a payload of payload_len bytes.
+inline void put_header(string &out, uint8_t op_or_code, uint32_t id, size_t payload_len){
+    put_u32(out, 1 + 4 + payload_len);
+    out.push_back(static_cast<char>(op_or_code));
+    put_u32(out, id);
+}
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "status.h"
+#include "env.h"
+
+using namespace std;
+
+/*
+    The MANIFEST names the files that make up the database. It is rewritten
+    whole (temp file + rename) whenever a flush or compaction changes the
+    segment set, so readers always see either the old or the new version.
+*/
+struct Manifest {
+    uint64_t next_file = 1;         // next number for a log or segment
+    uint64_t log_number = 0;        // logs numbered below this are flushed
+    uint64_t last_sequence = 0;     // highest seq contained in segments
+    uint64_t image_number = 0;      // memtable image left by a clean close, 0 if none
+    uint64_t image_sequence = 0;    // highest seq contained in that image
+    string comparator;              // name of the key order; empty = bytewise
+    vector<uint64_t> segments;      // segment numbers, oldest first
+};
+
+// Returns MANIFEST_NOT_FOUND if dir has no manifest yet.
+Status read_manifest(Env* env, const string &dir, Manifest* out);
+
+Status write_manifest(Env* env, const string &dir, const Manifest &m);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include "status.h"
+#include "env.h"
+
+using namespace std;
+
+/*
+    A memtable written out whole at clean shutdown, so the next open can
+    load it in one read instead of replaying the logs record by record.
+    deleted holds the keys whose tombstones have not been flushed yet.
+*/
+
+Status write_mem_image(
+    Env* env,
+    const string &path,
+    const unordered_map<string, string> &data,
+    const unordered_set<string> &deleted,
+    uint64_t seq
+);
+
+// Fails with MEM_IMAGE_CORRUPTED unless the whole image checks out.
+Status read_mem_image(
+    Env* env,
+    const string &path,
+    unordered_map<string, string> *data,
+    unordered_set<string> *deleted,
+    uint64_t *seq
+);
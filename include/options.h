@@ -0,0 +1,172 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "env.h"
+#include "comparator.h"
+
+using namespace std;
+
+enum class EngineType {
+    LSM,        // memtable + sorted segments
+    BITCASK,    // append-only data files + in-memory hash index (bitcask.h)
+    BTREE,      // mmap'd copy-on-write B+tree (btree.h)
+    CACHE,      // in-memory only, evicts to stay in budget (cache_engine.h)
+    FIXED,      // integer keys and values of one size (fixed_engine.h)
+};
+
+enum class SegmentFormat {
+    BLOCK,      // indexed, compressible blocks (segment.h)
+    PLAIN,      // unblocked records, mapped whole and hash-indexed on open
+};
+
+enum class MemtableType {
+    HASH,       // unordered_map + unordered_set; writers exclude readers
+    CUCKOO,     // CuckooTable (cuckoo_table.h); readers never wait on writers
+};
+
+enum class EvictionPolicy {
+    LRU,
+    CLOCK,
+    S3FIFO,
+};
+
+enum class CompressionType {
+    NONE,
+    ZLIB,       // deflate, per block
+};
+
+// A directory for segments and the bytes of them it should hold.
+struct DbPath {
+    string path;
+    uint64_t target_size;
+};
+
+struct Options {
+    // Storage engine behind CreateKVEngine().
+    EngineType engine = EngineType::LSM;
+
+    // Filesystem, locks and clock used by the engine. nullptr = DefaultEnv().
+    Env* env = nullptr;
+
+    // Root directory; the engine keeps wal/ and segments/ underneath it.
+    string path = ".";
+
+    // Key order of segments and scans; must outlive the engine. A
+    // database only opens with the comparator it was created with. The
+    // B+tree engine supports only the bytewise one.
+    const Comparator* comparator = BytewiseComparator();
+
+    // Tiered storage for segments, fastest first. A new segment goes to the
+    // first path whose segments stay within target_size with it added, else
+    // to the last, whose target is ignored. Flushes land on the fast paths;
+    // a compaction's merged output moves to a slower one once it outgrows
+    // them. Empty = everything in path/segments. Segments found in
+    // path/segments (restores, snapshots) are read from there.
+    vector<DbPath> db_paths;
+
+    // Directory for WAL logs and memtable images; empty = path/wal.
+    string wal_dir;
+
+    // Target size of a segment block, the unit of segment reads and caching,
+    // and how blocks are compressed. A block that does not shrink by an
+    // eighth is stored raw.
+    size_t segment_block_size = 4096;
+    CompressionType segment_compression = CompressionType::NONE;
+
+    // With ZLIB, compaction output is deflated with a preset dictionary of
+    // up to this many bytes sampled from its records and kept in the
+    // segment, so blocks of small values share context. 0 = none.
+    size_t segment_dictionary_bytes = 0;
+
+    // Layout of new segments. PLAIN suits data that fits in memory: point
+    // gets are a hash probe into the mapped file, with no blocks to read or
+    // decode, but nothing is compressed or cached and every open segment
+    // is mapped and indexed (about 16 bytes a key). Segments of either
+    // format are read whatever this says.
+    SegmentFormat segment_format = SegmentFormat::BLOCK;
+
+    // Memory for recently read segment blocks; 0 disables the cache. With
+    // compressed_block_cache_bytes, compressed blocks are first cached as
+    // stored and decompressed on every hit; only blocks hit there again
+    // are promoted to the block_cache_bytes of uncompressed ones.
+    size_t block_cache_bytes = 8 << 20;
+    size_t compressed_block_cache_bytes = 0;
+
+    // Keep cached blocks in 2 MiB chunks backed by huge pages, reserved
+    // ones if the system has any, else transparent ones, else (without
+    // failing) ordinary pages; see huge_pages.h. Fewer TLB misses on hits,
+    // one memcpy per insert.
+    bool block_cache_huge_pages = false;
+
+    // Flash tier under the block cache: blocks it evicts are kept in files
+    // under secondary_cache_path, up to secondary_cache_bytes, deflated if
+    // secondary_cache_compress. Only blocks of segments off the first of
+    // several db_paths go there. Empty disables it. The directory is
+    // wiped at open and must not be shared between engines.
+    string secondary_cache_path;
+    uint64_t secondary_cache_bytes = 256 << 20;
+    bool secondary_cache_compress = true;
+
+    // Number of memtable entries that triggers a flush to a new segment.
+    size_t mem_limit = 5;
+
+    // LSM: how the memtable is kept. Either is flushed sorted, once.
+    MemtableType memtable = MemtableType::HASH;
+
+    // Number of segments that triggers a full compaction.
+    size_t compaction_threshold = 3;
+
+    // Threads used to decode and replay logs at open; 0 = one per core.
+    int recovery_threads = 0;
+
+    // On clean close, write the memtable out as one sorted image that the
+    // next open loads in bulk instead of replaying the logs.
+    bool memtable_image_on_close = true;
+
+    // Flushed WAL logs are kept for get_updates_since() readers until they
+    // are older than wal_ttl_seconds or, oldest first, until the kept logs
+    // fit in wal_size_limit_bytes. With both 0 they are deleted at flush.
+    uint64_t wal_ttl_seconds = 0;
+    uint64_t wal_size_limit_bytes = 0;
+
+    // Secondary: open path read-only alongside the primary engine that owns
+    // it, without taking its lock. Reads see the primary's state as of the
+    // last catch_up_with_primary(), which also runs every
+    // secondary_refresh_ms when that is non-zero.
+    bool secondary = false;
+    uint64_t secondary_refresh_ms = 0;
+
+    // Bitcask: the active data file is sealed once it reaches this size,
+    // and the sealed files are merged once this fraction of them is dead.
+    uint64_t bitcask_max_file_size = 64 << 20;
+    double bitcask_merge_ratio = 0.5;
+
+    // B+tree: address space reserved for the mapped file, which caps the
+    // size of the database.
+    uint64_t btree_map_size = 1ull << 30;
+
+    // Cache: memory budget for keys, values and per-entry overhead, split
+    // evenly across cache_shards hash shards.
+    size_t cache_capacity_bytes = 64 << 20;
+    int cache_shards = 16;
+    EvictionPolicy cache_eviction = EvictionPolicy::S3FIFO;
+
+    // Fixed: key width (4 or 8) and value width (8, 16 or 32) in bytes.
+    size_t fixed_key_size = 8;
+    size_t fixed_value_size = 16;
+
+    // Leader: serve followers on this address ("unix:/path" or "host:port").
+    // Empty disables replication.
+    string replication_listen;
+
+    // Bytes of recent WAL records a leader keeps in memory. A follower that
+    // falls further behind than this catches up from a snapshot instead.
+    size_t replication_backlog_bytes = 4 << 20;
+
+    // Follower: replicate from the leader at this address. The engine then
+    // serves reads only; put/del/write return READ_ONLY.
+    string replicate_from;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "status.h"
+#include "env.h"
+
+using namespace std;
+
+/*
+    WAL-shipping replication. A leader keeps the most recent WAL records in
+    an in-memory backlog and streams them, with their sequence numbers, to
+    followers. A follower too far behind for the backlog is sent a snapshot
+    instead: the leader's segment files, live logs and manifest, which it
+    installs and replays before resuming the stream.
+
+    Addresses are "unix:/path/to.sock" or "host:port".
+*/
+
+struct SnapshotFile {
+    string name;                // relative to the database root
+    RandomAccessFile* file;     // owned by the snapshot
+    uint64_t size;
+};
+
+// Implemented by a leader engine.
+class ReplicationSource {
+    public:
+        virtual ~ReplicationSource() = default;
+
+        // Copies encoded records with seq > after into *out (at most about
+        // max_bytes), waiting up to timeout_ms for new ones. *last is the
+        // seq of the final record copied. Returns NEED_SNAPSHOT when the
+        // backlog no longer reaches back to after.
+        virtual Status readBacklog(uint64_t after, size_t max_bytes, int timeout_ms,
+                                   string* out, uint64_t* last) = 0;
+
+        // Consistent set of files a follower can restart from. The caller
+        // deletes the file handles.
+        virtual Status snapshot(vector<SnapshotFile>* files) = 0;
+};
+
+// Implemented by a follower engine.
+class ReplicationSink {
+    public:
+        virtual ~ReplicationSink() = default;
+
+        virtual uint64_t appliedSequence() = 0;
+
+        // Applies encoded WAL records in order; records at or below the
+        // applied sequence are skipped.
+        virtual Status applyRecords(const char* data, size_t len) = 0;
+
+        // Directory where incoming snapshot files are staged.
+        virtual string stagingDir() = 0;
+
+        // Replaces local state with the staged snapshot files.
+        virtual Status installSnapshot(const vector<string> &names) = 0;
+};
+
+class ReplicationServer {
+    public:
+        virtual ~ReplicationServer() = default;
+};
+
+class ReplicationClient {
+    public:
+        virtual ~ReplicationClient() = default;
+        virtual bool connected() = 0;
+        // How the last session ended: OK, or the error that ended it, such
+        // as a snapshot that could not be installed.
+        virtual Status status() = 0;
+};
+
+// Serves followers on address until deleted. Returns nullptr if the
+// address cannot be bound.
+ReplicationServer* StartReplicationServer(ReplicationSource* source, const string &address);
+
+// Follows the leader at address until deleted, reconnecting as needed.
+ReplicationClient* StartReplicationClient(ReplicationSink* sink, Env* env, const string &address);
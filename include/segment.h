@@ -1,17 +1,160 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "status.h"
+#include "env.h"
+#include "block_cache.h"
+#include "options.h"
+#include "comparator.h"
 
 using namespace std;
 
+/*
+    A segment holds its records sorted by key, cut into blocks of about
+    block_size bytes, followed by an optional meta block, an index block
+    and a fixed footer:
+
+    | data block | trailer | ... | meta block | trailer | index block | trailer | footer |
+
+    block:    records, then the uint32 offset of each record within the
+              block and a uint32 record count, for binary search
+    prefixed: records | count uint64 key prefixes | uint32 shared |
+              offsets | count; shared is the length of the prefix common
+              to all keys, and each key's next 8 bytes after it are a
+              KeyPrefix (key_prefix.h) to narrow the search by
+    record:   uint32 key_len | uint32 val_len | key | value
+              (a tombstone has val_len = 0xFFFFFFFF and no value)
+    trailer:  uint8 type | uint32 crc of the stored block and type
+              (type 0 = raw, 1 = uint32 raw size + zlib stream, 2 = the
+              same, deflated with the segment's dictionary)
+    meta:     a raw block of named records; "zlib.dictionary" holds the
+              preset dictionary of type 2 blocks
+    index:    a block whose records map a key between each data block and
+              the next (at least its last key, below the next one's first)
+              to the block's uint64 offset and uint32 size; prefixed in
+              files of the bytewise comparator
+    footer:   uint64 meta offset | uint64 meta size (0 = none) |
+              uint64 index offset | uint64 index size | uint64 magic
+
+    Files ending in the previous magic have the same footer but no index
+    prefixes, and those before it a footer of just the index handle and
+    magic. Files with neither are segments from before blocks:
+    unsorted crc-prefixed records, read front to back.
+
+    The plain format has no blocks, just the sorted records and a footer:
+
+    | record | record | ... | footer |
+
+    footer:   uint64 records size | uint64 record count | uint32 crc of
+              the records | uint32 0 | uint64 magic
+
+    Its index is not stored: OpenPlainSegment maps the file read-only,
+    checks the crc and hashes every key into an open-addressed table of
+    record offsets.
+*/
+
+struct SegmentWriteOptions {
+    // orders the records and shortens the index keys
+    const Comparator* comparator = BytewiseComparator();
+    size_t block_size = 4096;
+    CompressionType compression = CompressionType::NONE;
+    // With ZLIB: sample up to this many bytes of records (at most 32KiB and
+    // a sixteenth of the segment) into a preset dictionary that every block
+    // is deflated with. 0 = none.
+    size_t dictionary_bytes = 0;
+    // Write index key prefixes (bytewise comparator only); false writes
+    // the previous format, for comparison.
+    bool index_prefixes = true;
+    // PLAIN ignores the block, compression and index options.
+    SegmentFormat format = SegmentFormat::BLOCK;
+};
+
+// Lets search_segment keep blocks in a BlockCache. file_id names the file
+// there and must never be reused for other contents; 0 = no caching.
+struct SegmentReadOptions {
+    // the one the segment was written with
+    const Comparator* comparator = BytewiseComparator();
+    BlockCache* cache = nullptr;
+    uint64_t file_id = 0;
+    // blocks may go to the cache's secondary tier when evicted
+    bool spill = true;
+    // Set by a caller that has told the segment's format apart once, with
+    // ReadSegmentFormat(); otherwise each call reads it from the file.
+    bool format_known = false;
+    SegmentFormat format = SegmentFormat::BLOCK;
+};
+
+// Keys in deleted are written as tombstones.
 Status write_segment(
+    Env* env,
     const string &path,
-    const unordered_map<string, string> &data
+    const unordered_map<string, string> &data,
+    const unordered_set<string> *deleted = nullptr,
+    const SegmentWriteOptions &options = SegmentWriteOptions()
 );
 
+// One key's record for the overload below; value is ignored for a tombstone.
+struct SegmentRecord {
+    string_view key;
+    string_view value;
+    bool tombstone;
+};
+
+// The same from records in any order, one per key, sorted here once. The
+// bytes they point at must outlive the call.
+Status write_segment(
+    Env* env,
+    const string &path,
+    vector<SegmentRecord> records,
+    const SegmentWriteOptions &options = SegmentWriteOptions()
+);
+
+// Merges the segment into out: puts overwrite, tombstones erase. If deleted
+// is given it tracks the keys whose latest record merged was a tombstone.
+// Stops at the first corrupted block with CORRUPTION, having merged the
+// blocks before it (the old format just stops at a corrupted record). A
+// plain segment that fails its crc merges nothing.
 Status read_segment(
+    Env* env,
+    const string &path,
+    unordered_map<string, string> &out,
+    unordered_set<string> *deleted = nullptr,
+    const SegmentReadOptions &options = SegmentReadOptions()
+);
+
+// Looks key up through the index, reading one data block. Returns
+// KEY_DELETED if the segment holds a tombstone for it, and CORRUPTION if
+// the index or the data block fails its crc or does not parse. A plain
+// segment is read whole, and CORRUPTION if it fails its crc, so callers
+// that look it up more than once keep it open with OpenPlainSegment
+// instead.
+Status search_segment(
+    Env* env,
     const string &path,
-    unordered_map<string, string> &out
-);
\ No newline at end of file
+    const string &key,
+    string* value,
+    const SegmentReadOptions &options = SegmentReadOptions()
+);
+
+// A plain segment mapped whole. Safe for concurrent readers.
+class PlainSegment {
+    public:
+        virtual ~PlainSegment() = default;
+
+        // One probe of the hash index. OK with *value pointing into the
+        // mapping, valid while this is open; DELETED for a tombstone.
+        virtual Status get(string_view key, string_view* value) const = 0;
+        virtual uint64_t count() const = 0;
+};
+
+// PLAIN or BLOCK, the latter for every older format too, from the magic
+// at the end of the file.
+Status ReadSegmentFormat(Env* env, const string &path, SegmentFormat* format);
+
+// NOT_SUPPORTED if path is a segment of another format; CORRUPTION if its
+// records do not match the footer.
+Status OpenPlainSegment(Env* env, const string &path, PlainSegment** out);
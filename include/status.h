@@ -1,25 +1,85 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include <cstdint>
 using namespace std;
 
+/*
+    What an operation came to: a code callers branch on, and for errors a
+    name saying what exactly failed ("SEGMENT_OPEN_FAILED"). Names are
+    string literals, so making, copying and returning a Status allocates
+    nothing; only detail built at run time (an error text a server sent
+    back) goes to the heap, when there is some.
+*/
+enum class StatusCode : uint8_t {
+    OK,
+    NOT_FOUND,          // no such key, file or backup
+    DELETED,            // a segment's tombstone hides the key; stays inside the engine
+    IO_ERROR,           // a file, mapping or connection failed
+    CORRUPTION,         // data failed its checks
+    NOT_SUPPORTED,      // the engine or instance cannot do this
+    INVALID_ARGUMENT,
+    BUSY,               // locked, read-only, not open or shutting down
+    INCOMPLETE,         // history needed to answer is gone; start over from a snapshot
+    REMOTE,             // a server's error; the detail is its text
+};
+
 class Status{
     private:
-        bool ok_;
-        string msg_;
+        StatusCode code_;
+        const char* name_;
+        shared_ptr<const string> detail_;
+
+        Status(StatusCode code, const char* name) : code_(code), name_(name) {}
 
     public:
-        Status(bool ok = true, string msg = "") : ok_(ok), msg_(msg) {}
+        Status() : code_(StatusCode::OK), name_("OK") {}
+
         static Status OK(){
-            return Status(true);
+            return Status();
+        }
+        static Status NotFound(const char* name = "KEY_NOT_FOUND"){
+            return Status(StatusCode::NOT_FOUND, name);
+        }
+        static Status Deleted(){
+            return Status(StatusCode::DELETED, "KEY_DELETED");
+        }
+        static Status IOError(const char* name){
+            return Status(StatusCode::IO_ERROR, name);
+        }
+        static Status Corruption(const char* name){
+            return Status(StatusCode::CORRUPTION, name);
         }
-        static Status Error(const string &msg){
-            return Status(false, msg);
+        static Status NotSupported(const char* name = "NOT_SUPPORTED"){
+            return Status(StatusCode::NOT_SUPPORTED, name);
         }
+        static Status InvalidArgument(const char* name){
+            return Status(StatusCode::INVALID_ARGUMENT, name);
+        }
+        static Status Busy(const char* name){
+            return Status(StatusCode::BUSY, name);
+        }
+        static Status Incomplete(const char* name){
+            return Status(StatusCode::INCOMPLETE, name);
+        }
+        static Status Remote(const string &detail){
+            Status s(StatusCode::REMOTE, "REMOTE_ERROR");
+            s.detail_ = make_shared<const string>(detail);
+            return s;
+        }
+
         bool ok() const {
-            return ok_;
+            return code_ == StatusCode::OK;
+        }
+        bool isNotFound() const {
+            return code_ == StatusCode::NOT_FOUND;
+        }
+        StatusCode code() const {
+            return code_;
         }
-        string msg() const { 
-            return msg_; 
+        // The detail if there is one, else the name.
+        const char* msg() const {
+            return detail_ ? detail_->c_str() : name_;
         }
 };
@@ -2,7 +2,10 @@
 
 #include <string>
 #include <functional>
+#include <vector>
+#include <cstdint>
 #include "status.h"
+#include "env.h"
 
 using namespace std;
 
@@ -10,17 +13,71 @@ enum class WalOpType {
     PUT,
     DEL
 };
+
+class WriteBatch;
+
+// seq is 0 for records written before sequence numbers existed.
+using WalRecordFn = function<void(uint64_t seq, WalOpType type, const string &key, const string &value)>;
+
 class WAL{
     public:
         virtual ~WAL() = default;
 
-        virtual Status appendPut(const string &key ,const string & value) = 0;
-        virtual Status appendDel(const string &key) = 0;
+        virtual Status appendPut(uint64_t seq, const string &key ,const string & value) = 0;
+        virtual Status appendDel(uint64_t seq, const string &key) = 0;
+        // Appends every record of the batch, numbered from first_seq, with
+        // one write and one sync. After a failed append or sync, the next
+        // call first cuts the log back to the end of its last good record.
+        virtual Status appendBatch(uint64_t first_seq, const WriteBatch &batch) = 0;
         virtual Status sync() = 0;
-        virtual Status replay(
-            const function<void(WalOpType,const string& ,const string&) >& fn
-        ) = 0;
+        virtual Status replay(const WalRecordFn& fn) = 0;
+
+        // fn sees the encoded bytes of every append after it is synced, in
+        // log order, while the WAL is still locked.
+        virtual void setAppendListener(function<void(const char* data, size_t len)> fn) = 0;
 };
 
 // Factory method to create a WAL instance
-WAL* CreateWAL(const string &path);
\ No newline at end of file
+WAL* CreateWAL(Env* env, const string &path);
+
+// One logged operation, as returned by KVEngine::get_updates_since().
+struct UpdateRecord {
+    uint64_t seq = 0;
+    WalOpType type = WalOpType::PUT;
+    string key;
+    string value;       // empty for DEL
+};
+
+class UpdateIterator {
+    public:
+        virtual ~UpdateIterator() = default;
+
+        // False once the records run out or after an error; see status().
+        virtual bool valid() const = 0;
+        virtual const UpdateRecord& record() const = 0;
+        virtual void next() = 0;
+        virtual Status status() const = 0;
+};
+
+// Iterates the records with seq >= start_seq across logs (oldest first),
+// up to the end of the last log as it is when that log is reached. Logs
+// that end before start_seq are skipped without being read through.
+UpdateIterator* NewWalIterator(Env* env, const vector<string> &logs, uint64_t start_seq);
+
+// Decodes the complete records of the log at path from byte offset on.
+// *end is set to the offset just past the last record decoded, where a
+// later call can resume once more has been appended.
+Status ReadWalRecords(Env* env, const string &path, uint64_t offset, const WalRecordFn &fn, uint64_t* end);
+
+// Reads the whole log at path and decodes it on up to threads threads.
+// out receives the records in log order, up to the first record that is
+// incomplete or fails its checksum (the same cut-off as WAL::replay).
+Status ReadWalParallel(Env* env, const string &path, int threads, vector<UpdateRecord>* out);
+
+// Seq of the first record in the log; 0 if it is empty or has no seqs.
+uint64_t ReadFirstWalSeq(Env* env, const string &path);
+
+// Decodes complete records from data[0, len) and returns the bytes used.
+// A trailing partial record is left unconsumed; *corrupt is set if decoding
+// stopped at a record whose checksum does not match.
+size_t DecodeWalRecords(const char* data, size_t len, const WalRecordFn &fn, bool* corrupt = nullptr);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "wal.h"
+
+using namespace std;
+
+/*
+    An ordered group of puts and deletes that the engine logs with a single
+    WAL sync and applies to the memtable under one lock.
+*/
+class WriteBatch {
+    public:
+        struct Op {
+            WalOpType type;
+            string key;
+            string value;
+        };
+
+        void put(const string &key, const string &value){
+            ops_.push_back({WalOpType::PUT, key, value});
+        }
+
+        void del(const string &key){
+            ops_.push_back({WalOpType::DEL, key, ""});
+        }
+
+        void clear(){
+            ops_.clear();
+        }
+
+        size_t count() const {
+            return ops_.size();
+        }
+
+        const vector<Op> &ops() const {
+            return ops_;
+        }
+
+    private:
+        vector<Op> ops_;
+};
@@ -1,14 +1,38 @@
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <atomic>
+#include <map>
+#include <set>
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 
 #include "kv_engine.h"
+#include "fault_env.h"
+#include "backup.h"
+#include "block_cache.h"
+#include "huge_pages.h"
+#include "segment.h"
+#include "key_prefix.h"
+#include "cuckoo_table.h"
 
 using namespace std;
 
+// Heap allocations made so far, for status_test.
+static atomic<uint64_t> allocations{0};
+
+void* operator new(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+// out of line, or GCC sees free() paired with the allocator's operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
 /* ---------------- Concurrency Test ---------------- */
 void concurrency_test() {
     cout << "[TEST] Fine-grained concurrency test\n";
@@ -177,28 +201,2148 @@ void corruption_test() {
         delete e;
     }
 
-    // WAL must be removed so only segment is used
-    unlink("wal/kv.wal");
+    // Logs must be removed so only segments are used
+    vector<string> names;
+    DefaultEnv()->getChildren("wal", &names);
+    for (const auto& name : names) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0) {
+            unlink(("wal/" + name).c_str());
+        }
+    }
 
-    // Corrupt the segment
-    int fd = open("segments/seg_0.sst", O_WRONLY);
-    uint32_t junk = 0xdeadbeef;
-    write(fd, &junk, sizeof(junk));
-    close(fd);
+    // Corrupt the segments
+    DefaultEnv()->getChildren("segments", &names);
+    for (const auto& name : names) {
+        int fd = open(("segments/" + name).c_str(), O_WRONLY);
+        uint32_t junk = 0xdeadbeef;
+        write(fd, &junk, sizeof(junk));
+        close(fd);
+    }
 
     KVEngine* e2 = CreateKVEngine();
     string v;
     Status s = e2->get("X", &v);
 
-    if (s.ok()) {
+    if (s.code() != StatusCode::CORRUPTION) {
         cout << "[FAIL] Corruption not detected\n";
         exit(1);
     }
+    delete e2;
+
+    // a corrupted block in a newer segment is reported, not read past to
+    // the value it replaced in an older one
+    Options opts;
+    opts.path = "corruptdb";
+    opts.mem_limit = 10;
+    opts.compaction_threshold = 100;
+    e2 = CreateKVEngine(opts);
+    for (const char* value : {"old", "new"}) {
+        e2->put("X", value);
+        for (int i = 0; i < 9; i++) e2->put(string(value) + to_string(i), value);
+    }
+    delete e2;
+    DefaultEnv()->getChildren("corruptdb/segments", &names);
+    string newest;
+    for (const auto& name : names) {
+        if (newest.empty() || name.size() > newest.size() || (name.size() == newest.size() && name > newest)) newest = name;
+    }
+    int fd = open(("corruptdb/segments/" + newest).c_str(), O_RDWR);
+    char byte = 0;
+    bool flipped = pread(fd, &byte, 1, 20) == 1;
+    byte ^= 1;
+    flipped = flipped && pwrite(fd, &byte, 1, 20) == 1;
+    close(fd);
+    e2 = CreateKVEngine(opts);
+    if (!flipped || e2->get("X", &v).code() != StatusCode::CORRUPTION) {
+        cout << "[FAIL] Corrupted block read past to an older value\n";
+        exit(1);
+    }
 
     cout << "[PASS] Corruption detected safely\n";
     delete e2;
 }
 
+void memenv_test() {
+    cout << "[TEST] In-memory Env test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "memdb";
+
+    {
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 20; i++) {
+            e->put("k" + to_string(i), "v" + to_string(i));
+        }
+        e->del("k3");
+
+        if (CreateKVEngine(opts) != nullptr) {
+            cout << "[FAIL] Second engine acquired the lock\n";
+            exit(1);
+        }
+        delete e;
+    }
+
+    KVEngine* e = CreateKVEngine(opts);
+    string v;
+    if (!e->get("k19", &v).ok() || v != "v19") {
+        cout << "[FAIL] k19 not recovered from in-memory WAL\n";
+        exit(1);
+    }
+    if (e->get("k3", &v).ok()) {
+        cout << "[FAIL] Deleted key k3 came back\n";
+        exit(1);
+    }
+    if (DefaultEnv()->fileExists("memdb")) {
+        cout << "[FAIL] In-memory Env touched the real disk path\n";
+        exit(1);
+    }
+
+    cout << "[PASS] In-memory Env verified\n";
+    delete e;
+    delete env;
+}
+void fault_test() {
+    cout << "[TEST] Fault injection test\n";
+
+    Env* mem = NewMemEnv();
+    FaultInjectionEnv* env = NewFaultInjectionEnv(mem);
+    Options opts;
+    opts.env = env;
+    opts.path = "faultdb";
+    opts.mem_limit = 1000;
+    // recover from the log alone, not from a close-time image
+    opts.memtable_image_on_close = false;
+
+    KVEngine* e = CreateKVEngine(opts);
+    e->put("A", "1");
+
+    FaultOptions fo;
+    fo.write.error_rate = 1.0;
+    env->setOptions(fo);
+    if (e->put("B", "2").ok()) {
+        cout << "[FAIL] Injected write error not surfaced\n";
+        exit(1);
+    }
+
+    fo = FaultOptions();
+    fo.torn_write_rate = 1.0;
+    env->setOptions(fo);
+    if (e->put("C", "3").ok()) {
+        cout << "[FAIL] Torn write not surfaced\n";
+        exit(1);
+    }
+    env->setOptions(FaultOptions());
+    // the torn record must not hide writes acknowledged after it
+    if (!e->put("D", "4").ok()) {
+        cout << "[FAIL] Write after torn write failed\n";
+        exit(1);
+    }
+    delete e;
+
+    e = CreateKVEngine(opts);
+    string v;
+    if (!e->get("A", &v).ok() || v != "1") {
+        cout << "[FAIL] Record before torn write lost\n";
+        exit(1);
+    }
+    if (e->get("C", &v).ok()) {
+        cout << "[FAIL] Torn record replayed\n";
+        exit(1);
+    }
+    if (!e->get("D", &v).ok() || v != "4") {
+        cout << "[FAIL] Record after torn write lost\n";
+        exit(1);
+    }
+    FaultStats st = env->stats();
+    if (st.injected_errors != 1 || st.torn_writes != 1) {
+        cout << "[FAIL] Unexpected fault counters\n";
+        exit(1);
+    }
+
+    delete e;
+    delete env;
+
+    // Fails the creation of chosen segment files: a flush or compaction
+    // that cannot write its segment must leave everything readable.
+    struct SegmentFailEnv : public EnvWrapper {
+        int created = 0;
+        set<int> fail;
+        explicit SegmentFailEnv(Env* base) : EnvWrapper(base) {}
+        Status newWritableFile(const string &path, WritableFile** out) override {
+            if (path.find("/seg_") != string::npos && fail.count(++created)) {
+                return Status::IOError("INJECTED");
+            }
+            return EnvWrapper::newWritableFile(path, out);
+        }
+    };
+    SegmentFailEnv seg_env(mem);
+    opts.env = &seg_env;
+    opts.path = "segfaultdb";
+    opts.mem_limit = 10;
+    opts.compaction_threshold = 3;
+    // the second flush, and the first compaction
+    seg_env.fail = {2, 5};
+    e = CreateKVEngine(opts);
+    for (int i = 0; i < 60; i++) {
+        e->put("k" + to_string(i), "v" + to_string(i));
+    }
+    e->del("k7");
+    auto check = [&](const char* when) {
+        for (int i = 0; i < 60; i++) {
+            Status s = e->get("k" + to_string(i), &v);
+            bool want = i != 7;
+            if (s.ok() != want || (want && v != "v" + to_string(i))) {
+                cout << "[FAIL] Key k" << i << " wrong " << when << "\n";
+                exit(1);
+            }
+        }
+    };
+    check("after failed segment writes");
+    if (seg_env.created < 6) {
+        cout << "[FAIL] Failed flush or compaction not retried\n";
+        exit(1);
+    }
+    delete e;
+    e = CreateKVEngine(opts);
+    check("after reopening");
+
+    cout << "[PASS] Fault injection verified\n";
+    delete e;
+    delete mem;
+}
+
+void batch_test() {
+    cout << "[TEST] WriteBatch, multi_get and scan test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "batchdb";
+
+    KVEngine* e = CreateKVEngine(opts);
+    WriteBatch b;
+    for (int i = 0; i < 12; i++) {
+        b.put("k" + to_string(i), "v" + to_string(i));
+    }
+    b.del("k5");
+    if (!e->write(b).ok()) {
+        cout << "[FAIL] Batch write failed\n";
+        exit(1);
+    }
+    e->put("k0", "new");
+
+    vector<string> vals;
+    vector<Status> st = e->multi_get({"k0", "k5", "k11", "nope"}, &vals);
+    if (!st[0].ok() || vals[0] != "new" || st[1].ok() ||
+        !st[2].ok() || vals[2] != "v11" || st[3].ok()) {
+        cout << "[FAIL] multi_get returned wrong results\n";
+        exit(1);
+    }
+
+    vector<pair<string, string>> rows;
+    e->scan("k1", 3, &rows);
+    if (rows.size() != 3 || rows[0].first != "k1" || rows[1].first != "k10" || rows[2].first != "k11") {
+        cout << "[FAIL] scan returned wrong range\n";
+        exit(1);
+    }
+    delete e;
+
+    e = CreateKVEngine(opts);
+    string v;
+    if (!e->get("k7", &v).ok() || v != "v7") {
+        cout << "[FAIL] Batch not recovered from WAL\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Batch APIs verified\n";
+    delete e;
+    delete env;
+}
+
+void updates_test() {
+    cout << "[TEST] get_updates_since test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "cdcdb";
+    opts.wal_ttl_seconds = 3600;
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int i = 1; i <= 20; i++) {
+        e->put("k" + to_string(i), "v" + to_string(i));
+    }
+    e->del("k4");
+
+    // Records span several flushed logs and the live one.
+    UpdateIterator* it = nullptr;
+    if (!e->get_updates_since(7, &it).ok()) {
+        cout << "[FAIL] get_updates_since rejected a retained seq\n";
+        exit(1);
+    }
+    uint64_t want = 7;
+    for (; it->valid(); it->next(), want++) {
+        const UpdateRecord& r = it->record();
+        bool is_del = want == 21;
+        if (r.seq != want || (r.type == WalOpType::DEL) != is_del ||
+            (!is_del && r.value != "v" + to_string(want))) {
+            cout << "[FAIL] Unexpected record at seq " << r.seq << "\n";
+            exit(1);
+        }
+    }
+    if (!it->status().ok() || want != 22) {
+        cout << "[FAIL] Iterator stopped early at seq " << want << "\n";
+        exit(1);
+    }
+    delete it;
+    delete e;
+
+    // Without retention flushed logs are deleted.
+    opts.wal_ttl_seconds = 0;
+    e = CreateKVEngine(opts);
+    e->put("k21", "v21");
+    for (int i = 0; i < 5; i++) e->put("pad" + to_string(i), "x");
+    if (e->get_updates_since(1, &it).ok()) {
+        cout << "[FAIL] Purged updates reported as retained\n";
+        exit(1);
+    }
+
+    cout << "[PASS] get_updates_since verified\n";
+    delete e;
+    delete env;
+}
+
+void checkpoint_test() {
+    cout << "[TEST] Checkpoint and incremental backup test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "cpdb";
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int i = 0; i < 12; i++) {
+        e->put("k" + to_string(i), "v" + to_string(i));
+    }
+    if (!e->create_checkpoint("cpdb_copy").ok() || e->create_checkpoint("cpdb_copy").ok()) {
+        cout << "[FAIL] Checkpoint creation\n";
+        exit(1);
+    }
+
+    BackupEngine* be = OpenBackupEngine(env, "backups");
+    uint32_t first = 0;
+    be->createBackup(e, &first);
+    vector<string> shared_before;
+    env->getChildren("backups/shared", &shared_before);
+
+    for (int i = 12; i < 24; i++) {
+        e->put("k" + to_string(i), "v" + to_string(i));
+    }
+    be->createBackup(e);
+    delete e;
+
+    vector<BackupInfo> infos;
+    be->getBackupInfo(&infos);
+    vector<string> shared_after;
+    env->getChildren("backups/shared", &shared_after);
+    if (infos.size() != 2 || shared_before.empty() || shared_after.size() < shared_before.size()) {
+        cout << "[FAIL] Unexpected backup contents\n";
+        exit(1);
+    }
+
+    // The checkpoint and the first backup both predate k12..k23.
+    opts.path = "cpdb_copy";
+    KVEngine* c = CreateKVEngine(opts);
+    string v;
+    if (!c || !c->get("k11", &v).ok() || v != "v11" || c->get("k12", &v).ok()) {
+        cout << "[FAIL] Checkpoint does not match the source\n";
+        exit(1);
+    }
+    delete c;
+
+    if (!be->restoreBackup(first, "restored").ok()) {
+        cout << "[FAIL] Restore failed\n";
+        exit(1);
+    }
+    opts.path = "restored";
+    c = CreateKVEngine(opts);
+    if (!c || !c->get("k0", &v).ok() || v != "v0" || c->get("k20", &v).ok()) {
+        cout << "[FAIL] Restored backup does not match\n";
+        exit(1);
+    }
+    delete c;
+
+    be->deleteBackup(first);
+    be->getBackupInfo(&infos);
+    if (infos.size() != 1) {
+        cout << "[FAIL] Backup not deleted\n";
+        exit(1);
+    }
+
+    // A damaged shared segment is copied again, not reused.
+    vector<string> shared;
+    env->getChildren("backups/shared", &shared);
+    for (const auto& name : shared) {
+        uint64_t size = 0;
+        env->getFileSize("backups/shared/" + name, &size);
+        WritableFile* f = nullptr;
+        env->newWritableFile("backups/shared/" + name, &f);
+        string junk(size, 'x');
+        f->append(junk.data(), junk.size());
+        f->close();
+        delete f;
+    }
+    opts.path = "cpdb";
+    e = CreateKVEngine(opts);
+    uint32_t last = 0;
+    if (!be->createBackup(e, &last).ok() || !be->restoreBackup(last, "restored").ok()) {
+        cout << "[FAIL] Backup over damaged shared segments\n";
+        exit(1);
+    }
+    delete e;
+    opts.path = "restored";
+    c = CreateKVEngine(opts);
+    for (int i = 0; i < 24; i++) {
+        if (!c || !c->get("k" + to_string(i), &v).ok() || v != "v" + to_string(i)) {
+            cout << "[FAIL] Damaged shared segment reused\n";
+            exit(1);
+        }
+    }
+    delete c;
+
+    cout << "[PASS] Checkpoint and backup verified\n";
+    delete be;
+    delete env;
+}
+
+void secondary_test() {
+    cout << "[TEST] Secondary instance test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "secdb";
+
+    KVEngine* primary = CreateKVEngine(opts);
+    for (int i = 0; i < 12; i++) {
+        primary->put("k" + to_string(i), "v" + to_string(i));
+    }
+
+    Options sopts = opts;
+    sopts.secondary = true;
+    KVEngine* sec = CreateKVEngine(sopts);
+    string v;
+    if (!sec || !sec->get("k0", &v).ok() || !sec->get("k11", &v).ok()) {
+        cout << "[FAIL] Secondary did not load the primary's state\n";
+        exit(1);
+    }
+    if (sec->put("x", "y").ok()) {
+        cout << "[FAIL] Secondary accepted a write\n";
+        exit(1);
+    }
+
+    primary->put("k12", "v12");
+    if (sec->get("k12", &v).ok()) {
+        cout << "[FAIL] Secondary saw a write before catching up\n";
+        exit(1);
+    }
+
+    // Enough writes to flush and compact under the secondary.
+    for (int i = 13; i < 40; i++) {
+        primary->put("k" + to_string(i), "v" + to_string(i));
+    }
+    primary->del("k1");
+    if (!sec->catch_up_with_primary().ok() || !sec->get("k39", &v).ok() ||
+        !sec->get("k5", &v).ok() || v != "v5" || sec->get("k1", &v).ok()) {
+        cout << "[FAIL] Secondary did not catch up\n";
+        exit(1);
+    }
+    delete sec;
+
+    sopts.secondary_refresh_ms = 10;
+    sec = CreateKVEngine(sopts);
+    primary->put("late", "1");
+    bool seen = false;
+    for (int i = 0; i < 100 && !seen; i++) {
+        usleep(10 * 1000);
+        seen = sec->get("late", &v).ok();
+    }
+    if (!seen) {
+        cout << "[FAIL] Background refresh did not pick up a write\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Secondary instance verified\n";
+    delete sec;
+    delete primary;
+    delete env;
+}
+
+void image_test() {
+    cout << "[TEST] Memtable image on clean close test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "imgdb";
+    opts.mem_limit = 1000;
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int i = 0; i < 100; i++) {
+        e->put("k" + to_string(i), "v" + to_string(i));
+    }
+    e->del("k7");
+    delete e;
+
+    auto count_images = [&]() {
+        vector<string> names;
+        env->getChildren("imgdb/wal", &names);
+        int n = 0;
+        for (const auto& name : names) n += name.find(".img") != string::npos;
+        return n;
+    };
+    if (count_images() != 1) {
+        cout << "[FAIL] No memtable image written on close\n";
+        exit(1);
+    }
+
+    // A small mem_limit makes the next write flush the loaded image.
+    opts.mem_limit = 5;
+    e = CreateKVEngine(opts);
+    string v;
+    if (!e->get("k99", &v).ok() || v != "v99" || e->get("k7", &v).ok()) {
+        cout << "[FAIL] Image not loaded on open\n";
+        exit(1);
+    }
+    e->put("after", "1");
+    if (count_images() != 0) {
+        cout << "[FAIL] Image kept after its contents were flushed\n";
+        exit(1);
+    }
+    delete e;
+
+    e = CreateKVEngine(opts);
+    if (!e->get("k42", &v).ok() || v != "v42" || !e->get("after", &v).ok()) {
+        cout << "[FAIL] Data lost after flushing the image\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Memtable image verified\n";
+    delete e;
+    delete env;
+}
+
+void parallel_recovery_test() {
+    cout << "[TEST] Parallel log recovery test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "recdb";
+    opts.mem_limit = 100000;
+    opts.memtable_image_on_close = false;
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 2000; i++) {
+            e->put("k" + to_string(i), "v" + to_string(round) + "_" + to_string(i));
+        }
+    }
+    for (int i = 0; i < 2000; i += 10) e->del("k" + to_string(i));
+    delete e;
+
+    // Replay with four threads and a small budget forces partitions to
+    // flush to segments during recovery.
+    opts.mem_limit = 400;
+    opts.recovery_threads = 4;
+    e = CreateKVEngine(opts);
+    vector<string> segs;
+    env->getChildren("recdb/segments", &segs);
+    if (segs.empty()) {
+        cout << "[FAIL] Recovery did not flush early\n";
+        exit(1);
+    }
+    string v;
+    for (int i = 0; i < 2000; i++) {
+        bool found = e->get("k" + to_string(i), &v).ok();
+        if (i % 10 == 0 ? found : (!found || v != "v2_" + to_string(i))) {
+            cout << "[FAIL] Wrong value for k" << i << " after parallel recovery\n";
+            exit(1);
+        }
+    }
+    e->put("after", "1");
+    delete e;
+
+    opts.recovery_threads = 1;
+    e = CreateKVEngine(opts);
+    if (!e->get("k1999", &v).ok() || v != "v2_1999" || e->get("k1990", &v).ok() ||
+        !e->get("after", &v).ok()) {
+        cout << "[FAIL] Data lost after reopening a recovered database\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Parallel recovery verified\n";
+    delete e;
+    delete env;
+}
+
+// Counts pread calls on every file opened through it.
+class PreadCountingEnv : public EnvWrapper {
+    class File : public RandomAccessFile {
+        RandomAccessFile* base_;
+        atomic<int>* count_;
+    public:
+        File(RandomAccessFile* base, atomic<int>* count) : base_(base), count_(count) {}
+        ~File() { delete base_; }
+        Status pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const override {
+            (*count_)++;
+            return base_->pread(offset, n, scratch, bytes_read);
+        }
+    };
+
+public:
+    atomic<int> preads{0};
+
+    explicit PreadCountingEnv(Env* base) : EnvWrapper(base) {}
+
+    Status newRandomAccessFile(const string& path, RandomAccessFile** out) override {
+        RandomAccessFile* f = nullptr;
+        Status s = base_->newRandomAccessFile(path, &f);
+        if (s.ok()) *out = new File(f, &preads);
+        return s;
+    }
+};
+
+void bitcask_test() {
+    cout << "[TEST] Bitcask engine test\n";
+
+    Env* mem = NewMemEnv();
+    PreadCountingEnv env(mem);
+    Options opts;
+    opts.env = &env;
+    opts.path = "bcdb";
+    opts.engine = EngineType::BITCASK;
+    opts.bitcask_max_file_size = 4096;
+
+    // Overwrites make most sealed bytes dead, so files get merged.
+    KVEngine* e = CreateKVEngine(opts);
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < 200; i++) {
+            e->put("k" + to_string(i), "v" + to_string(round) + "_" + to_string(i));
+        }
+    }
+    for (int i = 0; i < 200; i += 10) e->del("k" + to_string(i));
+
+    vector<string> names;
+    mem->getChildren("bcdb", &names);
+    int hints = 0;
+    for (const auto& name : names) hints += name.find(".hint") != string::npos;
+    if (hints == 0) {
+        cout << "[FAIL] No merge happened\n";
+        exit(1);
+    }
+
+    string v;
+    int before = env.preads.load();
+    if (!e->get("k57", &v).ok() || v != "v4_57" || env.preads.load() != before + 1) {
+        cout << "[FAIL] Get did not take exactly one pread\n";
+        exit(1);
+    }
+    delete e;
+
+    e = CreateKVEngine(opts);
+    for (int i = 0; i < 200; i++) {
+        bool found = e->get("k" + to_string(i), &v).ok();
+        if (i % 10 == 0 ? found : (!found || v != "v4_" + to_string(i))) {
+            cout << "[FAIL] Wrong value for k" << i << " after reopen\n";
+            exit(1);
+        }
+    }
+    vector<pair<string, string>> rows;
+    if (!e->scan("k198", 5, &rows).ok() || rows.size() != 5 || rows[0].first != "k198" ||
+        rows[1].first != "k199" || rows[2].first != "k2" || rows[3].first != "k21") {
+        cout << "[FAIL] Scan out of order\n";
+        exit(1);
+    }
+
+    delete e;
+
+    // A torn append fails, and the records after it still land where the
+    // keydir says.
+    FaultInjectionEnv* faults = NewFaultInjectionEnv(mem);
+    opts.env = faults;
+    e = CreateKVEngine(opts);
+    FaultOptions fo;
+    fo.torn_write_rate = 1.0;
+    faults->setOptions(fo);
+    if (e->put("torn", string(100, 't')).ok()) {
+        cout << "[FAIL] Torn bitcask append not surfaced\n";
+        exit(1);
+    }
+    faults->setOptions(FaultOptions());
+    for (int round = 0; round < 2; round++) {
+        if (round == 0 && !e->put("after", "torn").ok()) {
+            cout << "[FAIL] Bitcask append after a torn one failed\n";
+            exit(1);
+        }
+        if (!e->get("after", &v).ok() || v != "torn" || !e->get("k1", &v).ok() || v != "v4_1") {
+            cout << "[FAIL] Bitcask read wrong after a torn append\n";
+            exit(1);
+        }
+        delete e;
+        e = CreateKVEngine(opts);
+    }
+
+    delete e;
+
+    // A merge that dies part way through deleting its victims must not
+    // bring back a key: its value sits in an earlier merge's output, whose
+    // id is above the file holding its tombstone.
+    struct DeleteLimitEnv : public EnvWrapper {
+        int data_deletes = -1;  // allowed before the "crash"; -1 = all
+        int attempts = 0;
+        explicit DeleteLimitEnv(Env* base) : EnvWrapper(base) {}
+        Status deleteFile(const string& path) override {
+            if (path.find(".data") != string::npos && data_deletes >= 0) {
+                attempts++;
+                if (data_deletes == 0) return Status::IOError("INJECTED");
+                data_deletes--;
+            }
+            return EnvWrapper::deleteFile(path);
+        }
+    };
+    DeleteLimitEnv limit(mem);
+    opts.env = &limit;
+    opts.path = "bcmerge";
+    e = CreateKVEngine(opts);
+    e->put("x", "old");
+    auto merges = [&]() {
+        names.clear();
+        mem->getChildren("bcmerge", &names);
+        int n = 0;
+        for (const auto& name : names) n += name.find(".hint") != string::npos;
+        return n;
+    };
+    for (int i = 0; merges() == 0; i++) e->put("w", string(100, 'a' + i % 26));
+    e->del("x");
+    limit.data_deletes = 1;
+    for (int i = 0; limit.attempts == 0; i++) e->put("w", string(100, 'a' + i % 26));
+    delete e;
+    limit.data_deletes = -1;
+    e = CreateKVEngine(opts);
+    if (e->get("x", &v).ok()) {
+        cout << "[FAIL] Interrupted bitcask merge resurrected a deleted key\n";
+        exit(1);
+    }
+    delete e;
+
+    // a hint a merge did not finish renaming is cleared on open
+    WritableFile* stray = nullptr;
+    mem->newWritableFile("bcmerge/000099.hint.tmp", &stray);
+    stray->close();
+    delete stray;
+    e = CreateKVEngine(opts);
+    if (mem->fileExists("bcmerge/000099.hint.tmp")) {
+        cout << "[FAIL] Leftover bitcask hint.tmp not removed\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Bitcask engine verified\n";
+    delete e;
+    delete faults;
+    delete mem;
+}
+
+static void check_btree(KVEngine* e, const map<string, string>& model, const char* when) {
+    vector<pair<string, string>> rows;
+    e->scan("", model.size() + 10, &rows);
+    if (rows != vector<pair<string, string>>(model.begin(), model.end())) {
+        cout << "[FAIL] B+tree contents differ from the model " << when << "\n";
+        exit(1);
+    }
+}
+
+void btree_test() {
+    cout << "[TEST] Copy-on-write B+tree engine test\n";
+
+    Env* mem = NewMemEnv();
+    for (Env* env : {mem, DefaultEnv()}) {
+        Options opts;
+        opts.env = env;
+        opts.path = "btreedb";
+        opts.engine = EngineType::BTREE;
+        opts.btree_map_size = 64 << 20;
+
+        // Random puts, some with overflow values, overwrites and deletes.
+        map<string, string> model;
+        KVEngine* e = CreateKVEngine(opts);
+        unsigned x = 7;
+        for (int i = 0; i < 6000; i++) {
+            x = x * 1103515245 + 12345;
+            string key = "k" + to_string(x % 3000);
+            if (i % 7 == 3 && model.count(key)) {
+                e->del(key);
+                model.erase(key);
+                continue;
+            }
+            string value = string(i % 50 == 0 ? 9000 : x % 200, 'a' + i % 26);
+            e->put(key, value);
+            model[key] = value;
+        }
+        check_btree(e, model, "after writes");
+
+        vector<pair<string, string>> rows;
+        auto it = model.lower_bound("k2");
+        if (!e->scan("k2", 3, &rows).ok() || rows.size() != 3 || rows[0].first != it->first) {
+            cout << "[FAIL] B+tree scan from a key failed\n";
+            exit(1);
+        }
+
+        // Readers see either the whole batch or none of it.
+        atomic<bool> stop{false};
+        atomic<bool> torn{false};
+        thread reader([&]() {
+            while (!stop.load()) {
+                vector<string> values;
+                vector<Status> st = e->multi_get({"pair_a", "pair_b"}, &values);
+                if (st[0].ok() != st[1].ok() || values[0] != values[1]) torn = true;
+            }
+        });
+        for (int i = 0; i < 300; i++) {
+            WriteBatch b;
+            b.put("pair_a", to_string(i));
+            b.put("pair_b", to_string(i));
+            e->write(b);
+            model["pair_a"] = model["pair_b"] = to_string(i);
+        }
+        stop = true;
+        reader.join();
+        if (torn.load()) {
+            cout << "[FAIL] Reader saw half a batch\n";
+            exit(1);
+        }
+
+        // Overwriting in place must reuse freed pages, not grow the file.
+        uint64_t before = 0, after = 0;
+        env->getFileSize("btreedb/btree.db", &before);
+        for (int round = 0; round < 3; round++) {
+            for (const auto& [k, v] : model) e->put(k, v);
+        }
+        env->getFileSize("btreedb/btree.db", &after);
+        if (after > before * 2) {
+            cout << "[FAIL] B+tree file grew from " << before << " to " << after << "\n";
+            exit(1);
+        }
+        delete e;
+
+        e = CreateKVEngine(opts);
+        if (e == nullptr) {
+            cout << "[FAIL] B+tree did not reopen\n";
+            exit(1);
+        }
+        check_btree(e, model, "after reopen");
+        delete e;
+    }
+    delete mem;
+
+    cout << "[PASS] B+tree engine verified\n";
+}
+
+void cache_test() {
+    cout << "[TEST] Cache engine test\n";
+
+    for (EvictionPolicy policy : {EvictionPolicy::LRU, EvictionPolicy::CLOCK, EvictionPolicy::S3FIFO}) {
+        Options opts;
+        opts.path = "cache_should_not_exist";
+        opts.engine = EngineType::CACHE;
+        opts.cache_capacity_bytes = 256 << 10;
+        opts.cache_shards = 4;
+        opts.cache_eviction = policy;
+        KVEngine* e = CreateKVEngine(opts);
+
+        // A hot set that is read repeatedly, then a flood of one-off keys.
+        string v;
+        for (int round = 0; round < 4; round++) {
+            for (int i = 0; i < 100; i++) {
+                if (!e->get("hot" + to_string(i), &v).ok()) e->put("hot" + to_string(i), string(100, 'h'));
+            }
+        }
+        for (int i = 0; i < 5000; i++) e->put("cold" + to_string(i), string(100, 'c'));
+
+        int hot = 0;
+        for (int i = 0; i < 100; i++) hot += e->get("hot" + to_string(i), &v).ok();
+
+        EngineStats st = e->stats();
+        if (st.cache_bytes > opts.cache_capacity_bytes || st.cache_evictions == 0 ||
+            st.cache_hits < 300 || st.cache_inserts != st.cache_evictions + st.cache_entries) {
+            cout << "[FAIL] Cache statistics inconsistent\n";
+            exit(1);
+        }
+        if (policy == EvictionPolicy::S3FIFO && hot < 90) {
+            cout << "[FAIL] S3-FIFO let a scan evict the hot set (" << hot << "/100 left)\n";
+            exit(1);
+        }
+        if (!e->del("cold4999").ok() || e->get("cold4999", &v).ok()) {
+            cout << "[FAIL] Cache delete failed\n";
+            exit(1);
+        }
+        delete e;
+    }
+    if (DefaultEnv()->fileExists("cache_should_not_exist")) {
+        cout << "[FAIL] Cache engine touched the disk\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Cache engine verified\n";
+}
+
+/* ---------------- Replication Test ---------------- */
+static bool wait_for_key(KVEngine* e, const string& key, const string& want) {
+    string v;
+    for (int i = 0; i < 200; i++) {
+        if (e->get(key, &v).ok() && v == want) return true;
+        usleep(50 * 1000);
+    }
+    return false;
+}
+
+void replication_test() {
+    cout << "[TEST] Leader/follower replication test\n";
+
+    Options lopts;
+    lopts.path = "repl_leader";
+    lopts.mem_limit = 20;
+
+    // Written before replication is on, so a new follower is already
+    // behind the backlog and has to start from a snapshot.
+    {
+        KVEngine* e = CreateKVEngine(lopts);
+        for (int i = 0; i < 50; i++) {
+            e->put("k" + to_string(i), "v" + to_string(i));
+        }
+        delete e;
+    }
+
+    // Fork before any engine threads exist.
+    pid_t pid = fork();
+    if (pid == 0) {
+        Options fopts;
+        fopts.path = "repl_follower";
+        fopts.replicate_from = "unix:repl.sock";
+        KVEngine* f = CreateKVEngine(fopts);
+
+        if (!wait_for_key(f, "k49", "v49") || !wait_for_key(f, "k3", "v3")) {
+            cout << "[FAIL] Follower did not install the snapshot\n";
+            _exit(1);
+        }
+        if (DefaultEnv()->fileExists("repl_follower/staging")) {
+            cout << "[FAIL] Follower left its staging directory behind\n";
+            _exit(1);
+        }
+        if (f->put("x", "y").ok()) {
+            cout << "[FAIL] Follower accepted a write\n";
+            _exit(1);
+        }
+        if (!wait_for_key(f, "live99", "99") || !wait_for_key(f, "live0", "0")) {
+            cout << "[FAIL] Follower did not apply streamed records\n";
+            _exit(1);
+        }
+        delete f;
+        _exit(0);
+    }
+
+    lopts.replication_listen = "unix:repl.sock";
+    lopts.replication_backlog_bytes = 256;
+    KVEngine* leader = CreateKVEngine(lopts);
+    if (leader == nullptr) {
+        cout << "[FAIL] Leader could not listen\n";
+        exit(1);
+    }
+    usleep(500 * 1000);
+    for (int i = 0; i < 100; i++) {
+        leader->put("live" + to_string(i), to_string(i));
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    delete leader;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cout << "[FAIL] Follower exited with an error\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Replication verified\n";
+}
+
+void flash_cache_test() {
+    cout << "[TEST] Flash block cache test\n";
+
+    // The tier on its own: a ring of regions, oldest dropped first.
+    SecondaryCache* sc = NewFileSecondaryCache(DefaultEnv(), "flash_unit", 64 << 10, true);
+    auto block = [](int i) {
+        // 16 letters at random: deflates to about half
+        string s(2000, ' ');
+        uint32_t x = i * 2654435761u + 1;
+        for (auto& c : s) {
+            x = x * 1103515245 + 12345;
+            c = 'a' + (x >> 16) % 16;
+        }
+        return s;
+    };
+    for (int i = 0; i < 400; i++) sc->insert(1, i, block(i));
+    string b;
+    if (sc->lookup(1, 0, &b) || !sc->lookup(1, 399, &b) || b != block(399)) {
+        cout << "[FAIL] Flash tier kept the wrong blocks\n";
+        exit(1);
+    }
+    int kept = 0;
+    for (int i = 0; i < 400; i++) kept += sc->lookup(1, i, &b);
+    if (sc->stats().bytes > 64 << 10 || kept * 2000 <= 64 << 10) {
+        cout << "[FAIL] Flash tier over capacity or not compressing\n";
+        exit(1);
+    }
+    // corrupted copies read as misses, never as data
+    vector<string> regions;
+    DefaultEnv()->getChildren("flash_unit", &regions);
+    for (const auto& name : regions) {
+        int fd = open(("flash_unit/" + name).c_str(), O_WRONLY);
+        string junk(1 << 16, 'z');
+        write(fd, junk.data(), junk.size());
+        close(fd);
+    }
+    for (int i = 0; i < 400; i++) {
+        if (sc->lookup(1, i, &b)) {
+            cout << "[FAIL] Corrupted flash block returned\n";
+            exit(1);
+        }
+    }
+    delete sc;
+
+    // Behind the engine: a block cache far smaller than the data.
+    for (bool tiered : {false, true}) {
+        Options opts;
+        opts.path = tiered ? "fc_tiered" : "fcdb";
+        opts.mem_limit = 200;
+        opts.compaction_threshold = 100;
+        opts.block_cache_bytes = 16 << 10;
+        opts.secondary_cache_path = opts.path + "_flash";
+        opts.secondary_cache_bytes = 1 << 20;
+        // everything fits on the first path, which is not worth caching
+        if (tiered) opts.db_paths = {{opts.path + "/fast", 1ull << 30}, {opts.path + "/slow", 0}};
+
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 2000; i++) e->put("k" + to_string(i), string(100, 'v') + to_string(i));
+        string v;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < 2000; i += 7) {
+                if (!e->get("k" + to_string(i), &v).ok() || v != string(100, 'v') + to_string(i)) {
+                    cout << "[FAIL] k" << i << " wrong through the block caches\n";
+                    exit(1);
+                }
+            }
+        }
+        EngineStats st = e->stats();
+        if (st.block_cache_bytes > opts.block_cache_bytes || st.block_cache_hits == 0) {
+            cout << "[FAIL] Block cache statistics inconsistent\n";
+            exit(1);
+        }
+        if (!tiered && (st.secondary_cache_inserts == 0 || st.secondary_cache_hits == 0)) {
+            cout << "[FAIL] Evicted blocks were not served from flash\n";
+            exit(1);
+        }
+        if (tiered && st.secondary_cache_inserts != 0) {
+            cout << "[FAIL] Blocks on the fast path went to flash\n";
+            exit(1);
+        }
+        delete e;
+    }
+
+    cout << "[PASS] Flash block cache verified\n";
+}
+
+void compressed_cache_test() {
+    cout << "[TEST] Compressed block cache test\n";
+
+    Env* env = NewMemEnv();
+    auto json = [](int i) {
+        return "{\"id\":" + to_string(i) + ",\"name\":\"user" + to_string(i) +
+               "\",\"active\":true,\"roles\":[\"reader\",\"writer\"]}";
+    };
+    uint64_t sizes[2] = {0, 0};
+    for (int z = 0; z < 2; z++) {
+        Options opts;
+        opts.env = env;
+        opts.path = z ? "zdb" : "rawdb";
+        opts.mem_limit = 3000;
+        opts.segment_compression = z ? CompressionType::ZLIB : CompressionType::NONE;
+        opts.block_cache_bytes = 8 << 10;
+        opts.compressed_block_cache_bytes = 64 << 10;
+
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 3000; i++) e->put("k" + to_string(100000 + i), json(i));
+        vector<string> names;
+        env->getChildren(opts.path + "/segments", &names);
+        for (const auto& name : names) {
+            uint64_t size = 0;
+            env->getFileSize(opts.path + "/segments/" + name, &size);
+            sizes[z] += size;
+        }
+
+        // a key from every block or so, then a hot few many times
+        string v;
+        for (int i = 0; i < 3000; i += 101) {
+            if (!e->get("k" + to_string(100000 + i), &v).ok() || v != json(i)) {
+                cout << "[FAIL] k" << i << " wrong through the compressed tier\n";
+                exit(1);
+            }
+        }
+        for (int round = 0; round < 5; round++) {
+            for (int i = 0; i < 10; i++) e->get("k" + to_string(100000 + i), &v);
+        }
+
+        EngineStats st = e->stats();
+        if (!z && (st.compressed_cache_bytes != 0 || st.decompressions != 0)) {
+            cout << "[FAIL] Raw blocks went to the compressed tier\n";
+            exit(1);
+        }
+        if (z && (st.compressed_cache_hits == 0 || st.decompressions == 0 ||
+                  st.compressed_cache_gain() < 2 || st.compressed_cache_bytes > opts.compressed_block_cache_bytes)) {
+            cout << "[FAIL] Compressed tier statistics off (gain " << st.compressed_cache_gain() << ")\n";
+            exit(1);
+        }
+        // the hot keys were promoted and now hit uncompressed
+        if (z && st.block_cache_hits < 40) {
+            cout << "[FAIL] Hot blocks were not promoted\n";
+            exit(1);
+        }
+        delete e;
+    }
+    if (sizes[1] * 2 > sizes[0]) {
+        cout << "[FAIL] zlib segments barely shrank (" << sizes[1] << " vs " << sizes[0] << ")\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Compressed block cache verified\n";
+    delete env;
+}
+
+void huge_pages_test() {
+    cout << "[TEST] Huge page block cache test\n";
+
+    SlabAllocator slabs;
+    if (SlabAllocator::slot_size(1) != 64 || SlabAllocator::slot_size(65) != 96 ||
+        SlabAllocator::slot_size(4096) != 4096 || SlabAllocator::slot_size(4097) != 6144) {
+        cout << "[FAIL] Size classes off\n";
+        exit(1);
+    }
+    char* a = slabs.allocate(4000);
+    char* b = slabs.allocate(4000);
+    if (a == nullptr || b == nullptr || a == b || slabs.allocate(SlabAllocator::MAX_SLOT + 1) != nullptr) {
+        cout << "[FAIL] Slab allocation\n";
+        exit(1);
+    }
+    memset(a, 'a', 4000);
+    memset(b, 'b', 4000);
+    slabs.release(a, 4000);
+    if (slabs.allocate(4000) != a || b[3999] != 'b' || slabs.stats().bytes_in_use != 2 * 4096) {
+        cout << "[FAIL] Freed slot not reused\n";
+        exit(1);
+    }
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "hugedb";
+    opts.mem_limit = 2000;
+    opts.segment_compression = CompressionType::ZLIB;
+    opts.block_cache_bytes = 64 << 10;
+    opts.compressed_block_cache_bytes = 32 << 10;
+    opts.block_cache_huge_pages = true;
+
+    KVEngine* e = CreateKVEngine(opts);
+    auto value = [](int i) { return "value-" + to_string(i) + string(i % 90, 'v'); };
+    for (int i = 0; i < 6000; i++) e->put("k" + to_string(100000 + i), value(i));
+    // every key twice, so both tiers fill, evict and hand their slots on
+    string v;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 6000; i++) {
+            if (!e->get("k" + to_string(100000 + i), &v).ok() || v != value(i)) {
+                cout << "[FAIL] k" << i << " wrong through huge page blocks\n";
+                exit(1);
+            }
+        }
+    }
+    EngineStats st = e->stats();
+    if (st.block_cache_hits == 0 || st.compressed_cache_hits == 0 || st.block_cache_chunks == 0 ||
+        st.block_cache_bytes > opts.block_cache_bytes || st.compressed_cache_bytes > opts.compressed_block_cache_bytes) {
+        cout << "[FAIL] Huge page cache statistics off\n";
+        exit(1);
+    }
+    // evicted slots are reused: a chunk or so per size class in use
+    if (st.block_cache_chunks > 24) {
+        cout << "[FAIL] " << st.block_cache_chunks << " chunks for " << (96 << 10) << " bytes of cache\n";
+        exit(1);
+    }
+    delete e;
+
+    cout << "[PASS] Huge page block cache verified (" << st.block_cache_hugetlb_chunks << " reserved, "
+         << st.block_cache_advised_chunks << " transparent of " << st.block_cache_chunks << " chunks)\n";
+    delete env;
+}
+
+void dictionary_test() {
+    cout << "[TEST] Dictionary compression test\n";
+
+    Env* env = NewMemEnv();
+    auto json = [](int i) {
+        return "{\"id\":" + to_string(i) + ",\"kind\":\"" + (i % 2 ? "click" : "view") +
+               "\",\"ok\":true}";
+    };
+    uint64_t sizes[2] = {0, 0};
+    for (int d = 0; d < 2; d++) {
+        Options opts;
+        opts.env = env;
+        opts.path = d ? "dictdb" : "nodictdb";
+        opts.mem_limit = 1500;
+        opts.compaction_threshold = 2;
+        opts.segment_block_size = 256;
+        opts.segment_compression = CompressionType::ZLIB;
+        opts.segment_dictionary_bytes = d ? 4 << 10 : 0;
+        opts.compressed_block_cache_bytes = 64 << 10;
+
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 3000; i++) e->put("k" + to_string(100000 + i), json(i));
+        vector<string> names;
+        env->getChildren(opts.path + "/segments", &names);
+        for (const auto& name : names) {
+            uint64_t size = 0;
+            env->getFileSize(opts.path + "/segments/" + name, &size);
+            sizes[d] += size;
+        }
+        delete e;
+
+        // read back cold, through the compressed tier, and by scan
+        e = CreateKVEngine(opts);
+        string v;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < 3000; i += 7) {
+                if (!e->get("k" + to_string(100000 + i), &v).ok() || v != json(i)) {
+                    cout << "[FAIL] k" << i << " wrong after compaction\n";
+                    exit(1);
+                }
+            }
+        }
+        vector<pair<string, string>> rows;
+        if (!e->scan("k101000", 10, &rows).ok() || rows.size() != 10 || rows[9].second != json(1009)) {
+            cout << "[FAIL] Scan over a dictionary segment\n";
+            exit(1);
+        }
+        if (e->stats().compressed_cache_hits == 0) {
+            cout << "[FAIL] Compressed tier unused\n";
+            exit(1);
+        }
+        delete e;
+    }
+    if (sizes[1] * 5 > sizes[0] * 4) {
+        cout << "[FAIL] Dictionary did not help (" << sizes[1] << " vs " << sizes[0] << " bytes)\n";
+        exit(1);
+    }
+
+    cout << "[PASS] Dictionary compression verified\n";
+    delete env;
+}
+
+void status_test() {
+    cout << "[TEST] Status codes test\n";
+
+    if (!Status::OK().ok() || !Status::NotFound().isNotFound() || Status::NotFound().ok() ||
+        Status::IOError("SEGMENT_OPEN_FAILED").code() != StatusCode::IO_ERROR ||
+        string(Status::NotFound().msg()) != "KEY_NOT_FOUND" ||
+        string(Status::Corruption("WAL_CORRUPTED").msg()) != "WAL_CORRUPTED" ||
+        string(Status::Remote("ERR boom").msg()) != "ERR boom") {
+        cout << "[FAIL] Codes or names off\n";
+        exit(1);
+    }
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "statusdb";
+    opts.mem_limit = 1000;
+    KVEngine* e = CreateKVEngine(opts);
+    e->put("present", "value");
+    e->del("gone");
+    string v;
+    v.reserve(64);
+    Status s;
+
+    // hits and misses answered by the memtable allocate nothing
+    uint64_t before = allocations.load();
+    for (int i = 0; i < 1000; i++) {
+        s = e->get("present", &v);
+        if (!s.ok()) break;
+        s = e->get("missing", &v);
+        if (!s.isNotFound()) break;
+        s = e->get("gone", &v);
+        if (!s.isNotFound()) break;
+        Status copy = s;
+        s = copy;
+    }
+    uint64_t used = allocations.load() - before;
+    if (!s.isNotFound() || v != "value") {
+        cout << "[FAIL] Wrong results\n";
+        exit(1);
+    }
+    if (used != 0) {
+        cout << "[FAIL] " << used << " allocations on the hit and miss paths\n";
+        exit(1);
+    }
+
+    // errors keep their code on the way out of the engine
+    if (e->create_checkpoint("statusdb").code() != StatusCode::INVALID_ARGUMENT) {
+        cout << "[FAIL] Checkpoint over an existing directory\n";
+        exit(1);
+    }
+    delete e;
+    delete env;
+
+    cout << "[PASS] Status codes verified\n";
+}
+
+// Keys are 8-byte big-endian signed integers, which bytewise order puts
+// negatives-last.
+class Int64Comparator : public Comparator {
+    static int64_t decode(string_view k) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < 8 && i < k.size(); i++) v = v << 8 | static_cast<uint8_t>(k[i]);
+        return static_cast<int64_t>(v);
+    }
+
+    public:
+        int compare(string_view a, string_view b) const override {
+            int64_t x = decode(a), y = decode(b);
+            return x < y ? -1 : x > y ? 1 : 0;
+        }
+        const char* name() const override { return "test.int64"; }
+        void findShortestSeparator(string*, string_view) const override {}
+        void findShortSuccessor(string*) const override {}
+};
+
+static string int64_key(int64_t v) {
+    string k(8, '\0');
+    for (int i = 0; i < 8; i++) k[i] = static_cast<char>(static_cast<uint64_t>(v) >> (56 - 8 * i));
+    return k;
+}
+
+void comparator_test() {
+    cout << "[TEST] Comparator test\n";
+
+    const Comparator* bytewise = BytewiseComparator();
+    string sep = "abcdefg";
+    bytewise->findShortestSeparator(&sep, "abzz");
+    string prefix = "ab";
+    bytewise->findShortestSeparator(&prefix, "abc");
+    string succ = "\xff\xff" "ab";
+    bytewise->findShortSuccessor(&succ);
+    if (sep != "abd" || prefix != "ab" || succ != "\xff\xff" "b" || bytewise->compare("\x80", "\x7f") <= 0) {
+        cout << "[FAIL] Bytewise separators off\n";
+        exit(1);
+    }
+
+    Int64Comparator int64;
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "int64db";
+    opts.comparator = &int64;
+    opts.mem_limit = 300;
+    opts.compaction_threshold = 3;
+    opts.segment_block_size = 256;
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int i = 0; i < 2000; i++) {
+        int64_t k = (i * 7919) % 2000 - 1000;   // every key in -1000..999, shuffled
+        e->put(int64_key(k), "v" + to_string(k));
+    }
+    for (int64_t k = -1000; k < 1000; k += 10) e->del(int64_key(k));
+    delete e;
+
+    for (int reopen = 0; reopen < 2; reopen++) {
+        e = CreateKVEngine(opts);
+        string v;
+        for (int64_t k = -1000; k < 1000; k++) {
+            bool want = k % 10 != 0;
+            Status s = e->get(int64_key(k), &v);
+            if (s.ok() != want || (want && v != "v" + to_string(k))) {
+                cout << "[FAIL] Key " << k << " wrong under a custom order\n";
+                exit(1);
+            }
+        }
+        // -5..4 less the deleted 0, in numeric order
+        vector<pair<string, string>> rows;
+        e->scan(int64_key(-5), 9, &rows);
+        vector<int64_t> want = {-5, -4, -3, -2, -1, 1, 2, 3, 4};
+        bool ordered = rows.size() == want.size();
+        for (size_t i = 0; ordered && i < rows.size(); i++) ordered = rows[i].second == "v" + to_string(want[i]);
+        if (!ordered) {
+            cout << "[FAIL] Scan out of comparator order\n";
+            exit(1);
+        }
+        delete e;
+    }
+
+    // the database stays bound to its comparator
+    Options other = opts;
+    other.comparator = BytewiseComparator();
+    if ((e = CreateKVEngine(other)) != nullptr) {
+        cout << "[FAIL] Opened with a different comparator\n";
+        exit(1);
+    }
+    other.engine = EngineType::CACHE;
+    other.comparator = &int64;
+    e = CreateKVEngine(other);
+    for (int64_t k = 3; k >= -3; k--) e->put(int64_key(k), "v" + to_string(k));
+    vector<pair<string, string>> rows;
+    e->scan(int64_key(-2), 2, &rows);
+    if (rows.size() != 2 || rows[0].second != "v-2" || rows[1].second != "v-1") {
+        cout << "[FAIL] Cache engine scan out of comparator order\n";
+        exit(1);
+    }
+    delete e;
+    delete env;
+
+    cout << "[PASS] Comparator verified\n";
+}
+
+static string fixed_value(int64_t k, int round) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "r%d-%013lld", round, static_cast<long long>(k));
+    return string(buf, 16);
+}
+
+void fixed_test() {
+    cout << "[TEST] Fixed-width engine test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "fixeddb";
+    opts.engine = EngineType::FIXED;
+    opts.fixed_key_size = 8;
+    opts.fixed_value_size = 16;
+    opts.mem_limit = 300;
+    opts.compaction_threshold = 3;
+
+    KVEngine* e = CreateKVEngine(opts);
+    if (e == nullptr) {
+        cout << "[FAIL] Could not open fixed engine\n";
+        exit(1);
+    }
+    if (e->put("short", fixed_value(0, 0)).code() != StatusCode::INVALID_ARGUMENT ||
+        e->put(int64_key(1), "short").code() != StatusCode::INVALID_ARGUMENT) {
+        cout << "[FAIL] Wrong-size records accepted\n";
+        exit(1);
+    }
+    for (int i = 0; i < 2000; i++) {
+        int64_t k = (i * 7919) % 2000;   // every key in 0..1999, shuffled
+        e->put(int64_key(k), fixed_value(k, 0));
+    }
+    WriteBatch batch;
+    for (int64_t k = 0; k < 2000; k += 3) batch.put(int64_key(k), fixed_value(k, 1));
+    e->write(batch);
+    for (int64_t k = 0; k < 2000; k += 10) e->del(int64_key(k));
+    if (!e->del(int64_key(5000)).isNotFound()) {
+        cout << "[FAIL] Deleted a missing key\n";
+        exit(1);
+    }
+    delete e;
+
+    for (int reopen = 0; reopen < 2; reopen++) {
+        e = CreateKVEngine(opts);
+        string v;
+        for (int64_t k = 0; k < 2000; k++) {
+            bool want = k % 10 != 0;
+            Status s = e->get(int64_key(k), &v);
+            if (s.ok() != want || (want && v != fixed_value(k, k % 3 == 0))) {
+                cout << "[FAIL] Key " << k << " wrong after reopen\n";
+                exit(1);
+            }
+        }
+        vector<pair<string, string>> rows;
+        e->scan(int64_key(5), 9, &rows);
+        vector<int64_t> want = {5, 6, 7, 8, 9, 11, 12, 13, 14};
+        bool ordered = rows.size() == want.size();
+        for (size_t i = 0; ordered && i < rows.size(); i++) {
+            ordered = rows[i].first == int64_key(want[i]) && rows[i].second == fixed_value(want[i], want[i] % 3 == 0);
+        }
+        e->scan("", 5000, &rows);
+        if (!ordered || rows.size() != 1800) {
+            cout << "[FAIL] Fixed scan wrong\n";
+            exit(1);
+        }
+        delete e;
+    }
+
+    // the database only opens with the layout it was created with
+    Options other = opts;
+    other.fixed_value_size = 32;
+    if ((e = CreateKVEngine(other)) != nullptr) {
+        cout << "[FAIL] Opened with a different layout\n";
+        exit(1);
+    }
+    other.engine = EngineType::LSM;
+    if ((e = CreateKVEngine(other)) != nullptr) {
+        cout << "[FAIL] LSM engine opened a fixed database\n";
+        exit(1);
+    }
+    other = opts;
+    other.path = "fixed4";
+    other.fixed_key_size = 4;
+    other.fixed_value_size = 8;
+    e = CreateKVEngine(other);
+    e->put(string("\0\0\1\0", 4), "256bytes");
+    e->put(string("\0\0\0\2", 4), "2bytes!!");
+    vector<pair<string, string>> rows;
+    e->scan("", 10, &rows);
+    if (rows.size() != 2 || rows[0].second != "2bytes!!" || rows[1].second != "256bytes") {
+        cout << "[FAIL] 4-byte keys out of order\n";
+        exit(1);
+    }
+    delete e;
+    delete env;
+
+    cout << "[PASS] Fixed-width engine verified\n";
+}
+
+void prefix_search_test() {
+    cout << "[TEST] Prefix search test\n";
+
+    if (KeyPrefix("ab") != 0x6162000000000000ull || KeyPrefix("abcdefghij") != 0x6162636465666768ull) {
+        cout << "[FAIL] Key prefix wrong\n";
+        exit(1);
+    }
+    // against std::lower_bound, with runs of equal prefixes and both ends
+    unsigned x = 7;
+    for (size_t n = 0; n < 200; n++) {
+        vector<uint64_t> column(n);
+        for (auto& p : column) {
+            x = x * 1103515245 + 12345;
+            p = (x >> 8) % 64 == 0 ? UINT64_MAX : static_cast<uint64_t>((x >> 8) % 50) << 57;
+        }
+        sort(column.begin(), column.end());
+        const char* data = reinterpret_cast<const char*>(column.data());
+        for (uint64_t q : {uint64_t(0), uint64_t(1) << 57, uint64_t(25) << 57, (uint64_t(25) << 57) + 1, UINT64_MAX}) {
+            size_t want = lower_bound(column.begin(), column.end(), q) - column.begin();
+            if (PrefixLowerBound(data, n, q) != want || PrefixLowerBoundScalar(data, n, q) != want) {
+                cout << "[FAIL] Prefix lower bound wrong at n=" << n << "\n";
+                exit(1);
+            }
+        }
+    }
+
+    // keys sharing long prefixes, keys that are prefixes of others, high
+    // bytes: every lookup agrees with a segment without index prefixes
+    Env* env = NewMemEnv();
+    env->createDir("prefix");
+    unordered_map<string, string> data;
+    unordered_set<string> deleted;
+    for (int i = 0; i < 3000; i++) {
+        string k = "user" + string(12, '0') + to_string(i * 7);
+        data[k] = "v" + to_string(i);
+        data[k.substr(0, 5 + i % 12)] = "short";
+        if (i % 9 == 0) deleted.insert(k + "\xff");
+        if (i % 50 == 0) data[string(1, static_cast<char>(i % 256)) + "\xff\xff"] = "binary";
+    }
+    SegmentWriteOptions with, without;
+    with.block_size = without.block_size = 128;
+    without.index_prefixes = false;
+    write_segment(env, "prefix/with", data, &deleted, with);
+    write_segment(env, "prefix/without", data, &deleted, without);
+
+    vector<string> probes;
+    for (const auto& [k, v] : data) {
+        probes.push_back(k);
+        probes.push_back(k + "0");
+        probes.push_back(k.substr(0, k.size() - 1));
+    }
+    for (const auto& k : deleted) probes.push_back(k);
+    probes.push_back("");
+    probes.push_back("zzzz");
+    for (const auto& k : probes) {
+        string a, b;
+        Status sa = search_segment(env, "prefix/with", k, &a);
+        Status sb = search_segment(env, "prefix/without", k, &b);
+        auto it = data.find(k);
+        bool want = it != data.end();
+        if (sa.code() != sb.code() || sa.ok() != want || (want && (a != it->second || b != a)) ||
+            (deleted.count(k) && sa.code() != StatusCode::DELETED)) {
+            cout << "[FAIL] Prefixed index disagrees on a key\n";
+            exit(1);
+        }
+    }
+    unordered_map<string, string> all;
+    read_segment(env, "prefix/with", all);
+    if (all != data) {
+        cout << "[FAIL] Prefixed segment reads back wrong\n";
+        exit(1);
+    }
+    delete env;
+
+    cout << "[PASS] Prefix search verified\n";
+}
+
+void multi_get_test() {
+    cout << "[TEST] Batched multi_get test\n";
+
+    Env* env = NewMemEnv();
+    for (EngineType type : {EngineType::LSM, EngineType::BITCASK, EngineType::BTREE, EngineType::CACHE}) {
+        Options opts;
+        opts.env = env;
+        opts.engine = type;
+        opts.path = "multiget" + to_string(static_cast<int>(type));
+        opts.mem_limit = 700;
+
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 3000; i++) e->put("key" + to_string(i), "v" + to_string(i));
+        for (int i = 0; i < 3000; i += 7) e->del("key" + to_string(i));
+        for (int i = 0; i < 3000; i += 11) e->put("key" + to_string(i), "w" + to_string(i));
+
+        // more keys than a group, repeats, deleted and missing ones
+        vector<string> keys;
+        for (int i = 0; i < 1500; i++) keys.push_back("key" + to_string((i * 13) % 3500));
+        vector<string> values;
+        vector<Status> st = e->multi_get(keys, &values);
+        if (st.size() != keys.size() || values.size() != keys.size()) {
+            cout << "[FAIL] multi_get sized its results wrong\n";
+            exit(1);
+        }
+        for (size_t i = 0; i < keys.size(); i++) {
+            string v;
+            Status s = e->get(keys[i], &v);
+            if (st[i].ok() != s.ok() || (s.ok() && values[i] != v)) {
+                cout << "[FAIL] multi_get disagrees with get on " << keys[i] << "\n";
+                exit(1);
+            }
+        }
+        if (type == EngineType::CACHE) {
+            EngineStats stats = e->stats();
+            if (stats.cache_hits + stats.cache_misses != 2 * keys.size()) {
+                cout << "[FAIL] multi_get lookups not counted\n";
+                exit(1);
+            }
+        }
+        delete e;
+    }
+    delete env;
+
+    cout << "[PASS] Batched multi_get verified\n";
+}
+
+void cuckoo_test() {
+    cout << "[TEST] Cuckoo memtable test\n";
+
+    // through several growths and many cuckoo moves
+    CuckooTable t;
+    unordered_map<string, string> model;
+    unordered_set<string> tombstones;
+    for (int i = 0; i < 60000; i++) {
+        string k = "key" + to_string(i);
+        t.put(k, "v" + to_string(i));
+        model[k] = "v" + to_string(i);
+    }
+    for (int i = 0; i < 60000; i += 3) {
+        string k = "key" + to_string(i);
+        t.put(k, string(i % 50, 'w'));
+        model[k] = string(i % 50, 'w');
+    }
+    for (int i = 0; i < 60000; i += 5) {
+        string k = "key" + to_string(i);
+        t.del(k);
+        model.erase(k);
+        tombstones.insert(k);
+    }
+    t.del("never-put");
+    tombstones.insert("never-put");
+    if (t.size() != model.size() + tombstones.size() || t.load_factor() < 0.4 || t.load_factor() > 1) {
+        cout << "[FAIL] cuckoo table size " << t.size() << " load " << t.load_factor() << "\n";
+        exit(1);
+    }
+    for (int i = 0; i < 61000; i++) {
+        string k = "key" + to_string(i), v;
+        bool deleted = false;
+        bool found = t.find(k, &v, &deleted);
+        bool ok = model.count(k) ? found && !deleted && v == model[k]
+                                 : tombstones.count(k) ? found && deleted : !found;
+        if (!ok) {
+            cout << "[FAIL] cuckoo table lost " << k << "\n";
+            exit(1);
+        }
+    }
+    size_t seen = 0;
+    t.for_each([&](string_view k, string_view v, bool tombstone) {
+        seen++;
+        string key(k);
+        if (tombstone ? !tombstones.count(key) : model[key] != v) {
+            cout << "[FAIL] cuckoo for_each gave " << key << "\n";
+            exit(1);
+        }
+    });
+    if (seen != t.size()) {
+        cout << "[FAIL] cuckoo for_each visited " << seen << " of " << t.size() << "\n";
+        exit(1);
+    }
+    if (t.writes() != 60000 + 20000 + 12000 + 1) {
+        cout << "[FAIL] cuckoo table counted " << t.writes() << " writes\n";
+        exit(1);
+    }
+
+    // readers never miss a key written before they looked, nor see a torn
+    // value, while one writer grows the table and rewrites a hot key
+    {
+        CuckooTable c;
+        atomic<int> written{0};
+        atomic<bool> stop{false}, failed{false};
+        vector<thread> readers;
+        for (int r = 0; r < 4; r++) {
+            readers.emplace_back([&, r] {
+                uint64_t x = r + 1;
+                while (!stop.load()) {
+                    int n = written.load();
+                    string v;
+                    bool deleted;
+                    if (n > 0) {
+                        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+                        int i = (x >> 33) % n;
+                        if (!c.find("k" + to_string(i), &v, &deleted) || deleted || v != "v" + to_string(i)) {
+                            failed = true;
+                        }
+                    }
+                    if (c.find("hot", &v, &deleted) && v != string(v.size(), v.empty() ? 'x' : v[0])) {
+                        failed = true;
+                    }
+                }
+            });
+        }
+        for (int i = 0; i < 200000; i++) {
+            c.put("k" + to_string(i), "v" + to_string(i));
+            written.store(i + 1);
+            if (i % 16 == 0) c.put("hot", string(1 + i % 100, 'a' + i % 26));
+        }
+        stop = true;
+        for (auto& th : readers) th.join();
+        if (failed) {
+            cout << "[FAIL] cuckoo reader saw a missing or torn entry\n";
+            exit(1);
+        }
+    }
+
+    // the engine with either memtable, through flushes and reopens
+    Env* env = NewMemEnv();
+    KVEngine* engines[2];
+    // image: close by writing the memtable out rather than leaving the log
+    auto open = [&](bool image) {
+        for (int m = 0; m < 2; m++) {
+            Options opts;
+            opts.env = env;
+            opts.path = m ? "cuckoo" : "hash";
+            opts.memtable = m ? MemtableType::CUCKOO : MemtableType::HASH;
+            opts.mem_limit = 700;
+            opts.memtable_image_on_close = image;
+            engines[m] = CreateKVEngine(opts);
+        }
+    };
+    open(false);
+    auto agree = [&](const char* when) {
+        for (int i = 0; i < 2600; i++) {
+            string k = "key" + to_string(i), a, b;
+            Status sa = engines[0]->get(k, &a), sb = engines[1]->get(k, &b);
+            if (sa.ok() != sb.ok() || a != b) {
+                cout << "[FAIL] cuckoo memtable disagrees on " << k << " " << when << "\n";
+                exit(1);
+            }
+        }
+        vector<pair<string, string>> sa, sb;
+        engines[0]->scan("key1", 300, &sa);
+        engines[1]->scan("key1", 300, &sb);
+        vector<string> keys;
+        for (int i = 0; i < 2600; i += 3) keys.push_back("key" + to_string(i));
+        vector<string> va, vb;
+        vector<Status> ma = engines[0]->multi_get(keys, &va), mb = engines[1]->multi_get(keys, &vb);
+        bool same = sa == sb && va == vb;
+        for (size_t i = 0; i < keys.size(); i++) same = same && ma[i].ok() == mb[i].ok();
+        if (!same) {
+            cout << "[FAIL] cuckoo memtable scan or multi_get disagrees " << when << "\n";
+            exit(1);
+        }
+    };
+    for (int m = 0; m < 2; m++) {
+        KVEngine* e = engines[m];
+        for (int i = 0; i < 2500; i++) e->put("key" + to_string(i), "v" + to_string(i));
+        for (int i = 0; i < 2500; i += 7) e->del("key" + to_string(i));
+        for (int i = 0; i < 2500; i += 11) e->put("key" + to_string(i), "w" + to_string(i));
+        WriteBatch batch;
+        for (int i = 2500; i < 2550; i++) batch.put("key" + to_string(i), "b" + to_string(i));
+        batch.del("key2501");
+        e->write(batch);
+    }
+    agree("before reopening");
+    for (int m = 0; m < 2; m++) delete engines[m];
+    open(true);
+    agree("after replaying the log");
+    for (int m = 0; m < 2; m++) delete engines[m];
+    open(true);
+    agree("after loading the image");
+
+    // rewriting one key fills the memtable too, since each write keeps
+    // its entry until the flush
+    {
+        Options opts;
+        opts.env = env;
+        opts.path = "cuckoo_hot";
+        opts.memtable = MemtableType::CUCKOO;
+        opts.mem_limit = 100;
+        opts.compaction_threshold = 1000;
+        KVEngine* e = CreateKVEngine(opts);
+        for (int i = 0; i < 1000; i++) e->put("hot", to_string(i));
+        vector<string> names;
+        env->getChildren("cuckoo_hot/segments", &names);
+        string v;
+        if (names.size() < 9 || !e->get("hot", &v).ok() || v != "999") {
+            cout << "[FAIL] cuckoo memtable of one hot key never flushed\n";
+            exit(1);
+        }
+        delete e;
+    }
+
+    // gets while puts go in and the memtable is flushed under them
+    {
+        KVEngine* e = engines[1];
+        atomic<int> written{0};
+        atomic<bool> stop{false}, failed{false};
+        vector<thread> readers;
+        for (int r = 0; r < 2; r++) {
+            readers.emplace_back([&] {
+                while (!stop.load()) {
+                    int n = written.load();
+                    string v;
+                    if (n > 0 && (!e->get("live" + to_string(n - 1), &v).ok() || v != to_string(n - 1))) {
+                        failed = true;
+                    }
+                }
+            });
+        }
+        for (int i = 0; i < 3000; i++) {
+            e->put("live" + to_string(i), to_string(i));
+            written.store(i + 1);
+        }
+        stop = true;
+        for (auto& th : readers) th.join();
+        if (failed) {
+            cout << "[FAIL] cuckoo memtable get missed a written key\n";
+            exit(1);
+        }
+    }
+    for (int m = 0; m < 2; m++) delete engines[m];
+    delete env;
+
+    cout << "[PASS] Cuckoo memtable verified\n";
+}
+
+void plain_segment_test() {
+    cout << "[TEST] Plain segment test\n";
+
+    Env* env = NewMemEnv();
+    env->createDir("plain");
+    unordered_map<string, string> data;
+    unordered_set<string> deleted;
+    for (int i = 0; i < 5000; i++) data["key" + to_string(i)] = string(i % 40, 'a' + i % 26);
+    for (int i = 5000; i < 5300; i++) deleted.insert("key" + to_string(i));
+    SegmentWriteOptions wo;
+    wo.format = SegmentFormat::PLAIN;
+    write_segment(env, "plain/a.sst", data, &deleted, wo);
+
+    PlainSegment* seg = nullptr;
+    Status s = OpenPlainSegment(env, "plain/a.sst", &seg);
+    if (!s.ok() || seg->count() != data.size() + deleted.size()) {
+        cout << "[FAIL] Plain segment did not open\n";
+        exit(1);
+    }
+    for (int i = 0; i < 5500; i++) {
+        string k = "key" + to_string(i), v;
+        string_view view;
+        Status got = seg->get(k, &view);
+        Status searched = search_segment(env, "plain/a.sst", k, &v);
+        Status want = data.count(k) ? Status::OK() : deleted.count(k) ? Status::Deleted() : Status::NotFound();
+        if (got.code() != want.code() || searched.code() != want.code() ||
+            (want.ok() && (view != data[k] || v != data[k]))) {
+            cout << "[FAIL] Plain segment lookup of " << k << " wrong\n";
+            exit(1);
+        }
+    }
+    delete seg;
+    unordered_map<string, string> back;
+    unordered_set<string> back_deleted;
+    read_segment(env, "plain/a.sst", back, &back_deleted);
+    if (back != data || back_deleted != deleted) {
+        cout << "[FAIL] Plain segment read back wrong\n";
+        exit(1);
+    }
+
+    // other formats are told apart, and a flipped byte is caught
+    write_segment(env, "plain/b.sst", data);
+    SegmentFormat fa = SegmentFormat::BLOCK, fb = SegmentFormat::PLAIN;
+    if (OpenPlainSegment(env, "plain/b.sst", &seg).code() != StatusCode::NOT_SUPPORTED ||
+        !ReadSegmentFormat(env, "plain/a.sst", &fa).ok() || fa != SegmentFormat::PLAIN ||
+        !ReadSegmentFormat(env, "plain/b.sst", &fb).ok() || fb != SegmentFormat::BLOCK) {
+        cout << "[FAIL] Block segment opened as plain\n";
+        exit(1);
+    }
+    RandomAccessFile* in = nullptr;
+    uint64_t size = 0;
+    env->getFileSize("plain/a.sst", &size);
+    env->newRandomAccessFile("plain/a.sst", &in);
+    string bytes(size, '\0');
+    size_t n = 0;
+    in->pread(0, size, &bytes[0], &n);
+    delete in;
+    bytes[size / 2] ^= 1;
+    WritableFile* out = nullptr;
+    env->newWritableFile("plain/c.sst", &out);
+    out->append(bytes.data(), bytes.size());
+    out->close();
+    delete out;
+    string v;
+    SegmentReadOptions known;
+    known.format_known = true;
+    known.format = SegmentFormat::PLAIN;
+    back.clear();
+    if (OpenPlainSegment(env, "plain/c.sst", &seg).code() != StatusCode::CORRUPTION ||
+        search_segment(env, "plain/c.sst", "key1", &v).code() != StatusCode::CORRUPTION ||
+        search_segment(env, "plain/c.sst", "key1", &v, known).code() != StatusCode::CORRUPTION ||
+        read_segment(env, "plain/c.sst", back).code() != StatusCode::CORRUPTION || !back.empty()) {
+        cout << "[FAIL] Corrupted plain segment not detected\n";
+        exit(1);
+    }
+
+    // segments are mapped read-only: a missing file is not created, and a
+    // file shorter than asked for is not mapped past its end
+    ReadOnlyMmapFile* map = nullptr;
+    for (Env* menv : {env, DefaultEnv()}) {
+        menv->deleteFile("plain_missing.sst");
+        out = nullptr;
+        menv->newWritableFile("plain_short.sst", &out);
+        out->append("abc", 3);
+        out->close();
+        delete out;
+        if (menv->newReadOnlyMmapFile("plain_missing.sst", 8, &map).ok() ||
+            menv->fileExists("plain_missing.sst") ||
+            menv->newReadOnlyMmapFile("plain_short.sst", 8, &map).ok()) {
+            cout << "[FAIL] Read-only mapping created or overran a file\n";
+            exit(1);
+        }
+        if (!menv->newReadOnlyMmapFile("plain_short.sst", 3, &map).ok() || string(map->base(), 3) != "abc") {
+            cout << "[FAIL] Read-only mapping did not read the file\n";
+            exit(1);
+        }
+        delete map;
+        menv->deleteFile("plain_short.sst");
+    }
+    delete env;
+
+    // engines on disk, mapping real files: plain and block segments agree
+    // through flushes, compaction and reopening, and a plain database
+    // reopened for block segments still reads the plain ones
+    auto open = [](const string& path, SegmentFormat format) {
+        Options opts;
+        opts.path = path;
+        opts.segment_format = format;
+        opts.mem_limit = 400;
+        opts.compaction_threshold = 4;
+        return CreateKVEngine(opts);
+    };
+    KVEngine* engines[2] = {open("plaindb_block", SegmentFormat::BLOCK), open("plaindb_plain", SegmentFormat::PLAIN)};
+    for (KVEngine* e : engines) {
+        for (int i = 0; i < 3000; i++) e->put("key" + to_string(i), "v" + to_string(i));
+        for (int i = 0; i < 3000; i += 7) e->del("key" + to_string(i));
+        for (int i = 0; i < 3000; i += 11) e->put("key" + to_string(i), "w" + to_string(i));
+    }
+    // keys below rewritten were put again after the deletes
+    auto agree = [&](const char* when, int rewritten) {
+        vector<string> keys;
+        for (int i = 0; i < 3200; i++) {
+            string k = "key" + to_string(i), a, b;
+            Status sa = engines[0]->get(k, &a), sb = engines[1]->get(k, &b);
+            bool live = i < rewritten || (i < 3000 && (i % 7 != 0 || i % 11 == 0));
+            if (sa.ok() != sb.ok() || a != b || sa.ok() != live) {
+                cout << "[FAIL] Plain segments disagree on " << k << " " << when << "\n";
+                exit(1);
+            }
+            if (i % 3 == 0) keys.push_back(k);
+        }
+        vector<string> va, vb;
+        vector<Status> ma = engines[0]->multi_get(keys, &va), mb = engines[1]->multi_get(keys, &vb);
+        bool same = va == vb;
+        for (size_t i = 0; i < keys.size(); i++) same = same && ma[i].ok() == mb[i].ok();
+        vector<pair<string, string>> sa, sb;
+        engines[0]->scan("key2", 100, &sa);
+        engines[1]->scan("key2", 100, &sb);
+        if (!same || sa != sb || sa.size() != 100) {
+            cout << "[FAIL] Plain segments disagree on multi_get or scan " << when << "\n";
+            exit(1);
+        }
+    };
+    agree("after writing", 0);
+    for (KVEngine*& e : engines) delete e;
+    engines[0] = open("plaindb_block", SegmentFormat::BLOCK);
+    engines[1] = open("plaindb_plain", SegmentFormat::BLOCK);
+    agree("after reopening", 0);
+    for (int i = 0; i < 1000; i++) engines[1]->put("key" + to_string(i), "v" + to_string(i));
+    for (int i = 0; i < 1000; i++) engines[0]->put("key" + to_string(i), "v" + to_string(i));
+    agree("after mixing formats", 1000);
+    for (KVEngine* e : engines) delete e;
+
+    // a corrupted newer segment is reported, not read past to an older value
+    Options copts;
+    copts.path = "plaindb_corrupt";
+    copts.segment_format = SegmentFormat::PLAIN;
+    copts.mem_limit = 10;
+    copts.compaction_threshold = 100;
+    KVEngine* ce = CreateKVEngine(copts);
+    for (const char* value : {"old", "new"}) {
+        ce->put("x", value);
+        for (int i = 0; i < 9; i++) ce->put(string(value) + to_string(i), value);
+    }
+    delete ce;
+    vector<string> names;
+    DefaultEnv()->getChildren("plaindb_corrupt/segments", &names);
+    string newest;
+    for (const auto& name : names) {
+        if (newest.empty() || name.size() > newest.size() || (name.size() == newest.size() && name > newest)) newest = name;
+    }
+    int fd = ::open(("plaindb_corrupt/segments/" + newest).c_str(), O_RDWR);
+    char byte = 0;
+    bool flipped = pread(fd, &byte, 1, 20) == 1;
+    byte ^= 1;
+    flipped = flipped && pwrite(fd, &byte, 1, 20) == 1;
+    if (!flipped) {
+        cout << "[FAIL] Could not corrupt " << newest << "\n";
+        exit(1);
+    }
+    close(fd);
+    ce = CreateKVEngine(copts);
+    if (ce->get("x", &v).code() != StatusCode::CORRUPTION) {
+        cout << "[FAIL] Corrupted plain segment read past\n";
+        exit(1);
+    }
+    delete ce;
+
+    cout << "[PASS] Plain segments verified\n";
+}
+
+static size_t count_segments(Env* env, const string& dir) {
+    vector<string> names;
+    env->getChildren(dir, &names);
+    size_t n = 0;
+    for (const auto& name : names) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".sst") == 0) n++;
+    }
+    return n;
+}
+
+void tiered_test() {
+    cout << "[TEST] Tiered storage test\n";
+
+    Env* env = NewMemEnv();
+    Options opts;
+    opts.env = env;
+    opts.path = "tdb";
+    opts.mem_limit = 4;
+    opts.compaction_threshold = 4;
+    opts.wal_dir = "fast/wal";
+    // room for a few flushes, not for their merge
+    opts.db_paths = {{"fast/seg", 1600}, {"slow/seg", 0}};
+
+    string pad(100, 'x');
+    auto check = [&](KVEngine* e, int n, const char* when) {
+        string v;
+        for (int i = 0; i < n; i++) {
+            if (!e->get("k" + to_string(i), &v).ok() || v != pad + to_string(i)) {
+                cout << "[FAIL] k" << i << " wrong " << when << "\n";
+                exit(1);
+            }
+        }
+    };
+
+    KVEngine* e = CreateKVEngine(opts);
+    for (int i = 0; i < 12; i++) {
+        e->put("k" + to_string(i), pad + to_string(i));
+    }
+    if (count_segments(env, "fast/seg") != 3 || count_segments(env, "slow/seg") != 0) {
+        cout << "[FAIL] Flushes did not land on the fast path\n";
+        exit(1);
+    }
+    for (int i = 12; i < 16; i++) {
+        e->put("k" + to_string(i), pad + to_string(i));
+    }
+    if (count_segments(env, "fast/seg") != 0 || count_segments(env, "slow/seg") != 1) {
+        cout << "[FAIL] Compaction output did not move to the slow path\n";
+        exit(1);
+    }
+    for (int i = 16; i < 20; i++) {
+        e->put("k" + to_string(i), pad + to_string(i));
+    }
+    if (count_segments(env, "fast/seg") != 1 || count_segments(env, "tdb/segments") != 0) {
+        cout << "[FAIL] New flush did not land on the fast path\n";
+        exit(1);
+    }
+    vector<string> logs;
+    env->getChildren("tdb/wal", &logs);
+    if (!logs.empty() || !env->fileExists("fast/wal")) {
+        cout << "[FAIL] WAL not kept in wal_dir\n";
+        exit(1);
+    }
+    e->put("k20", pad + "20");
+    check(e, 21, "before reopen");
+    if (!e->create_checkpoint("tdb_copy").ok()) {
+        cout << "[FAIL] Checkpoint of a tiered database\n";
+        exit(1);
+    }
+    delete e;
+
+    e = CreateKVEngine(opts);
+    if (!e) {
+        cout << "[FAIL] Reopen failed\n";
+        exit(1);
+    }
+    check(e, 21, "after reopen");
+    delete e;
+
+    // the checkpoint has the default layout and opens either way
+    Options copy;
+    copy.env = env;
+    copy.path = "tdb_copy";
+    e = CreateKVEngine(copy);
+    if (!e) {
+        cout << "[FAIL] Checkpoint did not open\n";
+        exit(1);
+    }
+    check(e, 21, "in the checkpoint");
+    delete e;
+    copy.db_paths = {{"copy_fast", 1 << 20}, {"copy_slow", 0}};
+    copy.wal_dir = "copy_wal";
+    e = CreateKVEngine(copy);
+    if (!e) {
+        cout << "[FAIL] Checkpoint did not open with tiers\n";
+        exit(1);
+    }
+    check(e, 21, "in the tiered checkpoint");
+    delete e;
+
+    cout << "[PASS] Tiered storage verified\n";
+    delete env;
+}
 
 int main(int argc, char** argv) {
 
@@ -218,6 +2362,30 @@ int main(int argc, char** argv) {
     else if (mode == "flush")flush_test();
     else if (mode == "compact")compaction_test();
     else if (mode == "corrupt") corruption_test();
+    else if (mode == "memenv") memenv_test();
+    else if (mode == "faults") fault_test();
+    else if (mode == "batch") batch_test();
+    else if (mode == "replication") replication_test();
+    else if (mode == "updates") updates_test();
+    else if (mode == "checkpoint") checkpoint_test();
+    else if (mode == "secondary") secondary_test();
+    else if (mode == "image") image_test();
+    else if (mode == "recovery") parallel_recovery_test();
+    else if (mode == "bitcask") bitcask_test();
+    else if (mode == "btree") btree_test();
+    else if (mode == "cache") cache_test();
+    else if (mode == "tiered") tiered_test();
+    else if (mode == "flashcache") flash_cache_test();
+    else if (mode == "compressedcache") compressed_cache_test();
+    else if (mode == "dictionary") dictionary_test();
+    else if (mode == "hugepages") huge_pages_test();
+    else if (mode == "status") status_test();
+    else if (mode == "comparator") comparator_test();
+    else if (mode == "fixed") fixed_test();
+    else if (mode == "prefixsearch") prefix_search_test();
+    else if (mode == "multiget") multi_get_test();
+    else if (mode == "cuckoo") cuckoo_test();
+    else if (mode == "plainsegment") plain_segment_test();
 
     else cout << "Unknown mode\n";
     
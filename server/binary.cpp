@@ -0,0 +1,177 @@
+#include "binary.h"
+#include "kv_protocol.h"
+#include <vector>
+
+using namespace std;
+using namespace kvproto;
+
+class BinarySession : public Session {
+
+    private:
+        struct Request {
+            uint8_t op;
+            uint32_t id;
+            string key;
+            string value;     // PUT value
+            uint32_t limit;   // SCAN limit
+        };
+
+        KVEngine* engine_;
+
+        static void reply(OutBuffer &out, uint8_t code, uint32_t id){
+            string h;
+            put_header(h, code, id, 0);
+            out.append(h);
+        }
+
+        static void reply_error(OutBuffer &out, uint32_t id, const string &msg){
+            string h;
+            put_header(h, CODE_ERROR, id, msg.size());
+            h.append(msg);
+            out.append(h);
+        }
+
+        // Header goes into the open piece; the value itself is moved.
+        static void reply_value(OutBuffer &out, uint32_t id, string &&v){
+            string h;
+            put_header(h, CODE_OK, id, v.size());
+            out.append(h);
+            out.append(move(v));
+        }
+
+        static bool is_write(uint8_t op){
+            return op == OP_PUT || op == OP_DEL;
+        }
+
+        // Parses one frame. Returns bytes used, 0 if incomplete, -1 if malformed.
+        static long parse(const char* p, const char* end, Request* r){
+            if(end - p < 4) return 0;
+            uint32_t len = get_u32(p);
+            if(len < 5 || len > kMaxFrame) return -1;
+            if(static_cast<size_t>(end - p - 4) < len) return 0;
+
+            const char* body = p + 4;
+            const char* bend = body + len;
+            r->op = static_cast<uint8_t>(body[0]);
+            r->id = get_u32(body + 1);
+            const char* q = body + 5;
+
+            switch(r->op){
+                case OP_GET:
+                case OP_DEL:
+                    if(!get_str(&q, bend, &r->key)) return -1;
+                    break;
+                case OP_PUT:
+                    if(!get_str(&q, bend, &r->key) || !get_str(&q, bend, &r->value)) return -1;
+                    break;
+                case OP_SCAN:
+                    if(!get_str(&q, bend, &r->key) || bend - q < 4) return -1;
+                    r->limit = get_u32(q);
+                    q += 4;
+                    break;
+                case OP_PING:
+                    break;
+                default:
+                    return -1;
+            }
+            if(q != bend) return -1;
+            return 4 + len;
+        }
+
+        void exec_gets(vector<Request> &reqs, size_t b, size_t e, OutBuffer &out){
+            vector<string> keys;
+            keys.reserve(e - b);
+            for(size_t i = b; i < e; i++) keys.push_back(move(reqs[i].key));
+
+            vector<string> values;
+            vector<Status> st = engine_->multi_get(keys, &values);
+            for(size_t i = b; i < e; i++){
+                if(st[i - b].ok()) reply_value(out, reqs[i].id, move(values[i - b]));
+                else if(st[i - b].isNotFound()) reply(out, CODE_NOT_FOUND, reqs[i].id);
+                else reply_error(out, reqs[i].id, string(st[i - b].msg()));
+            }
+        }
+
+        void exec_writes(vector<Request> &reqs, size_t b, size_t e, OutBuffer &out){
+            WriteBatch batch;
+            for(size_t i = b; i < e; i++){
+                if(reqs[i].op == OP_PUT) batch.put(reqs[i].key, reqs[i].value);
+                else batch.del(reqs[i].key);
+            }
+            Status s = engine_->write(batch);
+            for(size_t i = b; i < e; i++){
+                if(s.ok()) reply(out, CODE_OK, reqs[i].id);
+                else reply_error(out, reqs[i].id, string(s.msg()));
+            }
+        }
+
+        void exec_scan(Request &r, OutBuffer &out){
+            vector<pair<string,string>> rows;
+            Status s = engine_->scan(r.key, r.limit, &rows);
+            if(!s.ok()){
+                reply_error(out, r.id, string(s.msg()));
+                return;
+            }
+            size_t len = 4;
+            for(const auto &kv : rows) len += 8 + kv.first.size() + kv.second.size();
+
+            string h;
+            put_header(h, CODE_OK, r.id, len);
+            put_u32(h, rows.size());
+            out.append(h);
+            for(auto &kv : rows){
+                string lens;
+                put_str(lens, kv.first);
+                put_u32(lens, kv.second.size());
+                out.append(lens);
+                out.append(move(kv.second));
+            }
+        }
+
+    public:
+        explicit BinarySession(KVEngine* engine) : engine_(engine) {}
+
+        long onData(const char* in, size_t len, OutBuffer &out) override{
+            const char* p = in;
+            const char* end = in + len;
+
+            vector<Request> reqs;
+            bool bad = false;
+            while(p < end){
+                Request r;
+                long used = parse(p, end, &r);
+                if(used == 0) break;
+                if(used < 0){
+                    bad = true;
+                    break;
+                }
+                p += used;
+                reqs.push_back(move(r));
+            }
+
+            size_t i = 0;
+            while(i < reqs.size()){
+                uint8_t op = reqs[i].op;
+                size_t j = i + 1;
+                if(op == OP_GET){
+                    while(j < reqs.size() && reqs[j].op == OP_GET) j++;
+                    exec_gets(reqs, i, j, out);
+                } else if(is_write(op)){
+                    while(j < reqs.size() && is_write(reqs[j].op)) j++;
+                    exec_writes(reqs, i, j, out);
+                } else if(op == OP_SCAN){
+                    exec_scan(reqs[i], out);
+                } else {
+                    reply(out, CODE_OK, reqs[i].id);
+                }
+                i = j;
+            }
+
+            if(bad) return -1;
+            return p - in;
+        }
+};
+
+Session* BinaryHandler::newSession(){
+    return new BinarySession(engine_);
+}
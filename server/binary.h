@@ -0,0 +1,22 @@
+#pragma once
+
+#include "event_loop.h"
+#include "kv_engine.h"
+
+using namespace std;
+
+/*
+    Frontend for the length-prefixed binary protocol in kv_protocol.h.
+    Pipelined GETs are coalesced into one multi_get and pipelined PUT/DELs
+    into one WriteBatch, exactly like the RESP frontend.
+*/
+class BinaryHandler : public ProtocolHandler {
+
+    private:
+        KVEngine* engine_;
+
+    public:
+        explicit BinaryHandler(KVEngine* engine) : engine_(engine) {}
+
+        Session* newSession() override;
+};
@@ -0,0 +1,244 @@
+#include "event_loop.h"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+void OutBuffer::append(const char* p, size_t n){
+    if(n == 0) return;
+    if(pieces_.empty() || pieces_.back().sealed){
+        pieces_.push_back({string(), false});
+    }
+    pieces_.back().data.append(p, n);
+    bytes_ += n;
+}
+
+void OutBuffer::append(string &&s){
+    if(s.size() < kCopyThreshold){
+        append(s.data(), s.size());
+        return;
+    }
+    bytes_ += s.size();
+    pieces_.push_back({move(s), true});
+}
+
+bool OutBuffer::flushTo(int fd){
+    while(bytes_ > 0){
+        iovec iov[64];
+        int cnt = 0;
+        size_t off = head_off_;
+        for(auto it = pieces_.begin(); it != pieces_.end() && cnt < 64; ++it){
+            iov[cnt].iov_base = const_cast<char*>(it->data.data()) + off;
+            iov[cnt].iov_len = it->data.size() - off;
+            off = 0;
+            cnt++;
+        }
+
+        ssize_t n = writev(fd, iov, cnt);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        bytes_ -= n;
+        size_t left = n;
+        while(left > 0){
+            size_t avail = pieces_.front().data.size() - head_off_;
+            if(left < avail){
+                head_off_ += left;
+                break;
+            }
+            left -= avail;
+            pieces_.pop_front();
+            head_off_ = 0;
+        }
+    }
+    return true;
+}
+
+EventLoop::EventLoop(){
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd_;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+}
+
+EventLoop::~EventLoop(){
+    for(auto &[fd, c] : conns_){
+        close(fd);
+        delete c->session;
+        delete c;
+    }
+    for(auto &[fd, h] : listeners_){
+        close(fd);
+    }
+    close(wakefd_);
+    close(epfd_);
+}
+
+bool EventLoop::listen(const string &host, int port, ProtocolHandler* handler){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return false;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+       bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+       ::listen(fd, SOMAXCONN) != 0){
+        close(fd);
+        return false;
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    listeners_[fd] = handler;
+    return true;
+}
+
+void EventLoop::accept_all(int lfd, ProtocolHandler* handler){
+    while(true){
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;  // EAGAIN, or another loop won the race
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Connection* c = new Connection();
+        c->fd = fd;
+        c->session = handler->newSession();
+        c->events = EPOLLIN | EPOLLRDHUP;
+        conns_[fd] = c;
+
+        epoll_event ev = {};
+        ev.events = c->events;
+        ev.data.fd = fd;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void EventLoop::close_conn(Connection* c){
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    conns_.erase(c->fd);
+    delete c->session;
+    delete c;
+}
+
+void EventLoop::update_interest(Connection* c){
+    uint32_t events = 0;
+    if(!c->read_closed && c->out.size() <= kHighWater) events |= EPOLLIN | EPOLLRDHUP;
+    if(!c->out.empty()) events |= EPOLLOUT;
+    if(events == c->events) return;
+    c->events = events;
+
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void EventLoop::on_readable(Connection* c){
+    bool failed = false;
+    char buf[64 * 1024];
+    size_t taken = 0;
+    // anything past kHighWater waits for the next wakeup
+    while(!c->read_closed && taken < kHighWater){
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if(n > 0){
+            c->in.append(buf, n);
+            taken += n;
+            continue;
+        }
+        if(n == 0){
+            c->read_closed = true;
+        } else if(errno == EINTR){
+            continue;
+        } else if(errno != EAGAIN && errno != EWOULDBLOCK){
+            failed = true;
+        }
+        break;
+    }
+
+    // Everything read so far is handed over at once, so a pipelined burst
+    // reaches the session as one batch.
+    if(!c->in.empty()){
+        long used = c->session->onData(c->in.data(), c->in.size(), c->out);
+        if(used < 0){
+            c->out.flushTo(c->fd);
+            close_conn(c);
+            return;
+        }
+        c->in.erase(0, used);
+    }
+
+    // A client that half-closes after its last request still gets the
+    // replies to it.
+    if(failed || !c->out.flushTo(c->fd) || (c->read_closed && c->out.empty())){
+        close_conn(c);
+        return;
+    }
+    update_interest(c);
+}
+
+void EventLoop::on_writable(Connection* c){
+    if(!c->out.flushTo(c->fd) || (c->read_closed && c->out.empty())){
+        close_conn(c);
+        return;
+    }
+    update_interest(c);
+}
+
+void EventLoop::run(){
+    epoll_event events[256];
+    while(!stop_.load()){
+        int n = epoll_wait(epfd_, events, 256, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            int fd = events[i].data.fd;
+            if(fd == wakefd_) continue;
+
+            auto lit = listeners_.find(fd);
+            if(lit != listeners_.end()){
+                accept_all(fd, lit->second);
+                continue;
+            }
+
+            auto cit = conns_.find(fd);
+            if(cit == conns_.end()) continue;
+            Connection* c = cit->second;
+
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+                on_readable(c);
+            } else if(events[i].events & EPOLLOUT){
+                on_writable(c);
+            }
+        }
+    }
+}
+
+void EventLoop::stop(){
+    stop_.store(true);
+    uint64_t one = 1;
+    ssize_t r = write(wakefd_, &one, sizeof(one));
+    (void)r;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <sys/uio.h>
+
+using namespace std;
+
+/*
+    Outgoing bytes for one connection, kept as a queue of pieces handed to
+    writev() directly. Reply framing is copied into small open pieces; large
+    payloads (values) are moved in whole and never copied again.
+*/
+class OutBuffer {
+
+    private:
+        struct Piece {
+            string data;
+            bool sealed;    // owned payload, never appended to
+        };
+
+        deque<Piece> pieces_;
+        size_t head_off_ = 0;   // bytes of pieces_.front() already written
+        size_t bytes_ = 0;
+
+        static const size_t kCopyThreshold = 256;
+
+    public:
+        void append(const char* p, size_t n);
+
+        void append(const string &s){
+            append(s.data(), s.size());
+        }
+
+        // Takes ownership of s; only small strings are copied.
+        void append(string &&s);
+
+        bool empty() const {
+            return bytes_ == 0;
+        }
+
+        size_t size() const {
+            return bytes_;
+        }
+
+        // Writes as much as the socket accepts. False on a fatal socket error.
+        bool flushTo(int fd);
+};
+
+/*
+    A protocol session turns request bytes into reply bytes. It is created
+    per connection and only ever called from that connection's loop thread.
+*/
+class Session {
+    public:
+        virtual ~Session() = default;
+
+        // Consumes complete requests from in[0, len) and queues replies on out.
+        // Returns the number of bytes consumed, or -1 to close the connection.
+        virtual long onData(const char* in, size_t len, OutBuffer &out) = 0;
+};
+
+class ProtocolHandler {
+    public:
+        virtual ~ProtocolHandler() = default;
+        virtual Session* newSession() = 0;
+};
+
+/*
+    One epoll loop, meant to run on its own thread. Each loop opens its own
+    SO_REUSEPORT listener per port so the kernel spreads accepts across
+    loops and a connection stays on one thread for its whole life.
+*/
+class EventLoop {
+
+    private:
+        struct Connection {
+            int fd;
+            Session* session;
+            string in;
+            OutBuffer out;
+            uint32_t events = 0;        // as last registered with epoll
+            bool read_closed = false;   // EOF seen; closes once out drains
+        };
+
+        // Past this many queued reply bytes a connection is not read from
+        // until they drain, so a client that pipelines requests without
+        // reading replies is held back by TCP rather than by our memory.
+        // Also the most read from a connection in one wakeup.
+        static const size_t kHighWater = 4 << 20;
+
+        int epfd_ = -1;
+        int wakefd_ = -1;
+        atomic<bool> stop_{false};
+        unordered_map<int, ProtocolHandler*> listeners_;
+        unordered_map<int, Connection*> conns_;
+
+        void accept_all(int lfd, ProtocolHandler* handler);
+        void on_readable(Connection* c);
+        void on_writable(Connection* c);
+        void update_interest(Connection* c);
+        void close_conn(Connection* c);
+
+    public:
+        EventLoop();
+        ~EventLoop();
+
+        // Binds host:port with SO_REUSEPORT and serves it with handler.
+        bool listen(const string &host, int port, ProtocolHandler* handler);
+
+        void run();
+
+        // Thread-safe; makes run() return.
+        void stop();
+};
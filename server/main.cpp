@@ -0,0 +1,158 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include "kv_engine.h"
+#include "event_loop.h"
+#include "resp.h"
+#include "binary.h"
+
+using namespace std;
+
+static vector<EventLoop*> loops;
+
+static void on_signal(int){
+    for(EventLoop* l : loops) l->stop();
+}
+
+static void usage(){
+    cout << "Usage: ./kv_server [options]\n";
+    cout << "  --port N                  RESP port (default 6379)\n";
+    cout << "  --binary-port N           binary protocol port, 0 disables (default 7379)\n";
+    cout << "  --bind ADDR               listen address (default 127.0.0.1)\n";
+    cout << "  --threads N               event loops (default: one per core)\n";
+    cout << "  --path DIR                data directory (default .)\n";
+    cout << "  --db-path DIR:BYTES       segment tier, fastest first; repeatable\n";
+    cout << "  --wal-dir DIR             WAL directory (default PATH/wal)\n";
+    cout << "  --compression NAME        segment blocks: none or zlib (default none)\n";
+    cout << "  --segment-format NAME     block or plain (default block)\n";
+    cout << "  --dictionary-bytes N      zlib dictionary sampled by compaction (default 0)\n";
+    cout << "  --block-cache-bytes N     memory for cached segment blocks\n";
+    cout << "  --compressed-cache-bytes N  memory for blocks cached compressed\n";
+    cout << "  --huge-pages on|off       keep cached blocks on huge pages (default off)\n";
+    cout << "  --flash-cache DIR:BYTES   flash tier for blocks evicted from memory\n";
+    cout << "  --engine NAME             lsm, bitcask, btree, cache or fixed (default lsm)\n";
+    cout << "  --cache-bytes N           memory budget of the cache engine\n";
+    cout << "  --mem-limit N             memtable entries before flush\n";
+    cout << "  --memtable NAME           hash or cuckoo (default hash)\n";
+    cout << "  --compaction-threshold N  segments before compaction\n";
+    cout << "  --replicate-listen ADDR   serve followers on unix:PATH or HOST:PORT\n";
+    cout << "  --follow ADDR             run as a read-only follower of ADDR\n";
+    cout << "  --secondary-refresh-ms N  serve --path read-only beside its primary,\n";
+    cout << "                            catching up every N ms\n";
+}
+
+int main(int argc, char** argv){
+    Options opts;
+    string bind_addr = "127.0.0.1";
+    int port = 6379;
+    int binary_port = 7379;
+    int threads = thread::hardware_concurrency();
+    if(threads <= 0) threads = 1;
+
+    for(int i = 1; i < argc; i++){
+        string a = argv[i];
+        if(a == "--help"){
+            usage();
+            return 0;
+        }
+        if(i + 1 >= argc){
+            usage();
+            return 1;
+        }
+        string v = argv[++i];
+        if(a == "--port") port = atoi(v.c_str());
+        else if(a == "--binary-port") binary_port = atoi(v.c_str());
+        else if(a == "--bind") bind_addr = v;
+        else if(a == "--threads") threads = max(1, atoi(v.c_str()));
+        else if(a == "--path") opts.path = v;
+        else if(a == "--db-path"){
+            size_t colon = v.rfind(':');
+            if(colon == string::npos){
+                cerr << "--db-path wants DIR:BYTES\n";
+                return 1;
+            }
+            opts.db_paths.push_back(DbPath{v.substr(0, colon), strtoull(v.c_str() + colon + 1, nullptr, 10)});
+        }
+        else if(a == "--wal-dir") opts.wal_dir = v;
+        else if(a == "--compression"){
+            opts.segment_compression = v == "zlib" ? CompressionType::ZLIB : CompressionType::NONE;
+        }
+        else if(a == "--segment-format"){
+            opts.segment_format = v == "plain" ? SegmentFormat::PLAIN : SegmentFormat::BLOCK;
+        }
+        else if(a == "--dictionary-bytes") opts.segment_dictionary_bytes = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--block-cache-bytes") opts.block_cache_bytes = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--compressed-cache-bytes") opts.compressed_block_cache_bytes = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--huge-pages") opts.block_cache_huge_pages = v == "on";
+        else if(a == "--flash-cache"){
+            size_t colon = v.rfind(':');
+            if(colon == string::npos){
+                cerr << "--flash-cache wants DIR:BYTES\n";
+                return 1;
+            }
+            opts.secondary_cache_path = v.substr(0, colon);
+            opts.secondary_cache_bytes = strtoull(v.c_str() + colon + 1, nullptr, 10);
+        }
+        else if(a == "--engine"){
+            opts.engine = v == "bitcask" ? EngineType::BITCASK : v == "btree" ? EngineType::BTREE :
+                          v == "cache" ? EngineType::CACHE : v == "fixed" ? EngineType::FIXED : EngineType::LSM;
+        }
+        else if(a == "--cache-bytes") opts.cache_capacity_bytes = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--mem-limit") opts.mem_limit = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--memtable") opts.memtable = v == "cuckoo" ? MemtableType::CUCKOO : MemtableType::HASH;
+        else if(a == "--compaction-threshold") opts.compaction_threshold = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--replicate-listen") opts.replication_listen = v;
+        else if(a == "--follow") opts.replicate_from = v;
+        else if(a == "--secondary-refresh-ms"){
+            opts.secondary = true;
+            opts.secondary_refresh_ms = strtoull(v.c_str(), nullptr, 10);
+        }
+        else{
+            usage();
+            return 1;
+        }
+    }
+
+    KVEngine* engine = CreateKVEngine(opts);
+    if(engine == nullptr){
+        cerr << "failed to open engine at " << opts.path << "\n";
+        return 1;
+    }
+
+    RespHandler resp(engine);
+    BinaryHandler binary(engine);
+    for(int i = 0; i < threads; i++){
+        EventLoop* l = new EventLoop();
+        if(!l->listen(bind_addr, port, &resp)){
+            cerr << "failed to listen on " << bind_addr << ":" << port << "\n";
+            return 1;
+        }
+        if(binary_port > 0 && !l->listen(bind_addr, binary_port, &binary)){
+            cerr << "failed to listen on " << bind_addr << ":" << binary_port << "\n";
+            return 1;
+        }
+        loops.push_back(l);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    cout << "[SERVER] RESP on " << bind_addr << ":" << port;
+    if(binary_port > 0) cout << ", binary on " << bind_addr << ":" << binary_port;
+    cout << " with " << threads << " event loop(s)\n";
+
+    vector<thread> ts;
+    for(EventLoop* l : loops){
+        ts.emplace_back([l](){ l->run(); });
+    }
+    for(auto &t : ts) t.join();
+
+    for(EventLoop* l : loops) delete l;
+    delete engine;
+    return 0;
+}
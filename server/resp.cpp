@@ -0,0 +1,402 @@
+#include "resp.h"
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+    Requests are parsed as a whole pipeline first and then executed as runs:
+    consecutive GET/MGET become one multi_get, consecutive SET/MSET/DEL one
+    WriteBatch (one WAL sync). Replies are emitted in request order.
+*/
+
+static const size_t kMaxBulk = 512u << 20;
+static const size_t kMaxArgs = 1u << 20;
+static const size_t kMaxCursors = 1024;
+
+enum class CmdKind {
+    READ,
+    WRITE,
+    OTHER
+};
+
+static bool iequals(const string &a, const char* b){
+    size_t n = strlen(b);
+    if(a.size() != n) return false;
+    for(size_t i = 0; i < n; i++){
+        if(toupper(static_cast<unsigned char>(a[i])) != b[i]) return false;
+    }
+    return true;
+}
+
+// Redis-style glob: * ? [set] and backslash escapes.
+static bool glob_match(const char* p, const char* pe, const char* s, const char* se){
+    while(p < pe){
+        if(*p == '*'){
+            while(p < pe && *p == '*') p++;
+            if(p == pe) return true;
+            for(; s <= se; s++){
+                if(glob_match(p, pe, s, se)) return true;
+            }
+            return false;
+        }
+        if(s == se) return false;
+        if(*p == '?'){
+            p++;
+            s++;
+            continue;
+        }
+        if(*p == '['){
+            const char* q = p + 1;
+            bool neg = q < pe && *q == '^';
+            if(neg) q++;
+            bool hit = false;
+            while(q < pe && *q != ']'){
+                if(q + 2 < pe && q[1] == '-' && q[2] != ']'){
+                    if(*s >= q[0] && *s <= q[2]) hit = true;
+                    q += 3;
+                } else {
+                    if(*q == '\\' && q + 1 < pe) q++;
+                    if(*s == *q) hit = true;
+                    q++;
+                }
+            }
+            if(hit == neg) return false;
+            p = q < pe ? q + 1 : q;
+            s++;
+            continue;
+        }
+        if(*p == '\\' && p + 1 < pe) p++;
+        if(*p != *s) return false;
+        p++;
+        s++;
+    }
+    return s == se;
+}
+
+class RespSession : public Session {
+
+    private:
+        KVEngine* engine_;
+        // SCAN cursors: redis clients expect integers, so the last key each
+        // returned lives here
+        map<uint64_t, string> cursors_;
+        uint64_t next_cursor_ = 1;
+
+        /* ---------------- reply encoding ---------------- */
+
+        static void reply_simple(OutBuffer &out, const char* s){
+            out.append("+", 1);
+            out.append(s, strlen(s));
+            out.append("\r\n", 2);
+        }
+
+        static void reply_error(OutBuffer &out, const string &msg){
+            out.append("-", 1);
+            out.append(msg);
+            out.append("\r\n", 2);
+        }
+
+        static void reply_int(OutBuffer &out, long long v){
+            char buf[32];
+            int n = snprintf(buf, sizeof(buf), ":%lld\r\n", v);
+            out.append(buf, n);
+        }
+
+        static void reply_array(OutBuffer &out, size_t n){
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "*%zu\r\n", n);
+            out.append(buf, len);
+        }
+
+        static void reply_nil(OutBuffer &out){
+            out.append("$-1\r\n", 5);
+        }
+
+        static void reply_bulk(OutBuffer &out, string &&v){
+            char buf[32];
+            int n = snprintf(buf, sizeof(buf), "$%zu\r\n", v.size());
+            out.append(buf, n);
+            out.append(move(v));
+            out.append("\r\n", 2);
+        }
+
+        /* ---------------- request parsing ---------------- */
+
+        // Parses one request at p. Returns bytes used, 0 if incomplete, -1 on error.
+        static long parse(const char* p, const char* end, vector<string> &args){
+            args.clear();
+            const char* start = p;
+
+            if(*p != '*'){
+                // inline command, as typed into telnet
+                const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                if(nl == nullptr) return 0;
+                const char* q = p;
+                while(q < nl){
+                    while(q < nl && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+                    const char* w = q;
+                    while(q < nl && *q != ' ' && *q != '\t' && *q != '\r') q++;
+                    if(q > w) args.emplace_back(w, q - w);
+                }
+                return nl + 1 - start;
+            }
+
+            auto read_line_num = [&](char tag, long long* v) -> int {
+                if(p >= end) return 0;
+                if(*p != tag) return -1;
+                const char* cr = static_cast<const char*>(memchr(p, '\r', end - p));
+                if(cr == nullptr || cr + 1 >= end) return 0;
+                if(cr[1] != '\n') return -1;
+                char* ep;
+                *v = strtoll(p + 1, &ep, 10);
+                if(ep != cr) return -1;
+                p = cr + 2;
+                return 1;
+            };
+
+            long long n;
+            int r = read_line_num('*', &n);
+            if(r <= 0) return r;
+            if(n < 0 || static_cast<size_t>(n) > kMaxArgs) return -1;
+
+            args.reserve(n);
+            for(long long i = 0; i < n; i++){
+                long long len;
+                r = read_line_num('$', &len);
+                if(r <= 0) return r;
+                if(len < 0 || static_cast<size_t>(len) > kMaxBulk) return -1;
+                if(end - p < len + 2) return 0;
+                if(p[len] != '\r' || p[len + 1] != '\n') return -1;
+                args.emplace_back(p, len);
+                p += len + 2;
+            }
+            return p - start;
+        }
+
+        static CmdKind classify(const vector<string> &a){
+            if(a.empty()) return CmdKind::OTHER;
+            const string &c = a[0];
+            if(iequals(c, "GET") && a.size() == 2) return CmdKind::READ;
+            if(iequals(c, "MGET") && a.size() >= 2) return CmdKind::READ;
+            if(iequals(c, "SET") && a.size() == 3) return CmdKind::WRITE;
+            if(iequals(c, "MSET") && a.size() >= 3 && a.size() % 2 == 1) return CmdKind::WRITE;
+            if(iequals(c, "DEL") && a.size() >= 2) return CmdKind::WRITE;
+            return CmdKind::OTHER;
+        }
+
+        /* ---------------- execution ---------------- */
+
+        void exec_reads(vector<vector<string>> &cmds, size_t b, size_t e, OutBuffer &out){
+            vector<string> keys;
+            for(size_t i = b; i < e; i++){
+                for(size_t k = 1; k < cmds[i].size(); k++){
+                    keys.push_back(move(cmds[i][k]));
+                }
+            }
+
+            vector<string> values;
+            vector<Status> st = engine_->multi_get(keys, &values);
+
+            size_t k = 0;
+            for(size_t i = b; i < e; i++){
+                bool multi = iequals(cmds[i][0], "MGET");
+                if(multi) reply_array(out, cmds[i].size() - 1);
+                for(size_t a = 1; a < cmds[i].size(); a++, k++){
+                    if(st[k].ok()) reply_bulk(out, move(values[k]));
+                    else if(!multi && !st[k].isNotFound()) reply_error(out, "ERR " + string(st[k].msg()));
+                    else reply_nil(out);
+                }
+            }
+        }
+
+        void exec_writes(vector<vector<string>> &cmds, size_t b, size_t e, OutBuffer &out){
+            // DEL replies with how many keys existed, so look up the keys
+            // the run has not touched yet before applying it.
+            unordered_map<string, bool> exists;
+            vector<string> probe;
+            for(size_t i = b; i < e; i++){
+                bool is_del = iequals(cmds[i][0], "DEL");
+                for(size_t k = 1; k < cmds[i].size(); k += is_del ? 1 : 2){
+                    if(is_del && exists.find(cmds[i][k]) == exists.end()){
+                        probe.push_back(cmds[i][k]);
+                    }
+                    exists.emplace(cmds[i][k], false);
+                }
+            }
+            exists.clear();
+            if(!probe.empty()){
+                vector<string> values;
+                vector<Status> st = engine_->multi_get(probe, &values);
+                for(size_t i = 0; i < probe.size(); i++){
+                    exists[probe[i]] = st[i].ok();
+                }
+            }
+
+            WriteBatch batch;
+            vector<long long> deleted(e - b, 0);
+            for(size_t i = b; i < e; i++){
+                if(iequals(cmds[i][0], "DEL")){
+                    for(size_t k = 1; k < cmds[i].size(); k++){
+                        bool &ex = exists[cmds[i][k]];
+                        if(ex) deleted[i - b]++;
+                        ex = false;
+                        batch.del(cmds[i][k]);
+                    }
+                } else {
+                    for(size_t k = 1; k + 1 < cmds[i].size(); k += 2){
+                        exists[cmds[i][k]] = true;
+                        batch.put(cmds[i][k], cmds[i][k + 1]);
+                    }
+                }
+            }
+
+            Status s = engine_->write(batch);
+            for(size_t i = b; i < e; i++){
+                if(!s.ok()){
+                    reply_error(out, "ERR " + string(s.msg()));
+                } else if(iequals(cmds[i][0], "DEL")){
+                    reply_int(out, deleted[i - b]);
+                } else {
+                    reply_simple(out, "OK");
+                }
+            }
+        }
+
+        void exec_scan(const vector<string> &a, OutBuffer &out){
+            uint64_t cursor = strtoull(a[1].c_str(), nullptr, 10);
+            size_t count = 10;
+            string pattern;
+            for(size_t i = 2; i + 1 < a.size(); i += 2){
+                if(iequals(a[i], "COUNT")) count = max(1LL, atoll(a[i + 1].c_str()));
+                else if(iequals(a[i], "MATCH")) pattern = a[i + 1];
+                else{
+                    reply_error(out, "ERR syntax error");
+                    return;
+                }
+            }
+
+            // A cursor resumes after the last key it returned. No key is
+            // known to follow it in every comparator's order, so that key
+            // is scanned again and dropped.
+            string start;
+            bool after = false;
+            if(cursor != 0){
+                auto it = cursors_.find(cursor);
+                if(it == cursors_.end()){
+                    reply_error(out, "ERR invalid cursor");
+                    return;
+                }
+                start = move(it->second);
+                after = true;
+                cursors_.erase(it);
+            }
+
+            vector<pair<string,string>> rows;
+            Status s = engine_->scan(start, count + after, &rows);
+            if(!s.ok()){
+                reply_error(out, "ERR " + string(s.msg()));
+                return;
+            }
+            if(after && !rows.empty() && rows.front().first == start) rows.erase(rows.begin());
+            if(rows.size() > count) rows.pop_back();
+
+            uint64_t next = 0;
+            if(rows.size() == count){
+                next = next_cursor_++;
+                cursors_[next] = rows.back().first;
+                if(cursors_.size() > kMaxCursors) cursors_.erase(cursors_.begin());
+            }
+
+            vector<string*> keys;
+            for(auto &row : rows){
+                const string &k = row.first;
+                if(pattern.empty() ||
+                   glob_match(pattern.data(), pattern.data() + pattern.size(), k.data(), k.data() + k.size())){
+                    keys.push_back(&row.first);
+                }
+            }
+
+            reply_array(out, 2);
+            reply_bulk(out, to_string(next));
+            reply_array(out, keys.size());
+            for(string* k : keys) reply_bulk(out, move(*k));
+        }
+
+        // Returns false when the connection should close after replying.
+        bool exec_other(vector<string> &a, OutBuffer &out){
+            if(a.empty()) return true;
+            const string &c = a[0];
+
+            if(iequals(c, "PING")){
+                if(a.size() > 1) reply_bulk(out, move(a[1]));
+                else reply_simple(out, "PONG");
+            } else if(iequals(c, "ECHO") && a.size() == 2){
+                reply_bulk(out, move(a[1]));
+            } else if(iequals(c, "SCAN") && a.size() >= 2){
+                exec_scan(a, out);
+            } else if(iequals(c, "COMMAND") || iequals(c, "CONFIG")){
+                // enough for redis-cli and redis-benchmark start-up probes
+                reply_array(out, 0);
+            } else if(iequals(c, "QUIT")){
+                reply_simple(out, "OK");
+                return false;
+            } else if(classify(a) == CmdKind::OTHER &&
+                      (iequals(c, "GET") || iequals(c, "SET") || iequals(c, "DEL") ||
+                       iequals(c, "MGET") || iequals(c, "MSET") || iequals(c, "SCAN"))){
+                reply_error(out, "ERR wrong number of arguments for '" + c + "' command");
+            } else {
+                reply_error(out, "ERR unknown command '" + c + "'");
+            }
+            return true;
+        }
+
+    public:
+        explicit RespSession(KVEngine* engine) : engine_(engine) {}
+
+        long onData(const char* in, size_t len, OutBuffer &out) override{
+            const char* p = in;
+            const char* end = in + len;
+
+            vector<vector<string>> cmds;
+            bool bad = false;
+            while(p < end){
+                vector<string> args;
+                long used = parse(p, end, args);
+                if(used == 0) break;
+                if(used < 0){
+                    bad = true;
+                    break;
+                }
+                p += used;
+                if(!args.empty()) cmds.push_back(move(args));
+            }
+
+            size_t i = 0;
+            while(i < cmds.size()){
+                CmdKind kind = classify(cmds[i]);
+                size_t j = i + 1;
+                if(kind != CmdKind::OTHER){
+                    while(j < cmds.size() && classify(cmds[j]) == kind) j++;
+                }
+
+                if(kind == CmdKind::READ) exec_reads(cmds, i, j, out);
+                else if(kind == CmdKind::WRITE) exec_writes(cmds, i, j, out);
+                else if(!exec_other(cmds[i], out)) return -1;
+                i = j;
+            }
+
+            if(bad){
+                reply_error(out, "ERR Protocol error");
+                return -1;
+            }
+            return p - in;
+        }
+};
+
+Session* RespHandler::newSession(){
+    return new RespSession(engine_);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "event_loop.h"
+#include "kv_engine.h"
+
+using namespace std;
+
+/*
+    Redis protocol (RESP2) frontend for the subset PureKV can serve:
+    GET, SET, DEL, MGET, MSET, SCAN, plus PING, ECHO, COMMAND, CONFIG and
+    QUIT so stock clients and redis-benchmark can connect.
+*/
+class RespHandler : public ProtocolHandler {
+
+    private:
+        KVEngine* engine_;
+
+    public:
+        explicit RespHandler(KVEngine* engine) : engine_(engine) {}
+
+        Session* newSession() override;
+};
@@ -0,0 +1,255 @@
+#include "backup.h"
+#include <map>
+#include <set>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+    meta/<id> is plain text:
+
+    timestamp 1718000000000000
+    file shared/seg_7_4096_2864434397.sst segments/seg_7.sst
+    file private/3/wal/000012.log wal/000012.log
+    file private/3/MANIFEST MANIFEST
+*/
+
+struct BackupFile {
+    string stored;      // relative to the backup directory
+    string target;      // relative to the database directory
+};
+
+struct BackupMeta {
+    uint64_t timestamp = 0;
+    vector<BackupFile> files;
+};
+
+class BackupEngineImpl : public BackupEngine {
+
+    private:
+        Env* env_;
+        string dir_;
+
+        // Deletes path and, if it is a directory, everything below it.
+        void delete_tree(const string &path){
+            vector<string> names;
+            if(!env_->getChildren(path, &names).ok()){
+                env_->deleteFile(path);
+                return;
+            }
+            for(const auto &name : names){
+                string child = path + "/" + name;
+                if(env_->deleteFile(child).ok()) continue;
+                delete_tree(child);
+            }
+            env_->deleteDir(path);
+        }
+
+        // crc32 of everything in path.
+        Status file_crc(const string &path, uint32_t* crc){
+            SequentialFile* f = nullptr;
+            Status s = env_->newSequentialFile(path, &f);
+            if(!s.ok()) return s;
+            *crc = crc32(0, nullptr, 0);
+            char buf[65536];
+            size_t got = 0;
+            while((s = f->read(sizeof(buf), buf, &got)).ok() && got > 0){
+                *crc = crc32(*crc, reinterpret_cast<const Bytef*>(buf), got);
+            }
+            delete f;
+            return s;
+        }
+
+        vector<uint32_t> list_ids(){
+            vector<string> names;
+            vector<uint32_t> ids;
+            env_->getChildren(dir_ + "/meta", &names);
+            for(const auto &name : names){
+                if(name.empty() || name.find_first_not_of("0123456789") != string::npos) continue;
+                ids.push_back(strtoul(name.c_str(), nullptr, 10));
+            }
+            sort(ids.begin(), ids.end());
+            return ids;
+        }
+
+        Status read_meta(uint32_t id, BackupMeta* meta){
+            SequentialFile* f = nullptr;
+            if(!env_->newSequentialFile(dir_ + "/meta/" + to_string(id), &f).ok()){
+                return Status::NotFound("BACKUP_NOT_FOUND");
+            }
+            string text;
+            char buf[4096];
+            size_t got = 0;
+            while(f->read(sizeof(buf), buf, &got).ok() && got > 0){
+                text.append(buf, got);
+            }
+            delete f;
+
+            istringstream in(text);
+            string field;
+            while(in >> field){
+                if(field == "timestamp"){
+                    in >> meta->timestamp;
+                } else if(field == "file"){
+                    BackupFile bf;
+                    in >> bf.stored >> bf.target;
+                    meta->files.push_back(bf);
+                } else {
+                    return Status::Corruption("BACKUP_META_CORRUPTED");
+                }
+            }
+            return Status::OK();
+        }
+
+        Status write_meta(uint32_t id, const BackupMeta &meta){
+            ostringstream out;
+            out << "timestamp " << meta.timestamp << "\n";
+            for(const auto &f : meta.files){
+                out << "file " << f.stored << " " << f.target << "\n";
+            }
+            string text = out.str();
+
+            string path = dir_ + "/meta/" + to_string(id);
+            WritableFile* f = nullptr;
+            if(!env_->newWritableFile(path + ".tmp", &f).ok()) return Status::IOError("BACKUP_WRITE_FAILED");
+            Status s = f->append(text.data(), text.size());
+            if(s.ok()) s = f->sync();
+            f->close();
+            delete f;
+            if(!s.ok()) return s;
+            // the backup exists once its meta file does
+            return env_->renameFile(path + ".tmp", path);
+        }
+
+    public:
+        BackupEngineImpl(Env* env, const string &dir):env_(env), dir_(dir){}
+
+        Status open(){
+            Status s = env_->createDir(dir_);
+            if(s.ok()) s = env_->createDir(dir_ + "/shared");
+            if(s.ok()) s = env_->createDir(dir_ + "/private");
+            if(s.ok()) s = env_->createDir(dir_ + "/meta");
+            return s;
+        }
+
+        Status createBackup(KVEngine* db, uint32_t* id_out) override{
+            vector<uint32_t> ids = list_ids();
+            uint32_t id = ids.empty() ? 1 : ids.back() + 1;
+
+            string tmp = dir_ + "/tmp";
+            delete_tree(tmp);
+            Status s = db->create_checkpoint(tmp);
+            if(!s.ok()) return s;
+
+            BackupMeta meta;
+            meta.timestamp = env_->nowMicros();
+
+            vector<string> names;
+            env_->getChildren(tmp + "/segments", &names);
+            for(size_t i = 0; s.ok() && i < names.size(); i++){
+                const string &name = names[i];
+                uint64_t size = 0;
+                uint32_t crc = 0;
+                env_->getFileSize(tmp + "/segments/" + name, &size);
+                s = file_crc(tmp + "/segments/" + name, &crc);
+                if(!s.ok()) break;
+                // seg_7.sst -> shared/seg_7_<size>_<crc>.sst; a stored copy
+                // is reused only if it still has that crc
+                string stored = "shared/" + name.substr(0, name.size() - 4) + "_" + to_string(size) +
+                                "_" + to_string(crc) + ".sst";
+                uint32_t stored_crc = 0;
+                if(!file_crc(dir_ + "/" + stored, &stored_crc).ok() || stored_crc != crc){
+                    s = CopyFile(env_, tmp + "/segments/" + name, dir_ + "/" + stored + ".tmp");
+                    if(s.ok()) s = env_->renameFile(dir_ + "/" + stored + ".tmp", dir_ + "/" + stored);
+                }
+                meta.files.push_back({stored, "segments/" + name});
+            }
+
+            string priv = "private/" + to_string(id);
+            if(s.ok()) s = env_->createDir(dir_ + "/" + priv);
+            if(s.ok()) s = env_->createDir(dir_ + "/" + priv + "/wal");
+            env_->getChildren(tmp + "/wal", &names);
+            for(size_t i = 0; s.ok() && i < names.size(); i++){
+                string rel = "wal/" + names[i];
+                s = CopyFile(env_, tmp + "/" + rel, dir_ + "/" + priv + "/" + rel);
+                meta.files.push_back({priv + "/" + rel, rel});
+            }
+            if(s.ok()) s = CopyFile(env_, tmp + "/MANIFEST", dir_ + "/" + priv + "/MANIFEST");
+            meta.files.push_back({priv + "/MANIFEST", "MANIFEST"});
+
+            if(s.ok()) s = write_meta(id, meta);
+            delete_tree(tmp);
+            if(!s.ok()){
+                delete_tree(dir_ + "/" + priv);
+                return s;
+            }
+            if(id_out) *id_out = id;
+            return Status::OK();
+        }
+
+        Status getBackupInfo(vector<BackupInfo>* out) override{
+            out->clear();
+            for(uint32_t id : list_ids()){
+                BackupMeta meta;
+                Status s = read_meta(id, &meta);
+                if(!s.ok()) return s;
+                BackupInfo info{id, meta.timestamp, 0, static_cast<uint32_t>(meta.files.size())};
+                for(const auto &f : meta.files){
+                    uint64_t size = 0;
+                    env_->getFileSize(dir_ + "/" + f.stored, &size);
+                    info.size += size;
+                }
+                out->push_back(info);
+            }
+            return Status::OK();
+        }
+
+        Status deleteBackup(uint32_t id) override{
+            Status s = env_->deleteFile(dir_ + "/meta/" + to_string(id));
+            if(!s.ok()) return Status::NotFound("BACKUP_NOT_FOUND");
+            delete_tree(dir_ + "/private/" + to_string(id));
+
+            set<string> used;
+            for(uint32_t other : list_ids()){
+                BackupMeta meta;
+                if(!read_meta(other, &meta).ok()) return Status::OK();     // keep everything
+                for(const auto &f : meta.files) used.insert(f.stored);
+            }
+            vector<string> names;
+            env_->getChildren(dir_ + "/shared", &names);
+            for(const auto &name : names){
+                if(used.count("shared/" + name) == 0) env_->deleteFile(dir_ + "/shared/" + name);
+            }
+            return Status::OK();
+        }
+
+        Status restoreBackup(uint32_t id, const string &db_path) override{
+            BackupMeta meta;
+            Status s = read_meta(id, &meta);
+            if(!s.ok()) return s;
+
+            delete_tree(db_path + "/wal");
+            delete_tree(db_path + "/segments");
+            env_->deleteFile(db_path + "/MANIFEST");
+
+            s = env_->createDir(db_path);
+            if(s.ok()) s = env_->createDir(db_path + "/wal");
+            if(s.ok()) s = env_->createDir(db_path + "/segments");
+            for(size_t i = 0; s.ok() && i < meta.files.size(); i++){
+                s = CopyFile(env_, dir_ + "/" + meta.files[i].stored, db_path + "/" + meta.files[i].target);
+            }
+            return s;
+        }
+};
+
+BackupEngine* OpenBackupEngine(Env* env, const string &backup_dir){
+    BackupEngineImpl* engine = new BackupEngineImpl(env, backup_dir);
+    if(!engine->open().ok()){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
@@ -0,0 +1,605 @@
+#include "bitcask.h"
+#include "batch_find.h"
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+    Data record:
+    | uint32 crc     |   of everything after it
+    | uint64 seq     |
+    | uint32 key_len |
+    | uint32 val_len |   0xFFFFFFFF for a tombstone, which has no value
+    | key bytes      |
+    | value bytes    |
+
+    Hint file, one entry per live record of its data file:
+    | uint64 seq | uint64 offset | uint32 size | uint32 key_len | key |
+    and finally
+    | uint32 crc     |   of everything above
+*/
+
+static const size_t REC_HEADER = 4 + 8 + 4 + 4;
+static const uint32_t TOMBSTONE = 0xFFFFFFFF;
+
+static void encode_record(string &buf, uint64_t seq, const string &key, const string* value){
+    size_t start = buf.size();
+    uint32_t klen = key.size();
+    uint32_t vlen = value ? value->size() : TOMBSTONE;
+    buf.resize(start + 4);
+    buf.append(reinterpret_cast<const char*>(&seq), 8);
+    buf.append(reinterpret_cast<const char*>(&klen), 4);
+    buf.append(reinterpret_cast<const char*>(&vlen), 4);
+    buf.append(key);
+    if(value) buf.append(*value);
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(buf.data() + start + 4), buf.size() - start - 4);
+    memcpy(&buf[start], &crc, 4);
+}
+
+// Parses the record at p. Returns its size, 0 if incomplete or invalid.
+static size_t parse_record(const char* p, size_t avail, uint64_t* seq, uint32_t* klen, uint32_t* vlen){
+    if(avail < REC_HEADER) return 0;
+    uint32_t stored_crc;
+    memcpy(&stored_crc, p, 4);
+    memcpy(seq, p + 4, 8);
+    memcpy(klen, p + 12, 4);
+    memcpy(vlen, p + 16, 4);
+    uint64_t total = REC_HEADER + static_cast<uint64_t>(*klen) + (*vlen == TOMBSTONE ? 0 : *vlen);
+    if(avail < total) return 0;
+    if(crc32(0, reinterpret_cast<const Bytef*>(p + 4), total - 4) != stored_crc) return 0;
+    return total;
+}
+
+class BitcaskEngine : public KVEngine {
+
+    private:
+        struct Location {
+            uint32_t file;
+            uint32_t size;      // whole record
+            uint64_t offset;
+            uint64_t seq;
+        };
+
+        struct DataFile {
+            RandomAccessFile* file = nullptr;
+            uint64_t size = 0;
+            uint64_t live = 0;  // bytes of records the keydir points at
+            uint64_t max_seq = 0;   // newest record in the file, live or not
+        };
+
+        Options options_;
+        Env* env_;
+        FileLock* lock_ = nullptr;
+
+        // write_mu_ serializes writers, rotation, merges and checkpoints.
+        // mu_ guards keydir_ and files_; readers hold it shared through
+        // their pread so a merge cannot delete the file underneath them.
+        mutex write_mu_;
+        shared_mutex mu_;
+        unordered_map<string, Location> keydir_;
+        map<uint32_t, DataFile> files_;
+
+        WritableFile* active_ = nullptr;
+        uint32_t active_id_ = 0;
+        uint32_t next_id_ = 1;
+        uint64_t last_seq_ = 0;
+
+        string data_name(uint32_t id) const {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/%06u.data", id);
+            return options_.path + buf;
+        }
+
+        string hint_name(uint32_t id) const {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/%06u.hint", id);
+            return options_.path + buf;
+        }
+
+        // Points key at loc (nullptr removes it), keeping the per-file live
+        // byte counts in step. Caller holds mu_ exclusively.
+        void install(const string &key, const Location* loc){
+            auto it = keydir_.find(key);
+            if(it != keydir_.end()){
+                files_[it->second.file].live -= it->second.size;
+                if(loc == nullptr){
+                    keydir_.erase(it);
+                    return;
+                }
+                it->second = *loc;
+            } else if(loc != nullptr){
+                keydir_.emplace(key, *loc);
+            }
+            if(loc != nullptr) files_[loc->file].live += loc->size;
+        }
+
+        // While loading, the newest record for a key wins whatever file it
+        // is in: merged files carry old records under new file numbers.
+        void load_entry(const string &key, const Location &loc, bool tombstone,
+                        unordered_map<string, uint64_t> &dead){
+            auto it = keydir_.find(key);
+            if(it != keydir_.end() && it->second.seq >= loc.seq) return;
+            auto d = dead.find(key);
+            if(d != dead.end()){
+                if(d->second >= loc.seq) return;
+                if(!tombstone) dead.erase(d);
+            }
+            if(tombstone){
+                dead[key] = loc.seq;
+                install(key, nullptr);
+            } else {
+                install(key, &loc);
+            }
+        }
+
+        bool load_hint(uint32_t id, unordered_map<string, uint64_t> &dead){
+            uint64_t size = 0;
+            RandomAccessFile* f = nullptr;
+            if(!env_->getFileSize(hint_name(id), &size).ok() || size < 4 ||
+               !env_->newRandomAccessFile(hint_name(id), &f).ok()){
+                return false;
+            }
+            string buf(size, '\0');
+            size_t got = 0;
+            Status s = f->pread(0, size, &buf[0], &got);
+            delete f;
+            uint32_t stored_crc;
+            memcpy(&stored_crc, buf.data() + size - 4, 4);
+            if(!s.ok() || got != size ||
+               crc32(0, reinterpret_cast<const Bytef*>(buf.data()), size - 4) != stored_crc){
+                return false;
+            }
+
+            const char* p = buf.data();
+            const char* end = buf.data() + size - 4;
+            string key;
+            while(end - p >= 24){
+                Location loc;
+                uint32_t klen;
+                loc.file = id;
+                memcpy(&loc.seq, p, 8);
+                memcpy(&loc.offset, p + 8, 8);
+                memcpy(&loc.size, p + 16, 4);
+                memcpy(&klen, p + 20, 4);
+                p += 24;
+                if(static_cast<size_t>(end - p) < klen) break;
+                key.assign(p, klen);
+                p += klen;
+                load_entry(key, loc, false, dead);
+                last_seq_ = max(last_seq_, loc.seq);
+                files_[id].max_seq = max(files_[id].max_seq, loc.seq);
+            }
+            return true;
+        }
+
+        // Reads a data file front to back, stopping at the first torn or
+        // corrupted record.
+        Status load_data(uint32_t id, uint64_t size, unordered_map<string, uint64_t> &dead){
+            string buf(size, '\0');
+            size_t got = 0;
+            Status s = files_[id].file->pread(0, size, &buf[0], &got);
+            if(!s.ok()) return s;
+
+            size_t off = 0;
+            string key;
+            while(off < got){
+                uint64_t seq;
+                uint32_t klen, vlen;
+                size_t n = parse_record(buf.data() + off, got - off, &seq, &klen, &vlen);
+                if(n == 0) break;
+                key.assign(buf.data() + off + REC_HEADER, klen);
+                Location loc{id, static_cast<uint32_t>(n), off, seq};
+                load_entry(key, loc, vlen == TOMBSTONE, dead);
+                last_seq_ = max(last_seq_, seq);
+                files_[id].max_seq = max(files_[id].max_seq, seq);
+                off += n;
+            }
+            return Status::OK();
+        }
+
+        Status open_active(){
+            active_id_ = next_id_++;
+            Status s = env_->newWritableFile(data_name(active_id_), &active_);
+            if(!s.ok()) return s;
+            RandomAccessFile* rf = nullptr;
+            s = env_->newRandomAccessFile(data_name(active_id_), &rf);
+            if(!s.ok()) return s;
+            files_[active_id_].file = rf;
+            return Status::OK();
+        }
+
+        // Seals the active file, starts a new one and merges if the sealed
+        // files have become mostly garbage. Caller holds write_mu_.
+        Status rotate(){
+            active_->close();
+            delete active_;
+            active_ = nullptr;
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                Status s = open_active();
+                if(!s.ok()) return s;
+            }
+
+            uint64_t total = 0, live = 0;
+            {
+                shared_lock<shared_mutex> lock(mu_);
+                for(const auto &[id, f] : files_){
+                    if(id == active_id_) continue;
+                    total += f.size;
+                    live += f.live;
+                }
+            }
+            // A failed merge leaves the sealed files as they were.
+            if(total > 0 && total - live >= options_.bitcask_merge_ratio * total){
+                merge();
+            }
+            return Status::OK();
+        }
+
+        Status write_hint(uint32_t id, const string &entries){
+            string buf = entries;
+            uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(buf.data()), buf.size());
+            buf.append(reinterpret_cast<const char*>(&crc), 4);
+
+            WritableFile* f = nullptr;
+            string tmp = hint_name(id) + ".tmp";
+            Status s = env_->newWritableFile(tmp, &f);
+            if(!s.ok()) return s;
+            s = f->append(buf.data(), buf.size());
+            if(s.ok()) s = f->sync();
+            f->close();
+            delete f;
+            if(!s.ok()) return s;
+            return env_->renameFile(tmp, hint_name(id));
+        }
+
+        // Copies the live records of every sealed file into new files and
+        // drops the old ones. Tombstones are not copied: every older record
+        // they could hide is in the files being dropped. Caller holds
+        // write_mu_, so the keydir only changes here.
+        Status merge(){
+            // (max_seq, id): victims go oldest first, so a crash part way
+            // through never keeps a record whose tombstone is gone. Ids do
+            // not give that order, as merge outputs carry old records under
+            // ids above the file that was active while they were written.
+            vector<pair<uint64_t, uint32_t>> victims;
+            vector<pair<const string*, Location>> live;
+            {
+                shared_lock<shared_mutex> lock(mu_);
+                for(const auto &[id, f] : files_){
+                    if(id != active_id_) victims.emplace_back(f.max_seq, id);
+                }
+                for(const auto &[key, loc] : keydir_){
+                    if(loc.file != active_id_) live.emplace_back(&key, loc);
+                }
+            }
+            if(victims.empty()) return Status::OK();
+            sort(victims.begin(), victims.end());
+            sort(live.begin(), live.end(), [](const auto &a, const auto &b){
+                return a.second.file != b.second.file ? a.second.file < b.second.file
+                                                      : a.second.offset < b.second.offset;
+            });
+
+            struct Output {
+                uint32_t id;
+                uint64_t size = 0;
+                uint64_t max_seq = 0;
+                string hints;
+            };
+            vector<Output> outputs;
+            vector<Location> moved(live.size());
+            WritableFile* out = nullptr;
+            Status s;
+            string rec;
+            for(size_t i = 0; s.ok() && i < live.size(); i++){
+                const Location &from = live[i].second;
+                if(out == nullptr || outputs.back().size + from.size > options_.bitcask_max_file_size){
+                    if(out != nullptr){
+                        s = out->sync();
+                        out->close();
+                        delete out;
+                        out = nullptr;
+                        if(!s.ok()) break;
+                    }
+                    outputs.emplace_back();
+                    outputs.back().id = next_id_++;
+                    s = env_->newWritableFile(data_name(outputs.back().id), &out);
+                    if(!s.ok()) break;
+                }
+
+                rec.resize(from.size);
+                size_t got = 0;
+                s = files_[from.file].file->pread(from.offset, from.size, &rec[0], &got);
+                if(s.ok() && got != from.size) s = Status::Corruption("BITCASK_CORRUPTED");
+                if(s.ok()) s = out->append(rec.data(), rec.size());
+                if(!s.ok()) break;
+
+                Output &o = outputs.back();
+                moved[i] = Location{o.id, from.size, o.size, from.seq};
+                uint32_t klen = live[i].first->size();
+                o.hints.append(reinterpret_cast<const char*>(&from.seq), 8);
+                o.hints.append(reinterpret_cast<const char*>(&o.size), 8);
+                o.hints.append(reinterpret_cast<const char*>(&from.size), 4);
+                o.hints.append(reinterpret_cast<const char*>(&klen), 4);
+                o.hints.append(*live[i].first);
+                o.size += from.size;
+                o.max_seq = max(o.max_seq, from.seq);
+            }
+            if(out != nullptr){
+                if(s.ok()) s = out->sync();
+                out->close();
+                delete out;
+            }
+            for(size_t i = 0; s.ok() && i < outputs.size(); i++){
+                s = write_hint(outputs[i].id, outputs[i].hints);
+            }
+            vector<RandomAccessFile*> readers(outputs.size(), nullptr);
+            for(size_t i = 0; s.ok() && i < outputs.size(); i++){
+                s = env_->newRandomAccessFile(data_name(outputs[i].id), &readers[i]);
+            }
+            if(!s.ok()){
+                // the old files are untouched; drop the partial output
+                for(size_t i = 0; i < outputs.size(); i++){
+                    delete readers[i];
+                    env_->deleteFile(data_name(outputs[i].id));
+                    env_->deleteFile(hint_name(outputs[i].id));
+                }
+                return s;
+            }
+
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                for(size_t i = 0; i < outputs.size(); i++){
+                    DataFile &f = files_[outputs[i].id];
+                    f.file = readers[i];
+                    f.size = outputs[i].size;
+                    f.max_seq = outputs[i].max_seq;
+                }
+                for(size_t i = 0; i < live.size(); i++){
+                    install(*live[i].first, &moved[i]);
+                }
+                for(const auto &[seq, id] : victims){
+                    delete files_[id].file;
+                    files_.erase(id);
+                }
+            }
+            for(const auto &[seq, id] : victims){
+                env_->deleteFile(data_name(id));
+                env_->deleteFile(hint_name(id));
+            }
+            return Status::OK();
+        }
+
+        // Appends encoded records and points the keydir at them. ops holds
+        // (key, value or nullptr for a delete) in the order encoded.
+        Status append(const string &buf, const vector<pair<const string*, const string*>> &ops, uint64_t first_seq){
+            if(active_ == nullptr) return Status::Busy("BITCASK_NOT_OPEN");
+            uint64_t start = files_[active_id_].size;
+            if(start > 0 && start + buf.size() > options_.bitcask_max_file_size){
+                Status s = rotate();
+                if(!s.ok()) return s;
+                start = 0;
+            }
+            Status s = active_->append(buf.data(), buf.size());
+            if(s.ok()) s = active_->sync();
+            if(!s.ok()){
+                // Part of buf may be in the file, so nothing more can go
+                // after it: the next append starts a fresh one.
+                rotate();
+                return s;
+            }
+
+            unique_lock<shared_mutex> lock(mu_);
+            uint64_t off = start;
+            uint64_t seq = first_seq;
+            for(const auto &[key, value] : ops){
+                uint32_t size = REC_HEADER + key->size() + (value ? value->size() : 0);
+                Location loc{active_id_, size, off, seq++};
+                install(*key, value ? &loc : nullptr);
+                off += size;
+            }
+            files_[active_id_].size = off;
+            files_[active_id_].max_seq = seq - 1;
+            last_seq_ = seq - 1;
+            return Status::OK();
+        }
+
+        // One pread of the whole record. Caller holds mu_ shared.
+        Status read_value(const string &key, const Location &loc, string* value){
+            string rec(loc.size, '\0');
+            size_t got = 0;
+            Status s = files_.at(loc.file).file->pread(loc.offset, loc.size, &rec[0], &got);
+            if(!s.ok()) return s;
+            uint64_t seq;
+            uint32_t klen = 0, vlen = 0;
+            if(got != loc.size || parse_record(rec.data(), got, &seq, &klen, &vlen) != loc.size ||
+               vlen == TOMBSTONE || rec.compare(REC_HEADER, klen, key) != 0){
+                return Status::Corruption("BITCASK_CORRUPTED");
+            }
+            value->assign(rec, REC_HEADER + klen, vlen);
+            return Status::OK();
+        }
+
+    public:
+        BitcaskEngine(const Options &options)
+            :options_(options),
+             env_(options.env ? options.env : DefaultEnv()){}
+
+        Status open(){
+            if(options_.secondary || !options_.replication_listen.empty() || !options_.replicate_from.empty()){
+                return Status::NotSupported();
+            }
+            env_->createDir(options_.path);
+            Status s = env_->lockFile(options_.path + "/LOCK", &lock_);
+            if(!s.ok()) return s;
+
+            vector<string> names;
+            env_->getChildren(options_.path, &names);
+            vector<uint32_t> ids;
+            for(const auto &name : names){
+                // a hint a merge did not finish renaming
+                if(name.size() > 9 && name.compare(name.size() - 9, 9, ".hint.tmp") == 0){
+                    env_->deleteFile(options_.path + "/" + name);
+                    continue;
+                }
+                size_t dot = name.find(".data");
+                if(dot == string::npos || dot + 5 != name.size()) continue;
+                ids.push_back(strtoul(name.c_str(), nullptr, 10));
+            }
+            sort(ids.begin(), ids.end());
+
+            unordered_map<string, uint64_t> dead;
+            for(uint32_t id : ids){
+                DataFile &f = files_[id];
+                s = env_->getFileSize(data_name(id), &f.size);
+                if(s.ok()) s = env_->newRandomAccessFile(data_name(id), &f.file);
+                if(!s.ok()) return s;
+                if(!load_hint(id, dead)){
+                    s = load_data(id, f.size, dead);
+                    if(!s.ok()) return s;
+                }
+                next_id_ = max(next_id_, id + 1);
+            }
+
+            // A torn tail in the last file is left as garbage for the next
+            // merge; new records always go to a fresh file.
+            return open_active();
+        }
+
+        ~BitcaskEngine(){
+            if(active_ != nullptr){
+                active_->close();
+                delete active_;
+                if(files_[active_id_].size == 0){
+                    delete files_[active_id_].file;
+                    files_.erase(active_id_);
+                    env_->deleteFile(data_name(active_id_));
+                }
+            }
+            for(auto &[id, f] : files_) delete f.file;
+            if(lock_ != nullptr){
+                env_->unlockFile(lock_);
+            }
+        }
+
+        Status put(const string &key, const string &value) override{
+            lock_guard<mutex> wlock(write_mu_);
+            string buf;
+            encode_record(buf, last_seq_ + 1, key, &value);
+            return append(buf, {{&key, &value}}, last_seq_ + 1);
+        }
+
+        Status get(const string &key, string* value) override{
+            shared_lock<shared_mutex> lock(mu_);
+            auto it = keydir_.find(key);
+            if(it == keydir_.end()) return Status::NotFound();
+            return read_value(key, it->second, value);
+        }
+
+        Status del(const string &key) override{
+            lock_guard<mutex> wlock(write_mu_);
+            {
+                shared_lock<shared_mutex> lock(mu_);
+                if(keydir_.find(key) == keydir_.end()) return Status::NotFound();
+            }
+            string buf;
+            encode_record(buf, last_seq_ + 1, key, nullptr);
+            return append(buf, {{&key, nullptr}}, last_seq_ + 1);
+        }
+
+        Status write(const WriteBatch &batch) override{
+            if(batch.count() == 0) return Status::OK();
+            lock_guard<mutex> wlock(write_mu_);
+            string buf;
+            vector<pair<const string*, const string*>> ops;
+            ops.reserve(batch.count());
+            uint64_t seq = last_seq_ + 1;
+            for(const auto &op : batch.ops()){
+                const string* value = op.type == WalOpType::PUT ? &op.value : nullptr;
+                encode_record(buf, seq++, op.key, value);
+                ops.emplace_back(&op.key, value);
+            }
+            return append(buf, ops, last_seq_ + 1);
+        }
+
+        vector<Status> multi_get(const vector<string> &keys, vector<string>* values) override{
+            values->assign(keys.size(), "");
+            vector<Status> statuses(keys.size());
+            shared_lock<shared_mutex> lock(mu_);
+            BatchFind(keydir_, keys.size(), [&](size_t i) -> const string& { return keys[i]; },
+                      [&](size_t i, const auto* entry){
+                statuses[i] = entry ? read_value(keys[i], entry->second, &(*values)[i]) : Status::NotFound();
+            });
+            return statuses;
+        }
+
+        // The keydir is unordered, so a scan sorts every key >= start.
+        Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) override{
+            out->clear();
+            shared_lock<shared_mutex> lock(mu_);
+            vector<const pair<const string, Location>*> hits;
+            const Comparator* cmp = options_.comparator;
+            for(const auto &entry : keydir_){
+                if(cmp->compare(entry.first, start) >= 0) hits.push_back(&entry);
+            }
+            size_t n = min(limit, hits.size());
+            partial_sort(hits.begin(), hits.begin() + n, hits.end(),
+                         [cmp](const auto* a, const auto* b){ return cmp->compare(a->first, b->first) < 0; });
+            for(size_t i = 0; i < n; i++){
+                string value;
+                Status s = read_value(hits[i]->first, hits[i]->second, &value);
+                if(!s.ok()) return s;
+                out->emplace_back(hits[i]->first, move(value));
+            }
+            return Status::OK();
+        }
+
+        Status get_updates_since(uint64_t, UpdateIterator**) override{
+            return Status::NotSupported();
+        }
+
+        // Sealed files never change, so they are hard-linked where the Env
+        // allows it; the active file is copied up to its current size.
+        Status create_checkpoint(const string &dir) override{
+            if(env_->fileExists(dir)) return Status::InvalidArgument("CHECKPOINT_EXISTS");
+            lock_guard<mutex> wlock(write_mu_);
+            Status s = env_->createDir(dir);
+            for(auto it = files_.begin(); s.ok() && it != files_.end(); ++it){
+                string name = data_name(it->first).substr(options_.path.size());
+                if(it->first == active_id_){
+                    s = CopyFile(env_, options_.path + name, dir + name, it->second.size);
+                    continue;
+                }
+                s = env_->linkFile(options_.path + name, dir + name);
+                if(!s.ok()) s = CopyFile(env_, options_.path + name, dir + name);
+                string hint = hint_name(it->first).substr(options_.path.size());
+                if(s.ok() && env_->fileExists(options_.path + hint)){
+                    s = env_->linkFile(options_.path + hint, dir + hint);
+                    if(!s.ok()) s = CopyFile(env_, options_.path + hint, dir + hint);
+                }
+            }
+            return s;
+        }
+
+        Status catch_up_with_primary() override{
+            return Status::NotSupported("NOT_SECONDARY");
+        }
+};
+
+KVEngine* CreateBitcaskEngine(const Options &options) {
+    BitcaskEngine* engine = new BitcaskEngine(options);
+    if(!engine->open().ok()){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
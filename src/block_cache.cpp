@@ -0,0 +1,417 @@
+#include "block_cache.h"
+#include "huge_pages.h"
+#include <unordered_map>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+struct BlockKey {
+    uint64_t file;
+    uint64_t offset;
+    bool operator==(const BlockKey &o) const { return file == o.file && offset == o.offset; }
+};
+
+struct BlockKeyHash {
+    size_t operator()(const BlockKey &k) const {
+        return hash<uint64_t>()(k.file * 0x9E3779B97F4A7C15ull ^ k.offset);
+    }
+};
+
+BlockRef MakeBlockRef(string bytes){
+    struct Owned {
+        string bytes;
+        string_view view;
+    };
+    auto owned = make_shared<Owned>();
+    owned->bytes = move(bytes);
+    owned->view = owned->bytes;
+    return BlockRef(owned, &owned->view);
+}
+
+/* ---------------- flash tier ---------------- */
+
+/*
+    Each stored block is
+
+    | uint32 crc      | of everything after it
+    | uint8 codec     | 0 = raw, 1 = deflated
+    | uint32 raw_len  |
+    | payload         |
+*/
+class FileSecondaryCache : public SecondaryCache {
+
+    private:
+        static const size_t HEADER = 9;
+        static const int REGIONS = 8;
+
+        struct Location {
+            int region;
+            uint64_t gen;       // region generation it was written in
+            uint64_t offset;
+            uint32_t size;
+        };
+        struct Region {
+            uint64_t gen = 0;
+            uint64_t used = 0;
+            vector<BlockKey> keys;
+            shared_ptr<RandomAccessFile> reader;
+        };
+
+        Env* env_;
+        string dir_;
+        uint64_t region_size_;
+        bool compress_;
+
+        mutex mu_;
+        unordered_map<BlockKey, Location, BlockKeyHash> index_;
+        Region regions_[REGIONS];
+        int active_ = 0;
+        WritableFile* writer_ = nullptr;
+        SecondaryCacheStats stats_;
+
+        string region_name(int r) const {
+            return dir_ + "/region_" + to_string(r);
+        }
+
+        // Empties region r and starts writing it. Caller holds mu_.
+        bool reset_region(int r){
+            Region &reg = regions_[r];
+            for(const auto &k : reg.keys){
+                auto it = index_.find(k);
+                if(it != index_.end() && it->second.region == r) index_.erase(it);
+            }
+            stats_.bytes -= reg.used;
+            reg.keys.clear();
+            reg.used = 0;
+            reg.gen++;
+            reg.reader.reset();
+
+            delete writer_;
+            writer_ = nullptr;
+            if(!env_->newWritableFile(region_name(r), &writer_).ok()) return false;
+            RandomAccessFile* f = nullptr;
+            if(!env_->newRandomAccessFile(region_name(r), &f).ok()) return false;
+            reg.reader.reset(f);
+            active_ = r;
+            return true;
+        }
+
+    public:
+        FileSecondaryCache(Env* env, const string &dir, uint64_t capacity, bool compress)
+            :env_(env), dir_(dir), region_size_(max<uint64_t>(capacity / REGIONS, 4096)), compress_(compress){}
+
+        ~FileSecondaryCache(){
+            delete writer_;
+        }
+
+        bool open(){
+            if(!env_->createDir(dir_).ok()) return false;
+            vector<string> names;
+            env_->getChildren(dir_, &names);
+            for(const auto &name : names) env_->deleteFile(dir_ + "/" + name);
+            return reset_region(0);
+        }
+
+        void insert(uint64_t file, uint64_t offset, string_view block) override{
+            string rec(HEADER, '\0');
+            uint8_t codec = 0;
+            if(compress_){
+                uLongf len = compressBound(block.size());
+                rec.resize(HEADER + len);
+                if(compress2(reinterpret_cast<Bytef*>(&rec[HEADER]), &len,
+                             reinterpret_cast<const Bytef*>(block.data()), block.size(), Z_BEST_SPEED) == Z_OK &&
+                   len < block.size()){
+                    rec.resize(HEADER + len);
+                    codec = 1;
+                }
+            }
+            if(codec == 0){
+                rec.resize(HEADER);
+                rec += block;
+            }
+            uint32_t raw_len = block.size();
+            rec[4] = codec;
+            memcpy(&rec[5], &raw_len, sizeof(raw_len));
+            uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(rec.data() + 4), rec.size() - 4);
+            memcpy(&rec[0], &crc, sizeof(crc));
+            if(rec.size() > region_size_) return;
+
+            lock_guard<mutex> lock(mu_);
+            BlockKey key{file, offset};
+            if(index_.count(key)) return;
+            if(writer_ == nullptr || regions_[active_].used + rec.size() > region_size_){
+                if(!reset_region((active_ + 1) % REGIONS)) return;
+            }
+            Region &reg = regions_[active_];
+            if(!writer_->append(rec.data(), rec.size()).ok()){
+                // the region's tail is unknown now; start over in the next one
+                delete writer_;
+                writer_ = nullptr;
+                return;
+            }
+            index_[key] = Location{active_, reg.gen, reg.used, static_cast<uint32_t>(rec.size())};
+            reg.keys.push_back(key);
+            reg.used += rec.size();
+            stats_.bytes += rec.size();
+            stats_.inserts++;
+        }
+
+        bool lookup(uint64_t file, uint64_t offset, string* block) override{
+            Location loc;
+            shared_ptr<RandomAccessFile> reader;
+            {
+                lock_guard<mutex> lock(mu_);
+                auto it = index_.find(BlockKey{file, offset});
+                if(it == index_.end()){
+                    stats_.misses++;
+                    return false;
+                }
+                loc = it->second;
+                reader = regions_[loc.region].reader;
+            }
+
+            // The region may be recycled while we read; the crc and the
+            // generation check below catch that.
+            string rec(loc.size, '\0');
+            size_t got = 0;
+            bool ok = reader && reader->pread(loc.offset, loc.size, &rec[0], &got).ok() && got == loc.size;
+            uint32_t crc = 0, raw_len = 0;
+            if(ok){
+                memcpy(&crc, rec.data(), sizeof(crc));
+                memcpy(&raw_len, rec.data() + 5, sizeof(raw_len));
+                ok = crc == crc32(0, reinterpret_cast<const Bytef*>(rec.data() + 4), rec.size() - 4);
+            }
+            if(ok && rec[4] == 1){
+                block->resize(raw_len);
+                uLongf len = raw_len;
+                ok = uncompress(reinterpret_cast<Bytef*>(&(*block)[0]), &len,
+                                reinterpret_cast<const Bytef*>(rec.data() + HEADER), rec.size() - HEADER) == Z_OK &&
+                     len == raw_len;
+            } else if(ok){
+                block->assign(rec, HEADER, string::npos);
+                ok = block->size() == raw_len;
+            }
+
+            lock_guard<mutex> lock(mu_);
+            ok = ok && regions_[loc.region].gen == loc.gen;
+            if(ok){
+                stats_.hits++;
+            } else {
+                index_.erase(BlockKey{file, offset});
+                stats_.misses++;
+            }
+            return ok;
+        }
+
+        SecondaryCacheStats stats() override{
+            lock_guard<mutex> lock(mu_);
+            return stats_;
+        }
+};
+
+SecondaryCache* NewFileSecondaryCache(Env* env, const string &dir, uint64_t capacity, bool compress){
+    FileSecondaryCache* cache = new FileSecondaryCache(env, dir, capacity, compress);
+    if(!cache->open()){
+        delete cache;
+        return nullptr;
+    }
+    return cache;
+}
+
+/* ---------------- memory tiers ---------------- */
+
+class LruBlockCache : public BlockCache {
+
+    private:
+        struct Entry {
+            BlockKey key;
+            BlockRef block;
+            size_t charge;      // block bytes charged to the tier
+            bool spill;
+            size_t raw_size;    // compressed tier: the block's size once decompressed
+            bool hit;           // compressed tier: looked up since it was inserted
+        };
+        // Memory charged per block besides its bytes.
+        static const size_t ENTRY_OVERHEAD = sizeof(Entry) + 64;
+
+        // One LRU list, most recent first.
+        struct Tier {
+            size_t capacity;
+            size_t bytes = 0;
+            list<Entry> lru;
+            unordered_map<BlockKey, list<Entry>::iterator, BlockKeyHash> map;
+
+            explicit Tier(size_t cap) : capacity(cap) {}
+
+            Entry* find(const BlockKey &key){
+                auto it = map.find(key);
+                if(it == map.end()) return nullptr;
+                lru.splice(lru.begin(), lru, it->second);
+                return &*it->second;
+            }
+            void erase(list<Entry>::iterator it){
+                bytes -= it->charge + ENTRY_OVERHEAD;
+                map.erase(it->key);
+                lru.erase(it);
+            }
+            // Makes room for charge bytes, moving the evicted entries to out.
+            void evict(size_t charge, vector<Entry>* out){
+                while(bytes + charge > capacity){
+                    auto victim = prev(lru.end());
+                    out->push_back(*victim);
+                    erase(victim);
+                }
+            }
+            void add(Entry e){
+                bytes += e.charge + ENTRY_OVERHEAD;
+                lru.push_front(move(e));
+                map[lru.front().key] = lru.begin();
+            }
+        };
+
+        SecondaryCache* secondary_;
+        // held by every block copied into it, which may outlive the cache
+        shared_ptr<SlabAllocator> slabs_;
+
+        mutex mu_;
+        Tier plain_;
+        Tier compressed_;
+        BlockCacheStats stats_;
+
+        size_t charge(const BlockRef &block) const {
+            return slabs_ ? SlabAllocator::slot_size(block->size()) : block->size();
+        }
+
+        // The block as the cache keeps it: in a slab if there are slabs
+        // and one has room, else as given.
+        BlockRef to_slab(BlockRef block){
+            if(!slabs_) return block;
+            size_t n = block->size();
+            char* p = slabs_->allocate(n);
+            if(p == nullptr) return block;
+            memcpy(p, block->data(), n);
+            shared_ptr<SlabAllocator> slabs = slabs_;
+            return BlockRef(new string_view(p, n), [slabs, p](const string_view* v){
+                slabs->release(p, v->size());
+                delete v;
+            });
+        }
+
+    public:
+        LruBlockCache(size_t capacity, SecondaryCache* secondary, size_t compressed_capacity, bool huge_pages)
+            :secondary_(secondary), plain_(capacity), compressed_(compressed_capacity){
+            if(huge_pages) slabs_ = make_shared<SlabAllocator>();
+        }
+
+        bool hasCompressedTier() const override{
+            return compressed_.capacity > 0;
+        }
+
+        BlockRef lookup(uint64_t file, uint64_t offset) override{
+            lock_guard<mutex> lock(mu_);
+            Entry* e = plain_.find(BlockKey{file, offset});
+            if(e == nullptr){
+                stats_.misses++;
+                return nullptr;
+            }
+            stats_.hits++;
+            return e->block;
+        }
+
+        BlockRef lookupCompressed(uint64_t file, uint64_t offset, bool* hot) override{
+            if(!hasCompressedTier()) return nullptr;
+            lock_guard<mutex> lock(mu_);
+            Entry* e = compressed_.find(BlockKey{file, offset});
+            if(e == nullptr){
+                stats_.compressed_misses++;
+                return nullptr;
+            }
+            stats_.compressed_hits++;
+            *hot = e->hit;
+            e->hit = true;
+            return e->block;
+        }
+
+        BlockRef lookupSecondary(uint64_t file, uint64_t offset) override{
+            string block;
+            if(secondary_ == nullptr || !secondary_->lookup(file, offset, &block)) return nullptr;
+            BlockRef ref = MakeBlockRef(move(block));
+            insert(file, offset, ref, true);
+            return ref;
+        }
+
+        void insert(uint64_t file, uint64_t offset, BlockRef block, bool spill) override{
+            size_t bytes = charge(block);
+            if(bytes + ENTRY_OVERHEAD > plain_.capacity) return;
+            block = to_slab(move(block));
+
+            vector<Entry> evicted;
+            {
+                lock_guard<mutex> lock(mu_);
+                BlockKey key{file, offset};
+                if(plain_.map.count(key)) return;
+                // promoted: the compressed copy is no longer needed
+                auto c = compressed_.map.find(key);
+                if(c != compressed_.map.end()){
+                    stats_.compressed_raw_bytes -= c->second->raw_size;
+                    compressed_.erase(c->second);
+                }
+                plain_.evict(bytes + ENTRY_OVERHEAD, &evicted);
+                plain_.add(Entry{key, move(block), bytes, spill, 0, false});
+                stats_.bytes = plain_.bytes;
+                stats_.compressed_bytes = compressed_.bytes;
+            }
+            // written out off the lock
+            for(const auto &e : evicted){
+                if(e.spill && secondary_) secondary_->insert(e.key.file, e.key.offset, *e.block);
+            }
+        }
+
+        // Blocks leave the compressed tier for good: the secondary takes
+        // them only from the uncompressed one.
+        void insertCompressed(uint64_t file, uint64_t offset, BlockRef block, size_t raw_size) override{
+            size_t bytes = charge(block);
+            if(bytes + ENTRY_OVERHEAD > compressed_.capacity) return;
+            block = to_slab(move(block));
+
+            vector<Entry> evicted;
+            lock_guard<mutex> lock(mu_);
+            BlockKey key{file, offset};
+            if(plain_.map.count(key) || compressed_.map.count(key)) return;
+            compressed_.evict(bytes + ENTRY_OVERHEAD, &evicted);
+            for(const auto &e : evicted) stats_.compressed_raw_bytes -= e.raw_size;
+            compressed_.add(Entry{key, move(block), bytes, false, raw_size, false});
+            stats_.compressed_raw_bytes += raw_size;
+            stats_.compressed_bytes = compressed_.bytes;
+        }
+
+        void recordDecompression(uint64_t nanos) override{
+            lock_guard<mutex> lock(mu_);
+            stats_.decompressions++;
+            stats_.decompress_nanos += nanos;
+        }
+
+        BlockCacheStats stats() override{
+            BlockCacheStats st;
+            {
+                lock_guard<mutex> lock(mu_);
+                st = stats_;
+            }
+            if(slabs_){
+                HugePageStats h = slabs_->stats();
+                st.chunks = h.chunks;
+                st.hugetlb_chunks = h.hugetlb_chunks;
+                st.advised_chunks = h.advised_chunks;
+            }
+            return st;
+        }
+};
+
+BlockCache* NewBlockCache(size_t capacity, SecondaryCache* secondary, size_t compressed_capacity,
+                          bool huge_pages){
+    return new LruBlockCache(capacity, secondary, compressed_capacity, huge_pages);
+}
@@ -0,0 +1,781 @@
+#include "btree.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <string_view>
+#include <unordered_set>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+    The file is a sequence of PAGE_SIZE pages:
+
+    page 0, 1   meta pages, written alternately; the valid one with the
+                higher txnid is current
+    page 2..    tree pages and overflow runs
+
+    Meta page:
+    | uint32 magic | uint32 page_size | uint64 txnid | uint64 root | uint64 npages | uint32 crc |
+
+    Tree page:
+    | uint16 flags | uint16 count | uint32 unused | uint16 offsets[count] | entries |
+
+    Leaf entry:
+    | uint16 key_len | uint8 overflow | uint32 val_len | key | value, or uint64 first overflow page |
+
+    Branch entry:
+    | uint64 child | uint16 key_len | key |
+
+    A branch's first key is empty: its child holds everything below the
+    second key. Values too large to sit in a leaf are stored in a run of
+    contiguous overflow pages. Root page 0 means an empty tree.
+
+    Free pages are not stored. Open walks the current tree and treats
+    every page it does not reach as free.
+*/
+
+static const size_t PAGE_SIZE = 4096;
+static const uint32_t META_MAGIC = 0x4b564231;   // "KVB1"
+static const uint16_t PAGE_LEAF = 1;
+static const uint16_t PAGE_BRANCH = 2;
+static const size_t PAGE_HEADER = 8;
+static const size_t MAX_KEY = 512;
+// Any entry fits in a quarter page, so a split always leaves two pages
+// that fit.
+static const size_t MAX_ENTRY = PAGE_SIZE / 4;
+static const int READER_SLOTS = 128;
+
+struct MetaPage {
+    uint32_t magic;
+    uint32_t page_size;
+    uint64_t txnid;
+    uint64_t root;
+    uint64_t npages;
+    uint32_t crc;
+};
+
+static uint32_t meta_crc(const MetaPage &m){
+    return crc32(0, reinterpret_cast<const Bytef*>(&m), offsetof(MetaPage, crc));
+}
+
+/* ---------------- page access ---------------- */
+
+static uint16_t get16(const char* p){
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static uint32_t get32(const char* p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t get64(const char* p){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint16_t page_flags(const char* p){
+    return get16(p);
+}
+
+static int page_count(const char* p){
+    return get16(p + 2);
+}
+
+static const char* entry_at(const char* p, int i){
+    return p + get16(p + PAGE_HEADER + 2 * i);
+}
+
+static string_view leaf_key(const char* p, int i){
+    const char* e = entry_at(p, i);
+    return string_view(e + 7, get16(e));
+}
+
+static string_view branch_key(const char* p, int i){
+    const char* e = entry_at(p, i);
+    return string_view(e + 10, get16(e + 8));
+}
+
+static uint64_t branch_child(const char* p, int i){
+    return get64(entry_at(p, i));
+}
+
+// Index of the child of branch p whose range holds key.
+static int branch_find(const char* p, string_view key){
+    int lo = 1, hi = page_count(p);
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(branch_key(p, mid) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+// First index of leaf p with a key >= key.
+static int leaf_lower_bound(const char* p, string_view key){
+    int lo = 0, hi = page_count(p);
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(leaf_key(p, mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* ---------------- decoded pages, for the writer ---------------- */
+
+struct LeafEntry {
+    string key;
+    bool overflow = false;
+    uint32_t vlen = 0;
+    string value;       // inline values only
+    uint64_t first = 0; // overflow values only
+};
+
+struct BranchEntry {
+    string key;
+    uint64_t child;
+};
+
+static size_t entry_size(const LeafEntry &e){
+    return 7 + e.key.size() + (e.overflow ? 8 : e.vlen);
+}
+
+static size_t entry_size(const BranchEntry &e){
+    return 10 + e.key.size();
+}
+
+static vector<LeafEntry> decode_leaf(const char* p){
+    vector<LeafEntry> out(page_count(p));
+    for(size_t i = 0; i < out.size(); i++){
+        const char* e = entry_at(p, i);
+        LeafEntry &le = out[i];
+        uint16_t klen = get16(e);
+        le.overflow = e[2] != 0;
+        le.vlen = get32(e + 3);
+        le.key.assign(e + 7, klen);
+        if(le.overflow) le.first = get64(e + 7 + klen);
+        else le.value.assign(e + 7 + klen, le.vlen);
+    }
+    return out;
+}
+
+static vector<BranchEntry> decode_branch(const char* p){
+    vector<BranchEntry> out(page_count(p));
+    for(size_t i = 0; i < out.size(); i++){
+        out[i].key = string(branch_key(p, i));
+        out[i].child = branch_child(p, i);
+    }
+    return out;
+}
+
+static void encode_entry(char* e, const LeafEntry &le){
+    uint16_t klen = le.key.size();
+    memcpy(e, &klen, 2);
+    e[2] = le.overflow ? 1 : 0;
+    memcpy(e + 3, &le.vlen, 4);
+    memcpy(e + 7, le.key.data(), klen);
+    if(le.overflow) memcpy(e + 7 + klen, &le.first, 8);
+    else memcpy(e + 7 + klen, le.value.data(), le.vlen);
+}
+
+static void encode_entry(char* e, const BranchEntry &be){
+    uint16_t klen = be.key.size();
+    memcpy(e, &be.child, 8);
+    memcpy(e + 8, &klen, 2);
+    memcpy(e + 10, be.key.data(), klen);
+}
+
+template <typename Entry>
+static bool fits(const vector<Entry> &entries, size_t begin, size_t end){
+    size_t bytes = PAGE_HEADER + 2 * (end - begin);
+    for(size_t i = begin; i < end; i++) bytes += entry_size(entries[i]);
+    return bytes <= PAGE_SIZE;
+}
+
+template <typename Entry>
+static void encode_page(char* p, uint16_t flags, const vector<Entry> &entries, size_t begin, size_t end){
+    uint16_t count = end - begin;
+    memcpy(p, &flags, 2);
+    memcpy(p + 2, &count, 2);
+    memset(p + 4, 0, 4);
+    uint16_t off = PAGE_HEADER + 2 * count;
+    for(size_t i = begin; i < end; i++){
+        memcpy(p + PAGE_HEADER + 2 * (i - begin), &off, 2);
+        encode_entry(p + off, entries[i]);
+        off += entry_size(entries[i]);
+    }
+}
+
+class BTreeEngine : public KVEngine {
+
+    private:
+        // A piece of a rewritten page: its first key and page number.
+        typedef vector<pair<string, uint64_t>> Pieces;
+
+        struct alignas(64) ReaderSlot {
+            atomic<uint64_t> txnid{0};      // 0 = free
+        };
+
+        // Root of each meta slot, published like a seqlock: txnid is
+        // zeroed while root changes.
+        struct Published {
+            atomic<uint64_t> txnid{0};
+            atomic<uint64_t> root{0};
+        };
+
+        Options options_;
+        Env* env_;
+        FileLock* lock_ = nullptr;
+        MmapFile* map_ = nullptr;
+        char* base_ = nullptr;
+
+        ReaderSlot readers_[READER_SLOTS];
+        Published published_[2];
+        atomic<uint64_t> latest_{0};
+
+        // Writer state, under write_mu_.
+        mutex write_mu_;
+        uint64_t root_ = 0;
+        uint64_t npages_ = 2;
+        vector<uint64_t> free_;                     // reusable now
+        deque<pair<uint64_t, uint64_t>> pending_;   // (txnid that freed it, page), oldest first
+
+        // The open write transaction.
+        uint64_t txn_root_ = 0;
+        uint64_t txn_npages_ = 0;
+        bool txn_changed_ = false;
+        unordered_set<uint64_t> dirty_;     // written by this txn, safe to modify in place
+        vector<uint64_t> popped_;           // taken from free_
+        vector<uint64_t> txn_free_;         // dirty pages dropped again
+        vector<uint64_t> freed_;            // committed pages this txn unlinked
+
+        char* page(uint64_t no) const {
+            return base_ + no * PAGE_SIZE;
+        }
+
+        /* ---------------- readers ---------------- */
+
+        // Registers a reader and returns its slot; *root is the root of the
+        // latest committed tree, which stays intact until end_read.
+        int begin_read(uint64_t* root){
+            int slot = hash<thread::id>()(this_thread::get_id()) % READER_SLOTS;
+            while(true){
+                uint64_t t = latest_.load();
+                uint64_t expected = 0;
+                if(!readers_[slot].txnid.compare_exchange_strong(expected, t)){
+                    slot = (slot + 1) % READER_SLOTS;
+                    if(slot == 0) this_thread::yield();
+                    continue;
+                }
+                // A writer that started before the slot was set may only
+                // reuse pages freed up to the then latest txn; if that is
+                // still t, t's pages are safe.
+                if(latest_.load() == t){
+                    Published &p = published_[t % 2];
+                    uint64_t t1 = p.txnid.load();
+                    uint64_t r = p.root.load();
+                    if(t1 == t && p.txnid.load() == t){
+                        *root = r;
+                        return slot;
+                    }
+                }
+                readers_[slot].txnid.store(0);
+            }
+        }
+
+        void end_read(int slot){
+            readers_[slot].txnid.store(0);
+        }
+
+        // Leaf page and index of the first key >= key in the tree at root.
+        void seek(uint64_t root, string_view key, const char** leaf, int* idx,
+                  vector<pair<const char*, int>>* path = nullptr) const {
+            const char* p = page(root);
+            while(page_flags(p) == PAGE_BRANCH){
+                int i = branch_find(p, key);
+                if(path) path->emplace_back(p, i);
+                p = page(branch_child(p, i));
+            }
+            *leaf = p;
+            *idx = leaf_lower_bound(p, key);
+        }
+
+        void read_value(const char* leaf, int i, string* value) const {
+            const char* e = entry_at(leaf, i);
+            uint16_t klen = get16(e);
+            uint32_t vlen = get32(e + 3);
+            if(e[2]) value->assign(page(get64(e + 7 + klen)), vlen);
+            else value->assign(e + 7 + klen, vlen);
+        }
+
+        Status lookup(uint64_t root, const string &key, string* value) const {
+            if(root == 0) return Status::NotFound();
+            const char* leaf;
+            int i;
+            seek(root, key, &leaf, &i);
+            if(i >= page_count(leaf) || leaf_key(leaf, i) != key) return Status::NotFound();
+            read_value(leaf, i, value);
+            return Status::OK();
+        }
+
+        /* ---------------- write transactions ---------------- */
+
+        uint64_t oldest_reader(){
+            uint64_t oldest = latest_.load();
+            for(auto &r : readers_){
+                uint64_t t = r.txnid.load();
+                if(t != 0 && t < oldest) oldest = t;
+            }
+            return oldest;
+        }
+
+        void begin_write(){
+            // A page unlinked by txn F is reachable only from trees older
+            // than F.
+            uint64_t oldest = oldest_reader();
+            while(!pending_.empty() && pending_.front().first <= oldest){
+                free_.push_back(pending_.front().second);
+                pending_.pop_front();
+            }
+            txn_root_ = root_;
+            txn_npages_ = npages_;
+            txn_changed_ = false;
+            dirty_.clear();
+            popped_.clear();
+            txn_free_.clear();
+            freed_.clear();
+        }
+
+        void abort_write(){
+            free_.insert(free_.end(), popped_.begin(), popped_.end());
+        }
+
+        // Flushes the pages this txn wrote rather than the whole file. One
+        // msync spans them all: each MS_SYNC waits on its own writeback,
+        // and the clean pages between them cost nothing to pass over.
+        Status sync_dirty(){
+            if(dirty_.empty()) return Status::OK();
+            auto [lo, hi] = minmax_element(dirty_.begin(), dirty_.end());
+            return map_->sync(*lo * PAGE_SIZE, (*hi - *lo + 1) * PAGE_SIZE);
+        }
+
+        Status commit_write(){
+            if(!txn_changed_) return Status::OK();
+            Status s = sync_dirty();
+            if(!s.ok()){
+                abort_write();
+                return s;
+            }
+
+            uint64_t t = latest_.load() + 1;
+            MetaPage m;
+            memset(&m, 0, sizeof(m));
+            m.magic = META_MAGIC;
+            m.page_size = PAGE_SIZE;
+            m.txnid = t;
+            m.root = txn_root_;
+            m.npages = txn_npages_;
+            m.crc = meta_crc(m);
+            memcpy(page(t % 2), &m, sizeof(m));
+            s = map_->sync((t % 2) * PAGE_SIZE, PAGE_SIZE);
+            if(!s.ok()){
+                // the slot now holds a txn no reader was told about
+                memset(page(t % 2), 0, sizeof(m));
+                abort_write();
+                return s;
+            }
+
+            Published &p = published_[t % 2];
+            p.txnid.store(0);
+            p.root.store(txn_root_);
+            p.txnid.store(t);
+            latest_.store(t);
+
+            root_ = txn_root_;
+            npages_ = txn_npages_;
+            free_.insert(free_.end(), txn_free_.begin(), txn_free_.end());
+            for(uint64_t no : freed_) pending_.emplace_back(t, no);
+            return Status::OK();
+        }
+
+        // Makes sure the file has room for n more pages, so allocation
+        // within one operation cannot fail.
+        Status reserve(uint64_t n){
+            uint64_t need = (txn_npages_ + n) * PAGE_SIZE;
+            if(need <= map_->size()) return Status::OK();
+            uint64_t want = max(need, map_->size() + map_->size() / 2);
+            want = min<uint64_t>(want, options_.btree_map_size / PAGE_SIZE * PAGE_SIZE);
+            return map_->grow(max(need, want));
+        }
+
+        uint64_t alloc(){
+            uint64_t no;
+            if(!txn_free_.empty()){
+                no = txn_free_.back();
+                txn_free_.pop_back();
+            } else if(!free_.empty()){
+                no = free_.back();
+                free_.pop_back();
+                popped_.push_back(no);
+            } else {
+                no = txn_npages_++;
+            }
+            dirty_.insert(no);
+            return no;
+        }
+
+        // n contiguous pages, from the free list if it has a long enough run.
+        uint64_t alloc_run(uint64_t n){
+            sort(free_.begin(), free_.end(), greater<uint64_t>());
+            for(size_t i = 0; i + n <= free_.size(); i++){
+                if(free_[i] - free_[i + n - 1] != n - 1) continue;
+                uint64_t first = free_[i + n - 1];
+                popped_.insert(popped_.end(), free_.begin() + i, free_.begin() + i + n);
+                free_.erase(free_.begin() + i, free_.begin() + i + n);
+                for(uint64_t j = 0; j < n; j++) dirty_.insert(first + j);
+                return first;
+            }
+            uint64_t first = txn_npages_;
+            txn_npages_ += n;
+            for(uint64_t i = 0; i < n; i++) dirty_.insert(first + i);
+            return first;
+        }
+
+        void release(uint64_t no){
+            if(dirty_.count(no)) txn_free_.push_back(no);
+            else freed_.push_back(no);
+        }
+
+        // The page to rewrite old's contents into.
+        uint64_t writable(uint64_t old){
+            if(old != 0 && dirty_.count(old)) return old;
+            if(old != 0) release(old);
+            return alloc();
+        }
+
+        template <typename Entry>
+        Pieces store(uint64_t old, uint16_t flags, vector<Entry> &entries){
+            if(entries.empty()){
+                if(old != 0) release(old);
+                return {};
+            }
+            if(flags == PAGE_BRANCH) entries[0].key.clear();
+            if(fits(entries, 0, entries.size())){
+                uint64_t no = writable(old);
+                encode_page(page(no), flags, entries, 0, entries.size());
+                return {{entries[0].key, no}};
+            }
+
+            size_t total = 0, half = 0, m = 0;
+            for(const auto &e : entries) total += entry_size(e);
+            while(m + 1 < entries.size() && half + entry_size(entries[m]) <= total / 2){
+                half += entry_size(entries[m++]);
+            }
+            m = max<size_t>(m, 1);
+            string sep = entries[m].key;
+            if(flags == PAGE_BRANCH) entries[m].key.clear();
+            uint64_t left = writable(old);
+            uint64_t right = alloc();
+            encode_page(page(left), flags, entries, 0, m);
+            encode_page(page(right), flags, entries, m, entries.size());
+            return {{entries[0].key, left}, {sep, right}};
+        }
+
+        // Puts key (or deletes it when value is nullptr) in the open txn.
+        Status apply(const string &key, const string* value, bool* found){
+            if(key.size() > MAX_KEY) return Status::InvalidArgument("KEY_TOO_LARGE");
+
+            vector<pair<uint64_t, int>> path;
+            uint64_t leaf = txn_root_;
+            if(leaf != 0){
+                while(page_flags(page(leaf)) == PAGE_BRANCH){
+                    int i = branch_find(page(leaf), key);
+                    path.emplace_back(leaf, i);
+                    leaf = branch_child(page(leaf), i);
+                }
+            }
+
+            LeafEntry ne;
+            ne.key = key;
+            uint64_t run = 0;
+            if(value){
+                ne.vlen = value->size();
+                ne.overflow = 7 + key.size() + value->size() > MAX_ENTRY;
+                if(ne.overflow) run = (value->size() + PAGE_SIZE - 1) / PAGE_SIZE;
+                else ne.value = *value;
+            }
+            Status s = reserve(2 * (path.size() + 2) + run);
+            if(!s.ok()) return s;
+
+            vector<LeafEntry> entries;
+            if(leaf != 0) entries = decode_leaf(page(leaf));
+            auto pos = lower_bound(entries.begin(), entries.end(), key,
+                                   [](const LeafEntry &e, const string &k){ return e.key < k; });
+            *found = pos != entries.end() && pos->key == key;
+            if(!value && !*found) return Status::OK();
+
+            if(*found && pos->overflow){
+                uint64_t pages = (pos->vlen + PAGE_SIZE - 1) / PAGE_SIZE;
+                for(uint64_t i = 0; i < pages; i++) release(pos->first + i);
+            }
+            if(ne.overflow){
+                ne.first = alloc_run(run);
+                memcpy(page(ne.first), value->data(), value->size());
+            }
+            if(!value) entries.erase(pos);
+            else if(*found) *pos = move(ne);
+            else entries.insert(pos, move(ne));
+
+            Pieces pieces = store(leaf, PAGE_LEAF, entries);
+            for(size_t level = path.size(); level-- > 0;){
+                auto [no, idx] = path[level];
+                vector<BranchEntry> children = decode_branch(page(no));
+                if(pieces.empty()){
+                    children.erase(children.begin() + idx);
+                } else {
+                    children[idx].child = pieces[0].second;
+                    for(size_t j = 1; j < pieces.size(); j++){
+                        children.insert(children.begin() + idx + j, BranchEntry{pieces[j].first, pieces[j].second});
+                    }
+                }
+                pieces = store(no, PAGE_BRANCH, children);
+            }
+
+            if(pieces.empty()){
+                txn_root_ = 0;
+            } else if(pieces.size() == 1){
+                txn_root_ = pieces[0].second;
+                // a branch left with one child is replaced by it
+                while(page_flags(page(txn_root_)) == PAGE_BRANCH && page_count(page(txn_root_)) == 1){
+                    uint64_t old = txn_root_;
+                    txn_root_ = branch_child(page(old), 0);
+                    release(old);
+                }
+            } else {
+                vector<BranchEntry> top = {{"", pieces[0].second}, {pieces[1].first, pieces[1].second}};
+                txn_root_ = alloc();
+                encode_page(page(txn_root_), PAGE_BRANCH, top, 0, top.size());
+            }
+            txn_changed_ = true;
+            return Status::OK();
+        }
+
+        /* ---------------- open ---------------- */
+
+        void mark(uint64_t no, vector<bool> &used) const {
+            used[no] = true;
+            const char* p = page(no);
+            int n = page_count(p);
+            for(int i = 0; i < n; i++){
+                if(page_flags(p) == PAGE_BRANCH){
+                    mark(branch_child(p, i), used);
+                    continue;
+                }
+                const char* e = entry_at(p, i);
+                if(!e[2]) continue;
+                uint64_t first = get64(e + 7 + get16(e));
+                uint64_t pages = (get32(e + 3) + PAGE_SIZE - 1) / PAGE_SIZE;
+                for(uint64_t j = 0; j < pages; j++) used[first + j] = true;
+            }
+        }
+
+    public:
+        BTreeEngine(const Options &options)
+            :options_(options),
+             env_(options.env ? options.env : DefaultEnv()){}
+
+        Status open(){
+            // pages are laid out bytewise
+            if(options_.secondary || !options_.replication_listen.empty() || !options_.replicate_from.empty() ||
+               options_.comparator != BytewiseComparator()){
+                return Status::NotSupported();
+            }
+            env_->createDir(options_.path);
+            Status s = env_->lockFile(options_.path + "/LOCK", &lock_);
+            if(!s.ok()) return s;
+            s = env_->newMmapFile(options_.path + "/btree.db", options_.btree_map_size, &map_);
+            if(!s.ok()) return s;
+            base_ = map_->base();
+
+            if(map_->size() == 0){
+                s = map_->grow(2 * PAGE_SIZE);
+                if(!s.ok()) return s;
+                MetaPage m;
+                memset(&m, 0, sizeof(m));
+                m.magic = META_MAGIC;
+                m.page_size = PAGE_SIZE;
+                m.txnid = 1;
+                m.npages = 2;
+                m.crc = meta_crc(m);
+                memcpy(page(1), &m, sizeof(m));
+                s = map_->sync(0, 2 * PAGE_SIZE);
+                if(!s.ok()) return s;
+            }
+
+            const MetaPage* current = nullptr;
+            for(int i = 0; i < 2 && map_->size() >= 2 * PAGE_SIZE; i++){
+                const MetaPage* m = reinterpret_cast<const MetaPage*>(page(i));
+                if(m->magic != META_MAGIC || m->page_size != PAGE_SIZE || m->crc != meta_crc(*m)) continue;
+                if(m->npages * PAGE_SIZE > map_->size()) continue;
+                if(current == nullptr || m->txnid > current->txnid) current = m;
+            }
+            if(current == nullptr) return Status::Corruption("BTREE_CORRUPTED");
+
+            root_ = current->root;
+            npages_ = current->npages;
+            uint64_t t = current->txnid;
+            published_[t % 2].root.store(root_);
+            published_[t % 2].txnid.store(t);
+            latest_.store(t);
+
+            vector<bool> used(npages_, false);
+            if(root_ != 0) mark(root_, used);
+            for(uint64_t no = npages_; no-- > 2;){
+                if(!used[no]) free_.push_back(no);
+            }
+            return Status::OK();
+        }
+
+        ~BTreeEngine(){
+            delete map_;
+            if(lock_ != nullptr){
+                env_->unlockFile(lock_);
+            }
+        }
+
+        Status put(const string &key, const string &value) override{
+            lock_guard<mutex> wlock(write_mu_);
+            begin_write();
+            bool found;
+            Status s = apply(key, &value, &found);
+            if(!s.ok()){
+                abort_write();
+                return s;
+            }
+            return commit_write();
+        }
+
+        Status get(const string &key, string* value) override{
+            uint64_t root;
+            int slot = begin_read(&root);
+            Status s = lookup(root, key, value);
+            end_read(slot);
+            return s;
+        }
+
+        Status del(const string &key) override{
+            lock_guard<mutex> wlock(write_mu_);
+            begin_write();
+            bool found;
+            Status s = apply(key, nullptr, &found);
+            if(s.ok() && !found) s = Status::NotFound();
+            if(!s.ok()){
+                abort_write();
+                return s;
+            }
+            return commit_write();
+        }
+
+        // The whole batch is one transaction: it commits entirely or not
+        // at all.
+        Status write(const WriteBatch &batch) override{
+            lock_guard<mutex> wlock(write_mu_);
+            begin_write();
+            for(const auto &op : batch.ops()){
+                bool found;
+                Status s = apply(op.key, op.type == WalOpType::PUT ? &op.value : nullptr, &found);
+                if(!s.ok()){
+                    abort_write();
+                    return s;
+                }
+            }
+            return commit_write();
+        }
+
+        // Every key is read from the same snapshot.
+        vector<Status> multi_get(const vector<string> &keys, vector<string>* values) override{
+            values->assign(keys.size(), "");
+            vector<Status> statuses(keys.size());
+            uint64_t root;
+            int slot = begin_read(&root);
+            for(size_t i = 0; i < keys.size(); i++){
+                statuses[i] = lookup(root, keys[i], &(*values)[i]);
+            }
+            end_read(slot);
+            return statuses;
+        }
+
+        Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) override{
+            out->clear();
+            uint64_t root;
+            int slot = begin_read(&root);
+            if(root != 0 && limit > 0){
+                vector<pair<const char*, int>> path;
+                const char* leaf;
+                int i;
+                seek(root, start, &leaf, &i, &path);
+                while(true){
+                    for(; i < page_count(leaf) && out->size() < limit; i++){
+                        string value;
+                        read_value(leaf, i, &value);
+                        out->emplace_back(string(leaf_key(leaf, i)), move(value));
+                    }
+                    if(out->size() >= limit) break;
+
+                    // up to the nearest branch with a next child, then down
+                    // its leftmost edge
+                    while(!path.empty() && path.back().second + 1 >= page_count(path.back().first)){
+                        path.pop_back();
+                    }
+                    if(path.empty()) break;
+                    const char* p = page(branch_child(path.back().first, ++path.back().second));
+                    while(page_flags(p) == PAGE_BRANCH){
+                        path.emplace_back(p, 0);
+                        p = page(branch_child(p, 0));
+                    }
+                    leaf = p;
+                    i = 0;
+                }
+            }
+            end_read(slot);
+            return Status::OK();
+        }
+
+        Status get_updates_since(uint64_t, UpdateIterator**) override{
+            return Status::NotSupported();
+        }
+
+        // The file up to the last committed page is a consistent database.
+        Status create_checkpoint(const string &dir) override{
+            if(env_->fileExists(dir)) return Status::InvalidArgument("CHECKPOINT_EXISTS");
+            lock_guard<mutex> wlock(write_mu_);
+            Status s = env_->createDir(dir);
+            if(s.ok()) s = CopyFile(env_, options_.path + "/btree.db", dir + "/btree.db", npages_ * PAGE_SIZE);
+            return s;
+        }
+
+        Status catch_up_with_primary() override{
+            return Status::NotSupported("NOT_SECONDARY");
+        }
+};
+
+KVEngine* CreateBTreeEngine(const Options &options) {
+    BTreeEngine* engine = new BTreeEngine(options);
+    if(!engine->open().ok()){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
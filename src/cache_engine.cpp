@@ -0,0 +1,368 @@
+#include "cache_engine.h"
+#include "batch_find.h"
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+struct CacheEntry;
+typedef list<CacheEntry*> Queue;
+
+struct CacheEntry {
+    string key;
+    string value;
+    atomic<uint8_t> freq{0};    // CLOCK reference bit, S3-FIFO hit count (max 3)
+    bool in_main = false;       // S3-FIFO: which queue holds it
+    Queue::iterator pos;
+};
+
+// Memory charged per entry on top of its key and value: the entry, its
+// queue node and its hash map node.
+static const size_t ENTRY_OVERHEAD = sizeof(CacheEntry) + 64;
+
+static size_t charge(const CacheEntry &e){
+    return e.key.size() + e.value.size() + ENTRY_OVERHEAD;
+}
+
+/* ---------------- eviction policies ---------------- */
+
+// Orders the entries of one shard. Called under the shard lock, except
+// onHit, which runs under a shared lock unless hitNeedsExclusive().
+class Policy {
+    public:
+        virtual ~Policy() = default;
+        virtual bool hitNeedsExclusive() const { return false; }
+        virtual void onInsert(CacheEntry* e) = 0;
+        virtual void onHit(CacheEntry* e) = 0;
+        virtual void onErase(CacheEntry* e) = 0;
+        // Picks the next entry to drop and unlinks it.
+        virtual CacheEntry* evict() = 0;
+};
+
+class LruPolicy : public Policy {
+    Queue q_;   // most recent first
+    public:
+        bool hitNeedsExclusive() const override { return true; }
+        void onInsert(CacheEntry* e) override { e->pos = q_.insert(q_.begin(), e); }
+        void onHit(CacheEntry* e) override { q_.splice(q_.begin(), q_, e->pos); }
+        void onErase(CacheEntry* e) override { q_.erase(e->pos); }
+        CacheEntry* evict() override{
+            CacheEntry* e = q_.back();
+            q_.pop_back();
+            return e;
+        }
+};
+
+class ClockPolicy : public Policy {
+    Queue q_;   // the hand is at the front
+    public:
+        void onInsert(CacheEntry* e) override { e->pos = q_.insert(q_.end(), e); }
+        void onHit(CacheEntry* e) override { e->freq.store(1, memory_order_relaxed); }
+        void onErase(CacheEntry* e) override { q_.erase(e->pos); }
+        CacheEntry* evict() override{
+            while(q_.front()->freq.load(memory_order_relaxed)){
+                q_.front()->freq.store(0, memory_order_relaxed);
+                q_.splice(q_.end(), q_, q_.begin());
+            }
+            CacheEntry* e = q_.front();
+            q_.pop_front();
+            return e;
+        }
+};
+
+class S3FifoPolicy : public Policy {
+    Queue small_, main_;        // newest at the front
+    size_t small_bytes_ = 0;
+    size_t small_limit_;        // 10% of the shard
+    // Key hashes evicted from small, oldest first, each once, and where
+    // each is in that list, so a ghost hit drops it from both.
+    list<size_t> ghost_fifo_;
+    unordered_map<size_t, list<size_t>::iterator> ghost_;
+    hash<string> hasher_;
+
+    void to_main(CacheEntry* e){
+        e->in_main = true;
+        e->freq.store(0, memory_order_relaxed);
+        e->pos = main_.insert(main_.begin(), e);
+    }
+
+    public:
+        explicit S3FifoPolicy(size_t capacity) : small_limit_(capacity / 10) {}
+
+        void onInsert(CacheEntry* e) override{
+            auto g = ghost_.find(hasher_(e->key));
+            if(g != ghost_.end()){
+                ghost_fifo_.erase(g->second);
+                ghost_.erase(g);
+                to_main(e);
+                return;
+            }
+            e->in_main = false;
+            e->pos = small_.insert(small_.begin(), e);
+            small_bytes_ += charge(*e);
+        }
+
+        void onHit(CacheEntry* e) override{
+            uint8_t f = e->freq.load(memory_order_relaxed);
+            if(f < 3) e->freq.store(f + 1, memory_order_relaxed);
+        }
+
+        void onErase(CacheEntry* e) override{
+            if(e->in_main){
+                main_.erase(e->pos);
+            } else {
+                small_.erase(e->pos);
+                small_bytes_ -= charge(*e);
+            }
+        }
+
+        CacheEntry* evict() override{
+            while(true){
+                if(!small_.empty() && (small_bytes_ >= small_limit_ || main_.empty())){
+                    CacheEntry* e = small_.back();
+                    small_.pop_back();
+                    small_bytes_ -= charge(*e);
+                    if(e->freq.load(memory_order_relaxed) > 0){
+                        to_main(e);
+                        continue;
+                    }
+                    // remembered for about as many keys as main holds
+                    size_t h = hasher_(e->key);
+                    auto g = ghost_.find(h);
+                    if(g != ghost_.end()) ghost_fifo_.erase(g->second);
+                    ghost_[h] = ghost_fifo_.insert(ghost_fifo_.end(), h);
+                    while(ghost_fifo_.size() > max<size_t>(main_.size(), 1)){
+                        ghost_.erase(ghost_fifo_.front());
+                        ghost_fifo_.pop_front();
+                    }
+                    return e;
+                }
+                CacheEntry* e = main_.back();
+                uint8_t f = e->freq.load(memory_order_relaxed);
+                if(f > 0){
+                    e->freq.store(f - 1, memory_order_relaxed);
+                    main_.splice(main_.begin(), main_, e->pos);
+                    continue;
+                }
+                main_.pop_back();
+                return e;
+            }
+        }
+};
+
+/* ---------------- engine ---------------- */
+
+class CacheEngine : public KVEngine {
+
+    private:
+        struct alignas(64) Shard {
+            shared_mutex mu;
+            unordered_map<string, unique_ptr<CacheEntry>> map;
+            unique_ptr<Policy> policy;
+            size_t capacity = 0;
+            size_t bytes = 0;
+            atomic<uint64_t> hits{0};
+            atomic<uint64_t> misses{0};
+            atomic<uint64_t> inserts{0};
+            atomic<uint64_t> evictions{0};
+        };
+
+        Options options_;
+        vector<Shard> shards_;
+        hash<string> hasher_;
+
+        Shard &shard_for(const string &key){
+            return shards_[hasher_(key) % shards_.size()];
+        }
+
+        // Caller holds s.mu exclusively.
+        Status put_locked(Shard &s, const string &key, const string &value){
+            size_t need = key.size() + value.size() + ENTRY_OVERHEAD;
+            if(need > s.capacity) return Status::InvalidArgument("CACHE_ENTRY_TOO_LARGE");
+
+            auto it = s.map.find(key);
+            if(it != s.map.end()){
+                CacheEntry* e = it->second.get();
+                s.policy->onErase(e);
+                s.bytes -= charge(*e);
+                s.map.erase(it);
+            }
+            while(s.bytes + need > s.capacity){
+                CacheEntry* victim = s.policy->evict();
+                s.bytes -= charge(*victim);
+                s.map.erase(victim->key);
+                s.evictions.fetch_add(1, memory_order_relaxed);
+            }
+
+            auto e = make_unique<CacheEntry>();
+            e->key = key;
+            e->value = value;
+            s.policy->onInsert(e.get());
+            s.bytes += need;
+            s.map.emplace(key, move(e));
+            s.inserts.fetch_add(1, memory_order_relaxed);
+            return Status::OK();
+        }
+
+        // Caller holds s.mu exclusively.
+        bool erase_locked(Shard &s, const string &key){
+            auto it = s.map.find(key);
+            if(it == s.map.end()) return false;
+            s.policy->onErase(it->second.get());
+            s.bytes -= charge(*it->second);
+            s.map.erase(it);
+            return true;
+        }
+
+        template <typename Lock>
+        Status get_locked(Shard &s, const string &key, string* value){
+            Lock lock(s.mu);
+            auto it = s.map.find(key);
+            if(it == s.map.end()){
+                s.misses.fetch_add(1, memory_order_relaxed);
+                return Status::NotFound();
+            }
+            s.policy->onHit(it->second.get());
+            *value = it->second->value;
+            s.hits.fetch_add(1, memory_order_relaxed);
+            return Status::OK();
+        }
+
+        template <typename Lock>
+        void multi_get_locked(Shard &s, const vector<string> &keys, const vector<size_t> &positions,
+                              vector<string>* values, vector<Status>* statuses){
+            Lock lock(s.mu);
+            uint64_t hits = 0;
+            BatchFind(s.map, positions.size(), [&](size_t j) -> const string& { return keys[positions[j]]; },
+                      [&](size_t j, const auto* entry){
+                if(!entry) return;
+                s.policy->onHit(entry->second.get());
+                (*values)[positions[j]] = entry->second->value;
+                (*statuses)[positions[j]] = Status::OK();
+                hits++;
+            });
+            s.hits.fetch_add(hits, memory_order_relaxed);
+            s.misses.fetch_add(positions.size() - hits, memory_order_relaxed);
+        }
+
+    public:
+        CacheEngine(const Options &options)
+            :options_(options),
+             shards_(max(1, options.cache_shards)){
+            for(auto &s : shards_){
+                s.capacity = options.cache_capacity_bytes / shards_.size();
+                switch(options.cache_eviction){
+                    case EvictionPolicy::LRU: s.policy = make_unique<LruPolicy>(); break;
+                    case EvictionPolicy::CLOCK: s.policy = make_unique<ClockPolicy>(); break;
+                    case EvictionPolicy::S3FIFO: s.policy = make_unique<S3FifoPolicy>(s.capacity); break;
+                }
+            }
+        }
+
+        Status put(const string &key, const string &value) override{
+            Shard &s = shard_for(key);
+            unique_lock<shared_mutex> lock(s.mu);
+            return put_locked(s, key, value);
+        }
+
+        Status get(const string &key, string* value) override{
+            Shard &s = shard_for(key);
+            if(s.policy->hitNeedsExclusive()) return get_locked<unique_lock<shared_mutex>>(s, key, value);
+            return get_locked<shared_lock<shared_mutex>>(s, key, value);
+        }
+
+        Status del(const string &key) override{
+            Shard &s = shard_for(key);
+            unique_lock<shared_mutex> lock(s.mu);
+            return erase_locked(s, key) ? Status::OK() : Status::NotFound();
+        }
+
+        // Applied in order, but not atomically: other threads can see part
+        // of a batch, and nothing survives a restart anyway.
+        Status write(const WriteBatch &batch) override{
+            for(const auto &op : batch.ops()){
+                Shard &s = shard_for(op.key);
+                unique_lock<shared_mutex> lock(s.mu);
+                if(op.type == WalOpType::PUT){
+                    Status st = put_locked(s, op.key, op.value);
+                    if(!st.ok()) return st;
+                } else {
+                    erase_locked(s, op.key);
+                }
+            }
+            return Status::OK();
+        }
+
+        // Each shard is locked once for all of its keys.
+        vector<Status> multi_get(const vector<string> &keys, vector<string>* values) override{
+            values->assign(keys.size(), "");
+            vector<Status> statuses(keys.size(), Status::NotFound());
+            vector<vector<size_t>> by_shard(shards_.size());
+            for(size_t i = 0; i < keys.size(); i++) by_shard[hasher_(keys[i]) % shards_.size()].push_back(i);
+            for(size_t n = 0; n < shards_.size(); n++){
+                if(by_shard[n].empty()) continue;
+                Shard &s = shards_[n];
+                if(s.policy->hitNeedsExclusive()){
+                    multi_get_locked<unique_lock<shared_mutex>>(s, keys, by_shard[n], values, &statuses);
+                } else {
+                    multi_get_locked<shared_lock<shared_mutex>>(s, keys, by_shard[n], values, &statuses);
+                }
+            }
+            return statuses;
+        }
+
+        // Sorts every cached key >= start; scans do not count as hits.
+        Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) override{
+            out->clear();
+            const Comparator* cmp = options_.comparator;
+            for(auto &s : shards_){
+                shared_lock<shared_mutex> lock(s.mu);
+                for(const auto &[key, e] : s.map){
+                    if(cmp->compare(key, start) >= 0) out->emplace_back(key, e->value);
+                }
+            }
+            size_t n = min(limit, out->size());
+            partial_sort(out->begin(), out->begin() + n, out->end(), [cmp](const auto &a, const auto &b){
+                return cmp->compare(a.first, b.first) < 0;
+            });
+            out->resize(n);
+            return Status::OK();
+        }
+
+        Status get_updates_since(uint64_t, UpdateIterator**) override{
+            return Status::NotSupported();
+        }
+
+        Status create_checkpoint(const string &) override{
+            return Status::NotSupported();
+        }
+
+        Status catch_up_with_primary() override{
+            return Status::NotSupported("NOT_SECONDARY");
+        }
+
+        EngineStats stats() override{
+            EngineStats st;
+            for(auto &s : shards_){
+                st.cache_hits += s.hits.load(memory_order_relaxed);
+                st.cache_misses += s.misses.load(memory_order_relaxed);
+                st.cache_inserts += s.inserts.load(memory_order_relaxed);
+                st.cache_evictions += s.evictions.load(memory_order_relaxed);
+                shared_lock<shared_mutex> lock(s.mu);
+                st.cache_entries += s.map.size();
+                st.cache_bytes += s.bytes;
+            }
+            return st;
+        }
+};
+
+KVEngine* CreateCacheEngine(const Options &options) {
+    if(options.cache_capacity_bytes == 0) return nullptr;
+    return new CacheEngine(options);
+}
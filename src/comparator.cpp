@@ -0,0 +1,46 @@
+#include "comparator.h"
+#include <algorithm>
+
+using namespace std;
+
+class BytewiseComparatorImpl : public Comparator {
+    public:
+        int compare(string_view a, string_view b) const override{
+            return a.compare(b);
+        }
+
+        const char* name() const override{
+            return "bytewise";
+        }
+
+        // Cuts start after the first byte where it differs from limit, and
+        // bumps that byte if it stays below limit's.
+        void findShortestSeparator(string* start, string_view limit) const override{
+            size_t n = min(start->size(), limit.size());
+            size_t diff = 0;
+            while(diff < n && (*start)[diff] == limit[diff]) diff++;
+            if(diff >= n) return;   // one is a prefix of the other
+            uint8_t b = static_cast<uint8_t>((*start)[diff]);
+            if(b < 0xff && b + 1 < static_cast<uint8_t>(limit[diff])){
+                (*start)[diff] = static_cast<char>(b + 1);
+                start->resize(diff + 1);
+            }
+        }
+
+        // The first byte that can be bumped, bumped, and nothing after it.
+        void findShortSuccessor(string* key) const override{
+            for(size_t i = 0; i < key->size(); i++){
+                uint8_t b = static_cast<uint8_t>((*key)[i]);
+                if(b != 0xff){
+                    (*key)[i] = static_cast<char>(b + 1);
+                    key->resize(i + 1);
+                    return;
+                }
+            }
+        }
+};
+
+const Comparator* BytewiseComparator(){
+    static BytewiseComparatorImpl bytewise;
+    return &bytewise;
+}
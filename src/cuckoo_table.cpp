@@ -0,0 +1,240 @@
+#include "cuckoo_table.h"
+#include <cstring>
+#include <functional>
+#include <new>
+#include <thread>
+
+using namespace std;
+
+CuckooTable::CuckooTable(size_t expected){
+    for(auto &v : versions_) v.store(0, memory_order_relaxed);
+    size_t buckets = STRIPES;
+    while(buckets * SLOTS * 9 / 10 < expected) buckets *= 2;
+    tables_.push_back(make_table(buckets));
+    table_.store(tables_.back().get(), memory_order_release);
+}
+
+uint8_t CuckooTable::tag_of(uint64_t hash){
+    uint8_t tag = hash >> 56;
+    return tag ? tag : 1;
+}
+
+// Its own inverse: alt_bucket(alt_bucket(b, tag, mask), tag, mask) == b.
+size_t CuckooTable::alt_bucket(size_t b, uint8_t tag, size_t mask){
+    return (b ^ (tag * 0x5bd1e995ULL)) & mask;
+}
+
+const CuckooTable::Entry* CuckooTable::probe(const Bucket &bucket, uint8_t tag, string_view key){
+    for(int s = 0; s < SLOTS; s++){
+        if(bucket.tags[s].load(memory_order_relaxed) != tag) continue;
+        const Entry* e = bucket.entries[s].load(memory_order_acquire);
+        if(e && e->key() == key) return e;
+    }
+    return nullptr;
+}
+
+unique_ptr<CuckooTable::Table> CuckooTable::make_table(size_t buckets){
+    auto t = make_unique<Table>();
+    t->mask = buckets - 1;
+    t->buckets = make_unique<Bucket[]>(buckets);
+    return t;
+}
+
+bool CuckooTable::find(string_view key, string* value, bool* deleted) const {
+    uint64_t h = hash<string_view>()(key);
+    uint8_t tag = tag_of(h);
+    // A bucket's stripe is its low bits, which every array size keeps.
+    size_t s1 = h & (STRIPES - 1), s2 = alt_bucket(s1, tag, STRIPES - 1);
+    const Entry* e;
+    while(true){
+        uint32_t v1 = versions_[s1].load(memory_order_acquire);
+        uint32_t v2 = versions_[s2].load(memory_order_acquire);
+        if((v1 | v2) & 1){
+            this_thread::yield();
+            continue;
+        }
+        const Table* t = table_.load(memory_order_acquire);
+        size_t b1 = h & t->mask;
+        e = probe(t->buckets[b1], tag, key);
+        if(!e) e = probe(t->buckets[alt_bucket(b1, tag, t->mask)], tag, key);
+        atomic_thread_fence(memory_order_acquire);
+        if(versions_[s1].load(memory_order_relaxed) == v1 &&
+           versions_[s2].load(memory_order_relaxed) == v2) break;
+    }
+    if(!e) return false;
+    *deleted = e->deleted;
+    if(!e->deleted) value->assign(e->value());
+    return true;
+}
+
+void CuckooTable::put(string_view key, string_view value){
+    write(key, value, false);
+}
+
+void CuckooTable::del(string_view key){
+    write(key, string_view(), true);
+}
+
+void CuckooTable::write(string_view key, string_view value, bool deleted){
+    lock_guard<mutex> lock(write_mu_);
+    uint64_t h = hash<string_view>()(key);
+    uint8_t tag = tag_of(h);
+    const Entry* e = make_entry(h, key, value, deleted);
+    uint64_t size = key.size() + value.size();
+    writes_.store(writes_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+    Table* t = tables_.back().get();
+    size_t b1 = h & t->mask;
+    for(size_t b : {b1, alt_bucket(b1, tag, t->mask)}){
+        Bucket &bucket = t->buckets[b];
+        for(int s = 0; s < SLOTS; s++){
+            const Entry* old = bucket.entries[s].load(memory_order_relaxed);
+            if(bucket.tags[s].load(memory_order_relaxed) != tag || !old || old->key() != key) continue;
+            // A reader gets the old entry or the new one, both whole, so
+            // nothing moves and no version changes.
+            bucket.entries[s].store(e, memory_order_release);
+            bytes_.store(bytes_.load(memory_order_relaxed) + size - old->key_size - old->value_size,
+                         memory_order_relaxed);
+            return;
+        }
+    }
+    while(!insert(t, e, true)){
+        grow();
+        t = tables_.back().get();
+    }
+    count_.store(count_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    bytes_.store(bytes_.load(memory_order_relaxed) + size, memory_order_relaxed);
+}
+
+const CuckooTable::Entry* CuckooTable::make_entry(uint64_t hash, string_view key, string_view value,
+                                                  bool deleted){
+    size_t size = (sizeof(Entry) + key.size() + value.size() + 7) & ~size_t(7);
+    char* p;
+    if(size > ARENA_BLOCK / 4){
+        arena_.emplace_back(new char[size]);
+        arena_bytes_ += size;
+        p = arena_.back().get();
+    } else {
+        if(size > arena_left_){
+            arena_.emplace_back(new char[ARENA_BLOCK]);
+            arena_bytes_ += ARENA_BLOCK;
+            arena_ptr_ = arena_.back().get();
+            arena_left_ = ARENA_BLOCK;
+        }
+        p = arena_ptr_;
+        arena_ptr_ += size;
+        arena_left_ -= size;
+    }
+    Entry* e = new (p) Entry{hash, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()), deleted};
+    memcpy(p + sizeof(Entry), key.data(), key.size());
+    memcpy(p + sizeof(Entry) + key.size(), value.data(), value.size());
+    return e;
+}
+
+/*
+    Breadth-first from the key's two buckets: every full bucket reached
+    adds the alternate buckets of its SLOTS entries. At the first bucket
+    with a free slot, the path to it is walked back, each entry on it
+    moving forward into the slot the previous move freed, until a slot in
+    one of the key's buckets is free. Each move copies before it clears,
+    so an entry is always in one of its buckets.
+*/
+bool CuckooTable::insert(Table* t, const Entry* e, bool visible){
+    struct Step {
+        size_t bucket;
+        int parent;     // index of the step it was reached from, -1 at the roots
+        int slot;       // slot of the parent whose entry would move here
+    };
+    Step steps[MAX_SEARCH];
+    uint8_t tag = tag_of(e->hash);
+    size_t b1 = e->hash & t->mask, b2 = alt_bucket(b1, tag, t->mask);
+    size_t n = 0;
+    steps[n++] = {b1, -1, -1};
+    if(b2 != b1) steps[n++] = {b2, -1, -1};
+
+    for(size_t i = 0; i < n; i++){
+        Bucket &bucket = t->buckets[steps[i].bucket];
+        int hole = -1;
+        for(int s = 0; s < SLOTS && hole < 0; s++){
+            if(!bucket.entries[s].load(memory_order_relaxed)) hole = s;
+        }
+        if(hole < 0){
+            for(int s = 0; s < SLOTS && n < MAX_SEARCH; s++){
+                uint8_t moving = bucket.tags[s].load(memory_order_relaxed);
+                steps[n++] = {alt_bucket(steps[i].bucket, moving, t->mask), static_cast<int>(i), s};
+            }
+            continue;
+        }
+
+        size_t j = i;
+        for(; steps[j].parent >= 0; j = steps[j].parent){
+            size_t to = steps[j].bucket, from = steps[steps[j].parent].bucket;
+            int slot = steps[j].slot;
+            Bucket &dst = t->buckets[to], &src = t->buckets[from];
+            const Entry* moving = src.entries[slot].load(memory_order_relaxed);
+            uint8_t moving_tag = src.tags[slot].load(memory_order_relaxed);
+            // a path through one bucket twice may have changed it already
+            if(!moving || alt_bucket(from, moving_tag, t->mask) != to ||
+               dst.entries[hole].load(memory_order_relaxed)) return false;
+            if(visible) begin_write(from, to);
+            dst.tags[hole].store(moving_tag, memory_order_relaxed);
+            dst.entries[hole].store(moving, memory_order_release);
+            src.entries[slot].store(nullptr, memory_order_relaxed);
+            src.tags[slot].store(0, memory_order_relaxed);
+            if(visible) end_write(from, to);
+            hole = slot;
+        }
+        Bucket &home = t->buckets[steps[j].bucket];
+        if(visible) begin_write(steps[j].bucket, steps[j].bucket);
+        home.tags[hole].store(tag, memory_order_relaxed);
+        home.entries[hole].store(e, memory_order_release);
+        if(visible) end_write(steps[j].bucket, steps[j].bucket);
+        return true;
+    }
+    return false;
+}
+
+void CuckooTable::grow(){
+    const Table* old = tables_.back().get();
+    size_t buckets = old->mask + 1;
+    unique_ptr<Table> t;
+    bool ok = false;
+    while(!ok){
+        buckets *= 2;
+        t = make_table(buckets);
+        ok = true;
+        for(size_t b = 0; ok && b <= old->mask; b++){
+            for(int s = 0; ok && s < SLOTS; s++){
+                const Entry* e = old->buckets[b].entries[s].load(memory_order_relaxed);
+                if(e) ok = insert(t.get(), e, false);
+            }
+        }
+    }
+    table_.store(t.get(), memory_order_release);
+    tables_.push_back(move(t));
+}
+
+void CuckooTable::begin_write(size_t a, size_t b){
+    size_t sa = a & (STRIPES - 1), sb = b & (STRIPES - 1);
+    versions_[sa].store(versions_[sa].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    if(sb != sa) versions_[sb].store(versions_[sb].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void CuckooTable::end_write(size_t a, size_t b){
+    size_t sa = a & (STRIPES - 1), sb = b & (STRIPES - 1);
+    versions_[sa].store(versions_[sa].load(memory_order_relaxed) + 1, memory_order_release);
+    if(sb != sa) versions_[sb].store(versions_[sb].load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+uint64_t CuckooTable::memory_usage() const {
+    lock_guard<mutex> lock(write_mu_);
+    uint64_t bytes = sizeof(*this) + arena_bytes_ + arena_.capacity() * sizeof(arena_[0]);
+    for(const auto &t : tables_) bytes += sizeof(Table) + (t->mask + 1) * sizeof(Bucket);
+    return bytes;
+}
+
+double CuckooTable::load_factor() const {
+    const Table* t = table_.load(memory_order_acquire);
+    return static_cast<double>(size()) / ((t->mask + 1) * SLOTS);
+}
@@ -0,0 +1,31 @@
+#include "env.h"
+#include <vector>
+
+using namespace std;
+
+Status CopyFile(Env* env, const string &from, const string &to, uint64_t size){
+    SequentialFile* src = nullptr;
+    if(!env->newSequentialFile(from, &src).ok()) return Status::IOError("COPY_OPEN_FAILED");
+    WritableFile* dst = nullptr;
+    if(!env->newWritableFile(to, &dst).ok()){
+        delete src;
+        return Status::IOError("COPY_OPEN_FAILED");
+    }
+
+    Status s;
+    vector<char> buf(64 * 1024);
+    while(size > 0){
+        size_t want = size < buf.size() ? size : buf.size();
+        size_t got = 0;
+        s = src->read(want, buf.data(), &got);
+        if(!s.ok() || got == 0) break;
+        s = dst->append(buf.data(), got);
+        if(!s.ok()) break;
+        size -= got;
+    }
+    if(s.ok()) s = dst->sync();
+    dst->close();
+    delete dst;
+    delete src;
+    return s;
+}
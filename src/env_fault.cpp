@@ -0,0 +1,248 @@
+#include "fault_env.h"
+#include <mutex>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+enum class IOClass {
+    READ,
+    WRITE,
+    SYNC
+};
+
+class FaultInjectionEnvImpl;
+
+/*
+    Files hold a back pointer to the env and ask it before every operation
+    whether to delay, fail or tear it.
+*/
+
+class FaultSequentialFile : public SequentialFile {
+
+    private:
+        FaultInjectionEnvImpl* env_;
+        SequentialFile* base_;
+
+    public:
+        FaultSequentialFile(FaultInjectionEnvImpl* env, SequentialFile* base) : env_(env), base_(base) {}
+
+        ~FaultSequentialFile(){
+            delete base_;
+        }
+
+        Status read(size_t n, char* scratch, size_t* bytes_read) override;
+
+        Status skip(uint64_t n) override{
+            return base_->skip(n);
+        }
+};
+
+class FaultRandomAccessFile : public RandomAccessFile {
+
+    private:
+        FaultInjectionEnvImpl* env_;
+        RandomAccessFile* base_;
+
+    public:
+        FaultRandomAccessFile(FaultInjectionEnvImpl* env, RandomAccessFile* base) : env_(env), base_(base) {}
+
+        ~FaultRandomAccessFile(){
+            delete base_;
+        }
+
+        Status pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const override;
+};
+
+class FaultWritableFile : public WritableFile {
+
+    private:
+        FaultInjectionEnvImpl* env_;
+        WritableFile* base_;
+
+    public:
+        FaultWritableFile(FaultInjectionEnvImpl* env, WritableFile* base) : env_(env), base_(base) {}
+
+        ~FaultWritableFile(){
+            delete base_;
+        }
+
+        Status append(const void* data, size_t len) override;
+        Status sync() override;
+
+        Status close() override{
+            return base_->close();
+        }
+};
+
+class FaultInjectionEnvImpl : public FaultInjectionEnv {
+
+    private:
+        mutex mu_;
+        FaultOptions options_;
+        FaultStats stats_;
+        mt19937_64 rng_;
+
+        // Per class, the time at which the simulated device becomes idle.
+        uint64_t busy_until_[3] = {0, 0, 0};
+
+        const IOProfile &profile(IOClass c) const {
+            switch(c){
+                case IOClass::READ: return options_.read;
+                case IOClass::WRITE: return options_.write;
+                default: return options_.sync;
+            }
+        }
+
+        uint64_t sampleLatency(const LatencyProfile &p){
+            double us = 0;
+            switch(p.dist){
+                case LatencyDist::NONE:
+                    return 0;
+                case LatencyDist::FIXED:
+                    return p.micros;
+                case LatencyDist::UNIFORM: {
+                    uint64_t hi = max(p.micros, p.max_micros);
+                    return uniform_int_distribution<uint64_t>(p.micros, hi)(rng_);
+                }
+                case LatencyDist::EXPONENTIAL:
+                    us = exponential_distribution<double>(p.micros > 0 ? 1.0 / p.micros : 1.0)(rng_);
+                    break;
+                case LatencyDist::PARETO: {
+                    double u = uniform_real_distribution<double>(0.0, 1.0)(rng_);
+                    us = p.micros / pow(1.0 - u, 1.0 / p.pareto_alpha);
+                    break;
+                }
+            }
+            if(p.max_micros > 0 && us > p.max_micros) us = p.max_micros;
+            return static_cast<uint64_t>(us);
+        }
+
+    public:
+        FaultInjectionEnvImpl(Env* base, const FaultOptions &options)
+            :FaultInjectionEnv(base), options_(options), rng_(options.seed){}
+
+        void setOptions(const FaultOptions &options) override{
+            lock_guard<mutex> lock(mu_);
+            options_ = options;
+            rng_.seed(options.seed);
+        }
+
+        FaultStats stats() override{
+            lock_guard<mutex> lock(mu_);
+            return stats_;
+        }
+
+        // Delays the caller for this operation and decides whether it fails.
+        Status beforeIO(IOClass c, size_t bytes){
+            uint64_t wait = 0;
+            {
+                lock_guard<mutex> lock(mu_);
+                const IOProfile &p = profile(c);
+
+                if(p.error_rate > 0 && uniform_real_distribution<double>(0.0, 1.0)(rng_) < p.error_rate){
+                    stats_.injected_errors++;
+                    return Status::IOError("INJECTED_IO_ERROR");
+                }
+
+                uint64_t now = base_->nowMicros();
+                uint64_t done = now + sampleLatency(p.latency);
+                if(p.bytes_per_sec > 0){
+                    uint64_t start = max(now, busy_until_[static_cast<int>(c)]);
+                    uint64_t transfer = bytes * 1000000ull / p.bytes_per_sec;
+                    busy_until_[static_cast<int>(c)] = start + transfer;
+                    done = max(done, start + transfer);
+                }
+                wait = done - now;
+                if(wait > 0){
+                    stats_.delayed_ops++;
+                    stats_.delay_micros += wait;
+                }
+            }
+            if(wait > 0) base_->sleepForMicros(wait);
+            return Status::OK();
+        }
+
+        // Returns how many bytes of a len-byte append actually reach the
+        // file; len means the append is not torn.
+        size_t tornLength(size_t len){
+            lock_guard<mutex> lock(mu_);
+            if(len == 0 || options_.torn_write_rate <= 0) return len;
+            if(uniform_real_distribution<double>(0.0, 1.0)(rng_) >= options_.torn_write_rate) return len;
+            stats_.torn_writes++;
+            return uniform_int_distribution<size_t>(0, len - 1)(rng_);
+        }
+
+        Status newSequentialFile(const string &path, SequentialFile** out) override{
+            SequentialFile* f = nullptr;
+            Status s = base_->newSequentialFile(path, &f);
+            if(!s.ok()) return s;
+            *out = new FaultSequentialFile(this, f);
+            return Status::OK();
+        }
+
+        Status newRandomAccessFile(const string &path, RandomAccessFile** out) override{
+            RandomAccessFile* f = nullptr;
+            Status s = base_->newRandomAccessFile(path, &f);
+            if(!s.ok()) return s;
+            *out = new FaultRandomAccessFile(this, f);
+            return Status::OK();
+        }
+
+        Status newWritableFile(const string &path, WritableFile** out) override{
+            WritableFile* f = nullptr;
+            Status s = base_->newWritableFile(path, &f);
+            if(!s.ok()) return s;
+            *out = new FaultWritableFile(this, f);
+            return Status::OK();
+        }
+
+        Status newAppendableFile(const string &path, WritableFile** out) override{
+            WritableFile* f = nullptr;
+            Status s = base_->newAppendableFile(path, &f);
+            if(!s.ok()) return s;
+            *out = new FaultWritableFile(this, f);
+            return Status::OK();
+        }
+};
+
+Status FaultSequentialFile::read(size_t n, char* scratch, size_t* bytes_read){
+    Status s = env_->beforeIO(IOClass::READ, n);
+    if(!s.ok()){
+        *bytes_read = 0;
+        return s;
+    }
+    return base_->read(n, scratch, bytes_read);
+}
+
+Status FaultRandomAccessFile::pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const{
+    Status s = env_->beforeIO(IOClass::READ, n);
+    if(!s.ok()){
+        *bytes_read = 0;
+        return s;
+    }
+    return base_->pread(offset, n, scratch, bytes_read);
+}
+
+Status FaultWritableFile::append(const void* data, size_t len){
+    Status s = env_->beforeIO(IOClass::WRITE, len);
+    if(!s.ok()) return s;
+
+    size_t keep = env_->tornLength(len);
+    if(keep < len){
+        base_->append(data, keep);
+        return Status::IOError("INJECTED_TORN_WRITE");
+    }
+    return base_->append(data, len);
+}
+
+Status FaultWritableFile::sync(){
+    Status s = env_->beforeIO(IOClass::SYNC, 0);
+    if(!s.ok()) return s;
+    return base_->sync();
+}
+
+FaultInjectionEnv* NewFaultInjectionEnv(Env* base, const FaultOptions &options){
+    return new FaultInjectionEnvImpl(base, options);
+}
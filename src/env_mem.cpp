@@ -0,0 +1,351 @@
+#include "env.h"
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+/*
+    Files are reference-counted byte strings, so a file that is deleted or
+    renamed while open stays readable through existing handles, the same as
+    an unlinked inode on POSIX.
+*/
+
+static uint64_t now_micros(){
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()
+    ).count();
+}
+
+struct MemFile {
+    mutable mutex mu;
+    string data;
+    uint64_t mtime = now_micros();
+};
+
+class MemSequentialFile : public SequentialFile {
+
+    private:
+        shared_ptr<MemFile> file_;
+        uint64_t pos_ = 0;
+
+    public:
+        MemSequentialFile(shared_ptr<MemFile> file) : file_(move(file)) {}
+
+        Status read(size_t n, char* scratch, size_t* bytes_read) override{
+            lock_guard<mutex> lock(file_->mu);
+            size_t size = file_->data.size();
+            size_t avail = pos_ < size ? size - pos_ : 0;
+            size_t len = n < avail ? n : avail;
+            memcpy(scratch, file_->data.data() + pos_, len);
+            pos_ += len;
+            *bytes_read = len;
+            return Status::OK();
+        }
+
+        Status skip(uint64_t n) override{
+            pos_ += n;
+            return Status::OK();
+        }
+};
+
+class MemRandomAccessFile : public RandomAccessFile {
+
+    private:
+        shared_ptr<MemFile> file_;
+
+    public:
+        MemRandomAccessFile(shared_ptr<MemFile> file) : file_(move(file)) {}
+
+        Status pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const override{
+            lock_guard<mutex> lock(file_->mu);
+            size_t size = file_->data.size();
+            size_t avail = offset < size ? size - offset : 0;
+            size_t len = n < avail ? n : avail;
+            memcpy(scratch, file_->data.data() + offset, len);
+            *bytes_read = len;
+            return Status::OK();
+        }
+};
+
+class MemWritableFile : public WritableFile {
+
+    private:
+        shared_ptr<MemFile> file_;
+
+    public:
+        MemWritableFile(shared_ptr<MemFile> file) : file_(move(file)) {}
+
+        Status append(const void* data, size_t len) override{
+            lock_guard<mutex> lock(file_->mu);
+            file_->data.append(static_cast<const char*>(data), len);
+            file_->mtime = now_micros();
+            return Status::OK();
+        }
+
+        Status sync() override{
+            return Status::OK();
+        }
+
+        Status close() override{
+            return Status::OK();
+        }
+};
+
+class MemFileLock : public FileLock {
+    public:
+        string path;
+};
+
+// The file's buffer is reserved at map_size so growing it never moves it.
+class MemMmapFile : public MmapFile {
+
+    private:
+        shared_ptr<MemFile> file_;
+        uint64_t map_size_;
+
+    public:
+        MemMmapFile(shared_ptr<MemFile> file, uint64_t map_size) : file_(move(file)), map_size_(map_size) {
+            lock_guard<mutex> lock(file_->mu);
+            file_->data.reserve(map_size);
+        }
+
+        char* base() const override{
+            return &file_->data[0];
+        }
+
+        uint64_t size() const override{
+            lock_guard<mutex> lock(file_->mu);
+            return file_->data.size();
+        }
+
+        Status grow(uint64_t size) override{
+            if(size > map_size_) return Status::IOError("MAP_FULL");
+            lock_guard<mutex> lock(file_->mu);
+            if(size > file_->data.size()) file_->data.resize(size, '\0');
+            file_->mtime = now_micros();
+            return Status::OK();
+        }
+
+        Status sync(uint64_t, uint64_t) override{
+            return Status::OK();
+        }
+};
+
+class MemReadOnlyMmapFile : public ReadOnlyMmapFile {
+
+    private:
+        shared_ptr<MemFile> file_;
+        uint64_t size_;
+
+    public:
+        MemReadOnlyMmapFile(shared_ptr<MemFile> file, uint64_t size) : file_(move(file)), size_(size) {}
+
+        const char* base() const override{
+            return file_->data.data();
+        }
+
+        uint64_t size() const override{
+            return size_;
+        }
+};
+
+class MemEnv : public Env {
+
+    private:
+        mutex mu_;
+        map<string, shared_ptr<MemFile>> files_;
+        set<string> dirs_;
+        set<string> locked_;
+
+        shared_ptr<MemFile> find(const string &path){
+            lock_guard<mutex> lock(mu_);
+            auto it = files_.find(path);
+            return it == files_.end() ? nullptr : it->second;
+        }
+
+    public:
+        Status newSequentialFile(const string &path, SequentialFile** out) override{
+            shared_ptr<MemFile> f = find(path);
+            if(!f) return Status::IOError("FILE_OPEN_FAILED");
+            *out = new MemSequentialFile(f);
+            return Status::OK();
+        }
+
+        Status newRandomAccessFile(const string &path, RandomAccessFile** out) override{
+            shared_ptr<MemFile> f = find(path);
+            if(!f) return Status::IOError("FILE_OPEN_FAILED");
+            *out = new MemRandomAccessFile(f);
+            return Status::OK();
+        }
+
+        Status newWritableFile(const string &path, WritableFile** out) override{
+            lock_guard<mutex> lock(mu_);
+            auto f = make_shared<MemFile>();
+            files_[path] = f;
+            *out = new MemWritableFile(f);
+            return Status::OK();
+        }
+
+        Status newAppendableFile(const string &path, WritableFile** out) override{
+            lock_guard<mutex> lock(mu_);
+            auto &f = files_[path];
+            if(!f) f = make_shared<MemFile>();
+            *out = new MemWritableFile(f);
+            return Status::OK();
+        }
+
+        Status newMmapFile(const string &path, uint64_t map_size, MmapFile** out) override{
+            shared_ptr<MemFile> f;
+            {
+                lock_guard<mutex> lock(mu_);
+                auto &slot = files_[path];
+                if(!slot) slot = make_shared<MemFile>();
+                f = slot;
+            }
+            if(f->data.size() > map_size) return Status::IOError("FILE_OPEN_FAILED");
+            *out = new MemMmapFile(f, map_size);
+            return Status::OK();
+        }
+
+        Status newReadOnlyMmapFile(const string &path, uint64_t size, ReadOnlyMmapFile** out) override{
+            shared_ptr<MemFile> f = find(path);
+            if(!f) return Status::IOError("FILE_OPEN_FAILED");
+            lock_guard<mutex> lock(f->mu);
+            if(f->data.size() < size) return Status::IOError("FILE_TOO_SHORT");
+            *out = new MemReadOnlyMmapFile(f, size);
+            return Status::OK();
+        }
+
+        bool fileExists(const string &path) override{
+            lock_guard<mutex> lock(mu_);
+            return files_.count(path) > 0 || dirs_.count(path) > 0;
+        }
+
+        Status getChildren(const string &dir, vector<string>* names) override{
+            names->clear();
+            lock_guard<mutex> lock(mu_);
+            if(dirs_.count(dir) == 0){
+                return Status::IOError("DIR_OPEN_FAILED");
+            }
+            string prefix = dir + "/";
+            auto collect = [&](const string &p){
+                if(p.compare(0, prefix.size(), prefix) != 0) return;
+                string rest = p.substr(prefix.size());
+                if(!rest.empty() && rest.find('/') == string::npos){
+                    names->push_back(rest);
+                }
+            };
+            for(const auto &[p, f] : files_) collect(p);
+            for(const auto &p : dirs_) collect(p);
+            return Status::OK();
+        }
+
+        Status getFileSize(const string &path, uint64_t* size) override{
+            shared_ptr<MemFile> f = find(path);
+            if(!f){
+                *size = 0;
+                return Status::IOError("FILE_STAT_FAILED");
+            }
+            lock_guard<mutex> lock(f->mu);
+            *size = f->data.size();
+            return Status::OK();
+        }
+
+        Status getFileModificationTime(const string &path, uint64_t* micros) override{
+            shared_ptr<MemFile> f = find(path);
+            if(!f){
+                *micros = 0;
+                return Status::IOError("FILE_STAT_FAILED");
+            }
+            lock_guard<mutex> lock(f->mu);
+            *micros = f->mtime;
+            return Status::OK();
+        }
+
+        Status deleteFile(const string &path) override{
+            lock_guard<mutex> lock(mu_);
+            if(files_.erase(path) == 0){
+                return Status::IOError("FILE_DELETE_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status renameFile(const string &from, const string &to) override{
+            lock_guard<mutex> lock(mu_);
+            auto it = files_.find(from);
+            if(it == files_.end()){
+                return Status::IOError("FILE_RENAME_FAILED");
+            }
+            files_[to] = it->second;
+            files_.erase(from);
+            return Status::OK();
+        }
+
+        Status linkFile(const string &from, const string &to) override{
+            lock_guard<mutex> lock(mu_);
+            auto it = files_.find(from);
+            if(it == files_.end() || files_.count(to) > 0){
+                return Status::IOError("LINK_FAILED");
+            }
+            files_[to] = it->second;
+            return Status::OK();
+        }
+
+        Status createDir(const string &path) override{
+            lock_guard<mutex> lock(mu_);
+            dirs_.insert(path);
+            return Status::OK();
+        }
+
+        Status deleteDir(const string &path) override{
+            lock_guard<mutex> lock(mu_);
+            string prefix = path + "/";
+            auto f = files_.lower_bound(prefix);
+            auto d = dirs_.lower_bound(prefix);
+            bool has_files = f != files_.end() && f->first.compare(0, prefix.size(), prefix) == 0;
+            bool has_dirs = d != dirs_.end() && d->compare(0, prefix.size(), prefix) == 0;
+            if(has_files || has_dirs || dirs_.erase(path) == 0){
+                return Status::IOError("DIR_DELETE_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status lockFile(const string &path, FileLock** lock) override{
+            *lock = nullptr;
+            lock_guard<mutex> guard(mu_);
+            if(!locked_.insert(path).second){
+                return Status::Busy("LOCK_HELD");
+            }
+            MemFileLock* l = new MemFileLock();
+            l->path = path;
+            *lock = l;
+            return Status::OK();
+        }
+
+        Status unlockFile(FileLock* lock) override{
+            MemFileLock* l = static_cast<MemFileLock*>(lock);
+            {
+                lock_guard<mutex> guard(mu_);
+                locked_.erase(l->path);
+            }
+            delete l;
+            return Status::OK();
+        }
+
+        uint64_t nowMicros() override{
+            return now_micros();
+        }
+
+        void sleepForMicros(uint64_t micros) override{
+            this_thread::sleep_for(chrono::microseconds(micros));
+        }
+};
+
+Env* NewMemEnv(){
+    return new MemEnv();
+}
@@ -0,0 +1,416 @@
+#include "env.h"
+#include <mutex>
+#include <set>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+class PosixSequentialFile : public SequentialFile {
+
+    private:
+        int fd_;
+
+    public:
+        PosixSequentialFile(int fd) : fd_(fd) {}
+
+        ~PosixSequentialFile(){
+            close(fd_);
+        }
+
+        Status read(size_t n, char* scratch, size_t* bytes_read) override{
+            while(true){
+                ssize_t r = ::read(fd_, scratch, n);
+                if(r < 0){
+                    if(errno == EINTR) continue;
+                    *bytes_read = 0;
+                    return Status::IOError("FILE_READ_FAILED");
+                }
+                *bytes_read = r;
+                return Status::OK();
+            }
+        }
+
+        Status skip(uint64_t n) override{
+            if(lseek(fd_, n, SEEK_CUR) < 0){
+                return Status::IOError("FILE_SEEK_FAILED");
+            }
+            return Status::OK();
+        }
+};
+
+class PosixRandomAccessFile : public RandomAccessFile {
+
+    private:
+        int fd_;
+
+    public:
+        PosixRandomAccessFile(int fd) : fd_(fd) {}
+
+        ~PosixRandomAccessFile(){
+            close(fd_);
+        }
+
+        Status pread(uint64_t offset, size_t n, char* scratch, size_t* bytes_read) const override{
+            size_t done = 0;
+            while(done < n){
+                ssize_t r = ::pread(fd_, scratch + done, n - done, offset + done);
+                if(r < 0){
+                    if(errno == EINTR) continue;
+                    *bytes_read = done;
+                    return Status::IOError("FILE_READ_FAILED");
+                }
+                if(r == 0) break; //EOF
+                done += r;
+            }
+            *bytes_read = done;
+            return Status::OK();
+        }
+};
+
+class PosixWritableFile : public WritableFile {
+
+    private:
+        int fd_;
+
+    public:
+        PosixWritableFile(int fd) : fd_(fd) {}
+
+        ~PosixWritableFile(){
+            close();
+        }
+
+        Status append(const void* data, size_t len) override{
+            const char* p = static_cast<const char*>(data);
+            while(len > 0){
+                ssize_t n = write(fd_, p, len);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0){
+                    return Status::IOError("FILE_WRITE_FAILED");
+                }
+                p += n;
+                len -= n;
+            }
+            return Status::OK();
+        }
+
+        Status sync() override{
+            if(fsync(fd_) != 0){
+                return Status::IOError("FILE_SYNC_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status close() override{
+            if(fd_ < 0) return Status::OK();
+            int r = ::close(fd_);
+            fd_ = -1;
+            return r == 0 ? Status::OK() : Status::IOError("FILE_CLOSE_FAILED");
+        }
+};
+
+class PosixMmapFile : public MmapFile {
+
+    private:
+        int fd_;
+        char* base_;
+        uint64_t size_;
+        uint64_t map_size_;
+
+    public:
+        PosixMmapFile(int fd, char* base, uint64_t size, uint64_t map_size)
+            : fd_(fd), base_(base), size_(size), map_size_(map_size) {}
+
+        ~PosixMmapFile(){
+            munmap(base_, map_size_);
+            close(fd_);
+        }
+
+        char* base() const override{
+            return base_;
+        }
+
+        uint64_t size() const override{
+            return size_;
+        }
+
+        Status grow(uint64_t size) override{
+            if(size <= size_) return Status::OK();
+            if(size > map_size_) return Status::IOError("MAP_FULL");
+            if(ftruncate(fd_, size) != 0){
+                return Status::IOError("FILE_WRITE_FAILED");
+            }
+            size_ = size;
+            return Status::OK();
+        }
+
+        Status sync(uint64_t offset, uint64_t len) override{
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            uint64_t start = offset / page * page;
+            if(msync(base_ + start, offset + len - start, MS_SYNC) != 0){
+                return Status::IOError("FILE_SYNC_FAILED");
+            }
+            return Status::OK();
+        }
+};
+
+class PosixReadOnlyMmapFile : public ReadOnlyMmapFile {
+
+    private:
+        const char* base_;
+        uint64_t size_;
+
+    public:
+        PosixReadOnlyMmapFile(const char* base, uint64_t size) : base_(base), size_(size) {}
+
+        ~PosixReadOnlyMmapFile(){
+            if(size_ > 0) munmap(const_cast<char*>(base_), size_);
+        }
+
+        const char* base() const override{
+            return base_;
+        }
+
+        uint64_t size() const override{
+            return size_;
+        }
+};
+
+class PosixFileLock : public FileLock {
+    public:
+        int fd;
+        string path;
+};
+
+class PosixEnv : public Env {
+
+    private:
+        // fcntl locks are per process, so locks taken by this process are
+        // tracked here to stop two engines in one process sharing a directory.
+        mutex locks_mu_;
+        set<string> locked_;
+
+        Status openFd(const string &path, int flags, int* fd){
+            *fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+            if(*fd < 0){
+                return Status::IOError("FILE_OPEN_FAILED");
+            }
+            return Status::OK();
+        }
+
+    public:
+        Status newSequentialFile(const string &path, SequentialFile** out) override{
+            int fd;
+            Status s = openFd(path, O_RDONLY, &fd);
+            if(!s.ok()) return s;
+            *out = new PosixSequentialFile(fd);
+            return Status::OK();
+        }
+
+        Status newRandomAccessFile(const string &path, RandomAccessFile** out) override{
+            int fd;
+            Status s = openFd(path, O_RDONLY, &fd);
+            if(!s.ok()) return s;
+            *out = new PosixRandomAccessFile(fd);
+            return Status::OK();
+        }
+
+        Status newWritableFile(const string &path, WritableFile** out) override{
+            int fd;
+            Status s = openFd(path, O_WRONLY | O_CREAT | O_TRUNC, &fd);
+            if(!s.ok()) return s;
+            *out = new PosixWritableFile(fd);
+            return Status::OK();
+        }
+
+        Status newAppendableFile(const string &path, WritableFile** out) override{
+            int fd;
+            Status s = openFd(path, O_WRONLY | O_CREAT | O_APPEND, &fd);
+            if(!s.ok()) return s;
+            *out = new PosixWritableFile(fd);
+            return Status::OK();
+        }
+
+        bool fileExists(const string &path) override{
+            return access(path.c_str(), F_OK) == 0;
+        }
+
+        Status getChildren(const string &dir, vector<string>* names) override{
+            names->clear();
+            DIR* d = opendir(dir.c_str());
+            if(d == nullptr){
+                return Status::IOError("DIR_OPEN_FAILED");
+            }
+            struct dirent* ent;
+            while((ent = readdir(d)) != nullptr){
+                string name = ent->d_name;
+                if(name == "." || name == "..") continue;
+                names->push_back(name);
+            }
+            closedir(d);
+            return Status::OK();
+        }
+
+        Status getFileSize(const string &path, uint64_t* size) override{
+            struct stat st;
+            if(stat(path.c_str(), &st) != 0){
+                *size = 0;
+                return Status::IOError("FILE_STAT_FAILED");
+            }
+            *size = st.st_size;
+            return Status::OK();
+        }
+
+        Status getFileModificationTime(const string &path, uint64_t* micros) override{
+            struct stat st;
+            if(stat(path.c_str(), &st) != 0){
+                *micros = 0;
+                return Status::IOError("FILE_STAT_FAILED");
+            }
+            *micros = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000 + st.st_mtim.tv_nsec / 1000;
+            return Status::OK();
+        }
+
+        Status deleteFile(const string &path) override{
+            if(unlink(path.c_str()) != 0){
+                return Status::IOError("FILE_DELETE_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status renameFile(const string &from, const string &to) override{
+            if(rename(from.c_str(), to.c_str()) != 0){
+                return Status::IOError("FILE_RENAME_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status newMmapFile(const string &path, uint64_t map_size, MmapFile** out) override{
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if(fd < 0){
+                return Status::IOError("FILE_OPEN_FAILED");
+            }
+            struct stat st;
+            if(fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) > map_size){
+                close(fd);
+                return Status::IOError("FILE_OPEN_FAILED");
+            }
+            void* base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(base == MAP_FAILED){
+                close(fd);
+                return Status::IOError("MMAP_FAILED");
+            }
+            *out = new PosixMmapFile(fd, static_cast<char*>(base), st.st_size, map_size);
+            return Status::OK();
+        }
+
+        Status newReadOnlyMmapFile(const string &path, uint64_t size, ReadOnlyMmapFile** out) override{
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0){
+                return Status::IOError("FILE_OPEN_FAILED");
+            }
+            // a shorter file would fault on the first access past its end
+            struct stat st;
+            if(fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < size){
+                close(fd);
+                return Status::IOError("FILE_TOO_SHORT");
+            }
+            void* base = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+            close(fd);
+            if(base == MAP_FAILED){
+                return Status::IOError("MMAP_FAILED");
+            }
+            *out = new PosixReadOnlyMmapFile(static_cast<const char*>(base), size);
+            return Status::OK();
+        }
+
+        Status linkFile(const string &from, const string &to) override{
+            if(link(from.c_str(), to.c_str()) != 0){
+                return Status::IOError("LINK_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status createDir(const string &path) override{
+            if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST){
+                return Status::IOError("DIR_CREATE_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status deleteDir(const string &path) override{
+            if(rmdir(path.c_str()) != 0){
+                return Status::IOError("DIR_DELETE_FAILED");
+            }
+            return Status::OK();
+        }
+
+        Status lockFile(const string &path, FileLock** lock) override{
+            *lock = nullptr;
+            {
+                lock_guard<mutex> guard(locks_mu_);
+                if(!locked_.insert(path).second){
+                    return Status::Busy("LOCK_HELD");
+                }
+            }
+
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if(fd < 0){
+                lock_guard<mutex> guard(locks_mu_);
+                locked_.erase(path);
+                return Status::IOError("FILE_OPEN_FAILED");
+            }
+
+            struct flock fl = {};
+            fl.l_type = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            if(fcntl(fd, F_SETLK, &fl) != 0){
+                close(fd);
+                lock_guard<mutex> guard(locks_mu_);
+                locked_.erase(path);
+                return Status::Busy("LOCK_HELD");
+            }
+
+            PosixFileLock* l = new PosixFileLock();
+            l->fd = fd;
+            l->path = path;
+            *lock = l;
+            return Status::OK();
+        }
+
+        Status unlockFile(FileLock* lock) override{
+            PosixFileLock* l = static_cast<PosixFileLock*>(lock);
+            struct flock fl = {};
+            fl.l_type = F_UNLCK;
+            fl.l_whence = SEEK_SET;
+            fcntl(l->fd, F_SETLK, &fl);
+            close(l->fd);
+            {
+                lock_guard<mutex> guard(locks_mu_);
+                locked_.erase(l->path);
+            }
+            delete l;
+            return Status::OK();
+        }
+
+        uint64_t nowMicros() override{
+            return chrono::duration_cast<chrono::microseconds>(
+                chrono::system_clock::now().time_since_epoch()
+            ).count();
+        }
+
+        void sleepForMicros(uint64_t micros) override{
+            this_thread::sleep_for(chrono::microseconds(micros));
+        }
+};
+
+Env* DefaultEnv(){
+    static PosixEnv* env = new PosixEnv();
+    return env;
+}
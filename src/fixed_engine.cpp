@@ -0,0 +1,610 @@
+#include "fixed_engine.h"
+#include "wal.h"
+#include "manifest.h"
+#include "write_batch.h"
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <zlib.h>
+
+using namespace std;
+
+static const uint64_t FIXED_MAGIC = 0x3178696674736166ull;  // "fastfix1"
+static const size_t FOOTER_SIZE = 32;
+
+/* ---------------- traits ---------------- */
+
+// Unsigned integer keys, stored big-endian so that byte order is numeric
+// order.
+template <typename Int>
+struct UintKey {
+    typedef Int Type;
+    static const size_t SIZE = sizeof(Int);
+
+    static Int decode(const char* p){
+        Int v;
+        memcpy(&v, p, SIZE);
+        if constexpr (SIZE == 8) return __builtin_bswap64(v);
+        else return __builtin_bswap32(v);
+    }
+    static void encode(Int v, char* p){
+        if constexpr (SIZE == 8) v = __builtin_bswap64(v);
+        else v = __builtin_bswap32(v);
+        memcpy(p, &v, SIZE);
+    }
+
+    // std::hash of an integer is the integer itself; this mixes its bits
+    // (the murmur3 finalizer) so runs of keys spread over the buckets.
+    struct Hash {
+        size_t operator()(Int k) const {
+            uint64_t x = k;
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ull;
+            x ^= x >> 33;
+            return x;
+        }
+    };
+};
+
+template <size_t N>
+struct FixedValue {
+    struct Type {
+        char bytes[N];
+    };
+    static const size_t SIZE = N;
+};
+
+/* ---------------- engine ---------------- */
+
+template <typename Key, typename Value>
+class FixedEngine : public KVEngine {
+
+    private:
+        typedef typename Key::Type K;
+        typedef typename Value::Type V;
+        static const size_t KS = Key::SIZE;
+        static const size_t VS = Value::SIZE;
+
+        struct Slot {
+            V value;
+            bool deleted;
+        };
+
+        // What flush and compaction write out.
+        struct Record {
+            K key;
+            const char* value;
+            bool deleted;
+        };
+
+        struct Segment {
+            uint64_t number = 0;
+            unique_ptr<RandomAccessFile> file;
+            vector<K> keys;
+            vector<uint8_t> tombstones;
+
+            bool deleted(size_t i) const {
+                return tombstones[i / 8] >> (i % 8) & 1;
+            }
+            uint64_t value_offset(size_t i) const {
+                return keys.size() * KS + i * VS;
+            }
+        };
+
+        Options options_;
+        Env* env_;
+        FileLock* lock_ = nullptr;
+
+        // write_mu_ serializes writers, flushes and compactions; mu_ guards
+        // mem_ and segments_, and readers hold it shared through their
+        // pread so that compaction cannot close a file underneath them.
+        mutex write_mu_;
+        shared_mutex mu_;
+        unordered_map<K, Slot, typename Key::Hash> mem_;
+        vector<unique_ptr<Segment>> segments_;  // oldest first
+
+        // Writer state, under write_mu_.
+        unique_ptr<WAL> wal_;
+        vector<uint64_t> logs_;                 // whose records mem_ holds
+        Manifest manifest_;
+        uint64_t last_seq_ = 0;
+
+        string file_name(uint64_t n, const char* ext) const {
+            char buf[40];
+            snprintf(buf, sizeof(buf), "/%06llu.%s", static_cast<unsigned long long>(n), ext);
+            return options_.path + buf;
+        }
+
+        static string layout(){
+            return "fixed.k" + to_string(KS) + ".v" + to_string(VS);
+        }
+
+        // First index whose key is >= k. The loop body compiles to a
+        // conditional move, so the search never mispredicts.
+        static size_t lower_bound(const vector<K> &keys, K k){
+            if(keys.empty()) return 0;
+            const K* base = keys.data();
+            size_t n = keys.size();
+            while(n > 1){
+                size_t half = n / 2;
+                base = base[half] < k ? base + half : base;
+                n -= half;
+            }
+            return (base - keys.data()) + (*base < k);
+        }
+
+        /* ---------------- segments ---------------- */
+
+        // Writes records, sorted by key, as segment n and opens it.
+        Status write_segment(uint64_t n, const vector<Record> &records, unique_ptr<Segment>* out){
+            size_t count = records.size();
+            size_t bitmap = (count + 7) / 8;
+            string buf(count * (KS + VS) + bitmap + FOOTER_SIZE, '\0');
+            char* keys = &buf[0];
+            char* values = keys + count * KS;
+            char* bits = values + count * VS;
+            auto seg = make_unique<Segment>();
+            seg->number = n;
+            seg->keys.resize(count);
+            for(size_t i = 0; i < count; i++){
+                Key::encode(records[i].key, keys + i * KS);
+                memcpy(values + i * VS, records[i].value, VS);
+                if(records[i].deleted) bits[i / 8] |= 1 << (i % 8);
+                seg->keys[i] = records[i].key;
+            }
+            seg->tombstones.assign(bits, bits + bitmap);
+
+            char* footer = bits + bitmap;
+            uint64_t c = count;
+            uint32_t ks = KS, vs = VS;
+            memcpy(footer, &c, 8);
+            memcpy(footer + 8, &ks, 4);
+            memcpy(footer + 12, &vs, 4);
+            uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(buf.data()), footer + 16 - buf.data());
+            memcpy(footer + 16, &crc, 4);
+            memcpy(footer + 24, &FIXED_MAGIC, 8);
+
+            string name = file_name(n, "fix");
+            WritableFile* f = nullptr;
+            Status s = env_->newWritableFile(name, &f);
+            if(!s.ok()) return s;
+            s = f->append(buf.data(), buf.size());
+            if(s.ok()) s = f->sync();
+            f->close();
+            delete f;
+            RandomAccessFile* raw = nullptr;
+            if(s.ok()) s = env_->newRandomAccessFile(name, &raw);
+            if(!s.ok()) return s;
+            seg->file.reset(raw);
+            *out = move(seg);
+            return Status::OK();
+        }
+
+        // Reads segment n through once, checking it, and keeps its keys and
+        // tombstones.
+        Status load_segment(uint64_t n, unique_ptr<Segment>* out){
+            string name = file_name(n, "fix");
+            uint64_t size = 0;
+            RandomAccessFile* raw = nullptr;
+            Status s = env_->getFileSize(name, &size);
+            if(s.ok()) s = env_->newRandomAccessFile(name, &raw);
+            if(!s.ok()) return s;
+            auto seg = make_unique<Segment>();
+            seg->number = n;
+            seg->file.reset(raw);
+
+            string buf(size, '\0');
+            size_t got = 0;
+            if(size < FOOTER_SIZE || !raw->pread(0, size, &buf[0], &got).ok() || got != size){
+                return Status::Corruption("FIXED_SEGMENT_CORRUPTED");
+            }
+            const char* footer = buf.data() + size - FOOTER_SIZE;
+            uint64_t count, magic;
+            uint32_t ks, vs, crc;
+            memcpy(&count, footer, 8);
+            memcpy(&ks, footer + 8, 4);
+            memcpy(&vs, footer + 12, 4);
+            memcpy(&crc, footer + 16, 4);
+            memcpy(&magic, footer + 24, 8);
+            if(magic != FIXED_MAGIC || ks != KS || vs != VS || count > size ||
+               count * (KS + VS) + (count + 7) / 8 + FOOTER_SIZE != size ||
+               crc != crc32(0, reinterpret_cast<const Bytef*>(buf.data()), footer + 16 - buf.data())){
+                return Status::Corruption("FIXED_SEGMENT_CORRUPTED");
+            }
+            seg->keys.resize(count);
+            for(size_t i = 0; i < count; i++) seg->keys[i] = Key::decode(buf.data() + i * KS);
+            const char* bits = buf.data() + count * (KS + VS);
+            seg->tombstones.assign(bits, bits + (count + 7) / 8);
+            *out = move(seg);
+            return Status::OK();
+        }
+
+        Status read_value(const Segment &s, size_t i, string* value){
+            value->resize(VS);
+            size_t got = 0;
+            if(!s.file->pread(s.value_offset(i), VS, &(*value)[0], &got).ok() || got != VS){
+                return Status::IOError("FILE_READ_FAILED");
+            }
+            return Status::OK();
+        }
+
+        // Newest first: the memtable, then segments newest to oldest. value
+        // may be nullptr to only learn whether k is live. Caller holds mu_.
+        Status lookup(K k, string* value){
+            auto it = mem_.find(k);
+            if(it != mem_.end()){
+                if(it->second.deleted) return Status::NotFound();
+                if(value) value->assign(it->second.value.bytes, VS);
+                return Status::OK();
+            }
+            for(auto seg = segments_.rbegin(); seg != segments_.rend(); ++seg){
+                const Segment &s = **seg;
+                size_t i = lower_bound(s.keys, k);
+                if(i == s.keys.size() || s.keys[i] != k) continue;
+                if(s.deleted(i)) return Status::NotFound();
+                return value ? read_value(s, i, value) : Status::OK();
+            }
+            return Status::NotFound();
+        }
+
+        /* ---------------- writes ---------------- */
+
+        // Caller holds write_mu_ and mu_ exclusively.
+        void apply(K k, const string* value){
+            Slot &slot = mem_[k];
+            slot.deleted = value == nullptr;
+            if(value) memcpy(slot.value.bytes, value->data(), VS);
+        }
+
+        // Caller holds write_mu_, so mem_ only changes here.
+        Status maybe_flush(){
+            if(mem_.size() < options_.mem_limit) return Status::OK();
+            vector<Record> records;
+            records.reserve(mem_.size());
+            for(const auto &[k, slot] : mem_) records.push_back(Record{k, slot.value.bytes, slot.deleted});
+            sort(records.begin(), records.end(), [](const Record &a, const Record &b){ return a.key < b.key; });
+
+            Manifest m = manifest_;
+            uint64_t number = m.next_file++;
+            uint64_t log = m.next_file++;
+            unique_ptr<Segment> seg;
+            Status s = write_segment(number, records, &seg);
+            if(!s.ok()) return s;
+            m.segments.push_back(number);
+            m.log_number = log;
+            m.last_sequence = last_seq_;
+            // if this fails the segment is deleted by the next open
+            s = write_manifest(env_, options_.path, m);
+            if(!s.ok()) return s;
+            manifest_ = m;
+
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                segments_.push_back(move(seg));
+                mem_.clear();
+            }
+            wal_.reset(CreateWAL(env_, file_name(log, "log")));
+            for(uint64_t n : logs_) env_->deleteFile(file_name(n, "log"));
+            logs_ = {log};
+
+            if(segments_.size() >= max<size_t>(2, options_.compaction_threshold)) return compact();
+            return Status::OK();
+        }
+
+        // Merges every segment into one. The newest record of each key wins
+        // and tombstones are dropped: nothing older is left for them to hide.
+        Status compact(){
+            size_t n = segments_.size();
+            vector<string> values(n);
+            for(size_t i = 0; i < n; i++){
+                const Segment &s = *segments_[i];
+                values[i].resize(s.keys.size() * VS);
+                size_t got = 0;
+                if(!s.file->pread(s.value_offset(0), values[i].size(), &values[i][0], &got).ok() ||
+                   got != values[i].size()){
+                    return Status::IOError("FILE_READ_FAILED");
+                }
+            }
+
+            vector<Record> out;
+            vector<size_t> pos(n, 0);
+            while(true){
+                bool any = false;
+                K k{};
+                for(size_t i = 0; i < n; i++){
+                    const auto &keys = segments_[i]->keys;
+                    if(pos[i] < keys.size() && (!any || keys[pos[i]] < k)){
+                        k = keys[pos[i]];
+                        any = true;
+                    }
+                }
+                if(!any) break;
+                bool decided = false;
+                for(size_t i = n; i-- > 0;){
+                    const Segment &s = *segments_[i];
+                    if(pos[i] == s.keys.size() || s.keys[pos[i]] != k) continue;
+                    if(!decided && !s.deleted(pos[i])) out.push_back(Record{k, values[i].data() + pos[i] * VS, false});
+                    decided = true;
+                    pos[i]++;
+                }
+            }
+
+            Manifest m = manifest_;
+            m.segments.clear();
+            unique_ptr<Segment> seg;
+            if(!out.empty()){
+                uint64_t number = m.next_file++;
+                Status s = write_segment(number, out, &seg);
+                if(!s.ok()) return s;
+                m.segments.push_back(number);
+            }
+            Status s = write_manifest(env_, options_.path, m);
+            if(!s.ok()) return s;
+            manifest_ = m;
+
+            vector<unique_ptr<Segment>> old;
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                old.swap(segments_);
+                if(seg) segments_.push_back(move(seg));
+            }
+            for(auto &o : old){
+                o->file.reset();
+                env_->deleteFile(file_name(o->number, "fix"));
+            }
+            return Status::OK();
+        }
+
+    public:
+        FixedEngine(const Options &options)
+            :options_(options),
+             env_(options.env ? options.env : DefaultEnv()){}
+
+        Status open(){
+            if(options_.secondary || !options_.replication_listen.empty() || !options_.replicate_from.empty() ||
+               options_.comparator != BytewiseComparator()){
+                return Status::NotSupported();
+            }
+            env_->createDir(options_.path);
+            Status s = env_->lockFile(options_.path + "/LOCK", &lock_);
+            if(!s.ok()) return s;
+
+            s = read_manifest(env_, options_.path, &manifest_);
+            if(s.isNotFound()){
+                manifest_ = Manifest();
+            } else if(!s.ok()){
+                return s;
+            } else if(manifest_.comparator != layout()){
+                return Status::InvalidArgument("LAYOUT_MISMATCH");
+            }
+
+            // Files the MANIFEST does not cover are left over from a flush
+            // or compaction that did not finish.
+            vector<string> names;
+            env_->getChildren(options_.path, &names);
+            for(const auto &name : names){
+                uint64_t n = strtoull(name.c_str(), nullptr, 10);
+                bool log = name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0;
+                bool seg = name.size() > 4 && name.compare(name.size() - 4, 4, ".fix") == 0;
+                if(log && n >= manifest_.log_number){
+                    logs_.push_back(n);
+                } else if(log || (seg && find(manifest_.segments.begin(), manifest_.segments.end(), n) ==
+                                             manifest_.segments.end())){
+                    env_->deleteFile(options_.path + "/" + name);
+                }
+            }
+            for(uint64_t n : manifest_.segments){
+                unique_ptr<Segment> seg;
+                s = load_segment(n, &seg);
+                if(!s.ok()) return s;
+                segments_.push_back(move(seg));
+            }
+
+            sort(logs_.begin(), logs_.end());
+            last_seq_ = manifest_.last_sequence;
+            for(uint64_t n : logs_){
+                uint64_t end;
+                s = ReadWalRecords(env_, file_name(n, "log"), 0,
+                                   [&](uint64_t seq, WalOpType type, const string &key, const string &value){
+                    if(key.size() != KS || (type == WalOpType::PUT && value.size() != VS)) return;
+                    apply(Key::decode(key.data()), type == WalOpType::PUT ? &value : nullptr);
+                    last_seq_ = max(last_seq_, seq);
+                }, &end);
+                if(!s.ok()) return s;
+                manifest_.next_file = max(manifest_.next_file, n + 1);
+            }
+
+            uint64_t log = manifest_.next_file++;
+            logs_.push_back(log);
+            wal_.reset(CreateWAL(env_, file_name(log, "log")));
+            manifest_.comparator = layout();
+            return write_manifest(env_, options_.path, manifest_);
+        }
+
+        ~FixedEngine(){
+            wal_.reset();
+            segments_.clear();
+            if(lock_ != nullptr){
+                env_->unlockFile(lock_);
+            }
+        }
+
+        Status put(const string &key, const string &value) override{
+            if(key.size() != KS) return Status::InvalidArgument("KEY_SIZE_MISMATCH");
+            if(value.size() != VS) return Status::InvalidArgument("VALUE_SIZE_MISMATCH");
+            lock_guard<mutex> wlock(write_mu_);
+            Status s = wal_->appendPut(last_seq_ + 1, key, value);
+            if(!s.ok()) return s;
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                apply(Key::decode(key.data()), &value);
+                last_seq_++;
+            }
+            return maybe_flush();
+        }
+
+        // Keys of another width cannot be stored, so they are never found.
+        Status get(const string &key, string* value) override{
+            if(key.size() != KS) return Status::NotFound();
+            K k = Key::decode(key.data());
+            shared_lock<shared_mutex> lock(mu_);
+            return lookup(k, value);
+        }
+
+        Status del(const string &key) override{
+            if(key.size() != KS) return Status::NotFound();
+            K k = Key::decode(key.data());
+            lock_guard<mutex> wlock(write_mu_);
+            {
+                shared_lock<shared_mutex> lock(mu_);
+                if(!lookup(k, nullptr).ok()) return Status::NotFound();
+            }
+            Status s = wal_->appendDel(last_seq_ + 1, key);
+            if(!s.ok()) return s;
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                apply(k, nullptr);
+                last_seq_++;
+            }
+            return maybe_flush();
+        }
+
+        Status write(const WriteBatch &batch) override{
+            if(batch.count() == 0) return Status::OK();
+            for(const auto &op : batch.ops()){
+                if(op.key.size() != KS) return Status::InvalidArgument("KEY_SIZE_MISMATCH");
+                if(op.type == WalOpType::PUT && op.value.size() != VS){
+                    return Status::InvalidArgument("VALUE_SIZE_MISMATCH");
+                }
+            }
+            lock_guard<mutex> wlock(write_mu_);
+            Status s = wal_->appendBatch(last_seq_ + 1, batch);
+            if(!s.ok()) return s;
+            {
+                unique_lock<shared_mutex> lock(mu_);
+                for(const auto &op : batch.ops()){
+                    apply(Key::decode(op.key.data()), op.type == WalOpType::PUT ? &op.value : nullptr);
+                }
+                last_seq_ += batch.count();
+            }
+            return maybe_flush();
+        }
+
+        vector<Status> multi_get(const vector<string> &keys, vector<string>* values) override{
+            values->assign(keys.size(), "");
+            vector<Status> statuses(keys.size());
+            shared_lock<shared_mutex> lock(mu_);
+            for(size_t i = 0; i < keys.size(); i++){
+                statuses[i] = keys[i].size() == KS ? lookup(Key::decode(keys[i].data()), &(*values)[i])
+                                                   : Status::NotFound();
+            }
+            return statuses;
+        }
+
+        // Merges the memtable's keys >= start, sorted, with a cursor per
+        // segment; the newest source holding a key decides it.
+        Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) override{
+            out->clear();
+            if(!start.empty() && start.size() != KS) return Status::InvalidArgument("KEY_SIZE_MISMATCH");
+            K from = start.empty() ? K(0) : Key::decode(start.data());
+            shared_lock<shared_mutex> lock(mu_);
+            vector<K> mem_keys;
+            for(const auto &entry : mem_){
+                if(entry.first >= from) mem_keys.push_back(entry.first);
+            }
+            sort(mem_keys.begin(), mem_keys.end());
+            size_t n = segments_.size(), mpos = 0;
+            vector<size_t> pos(n);
+            for(size_t i = 0; i < n; i++) pos[i] = lower_bound(segments_[i]->keys, from);
+
+            string key(KS, '\0');
+            while(out->size() < limit){
+                bool any = mpos < mem_keys.size();
+                K k = any ? mem_keys[mpos] : K(0);
+                for(size_t i = 0; i < n; i++){
+                    const auto &keys = segments_[i]->keys;
+                    if(pos[i] < keys.size() && (!any || keys[pos[i]] < k)){
+                        k = keys[pos[i]];
+                        any = true;
+                    }
+                }
+                if(!any) break;
+
+                bool decided = false, live = false;
+                string value;
+                if(mpos < mem_keys.size() && mem_keys[mpos] == k){
+                    const Slot &slot = mem_.find(k)->second;
+                    decided = true;
+                    live = !slot.deleted;
+                    if(live) value.assign(slot.value.bytes, VS);
+                    mpos++;
+                }
+                for(size_t i = n; i-- > 0;){
+                    const Segment &s = *segments_[i];
+                    if(pos[i] == s.keys.size() || s.keys[pos[i]] != k) continue;
+                    if(!decided){
+                        decided = true;
+                        live = !s.deleted(pos[i]);
+                        if(live){
+                            Status st = read_value(s, pos[i], &value);
+                            if(!st.ok()) return st;
+                        }
+                    }
+                    pos[i]++;
+                }
+                if(live){
+                    Key::encode(k, &key[0]);
+                    out->emplace_back(key, move(value));
+                }
+            }
+            return Status::OK();
+        }
+
+        Status get_updates_since(uint64_t, UpdateIterator**) override{
+            return Status::NotSupported();
+        }
+
+        Status create_checkpoint(const string &) override{
+            return Status::NotSupported();
+        }
+
+        Status catch_up_with_primary() override{
+            return Status::NotSupported("NOT_SECONDARY");
+        }
+};
+
+template <typename Key, typename Value>
+static KVEngine* open_fixed(const Options &options){
+    FixedEngine<Key, Value>* engine = new FixedEngine<Key, Value>(options);
+    if(!engine->open().ok()){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
+
+template <typename Key>
+static KVEngine* open_fixed_values(const Options &options){
+    switch(options.fixed_value_size){
+        case 8: return open_fixed<Key, FixedValue<8>>(options);
+        case 16: return open_fixed<Key, FixedValue<16>>(options);
+        case 32: return open_fixed<Key, FixedValue<32>>(options);
+    }
+    return nullptr;
+}
+
+KVEngine* CreateFixedEngine(const Options &options) {
+    switch(options.fixed_key_size){
+        case 4: return open_fixed_values<UintKey<uint32_t>>(options);
+        case 8: return open_fixed_values<UintKey<uint64_t>>(options);
+    }
+    return nullptr;
+}
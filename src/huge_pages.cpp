@@ -0,0 +1,78 @@
+#include "huge_pages.h"
+#include <sys/mman.h>
+
+using namespace std;
+
+// Maps a chunk, with the best kind of page on offer.
+static char* map_chunk(HugePageStats* stats){
+    const size_t size = SlabAllocator::CHUNK_SIZE;
+#ifdef MAP_HUGETLB
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED){
+        stats->hugetlb_chunks++;
+        return static_cast<char*>(p);
+    }
+#endif
+    // map twice the size and keep the aligned 2 MiB inside it, which is
+    // what a transparent huge page can back
+    void* m = mmap(nullptr, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) return nullptr;
+    char* base = static_cast<char*>(m);
+    char* chunk = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(base) + size - 1) & ~uintptr_t(size - 1));
+    if(chunk > base) munmap(base, chunk - base);
+    if(chunk + size < base + 2 * size) munmap(chunk + size, base + 2 * size - (chunk + size));
+#ifdef MADV_HUGEPAGE
+    if(madvise(chunk, size, MADV_HUGEPAGE) == 0) stats->advised_chunks++;
+#endif
+    return chunk;
+}
+
+SlabAllocator::~SlabAllocator(){
+    for(char* c : chunks_) munmap(c, CHUNK_SIZE);
+}
+
+size_t SlabAllocator::slot_size(size_t n){
+    size_t s = 64;
+    while(s < n){
+        if(s + s / 2 >= n) return s + s / 2;
+        s *= 2;
+    }
+    return s;
+}
+
+char* SlabAllocator::allocate(size_t n){
+    if(n > MAX_SLOT) return nullptr;
+    size_t slot = slot_size(n);
+    lock_guard<mutex> lock(mu_);
+    SizeClass &c = classes_[slot];
+    char* p = nullptr;
+    if(!c.free.empty()){
+        p = c.free.back();
+        c.free.pop_back();
+    } else {
+        if(c.next == nullptr || c.end - c.next < static_cast<ptrdiff_t>(slot)){
+            char* chunk = map_chunk(&stats_);
+            if(chunk == nullptr) return nullptr;
+            chunks_.push_back(chunk);
+            stats_.chunks++;
+            c.next = chunk;
+            c.end = chunk + CHUNK_SIZE;
+        }
+        p = c.next;
+        c.next += slot;
+    }
+    stats_.bytes_in_use += slot;
+    return p;
+}
+
+void SlabAllocator::release(char* p, size_t n){
+    size_t slot = slot_size(n);
+    lock_guard<mutex> lock(mu_);
+    classes_[slot].free.push_back(p);
+    stats_.bytes_in_use -= slot;
+}
+
+HugePageStats SlabAllocator::stats(){
+    lock_guard<mutex> lock(mu_);
+    return stats_;
+}
@@ -0,0 +1,84 @@
+#include "key_prefix.h"
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+uint64_t KeyPrefix(string_view key){
+    unsigned char b[8] = {0};
+    memcpy(b, key.data(), key.size() < 8 ? key.size() : 8);
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i++) v = v << 8 | b[i];
+    return v;
+}
+
+static inline uint64_t prefix_at(const char* prefixes, size_t i){
+    uint64_t v;
+    memcpy(&v, prefixes + 8 * i, 8);
+    return v;
+}
+
+static size_t count_below_scalar(const char* p, size_t n, uint64_t q){
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++) count += prefix_at(p, i) < q;
+    return count;
+}
+
+#if defined(__x86_64__)
+// AVX2 compares are signed; flipping the top bit of both sides makes them
+// order unsigned values.
+__attribute__((target("avx2")))
+static size_t count_below_avx2(const char* p, size_t n, uint64_t q){
+    const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i vq = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(q)), flip);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 8 * i));
+        __m256i lt = _mm256_cmpgt_epi64(vq, _mm256_xor_si256(v, flip));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    return count + count_below_scalar(p + 8 * i, n - i, q);
+}
+
+static size_t (*const count_below)(const char*, size_t, uint64_t) =
+    __builtin_cpu_supports("avx2") ? count_below_avx2 : count_below_scalar;
+#elif defined(__aarch64__)
+static size_t count_below(const char* p, size_t n, uint64_t q){
+    const uint64x2_t vq = vdupq_n_u64(q);
+    size_t count = 0, i = 0;
+    for(; i + 2 <= n; i += 2){
+        uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p + 8 * i)));
+        uint64x2_t lt = vcltq_u64(v, vq);
+        count += (vgetq_lane_u64(lt, 0) & 1) + (vgetq_lane_u64(lt, 1) & 1);
+    }
+    return count + count_below_scalar(p + 8 * i, n - i, q);
+}
+#else
+static size_t (*const count_below)(const char*, size_t, uint64_t) = count_below_scalar;
+#endif
+
+// Everything before base is < q and everything from base + n on is >= q,
+// so the answer is base plus the count below q in what is left. The
+// halving step compiles to a conditional move.
+template <typename Count>
+static size_t lower_bound(const char* prefixes, size_t n, uint64_t q, Count count){
+    size_t base = 0;
+    while(n > PREFIX_WINDOW){
+        size_t half = n / 2;
+        base = prefix_at(prefixes, base + half) < q ? base + half : base;
+        n -= half;
+    }
+    return base + count(prefixes + 8 * base, n, q);
+}
+
+size_t PrefixLowerBound(const char* prefixes, size_t n, uint64_t q){
+    return lower_bound(prefixes, n, q, count_below);
+}
+
+size_t PrefixLowerBoundScalar(const char* prefixes, size_t n, uint64_t q){
+    return lower_bound(prefixes, n, q, count_below_scalar);
+}
@@ -0,0 +1,188 @@
+#include "kv_client.h"
+#include "kv_protocol.h"
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+using namespace kvproto;
+
+class KVClientImpl : public KVClient {
+
+    private:
+        int fd_;
+        uint32_t next_id_ = 1;
+        string out_;
+        string in_;
+        size_t in_off_ = 0;
+
+        uint32_t begin(uint8_t op, size_t payload_len){
+            uint32_t id = next_id_++;
+            put_header(out_, op, id, payload_len);
+            return id;
+        }
+
+        Status fill(){
+            if(in_off_ > 0){
+                in_.erase(0, in_off_);
+                in_off_ = 0;
+            }
+            char buf[64 * 1024];
+            while(true){
+                ssize_t n = ::read(fd_, buf, sizeof(buf));
+                if(n > 0){
+                    in_.append(buf, n);
+                    return Status::OK();
+                }
+                if(n < 0 && errno == EINTR) continue;
+                return Status::IOError("CONNECTION_CLOSED");
+            }
+        }
+
+        Status round_trip(KVResponse* resp){
+            Status s = flush();
+            if(!s.ok()) return s;
+            return recv(resp);
+        }
+
+        static Status to_status(const KVResponse &r){
+            if(r.code == CODE_OK) return Status::OK();
+            if(r.code == CODE_NOT_FOUND) return Status::NotFound();
+            return Status::Remote(r.value);
+        }
+
+    public:
+        KVClientImpl(int fd) : fd_(fd) {}
+
+        ~KVClientImpl(){
+            close(fd_);
+        }
+
+        uint32_t sendGet(const string &key) override{
+            uint32_t id = begin(OP_GET, 4 + key.size());
+            put_str(out_, key);
+            return id;
+        }
+
+        uint32_t sendPut(const string &key, const string &value) override{
+            uint32_t id = begin(OP_PUT, 8 + key.size() + value.size());
+            put_str(out_, key);
+            put_str(out_, value);
+            return id;
+        }
+
+        uint32_t sendDel(const string &key) override{
+            uint32_t id = begin(OP_DEL, 4 + key.size());
+            put_str(out_, key);
+            return id;
+        }
+
+        uint32_t sendScan(const string &start, uint32_t limit) override{
+            uint32_t id = begin(OP_SCAN, 8 + start.size());
+            put_str(out_, start);
+            put_u32(out_, limit);
+            return id;
+        }
+
+        Status flush() override{
+            const char* p = out_.data();
+            size_t len = out_.size();
+            while(len > 0){
+                ssize_t n = ::write(fd_, p, len);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) return Status::IOError("CONNECTION_CLOSED");
+                p += n;
+                len -= n;
+            }
+            out_.clear();
+            return Status::OK();
+        }
+
+        Status recv(KVResponse* resp) override{
+            while(in_.size() - in_off_ < 4){
+                Status s = fill();
+                if(!s.ok()) return s;
+            }
+            uint32_t len = get_u32(in_.data() + in_off_);
+            if(len < 5 || len > kMaxFrame) return Status::Corruption("PROTOCOL_ERROR");
+            while(in_.size() - in_off_ < 4 + len){
+                Status s = fill();
+                if(!s.ok()) return s;
+            }
+
+            const char* p = in_.data() + in_off_ + 4;
+            const char* end = p + len;
+            in_off_ += 4 + len;
+
+            resp->code = static_cast<uint8_t>(p[0]);
+            resp->id = get_u32(p + 1);
+            resp->value.assign(p + 5, end);
+            return Status::OK();
+        }
+
+        Status get(const string &key, string* value) override{
+            sendGet(key);
+            KVResponse r;
+            Status s = round_trip(&r);
+            if(!s.ok()) return s;
+            if(r.code == CODE_OK) *value = move(r.value);
+            return to_status(r);
+        }
+
+        Status put(const string &key, const string &value) override{
+            sendPut(key, value);
+            KVResponse r;
+            Status s = round_trip(&r);
+            if(!s.ok()) return s;
+            return to_status(r);
+        }
+
+        Status del(const string &key) override{
+            sendDel(key);
+            KVResponse r;
+            Status s = round_trip(&r);
+            if(!s.ok()) return s;
+            return to_status(r);
+        }
+
+        Status scan(const string &start, uint32_t limit, vector<pair<string,string>>* out) override{
+            sendScan(start, limit);
+            KVResponse r;
+            Status s = round_trip(&r);
+            if(!s.ok()) return s;
+            if(r.code != CODE_OK) return to_status(r);
+
+            out->clear();
+            const char* p = r.value.data();
+            const char* end = p + r.value.size();
+            if(end - p < 4) return Status::Corruption("PROTOCOL_ERROR");
+            uint32_t n = get_u32(p);
+            p += 4;
+            for(uint32_t i = 0; i < n; i++){
+                string k, v;
+                if(!get_str(&p, end, &k) || !get_str(&p, end, &v)) return Status::Corruption("PROTOCOL_ERROR");
+                out->emplace_back(move(k), move(v));
+            }
+            return Status::OK();
+        }
+};
+
+KVClient* CreateKVClient(const string &host, int port){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return nullptr;
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+       connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0){
+        close(fd);
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return new KVClientImpl(fd);
+}
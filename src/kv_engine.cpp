@@ -1,214 +1,1521 @@
 #include "kv_engine.h"
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include "wal.h"
 #include "segment.h"
-#include <sstream>
-#include <unistd.h>
+#include "block_cache.h"
+#include "manifest.h"
+#include "mem_image.h"
+#include "replication.h"
+#include "bitcask.h"
+#include "btree.h"
+#include "cache_engine.h"
+#include "fixed_engine.h"
+#include "write_batch.h"
+#include "batch_find.h"
+#include "cuckoo_table.h"
 #include <shared_mutex>
-#include <fcntl.h>
-#include <filesystem>
-#include <cstring>
-#include <zlib.h>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
 
 using namespace std;
 
-class KVEngineImpl : public KVEngine {
+// Live values plus the keys deleted since the last flush, which are
+// written out as tombstones so they also hide older segments.
+struct MemTable {
+    unordered_map<string, string> data;
+    unordered_set<string> deleted;
+    // With MemtableType::CUCKOO every entry is here instead, and data and
+    // deleted stay empty.
+    unique_ptr<CuckooTable> cuckoo;
+
+    void put(const string &key, const string &value){
+        if(cuckoo) return cuckoo->put(key, value);
+        deleted.erase(key);
+        data[key]=value;
+    }
+    void del(const string &key){
+        if(cuckoo) return cuckoo->del(key);
+        data.erase(key);
+        deleted.insert(key);
+    }
+    size_t size() const {
+        if(cuckoo) return cuckoo->size();
+        return data.size() + deleted.size();
+    }
+    // What counts toward mem_limit: the entries, or every write for a
+    // CuckooTable, where an overwritten entry keeps its memory.
+    size_t fill() const {
+        if(cuckoo) return cuckoo->writes();
+        return size();
+    }
+    // Moves the entries into a CuckooTable sized for expected keys.
+    void use_cuckoo(size_t expected){
+        cuckoo = make_unique<CuckooTable>(max(expected, size()));
+        for(const auto &[k, v] : data) cuckoo->put(k, v);
+        for(const auto &k : deleted) cuckoo->del(k);
+        data = unordered_map<string, string>();
+        deleted = unordered_set<string>();
+    }
+    // Calls fn(key, value, tombstone) for every key, in no order.
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        if(cuckoo) return cuckoo->for_each(fn);
+        for(const auto &[k, v] : data) fn(string_view(k), string_view(v), false);
+        for(const auto &k : deleted) fn(string_view(k), string_view(), true);
+    }
+    // The entries as write_segment() takes them, pointing into this.
+    vector<SegmentRecord> records() const {
+        vector<SegmentRecord> out;
+        out.reserve(size());
+        for_each([&](string_view k, string_view v, bool tombstone){ out.push_back({k, v, tombstone}); });
+        return out;
+    }
+    // Adds the entries of older, an earlier memtable, for the keys this one
+    // has no entry for.
+    void absorb_older(const MemTable &older){
+        older.for_each([&](string_view k, string_view v, bool tombstone){
+            string key(k), ignored;
+            bool deleted = false;
+            if(find(key, &ignored, &deleted) || deleted) return;
+            if(tombstone) del(key);
+            else put(key, string(v));
+        });
+    }
+    // Moves every entry of other in; the two must not share any key.
+    void absorb(MemTable &other){
+        data.merge(other.data);
+        deleted.merge(other.deleted);
+    }
+    // True with *value if the key is live here; otherwise *is_deleted is
+    // set when this memtable hides older data for the key.
+    bool find(const string &key, string* value, bool* is_deleted) const {
+        if(cuckoo){
+            bool tombstone = false;
+            if(!cuckoo->find(key, value, &tombstone)) return false;
+            *is_deleted = tombstone;
+            return !tombstone;
+        }
+        auto it=data.find(key);
+        if(it!=data.end()){
+            *value = it->second;
+            return true;
+        }
+        *is_deleted = deleted.count(key) > 0;
+        return false;
+    }
+    // find() for the keys at the positions in pending: fills in those with
+    // a value here, drops those deleted here and leaves the rest.
+    void find_batch(const vector<string> &keys, vector<size_t>* pending,
+                    vector<string>* values, vector<Status>* statuses) const {
+        if(cuckoo){
+            vector<size_t> rest;
+            for(size_t i : *pending){
+                bool tombstone = false;
+                if(!cuckoo->find(keys[i], &(*values)[i], &tombstone)) rest.push_back(i);
+                else if(!tombstone) (*statuses)[i] = Status::OK();
+            }
+            pending->swap(rest);
+            return;
+        }
+        vector<size_t> rest;
+        BatchFind(data, pending->size(), [&](size_t j) -> const string& { return keys[(*pending)[j]]; },
+                  [&](size_t j, const auto* entry){
+            size_t i = (*pending)[j];
+            if(entry){
+                (*values)[i] = entry->second;
+                (*statuses)[i] = Status::OK();
+            } else {
+                rest.push_back(i);
+            }
+        });
+        pending->clear();
+        BatchFind(deleted, rest.size(), [&](size_t j) -> const string& { return keys[rest[j]]; },
+                  [&](size_t j, const auto* entry){
+            if(!entry) pending->push_back(rest[j]);
+        });
+    }
+};
+
+// Holds mem_mu_ for a memtable update: exclusively over the maps, but
+// shared over a CuckooTable, which takes concurrent readers itself. Either
+// way writers are serialized by wal_mu_.
+class MemWriteLock {
+    shared_mutex &mu_;
+    bool shared_;
+
+    public:
+        MemWriteLock(shared_mutex &mu, bool shared) : mu_(mu), shared_(shared) {
+            if(shared_) mu_.lock_shared();
+            else mu_.lock();
+        }
+        ~MemWriteLock(){
+            if(shared_) mu_.unlock_shared();
+            else mu_.unlock();
+        }
+};
+
+class KVEngineImpl : public KVEngine, public ReplicationSource, public ReplicationSink {
 
     private:
-        unordered_map<string, string> store_;
-        vector<string> segments_;
-        size_t mem_limit = 5;
-        size_t compaction_threshold = 3;   
-        WAL* wal_;
+        Options options_;
+        Env* env_;
+        FileLock* lock_ = nullptr;
+        MemTable store_;
+        // memtable being written out by flush_memtable(), still readable
+        shared_ptr<const MemTable> imm_;
+        vector<uint64_t> segments_;
+        // Where each live segment is and its size. Changed under seg_mu_
+        // by the holder of flush_mu_ (or by recover()), who may read it
+        // without seg_mu_.
+        struct SegmentFile {
+            string dir;
+            uint64_t size;
+            uint64_t file_id;   // names it in block_cache_
+            // told apart once, at open; not known if the file was unreadable
+            bool format_known;
+            SegmentFormat format;
+            // open for as long as the segment is live, if in the plain format
+            shared_ptr<PlainSegment> plain;
+        };
+        unordered_map<uint64_t, SegmentFile> seg_files_;
+        uint64_t next_file_id_ = 1;
+        unique_ptr<SecondaryCache> secondary_cache_;
+        unique_ptr<BlockCache> block_cache_;
+        size_t mem_limit;
+        size_t compaction_threshold;
+        WAL* wal_ = nullptr;
+
+        // seq of the last record written; guarded by wal_mu_
+        uint64_t last_seq_ = 0;
+        // Guarded by flush_mu_ (and only touched by open() before that).
+        Manifest manifest_;
 
         mutable shared_mutex mem_mu_;
         mutex wal_mu_;
         mutex seg_mu_;
+        // one flush (and the compaction it may trigger) at a time
+        mutex flush_mu_;
 
-    public:
-        KVEngineImpl() :wal_(CreateWAL("wal/kv.wal")){
-            
-            wal_->replay(
-                [this](WalOpType type, const string &key, const string &value){
-                    unique_lock<shared_mutex>lock(mem_mu_);
-                    if(type==WalOpType::PUT){
-                        store_[key]=value;
-                    } else if(type==WalOpType::DEL){
-                        store_.erase(key);
+        // Leader side: the most recent WAL appends, oldest first. Every
+        // record with seq > backlog_start_ is in backlog_.
+        struct BacklogEntry {
+            uint64_t first_seq;
+            uint64_t last_seq;
+            string bytes;
+        };
+        mutex bl_mu_;
+        condition_variable bl_cv_;
+        deque<BacklogEntry> backlog_;
+        size_t backlog_bytes_ = 0;
+        uint64_t backlog_start_ = 0;
+        uint64_t backlog_last_ = 0;
+        // set at shutdown to wake backlog readers and the refresh thread
+        bool stopping_ = false;
+
+        ReplicationServer* repl_server_ = nullptr;
+        ReplicationClient* repl_client_ = nullptr;
+
+        // Secondary side: how far into the primary's logs we have read.
+        // Guarded by flush_mu_.
+        bool caught_up_once_ = false;
+        uint64_t tail_log_ = 0;
+        uint64_t tail_pos_ = 0;
+        thread refresh_thread_;
+
+        static string segment_file(const string &dir, uint64_t n){
+            return dir + "/seg_" + to_string(n) + ".sst";
+        }
+
+        static string log_file(const string &dir, uint64_t n){
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/%06llu.log", static_cast<unsigned long long>(n));
+            return dir + buf;
+        }
+
+        static string image_file(const string &dir, uint64_t n){
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/%06llu.img", static_cast<unsigned long long>(n));
+            return dir + buf;
+        }
+
+        string default_segment_dir() const {
+            return options_.path + "/segments";
+        }
+
+        string wal_dir() const {
+            return options_.wal_dir.empty() ? options_.path + "/wal" : options_.wal_dir;
+        }
+
+        // Segments not (yet) placed are looked for in path/segments.
+        string segment_name(uint64_t n) const {
+            auto it = seg_files_.find(n);
+            return segment_file(it != seg_files_.end() ? it->second.dir : default_segment_dir(), n);
+        }
+
+        string log_name(uint64_t n) const {
+            return log_file(wal_dir(), n);
+        }
+
+        string image_name(uint64_t n) const {
+            return image_file(wal_dir(), n);
+        }
+
+        string legacy_log_name() const {
+            return options_.path + "/wal/kv.wal";
+        }
+
+        bool read_only() const {
+            return !options_.replicate_from.empty() || options_.secondary;
+        }
+
+        // Parses "<digits><suffix>" after prefix; false for anything else.
+        static bool parse_number(const string &name, const string &prefix, const string &suffix, uint64_t* n){
+            if(name.size() <= prefix.size() + suffix.size()) return false;
+            if(name.compare(0, prefix.size(), prefix) != 0) return false;
+            if(name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) return false;
+            string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+            if(digits.find_first_not_of("0123456789") != string::npos) return false;
+            *n = strtoull(digits.c_str(), nullptr, 10);
+            return true;
+        }
+
+        // Numbers of the logs in wal_dir(), ascending.
+        vector<uint64_t> list_logs(){
+            vector<string> names;
+            vector<uint64_t> logs;
+            env_->getChildren(wal_dir(), &names);
+            for(const auto &name : names){
+                uint64_t n;
+                if(parse_number(name, "", ".log", &n)) logs.push_back(n);
+            }
+            sort(logs.begin(), logs.end());
+            return logs;
+        }
+
+        // Every directory a segment may be in: the db_paths, fastest first,
+        // then path/segments.
+        vector<string> segment_dirs() const {
+            vector<string> dirs;
+            for(const auto &p : options_.db_paths) dirs.push_back(p.path);
+            if(find(dirs.begin(), dirs.end(), default_segment_dir()) == dirs.end()){
+                dirs.push_back(default_segment_dir());
+            }
+            return dirs;
+        }
+
+        // Rebuilds seg_files_ for segs by looking through segment_dirs().
+        // Caller holds seg_mu_ (or is recover()).
+        void locate_segments(const vector<uint64_t> &segs){
+            vector<string> dirs = segment_dirs();
+            seg_files_.clear();
+            for(uint64_t n : segs){
+                string found = default_segment_dir();
+                for(const auto &dir : dirs){
+                    if(env_->fileExists(segment_file(dir, n))){
+                        found = dir;
+                        break;
                     }
                 }
-            );
+                add_segment_file(n, open_segment(n, found));
+            }
+        }
+
+        // Directory for a new segment of about bytes that replaces the
+        // segments in replaced: the first db_path that still holds at most
+        // its target_size with it, otherwise the last one.
+        string place_segment(uint64_t bytes, const vector<uint64_t> &replaced) const {
+            const vector<DbPath> &paths = options_.db_paths;
+            if(paths.empty()) return default_segment_dir();
+            for(size_t i = 0; i + 1 < paths.size(); i++){
+                uint64_t used = bytes;
+                for(const auto &[n, f] : seg_files_){
+                    if(f.dir != paths[i].path) continue;
+                    if(find(replaced.begin(), replaced.end(), n) != replaced.end()) continue;
+                    used += f.size;
+                }
+                if(used <= paths[i].target_size) return paths[i].path;
+            }
+            return paths.back().path;
+        }
+
+        static uint64_t table_bytes(const MemTable &t){
+            if(t.cuckoo) return t.cuckoo->bytes();
+            uint64_t bytes = 0;
+            for(const auto &[k, v] : t.data) bytes += k.size() + v.size();
+            for(const auto &k : t.deleted) bytes += k.size();
+            return bytes;
+        }
+
+        // Tells segment n's format apart and, if it is plain, maps and
+        // indexes it; other formats are searched file by file instead.
+        SegmentFile open_segment(uint64_t n, const string &dir){
+            SegmentFile f{dir, 0, 0, false, SegmentFormat::BLOCK, nullptr};
+            string path = segment_file(dir, n);
+            env_->getFileSize(path, &f.size);
+            f.format_known = ReadSegmentFormat(env_, path, &f.format).ok();
+            if(f.format_known && f.format == SegmentFormat::PLAIN){
+                PlainSegment* p = nullptr;
+                OpenPlainSegment(env_, path, &p);
+                f.plain.reset(p);
+            }
+            return f;
+        }
+
+        // Records segment n as open_segment() found it. Caller holds
+        // seg_mu_ (or is recover()).
+        void add_segment_file(uint64_t n, SegmentFile f){
+            f.file_id = next_file_id_++;
+            seg_files_[n] = move(f);
+        }
+
+        // Caller holds seg_mu_.
+        const PlainSegment* plain_segment(uint64_t n) const {
+            auto it = seg_files_.find(n);
+            return it == seg_files_.end() ? nullptr : it->second.plain.get();
+        }
+
+        // Caller holds seg_mu_ (or flush_mu_).
+        SegmentReadOptions read_options(uint64_t n) const {
+            SegmentReadOptions ro;
+            ro.comparator = options_.comparator;
+            auto it = seg_files_.find(n);
+            if(it == seg_files_.end()) return ro;
+            ro.cache = block_cache_.get();
+            ro.file_id = it->second.file_id;
+            ro.format_known = it->second.format_known;
+            ro.format = it->second.format;
+            // a flash copy of blocks already on the fast path buys nothing
+            ro.spill = options_.db_paths.size() < 2 || it->second.dir != options_.db_paths[0].path;
+            return ro;
+        }
+
+        // Only compaction output is big and long-lived enough to be worth a
+        // dictionary.
+        SegmentWriteOptions write_options(bool compaction = false) const {
+            SegmentWriteOptions wo;
+            wo.comparator = options_.comparator;
+            wo.block_size = options_.segment_block_size;
+            wo.compression = options_.segment_compression;
+            wo.format = options_.segment_format;
+            if(compaction) wo.dictionary_bytes = options_.segment_dictionary_bytes;
+            return wo;
+        }
+
+        // Logs and images restored or checkpointed into path/wal move to
+        // wal_dir when that is somewhere else.
+        void adopt_wal_files(){
+            string from = options_.path + "/wal";
+            if(wal_dir() == from) return;
+            vector<string> names;
+            env_->getChildren(from, &names);
+            for(const auto &name : names){
+                uint64_t n;
+                if(!parse_number(name, "", ".log", &n) && !parse_number(name, "", ".img", &n)) continue;
+                string src = from + "/" + name, dst = wal_dir() + "/" + name;
+                if(env_->renameFile(src, dst).ok()) continue;
+                if(CopyFile(env_, src, dst).ok()) env_->deleteFile(src);
+            }
+        }
+
+        // Caller holds wal_mu_ (or is open()).
+        void open_log(uint64_t number){
+            delete wal_;
+            wal_ = CreateWAL(env_, log_name(number));
+            if(!options_.replication_listen.empty()){
+                wal_->setAppendListener([this](const char* data, size_t len){ on_append(data, len); });
+            }
+        }
+
+        // Rebuilds segments_, store_ and last_seq_ from the MANIFEST and the
+        // logs it has not flushed, then starts a fresh log. Single-threaded
+        // (open) or called with every engine lock held (installSnapshot).
+        Status recover(){
+            adopt_wal_files();
+            Manifest m;
+            Status s = read_manifest(env_, options_.path, &m);
+            bool legacy = false;
+            if(!s.ok()){
+                if(!s.isNotFound()) return s;
+                // Directory from before the MANIFEST existed: adopt whatever
+                // segments are there and replay the single kv.wal.
+                legacy = true;
+                vector<string> names;
+                env_->getChildren(options_.path + "/segments", &names);
+                for(const auto &name : names){
+                    uint64_t n;
+                    if(parse_number(name, "seg_", ".sst", &n)) m.segments.push_back(n);
+                }
+                sort(m.segments.begin(), m.segments.end());
+                if(!m.segments.empty()) m.next_file = m.segments.back() + 1;
+            } else {
+                s = check_comparator(m);
+                if(!s.ok()) return s;
+                // Segments not in the manifest are left over from a flush or
+                // compaction that did not finish.
+                vector<string> names;
+                for(const auto &dir : segment_dirs()){
+                    env_->getChildren(dir, &names);
+                    for(const auto &name : names){
+                        uint64_t n;
+                        if(parse_number(name, "seg_", ".sst", &n) &&
+                           find(m.segments.begin(), m.segments.end(), n) == m.segments.end()){
+                            env_->deleteFile(dir + "/" + name);
+                        }
+                    }
+                }
+                // likewise images from a close that did not finish
+                env_->getChildren(wal_dir(), &names);
+                for(const auto &name : names){
+                    uint64_t n;
+                    if(parse_number(name, "", ".img", &n) && n != m.image_number){
+                        env_->deleteFile(wal_dir() + "/" + name);
+                    }
+                }
+                env_->deleteFile(legacy_log_name());
+            }
+
+            locate_segments(m.segments);
+            store_ = MemTable();
+            imm_.reset();
+            uint64_t covered = max(m.last_sequence, m.image_sequence);
+            if(m.image_number != 0){
+                uint64_t image_seq = 0;
+                s = read_mem_image(env_, image_name(m.image_number), &store_.data, &store_.deleted, &image_seq);
+                if(!s.ok()) return s;
+            }
+            last_seq_ = covered;
+
+            vector<string> paths;
+            if(legacy && env_->fileExists(legacy_log_name())){
+                paths.push_back(legacy_log_name());
+            }
+            for(uint64_t n : list_logs()){
+                if(n < m.log_number) continue;
+                paths.push_back(log_name(n));
+                m.next_file = max(m.next_file, n + 1);
+            }
+            int threads = recovery_threads();
+            vector<vector<UpdateRecord>> logs(paths.size());
+            for(size_t i = 0; i < paths.size(); i++){
+                s = ReadWalParallel(env_, paths[i], threads, &logs[i]);
+                if(!s.ok()) return s;
+            }
+            s = replay_partitioned(logs, covered, threads, &m);
+            if(!s.ok()) return s;
+            if(cuckoo()) store_.use_cuckoo(mem_limit);
+
+            segments_ = m.segments;
+            open_log(m.next_file++);
+            m.comparator = options_.comparator->name();
+            manifest_ = m;
+            return write_manifest(env_, options_.path, manifest_);
+        }
+
+        // Segments written in one key order cannot be searched in another.
+        Status check_comparator(const Manifest &m) const {
+            string have = m.comparator.empty() ? BytewiseComparator()->name() : m.comparator;
+            if(have != options_.comparator->name()){
+                return Status::InvalidArgument("COMPARATOR_MISMATCH");
+            }
+            return Status::OK();
+        }
+
+        bool cuckoo() const {
+            return options_.memtable == MemtableType::CUCKOO;
+        }
+
+        int recovery_threads() const {
+            int n = options_.recovery_threads > 0 ? options_.recovery_threads
+                                                  : static_cast<int>(thread::hardware_concurrency());
+            return max(1, min(n, 64));
+        }
+
+        // Applies decoded log records on top of store_ (the image, if any).
+        // Keys are split into one partition per thread by hash, so each
+        // thread replays its keys in log order into a private memtable and
+        // the partitions merge without conflicts. A partition that outgrows
+        // its share of mem_limit is flushed to a segment on the spot; the
+        // logs stay, so m.last_sequence does not move.
+        Status replay_partitioned(const vector<vector<UpdateRecord>> &logs, uint64_t covered,
+                                  int parts, Manifest* m){
+            hash<string> hasher;
+            vector<vector<uint8_t>> part_of(logs.size());
+            vector<MemTable> tables(parts);
+            if(parts == 1){
+                tables[0] = move(store_);
+            } else {
+                // partition ids for every record, computed in parallel
+                auto label = [&](int t){
+                    for(size_t l = 0; l < logs.size(); l++){
+                        size_t n = logs[l].size();
+                        for(size_t i = n * t / parts; i < n * (t + 1) / parts; i++){
+                            part_of[l][i] = hasher(logs[l][i].key) % parts;
+                        }
+                    }
+                };
+                for(size_t l = 0; l < logs.size(); l++) part_of[l].resize(logs[l].size());
+                vector<thread> workers;
+                for(int t = 1; t < parts; t++) workers.emplace_back(label, t);
+
+                // the image seeds each partition with its own keys
+                for(auto it = store_.data.begin(); it != store_.data.end();){
+                    auto node = store_.data.extract(it++);
+                    tables[hasher(node.key()) % parts].data.insert(move(node));
+                }
+                for(auto it = store_.deleted.begin(); it != store_.deleted.end();){
+                    auto node = store_.deleted.extract(it++);
+                    tables[hasher(node.value()) % parts].deleted.insert(move(node));
+                }
+                label(0);
+                for(auto &w : workers) w.join();
+            }
+
+            size_t budget = max<size_t>(1, mem_limit / parts);
+            mutex m_mu;
+            Status status;
+            vector<uint64_t> max_seq(parts, covered);
+            auto apply = [&](int p){
+                MemTable &t = tables[p];
+                for(size_t l = 0; l < logs.size(); l++){
+                    for(size_t i = 0; i < logs[l].size(); i++){
+                        if(parts > 1 && part_of[l][i] != p) continue;
+                        const UpdateRecord &r = logs[l][i];
+                        if(r.seq != 0 && r.seq <= covered) continue;
+                        if(r.type==WalOpType::PUT){
+                            t.put(r.key, r.value);
+                        } else {
+                            t.del(r.key);
+                        }
+                        max_seq[p] = max(max_seq[p], r.seq);
+
+                        if(t.size() >= budget){
+                            uint64_t number;
+                            string dir;
+                            {
+                                lock_guard<mutex> lock(m_mu);
+                                number = m->next_file++;
+                                dir = place_segment(table_bytes(t), {});
+                            }
+                            Status s = write_segment(env_, segment_file(dir, number), t.data, &t.deleted, write_options());
+                            SegmentFile f = s.ok() ? open_segment(number, dir) : SegmentFile();
+                            lock_guard<mutex> lock(m_mu);
+                            if(!s.ok()){
+                                status = s;
+                                return;
+                            }
+                            m->segments.push_back(number);
+                            add_segment_file(number, move(f));
+                            t = MemTable();
+                        }
+                    }
+                }
+            };
+            vector<thread> workers;
+            for(int p = 1; p < parts; p++) workers.emplace_back(apply, p);
+            apply(0);
+            for(auto &w : workers) w.join();
+            if(!status.ok()) return status;
+
+            size_t total = 0;
+            for(const auto &t : tables) total += t.data.size();
+            store_ = move(tables[0]);
+            store_.data.reserve(total);
+            for(int p = 1; p < parts; p++) store_.absorb(tables[p]);
+            last_seq_ = *max_element(max_seq.begin(), max_seq.end());
+            return Status::OK();
+        }
+
+        // Writes the memtable as an image and points the MANIFEST past every
+        // existing log, so the next open loads the image and replays nothing.
+        // The logs are then flushed ones, kept or purged by the usual rules.
+        void write_image_on_close(){
+            lock_guard<mutex> flock(flush_mu_);
+            lock_guard<mutex> wlock(wal_mu_);
+            if(store_.size()==0) return;
+
+            Manifest m = manifest_;
+            m.image_number = m.next_file++;
+            m.image_sequence = last_seq_;
+            m.log_number = m.next_file++;
+            // the image format wants the maps
+            const MemTable* image = &store_;
+            MemTable copy;
+            if(store_.cuckoo){
+                store_.for_each([&](string_view k, string_view v, bool tombstone){
+                    if(tombstone) copy.deleted.emplace(k);
+                    else copy.data.emplace(k, v);
+                });
+                image = &copy;
+            }
+            if(!write_mem_image(env_, image_name(m.image_number), image->data, image->deleted, last_seq_).ok()){
+                return;
+            }
+            if(!write_manifest(env_, options_.path, m).ok()){
+                env_->deleteFile(image_name(m.image_number));
+                return;
+            }
+            if(manifest_.image_number != 0) env_->deleteFile(image_name(manifest_.image_number));
+            manifest_ = m;
+            purge_obsolete_logs();
+        }
+
+        // Deletes flushed logs that are past the retention limits, oldest
+        // first. Caller holds flush_mu_.
+        void purge_obsolete_logs(){
+            uint64_t ttl = options_.wal_ttl_seconds * 1000000;
+            uint64_t limit = options_.wal_size_limit_bytes;
+
+            vector<uint64_t> obsolete;
+            uint64_t total = 0;
+            for(uint64_t n : list_logs()){
+                if(n >= manifest_.log_number) break;
+                uint64_t size = 0;
+                env_->getFileSize(log_name(n), &size);
+                total += size;
+                obsolete.push_back(n);
+            }
+
+            uint64_t now = env_->nowMicros();
+            for(uint64_t n : obsolete){
+                bool expired = ttl == 0 && limit == 0;
+                uint64_t mtime = 0;
+                if(ttl > 0 && env_->getFileModificationTime(log_name(n), &mtime).ok() && mtime + ttl < now){
+                    expired = true;
+                }
+                if(limit > 0 && total > limit) expired = true;
+                // logs only get younger and the total only shrinks from here
+                if(!expired) break;
+
+                uint64_t size = 0;
+                env_->getFileSize(log_name(n), &size);
+                env_->deleteFile(log_name(n));
+                total -= size;
+            }
+        }
+
+        // WAL append listener (leader only); runs under wal_mu_.
+        void on_append(const char* data, size_t len){
+            BacklogEntry e{0, 0, string(data, len)};
+            DecodeWalRecords(data, len, [&e](uint64_t seq, WalOpType, const string &, const string &){
+                if(e.first_seq == 0) e.first_seq = seq;
+                e.last_seq = seq;
+            });
+            if(e.last_seq == 0) return;
+
+            lock_guard<mutex> lock(bl_mu_);
+            backlog_bytes_ += e.bytes.size();
+            backlog_last_ = e.last_seq;
+            backlog_.push_back(move(e));
+            while(backlog_bytes_ > options_.replication_backlog_bytes && backlog_.size() > 1){
+                backlog_bytes_ -= backlog_.front().bytes.size();
+                backlog_start_ = backlog_.front().last_seq;
+                backlog_.pop_front();
+            }
+            bl_cv_.notify_all();
+        }
+
+    public:
+        KVEngineImpl(const Options &options)
+            :options_(options),
+             env_(options.env ? options.env : DefaultEnv()),
+             mem_limit(options.mem_limit),
+             compaction_threshold(options.compaction_threshold){}
+
+        Status open(){
+            if(!options_.secondary_cache_path.empty()){
+                secondary_cache_.reset(NewFileSecondaryCache(env_, options_.secondary_cache_path,
+                                                             options_.secondary_cache_bytes,
+                                                             options_.secondary_cache_compress));
+                if(!secondary_cache_) return Status::IOError("SECONDARY_CACHE_OPEN_FAILED");
+            }
+            if(options_.block_cache_bytes > 0){
+                block_cache_.reset(NewBlockCache(options_.block_cache_bytes, secondary_cache_.get(),
+                                                 options_.compressed_block_cache_bytes,
+                                                 options_.block_cache_huge_pages));
+            }
+            if(options_.secondary){
+                Status s = catch_up_with_primary();
+                if(!s.ok()) return s;
+                if(options_.secondary_refresh_ms > 0){
+                    refresh_thread_ = thread([this](){ refresh_loop(); });
+                }
+                return Status::OK();
+            }
+
+            env_->createDir(options_.path);
+            env_->createDir(wal_dir());
+            env_->createDir(options_.path + "/segments");
+            for(const auto &p : options_.db_paths) env_->createDir(p.path);
+
+            Status s = env_->lockFile(options_.path + "/LOCK", &lock_);
+            if(!s.ok()) return s;
+
+            s = recover();
+            if(!s.ok()) return s;
+            {
+                lock_guard<mutex> flock(flush_mu_);
+                purge_obsolete_logs();
+                // recovery may have flushed early
+                if(segments_.size()>=compaction_threshold){
+                    compact_segments();
+                }
+            }
+
+            if(!options_.replication_listen.empty()){
+                backlog_start_ = backlog_last_ = last_seq_;
+                repl_server_ = StartReplicationServer(this, options_.replication_listen);
+                if(repl_server_ == nullptr) return Status::IOError("REPLICATION_LISTEN_FAILED");
+            }
+            if(read_only()){
+                repl_client_ = StartReplicationClient(this, env_, options_.replicate_from);
+            }
+            return Status::OK();
         }
 
         ~KVEngineImpl(){
+            {
+                lock_guard<mutex> lock(bl_mu_);
+                stopping_ = true;
+                bl_cv_.notify_all();
+            }
+            if(refresh_thread_.joinable()) refresh_thread_.join();
+            delete repl_server_;
+            delete repl_client_;
+            if(wal_ != nullptr && options_.memtable_image_on_close){
+                write_image_on_close();
+            }
             delete wal_;
+            if(lock_ != nullptr){
+                env_->unlockFile(lock_);
+            }
         }
 
         Status put(const string & key,const string & value) override{
+            if(read_only()) return Status::Busy("READ_ONLY");
             {
+                // wal_mu_ is held through the memtable update so the
+                // memtable always reflects a prefix of the log.
                 lock_guard<mutex> wlock(wal_mu_);
-                wal_->appendPut(key, value);
-            }
-            {
-                unique_lock<shared_mutex>mlock(mem_mu_);
-                store_[key]=value;
+                Status s = wal_->appendPut(last_seq_ + 1, key, value);
+                if(!s.ok()) return s;
+                last_seq_++;
+
+                MemWriteLock mlock(mem_mu_, cuckoo());
+                store_.put(key, value);
             }
 
-            bool flush_needed=false;
+            maybe_flush();
+            return Status::OK();
+        }
 
+        Status write(const WriteBatch &batch) override{
+            if(read_only()) return Status::Busy("READ_ONLY");
+            if(batch.count()==0) return Status::OK();
             {
-                shared_lock<shared_mutex> rlock(mem_mu_);   
-                if(store_.size()>=mem_limit){
-                    flush_needed=true;
-                }
-            }
+                lock_guard<mutex> wlock(wal_mu_);
+                Status s = wal_->appendBatch(last_seq_ + 1, batch);
+                if(!s.ok()) return s;
+                last_seq_ += batch.count();
 
-            if(flush_needed){
-                flush_memtable();
+                MemWriteLock mlock(mem_mu_, cuckoo());
+                for(const auto &op : batch.ops()){
+                    if(op.type==WalOpType::PUT){
+                        store_.put(op.key, op.value);
+                    } else {
+                        store_.del(op.key);
+                    }
+                }
             }
 
+            maybe_flush();
             return Status::OK();
         }
 
         Status get(const string & key, string* value) override{
+            bool missing_file = false;
+            Status s = lookup(key, value, &missing_file);
+            // The primary compacted away a segment our MANIFEST still names.
+            if(missing_file && options_.secondary && catch_up_with_primary().ok()){
+                s = lookup(key, value, &missing_file);
+            }
+            return s;
+        }
+
+        Status lookup(const string & key, string* value, bool* missing_file){
             {
 
                 shared_lock<shared_mutex> rlock(mem_mu_);
-                auto it=store_.find(key);
-                if(it!=store_.end()){
-                    *value=it->second;
-                    return Status::OK();
-                }
+                bool deleted=false;
+                bool found=store_.find(key,value,&deleted);
+                if(!found && !deleted && imm_) found=imm_->find(key,value,&deleted);
+                if(found) return Status::OK();
+                if(deleted) return Status::NotFound();
             }
             {
                 lock_guard<mutex>slock(seg_mu_);
                 for(auto it=segments_.rbegin();it!=segments_.rend();++it){
-                    if(read_from_segment(*it,key,value))return Status::OK();
+                    Status s;
+                    if(const PlainSegment* p = plain_segment(*it)){
+                        string_view v;
+                        s = p->get(key, &v);
+                        if(s.ok()) value->assign(v);
+                    } else {
+                        s = search_segment(env_, segment_name(*it), key, value, read_options(*it));
+                    }
+                    if(s.ok()) return s;
+                    if(s.code()==StatusCode::DELETED) break;
+                    // an older segment may hold a value this one replaced
+                    if(s.code()==StatusCode::CORRUPTION) return s;
+                    if(s.code()==StatusCode::IO_ERROR) *missing_file = true;
+                }
+
+            }
+            return Status::NotFound();
+        }
+
+        vector<Status> multi_get(const vector<string> &keys, vector<string>* values) override{
+            vector<Status> statuses(keys.size(), Status::NotFound());
+            values->assign(keys.size(), string());
+
+            vector<size_t> pending(keys.size());
+            for(size_t i=0;i<keys.size();i++) pending[i]=i;
+            {
+                shared_lock<shared_mutex> rlock(mem_mu_);
+                store_.find_batch(keys, &pending, values, &statuses);
+                if(imm_) imm_->find_batch(keys, &pending, values, &statuses);
+            }
+            if(pending.empty()) return statuses;
+
+            // key -> positions still unresolved
+            unordered_map<string, vector<size_t>> missing;
+            for(size_t i : pending) missing[keys[i]].push_back(i);
+
+            // Newest segment first, each key looked up as lookup() would: a
+            // plain segment with a probe, the rest through the index and
+            // the block cache.
+            lock_guard<mutex>slock(seg_mu_);
+            for(auto it=segments_.rbegin();it!=segments_.rend() && !missing.empty();++it){
+                const PlainSegment* p = plain_segment(*it);
+                string name = segment_name(*it);
+                SegmentReadOptions ro = read_options(*it);
+                for(auto mit=missing.begin();mit!=missing.end();){
+                    string value;
+                    Status s;
+                    if(p){
+                        string_view v;
+                        s = p->get(mit->first, &v);
+                        if(s.ok()) value.assign(v);
+                    } else {
+                        s = search_segment(env_, name, mit->first, &value, ro);
+                    }
+                    if(s.code()==StatusCode::NOT_FOUND || s.code()==StatusCode::IO_ERROR){
+                        ++mit;
+                        continue;
+                    }
+                    // a tombstone or a corrupted segment settles the key too
+                    for(size_t i : mit->second){
+                        if(s.ok()) (*values)[i]=value;
+                        if(s.code()!=StatusCode::DELETED) statuses[i]=s;
+                    }
+                    mit=missing.erase(mit);
                 }
-                
             }
-            return Status::Error("KEY_NOT_FOUND");
+            return statuses;
+        }
+
+        Status scan(const string &start, size_t limit, vector<pair<string,string>>* out) override{
+            out->clear();
+            if(limit==0) return Status::OK();
+
+            // Segments are unordered, so the view is rebuilt oldest to
+            // newest with the memtable on top, as get() would resolve it.
+            const Comparator* cmp = options_.comparator;
+            map<string,string,ComparatorLess> view(ComparatorLess{cmp});
+            auto merge = [&](const unordered_map<string,string> &data, const unordered_set<string> &deleted){
+                for(const auto &k : deleted){
+                    view.erase(k);
+                }
+                for(const auto &[k,v] : data){
+                    if(cmp->compare(k, start) >= 0) view[k]=v;
+                }
+            };
+            auto merge_memtable = [&](const MemTable &t){
+                t.for_each([&](string_view k, string_view v, bool tombstone){
+                    if(tombstone) view.erase(string(k));
+                    else if(cmp->compare(k, start) >= 0) view[string(k)]=string(v);
+                });
+            };
+            {
+                lock_guard<mutex>slock(seg_mu_);
+                for(uint64_t seg : segments_){
+                    unordered_map<string,string> data;
+                    unordered_set<string> deleted;
+                    Status s = read_segment(env_,segment_name(seg),data,&deleted,read_options(seg));
+                    if(!s.ok()) return s;
+                    merge(data, deleted);
+                }
+            }
+            {
+                shared_lock<shared_mutex> rlock(mem_mu_);
+                if(imm_) merge_memtable(*imm_);
+                merge_memtable(store_);
+            }
+
+            for(auto &kv : view){
+                if(out->size()>=limit) break;
+                out->emplace_back(kv.first, move(kv.second));
+            }
+            return Status::OK();
         }
 
         Status del(const string & key) override{
+            if(read_only()) return Status::Busy("READ_ONLY");
+            string old;
+            if(!get(key, &old).ok()){
+                return Status::NotFound();
+            }
             {
 
                 lock_guard<mutex> wlock(wal_mu_);
-                wal_->appendDel(key);
+                Status s = wal_->appendDel(last_seq_ + 1, key);
+                if(!s.ok()) return s;
+                last_seq_++;
+
+                MemWriteLock lock(mem_mu_, cuckoo());
+                store_.del(key);
             }
+
+            maybe_flush();
+            return Status::OK();
+        }
+
+        void maybe_flush(){
+            bool flush_needed=false;
+
             {
-                unique_lock<shared_mutex>lock(mem_mu_);
-                auto it=store_.find(key);
-                if(it==store_.end()){
-                    return Status::Error("KEY_NOT_FOUND");
-                }   
-                store_.erase(key);
+                shared_lock<shared_mutex> rlock(mem_mu_);
+                if(store_.fill()>=mem_limit){
+                    flush_needed=true;
+                }
             }
 
-            return Status::OK();
+            if(flush_needed){
+                flush_memtable();
+            }
         }
 
         void flush_memtable(){
+            lock_guard<mutex> flock(flush_mu_);
 
-            unordered_map<string,string>snapshot;
+            shared_ptr<MemTable> snapshot = make_shared<MemTable>();
+            // becomes store_ in the swap
+            if(cuckoo()) snapshot->use_cuckoo(mem_limit);
+            uint64_t flushed_seq, new_log;
 
             {
+                // Swapping the memtable and the log together means the new
+                // log holds exactly the records the snapshot lacks.
+                lock_guard<mutex> wlock(wal_mu_);
                 unique_lock<shared_mutex>lock(mem_mu_);
-                snapshot.swap(store_);   
+                // another writer flushed while we waited
+                if(store_.fill()<mem_limit) return;
+                swap(*snapshot, store_);
+                imm_ = snapshot;
+                flushed_seq = last_seq_;
+                new_log = manifest_.next_file++;
+                open_log(new_log);
             }
 
+            uint64_t number = manifest_.next_file++;
+            string dir = place_segment(table_bytes(*snapshot), {});
+            Status s = write_segment(env_, segment_file(dir, number), snapshot->records(), write_options());
 
-            ostringstream name;
-            name << "segments/seg_"<<segments_.size()<<".sst";
-            write_segment(name.str(), snapshot);
+            // the segment now holds whatever the image did
+            Manifest before = manifest_;
+            uint64_t old_image = manifest_.image_number;
+            manifest_.segments.push_back(number);
+            manifest_.log_number = new_log;
+            manifest_.last_sequence = flushed_seq;
+            manifest_.image_number = 0;
+            manifest_.image_sequence = 0;
+            if(s.ok()) s = write_manifest(env_, options_.path, manifest_);
+            if(!s.ok()){
+                // The MANIFEST still names the logs holding the snapshot,
+                // so they stay; its entries go back under the memtable to
+                // be flushed again.
+                env_->deleteFile(segment_file(dir, number));
+                before.next_file = manifest_.next_file;
+                manifest_ = before;
+                lock_guard<mutex> wlock(wal_mu_);
+                unique_lock<shared_mutex> lock(mem_mu_);
+                store_.absorb_older(*snapshot);
+                imm_.reset();
+                return;
+            }
+            if(old_image != 0) env_->deleteFile(image_name(old_image));
 
+            // indexed before readers wait on seg_mu_
+            SegmentFile f = open_segment(number, dir);
             {
                 lock_guard<mutex> lock(seg_mu_);
-                segments_.push_back(name.str());
+                segments_.push_back(number);
+                add_segment_file(number, move(f));
+            }
+            {
+                unique_lock<shared_mutex>lock(mem_mu_);
+                imm_.reset();
             }
+            purge_obsolete_logs();
+            env_->deleteFile(legacy_log_name());
 
             if(segments_.size()>=compaction_threshold){
                 compact_segments();
             }
 
         }
-        
+
+        // Called with flush_mu_ held, so segments_ only changes here.
         void  compact_segments(){
-            vector<string>local_segments;
+            vector<uint64_t>local_segments;
             {
                 lock_guard<mutex> lock(seg_mu_);
-                local_segments.swap(segments_);
+                local_segments = segments_;
             }
+            // Every segment takes part, so tombstones have nothing left to
+            // hide and are dropped.
+            // On any failure the inputs and the MANIFEST stay as they were.
             unordered_map<string, string> merged;
-            for(const auto &seg: local_segments){
-                read_segment(seg,merged);
+            vector<string> inputs;
+            uint64_t bytes = 0;
+            for(uint64_t seg: local_segments){
+                inputs.push_back(segment_name(seg));
+                bytes += seg_files_[seg].size;
+                if(!read_segment(env_,inputs.back(),merged,nullptr,read_options(seg)).ok()) return;
             }
-            ostringstream name;
-            name << "segments/seg_"<<segments_.size()<<".sst";
-            write_segment(name.str(), merged);
+            // sized by its inputs, so a merge that outgrows the fast paths
+            // is written to a slower one
+            uint64_t number = manifest_.next_file++;
+            string dir = place_segment(bytes, local_segments);
+            Status s = write_segment(env_, segment_file(dir, number), merged, nullptr, write_options(true));
 
+            vector<uint64_t> before = manifest_.segments;
+            manifest_.segments.assign(1, number);
+            if(s.ok()) s = write_manifest(env_, options_.path, manifest_);
+            if(!s.ok()){
+                manifest_.segments = before;
+                env_->deleteFile(segment_file(dir, number));
+                return;
+            }
+
+            SegmentFile f = open_segment(number, dir);
             {
                 lock_guard<mutex> lock(seg_mu_);
-                for(const auto &seg: local_segments){
-                    unlink(seg.c_str());
-                }
                 segments_.clear();
-                segments_.push_back(name.str());
+                segments_.push_back(number);
+                seg_files_.clear();
+                add_segment_file(number, move(f));
+            }
+            for(const auto &name : inputs){
+                env_->deleteFile(name);
+            }
+        }
+
+        Status get_updates_since(uint64_t seq, UpdateIterator** iter) override{
+            *iter = nullptr;
+            uint64_t last;
+            {
+                lock_guard<mutex> wlock(wal_mu_);
+                last = last_seq_;
+            }
+
+            // Holding flush_mu_ keeps the listed logs from being purged
+            // before the check below.
+            lock_guard<mutex> flock(flush_mu_);
+            vector<string> logs;
+            uint64_t first = 0;
+            for(uint64_t n : list_logs()){
+                logs.push_back(log_name(n));
+                if(first == 0) first = ReadFirstWalSeq(env_, logs.back());
+            }
+            uint64_t want = max<uint64_t>(seq, 1);
+            if(want <= last && (first == 0 || first > want)){
+                return Status::Incomplete("UPDATES_NOT_RETAINED");
             }
+            *iter = NewWalIterator(env_, logs, seq);
+            return Status::OK();
         }
 
-        static bool read_from_segment(
-            const string & path,
-            const string & key,
-            string* value
-        ){
-            int fd=open(path.c_str(),O_RDONLY);
-            if(fd<0){
-                return false;
+        Status create_checkpoint(const string &dir) override{
+            if(env_->fileExists(dir)) return Status::InvalidArgument("CHECKPOINT_EXISTS");
+
+            // flush_mu_ keeps every file we name alive and unchanged; the
+            // live log only grows, so copying it up to the size seen under
+            // wal_mu_ yields whole records.
+            lock_guard<mutex> flock(flush_mu_);
+            vector<pair<uint64_t, uint64_t>> logs;
+            {
+                lock_guard<mutex> wlock(wal_mu_);
+                for(uint64_t n : list_logs()){
+                    if(n < manifest_.log_number) continue;
+                    uint64_t size = 0;
+                    env_->getFileSize(log_name(n), &size);
+                    logs.emplace_back(n, size);
+                }
             }
-            while(true){
-                uint32_t stored_crc;
-                if(read(fd, &stored_crc, sizeof(stored_crc)) != sizeof(stored_crc)) break;
 
-                uint32_t klen,vlen;
-                
-                if(read(fd,&klen,sizeof(klen))!=sizeof(klen))break;
-                if (read(fd,&vlen,sizeof(vlen))!=sizeof(vlen))break;
+            Status s = env_->createDir(dir);
+            if(s.ok()) s = env_->createDir(dir + "/wal");
+            if(s.ok()) s = env_->createDir(dir + "/segments");
+            // The copy uses the default layout, whatever the tiers here.
+            for(size_t i = 0; s.ok() && i < manifest_.segments.size(); i++){
+                string from = segment_name(manifest_.segments[i]);
+                string to = segment_file(dir + "/segments", manifest_.segments[i]);
+                s = env_->linkFile(from, to);
+                if(!s.ok()) s = CopyFile(env_, from, to);
+            }
+            if(s.ok() && manifest_.image_number != 0){
+                string from = image_name(manifest_.image_number);
+                string to = image_file(dir + "/wal", manifest_.image_number);
+                s = env_->linkFile(from, to);
+                if(!s.ok()) s = CopyFile(env_, from, to);
+            }
+            for(size_t i = 0; s.ok() && i < logs.size(); i++){
+                s = CopyFile(env_, log_name(logs[i].first), log_file(dir + "/wal", logs[i].first), logs[i].second);
+            }
+            if(s.ok()) s = write_manifest(env_, dir, manifest_);
+            return s;
+        }
+
+        EngineStats stats() override{
+            EngineStats st;
+            if(block_cache_){
+                BlockCacheStats b = block_cache_->stats();
+                st.block_cache_hits = b.hits;
+                st.block_cache_misses = b.misses;
+                st.block_cache_bytes = b.bytes;
+                st.compressed_cache_hits = b.compressed_hits;
+                st.compressed_cache_misses = b.compressed_misses;
+                st.compressed_cache_bytes = b.compressed_bytes;
+                st.compressed_cache_raw_bytes = b.compressed_raw_bytes;
+                st.decompressions = b.decompressions;
+                st.decompress_nanos = b.decompress_nanos;
+                st.block_cache_chunks = b.chunks;
+                st.block_cache_hugetlb_chunks = b.hugetlb_chunks;
+                st.block_cache_advised_chunks = b.advised_chunks;
+            }
+            if(secondary_cache_){
+                SecondaryCacheStats s = secondary_cache_->stats();
+                st.secondary_cache_hits = s.hits;
+                st.secondary_cache_misses = s.misses;
+                st.secondary_cache_inserts = s.inserts;
+                st.secondary_cache_bytes = s.bytes;
+            }
+            return st;
+        }
+
+        Status catch_up_with_primary() override{
+            if(!options_.secondary) return Status::NotSupported("NOT_SECONDARY");
+            lock_guard<mutex> flock(flush_mu_);
 
+            // The primary may flush while we read; the logs we read are
+            // only known to match the MANIFEST if it has not changed since.
+            for(int attempt = 0; attempt < 3; attempt++){
+                Manifest m;
+                Status s = read_manifest(env_, options_.path, &m);
+                if(s.ok()) s = check_comparator(m);
+                if(!s.ok()) return s;
 
-                vector<char>buf(sizeof(klen)+sizeof(vlen)+klen+vlen);
-                size_t off=0;
+                bool rebuild = !caught_up_once_ || m.log_number != manifest_.log_number ||
+                               m.segments != manifest_.segments || m.image_number != manifest_.image_number;
+                uint64_t tail_log = rebuild ? m.log_number : tail_log_;
+                uint64_t tail_pos = rebuild ? 0 : tail_pos_;
 
-                memcpy(buf.data()+off,&klen,sizeof(klen));off+=sizeof(klen);
-                memcpy(buf.data()+off,&vlen,sizeof(vlen));off+=sizeof(vlen);
+                // Collected off-lock, installed below in one step.
+                MemTable image;
+                if(rebuild && m.image_number != 0){
+                    uint64_t image_seq;
+                    if(!read_mem_image(env_, image_name(m.image_number), &image.data, &image.deleted, &image_seq).ok()){
+                        continue;
+                    }
+                }
+                vector<UpdateRecord> updates;
+                uint64_t covered = max(m.last_sequence, m.image_sequence);
+                uint64_t last = covered;
+                auto collect = [&](uint64_t seq, WalOpType type, const string &key, const string &value){
+                    if(seq <= covered) return;
+                    updates.push_back(UpdateRecord{seq, type, key, value});
+                    last = max(last, seq);
+                };
+                for(uint64_t n : list_logs()){
+                    if(n < tail_log) continue;
+                    uint64_t from = n == tail_log ? tail_pos : 0;
+                    uint64_t end = from;
+                    ReadWalRecords(env_, log_name(n), from, collect, &end);
+                    tail_log = n;
+                    tail_pos = end;
+                }
 
-                if(read(fd,buf.data()+off,klen+vlen)!=(ssize_t)(klen+vlen))break;
+                Manifest again;
+                if(!read_manifest(env_, options_.path, &again).ok() ||
+                   again.log_number != m.log_number || again.segments != m.segments){
+                    continue;
+                }
 
-                uint32_t crc=crc32(
-                    0,
-                    reinterpret_cast<const Bytef*>(buf.data()),
-                    buf.size()
-                );
+                {
+                    lock_guard<mutex> wlock(wal_mu_);
+                    unique_lock<shared_mutex> mlock(mem_mu_);
+                    lock_guard<mutex> slock(seg_mu_);
+                    if(rebuild){
+                        store_ = move(image);
+                        if(cuckoo()) store_.use_cuckoo(mem_limit);
+                        segments_ = m.segments;
+                        locate_segments(segments_);
+                        last_seq_ = 0;
+                    }
+                    for(const auto &u : updates){
+                        if(u.type==WalOpType::PUT){
+                            store_.put(u.key, u.value);
+                        } else {
+                            store_.del(u.key);
+                        }
+                    }
+                    last_seq_ = max(last_seq_, last);
+                }
+                manifest_ = m;
+                tail_log_ = tail_log;
+                tail_pos_ = tail_pos;
+                caught_up_once_ = true;
+                return Status::OK();
+            }
+            return Status::Busy("CATCH_UP_RACED");
+        }
 
-                if(crc!=stored_crc) break;
+        void refresh_loop(){
+            unique_lock<mutex> lock(bl_mu_);
+            while(!stopping_){
+                bl_cv_.wait_for(lock, chrono::milliseconds(options_.secondary_refresh_ms));
+                if(stopping_) break;
+                lock.unlock();
+                catch_up_with_primary();
+                lock.lock();
+            }
+        }
+
+        /* ---------------- ReplicationSource ---------------- */
 
-                string k(buf.data() + sizeof(klen) + sizeof(vlen), klen);
-                string v(buf.data() + sizeof(klen) + sizeof(vlen) + klen, vlen);
+        Status readBacklog(uint64_t after, size_t max_bytes, int timeout_ms,
+                           string* out, uint64_t* last) override{
+            out->clear();
+            unique_lock<mutex> lock(bl_mu_);
+            // A follower ahead of us has history we do not; start it over.
+            if(after < backlog_start_ || after > backlog_last_){
+                return Status::Incomplete("NEED_SNAPSHOT");
+            }
+            bl_cv_.wait_for(lock, chrono::milliseconds(timeout_ms), [&](){
+                return stopping_ || backlog_last_ > after || after < backlog_start_;
+            });
+            if(stopping_) return Status::Busy("SHUTTING_DOWN");
+            if(after < backlog_start_) return Status::Incomplete("NEED_SNAPSHOT");
 
-                if(k==key){
-                    *value=v;
-                    close(fd);
-                    return true;
+            *last = after;
+            for(const auto &e : backlog_){
+                if(e.last_seq <= after) continue;
+                if(out->size() >= max_bytes) break;
+                out->append(e.bytes);
+                *last = e.last_seq;
+            }
+            return Status::OK();
+        }
+
+        Status snapshot(vector<SnapshotFile>* files) override{
+            files->clear();
+            // With flush_mu_ the file set cannot change, and with wal_mu_
+            // the live log ends on a record boundary at the size we record.
+            lock_guard<mutex> flock(flush_mu_);
+            lock_guard<mutex> wlock(wal_mu_);
+
+            // Named as in the default layout; the follower places them.
+            vector<pair<string, string>> names;
+            for(uint64_t seg : manifest_.segments){
+                names.emplace_back(segment_file("segments", seg), segment_name(seg));
+            }
+            for(uint64_t n : list_logs()){
+                if(n >= manifest_.log_number) names.emplace_back(log_file("wal", n), log_name(n));
+            }
+            if(manifest_.image_number != 0){
+                names.emplace_back(image_file("wal", manifest_.image_number), image_name(manifest_.image_number));
+            }
+            names.emplace_back("MANIFEST", options_.path + "/MANIFEST");
+
+            for(const auto &[name, full] : names){
+                SnapshotFile f{name, nullptr, 0};
+                Status s = env_->getFileSize(full, &f.size);
+                if(s.ok()) s = env_->newRandomAccessFile(full, &f.file);
+                if(!s.ok()){
+                    for(auto &o : *files) delete o.file;
+                    files->clear();
+                    return s;
                 }
+                files->push_back(f);
+            }
+            return Status::OK();
+        }
+
+        /* ---------------- ReplicationSink ---------------- */
+
+        uint64_t appliedSequence() override{
+            lock_guard<mutex> wlock(wal_mu_);
+            return last_seq_;
+        }
+
+        Status applyRecords(const char* data, size_t len) override{
+            {
+                lock_guard<mutex> wlock(wal_mu_);
+                if(wal_ == nullptr) return Status::Busy("WAL_NOT_OPEN");
+
+                WriteBatch batch;
+                uint64_t first = 0, expect = last_seq_ + 1;
+                bool gap = false;
+                bool corrupt = false;
+                DecodeWalRecords(data, len, [&](uint64_t seq, WalOpType type, const string &key, const string &value){
+                    if(seq < expect) return;
+                    if(seq != expect) gap = true;
+                    if(first == 0) first = seq;
+                    expect = seq + 1;
+                    if(type==WalOpType::PUT) batch.put(key, value);
+                    else batch.del(key);
+                }, &corrupt);
+                if(corrupt) return Status::Corruption("REPLICATION_CORRUPTED");
+                if(gap) return Status::Incomplete("REPLICATION_GAP");
+                if(batch.count()==0) return Status::OK();
+
+                Status s = wal_->appendBatch(first, batch);
+                if(!s.ok()) return s;
+                last_seq_ = expect - 1;
+
+                MemWriteLock mlock(mem_mu_, cuckoo());
+                for(const auto &op : batch.ops()){
+                    if(op.type==WalOpType::PUT){
+                        store_.put(op.key, op.value);
+                    } else {
+                        store_.del(op.key);
+                    }
+                }
+            }
+
+            maybe_flush();
+            return Status::OK();
+        }
+
+        string stagingDir() override{
+            return options_.path + "/staging";
+        }
+
+        // The staging directory is emptied whether or not the install
+        // succeeds; on failure the old state is left as it was.
+        Status installSnapshot(const vector<string> &names) override{
+            lock_guard<mutex> flock(flush_mu_);
+            lock_guard<mutex> wlock(wal_mu_);
+            unique_lock<shared_mutex> mlock(mem_mu_);
+            lock_guard<mutex> slock(seg_mu_);
+
+            Status s = install_staged(names);
+            for(const auto &name : names) env_->deleteFile(stagingDir() + "/" + name);
+            for(const char* dir : {"/segments", "/wal", ""}) env_->deleteDir(stagingDir() + dir);
+            return s;
+        }
+
+        // The staged files move in under numbers above every local file, so
+        // nothing local changes until the MANIFEST naming them replaces the
+        // old one. Caller holds every engine lock.
+        Status install_staged(const vector<string> &names){
+            Manifest m;
+            Status s = read_manifest(env_, stagingDir(), &m);
+            if(!s.ok()) return s;
+
+            // staged number -> local one, ascending so the logs keep their order
+            map<uint64_t, uint64_t> local;
+            auto number = [&](const string &name, uint64_t* n){
+                string base = name.substr(name.rfind('/') + 1);
+                return parse_number(base, "seg_", ".sst", n) || parse_number(base, "", ".log", n) ||
+                       parse_number(base, "", ".img", n);
+            };
+            for(const auto &name : names){
+                uint64_t n;
+                if(number(name, &n)) local[n] = 0;
+                else if(name != "MANIFEST") return Status::Corruption("SNAPSHOT_UNKNOWN_FILE");
+            }
+            uint64_t next = manifest_.next_file;
+            for(auto &[n, to] : local) to = next++;
+
+            vector<string> moved;
+            uint64_t first_log = next;
+            for(const auto &name : names){
+                uint64_t n;
+                if(!number(name, &n)) continue;
+                string to;
+                if(name.compare(name.size() - 4, 4, ".sst") == 0){
+                    to = segment_file(default_segment_dir(), local[n]);
+                } else if(name.compare(name.size() - 4, 4, ".log") == 0){
+                    to = log_name(local[n]);
+                    first_log = min(first_log, local[n]);
+                } else {
+                    to = image_name(local[n]);
+                }
+                s = env_->renameFile(stagingDir() + "/" + name, to);
+                if(!s.ok()) break;
+                moved.push_back(to);
+            }
+            for(uint64_t &seg : m.segments){
+                if(s.ok() && !local.count(seg)) s = Status::Corruption("SNAPSHOT_INCOMPLETE");
+                seg = local[seg];
+            }
+            if(s.ok() && m.image_number != 0){
+                if(!local.count(m.image_number)) s = Status::Corruption("SNAPSHOT_INCOMPLETE");
+                m.image_number = local[m.image_number];
+            }
+            m.log_number = first_log;
+            m.next_file = next;
+            if(s.ok()) s = write_manifest(env_, options_.path, m);
+            if(!s.ok()){
+                for(const auto &to : moved) env_->deleteFile(to);
+                return s;
+            }
+
+            // Committed: nothing numbered below the old next_file is named
+            // by the new MANIFEST.
+            delete wal_;
+            wal_ = nullptr;
+            for(uint64_t n : list_logs()){
+                if(n < manifest_.next_file) env_->deleteFile(log_name(n));
             }
-            close(fd);
-            return false;
+            if(manifest_.image_number != 0) env_->deleteFile(image_name(manifest_.image_number));
+            for(uint64_t seg : segments_) env_->deleteFile(segment_name(seg));
+            return recover();
         }
 
 };
 
 // Factory implementation
-KVEngine* CreateKVEngine() {
-    return new KVEngineImpl();
-}
\ No newline at end of file
+KVEngine* CreateKVEngine(const Options &options) {
+    if(options.engine == EngineType::BITCASK) return CreateBitcaskEngine(options);
+    if(options.engine == EngineType::BTREE) return CreateBTreeEngine(options);
+    if(options.engine == EngineType::CACHE) return CreateCacheEngine(options);
+    if(options.engine == EngineType::FIXED) return CreateFixedEngine(options);
+    KVEngineImpl* engine = new KVEngineImpl(options);
+    if(!engine->open().ok()){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
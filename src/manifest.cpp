@@ -0,0 +1,95 @@
+#include "manifest.h"
+#include <sstream>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+    Plain text, one field per line, sealed with a crc of everything above:
+
+    next_file 12
+    log_number 11
+    last_sequence 340
+    image_number 13
+    image_sequence 352
+    comparator bytewise
+    segment 7
+    segment 10
+    crc 2864434397
+*/
+
+static uint32_t text_crc(const string &s){
+    return crc32(0, reinterpret_cast<const Bytef*>(s.data()), s.size());
+}
+
+Status read_manifest(Env* env, const string &dir, Manifest* out){
+    string path = dir + "/MANIFEST";
+    if(!env->fileExists(path)) return Status::NotFound("MANIFEST_NOT_FOUND");
+
+    SequentialFile* f = nullptr;
+    if(!env->newSequentialFile(path, &f).ok()) return Status::IOError("MANIFEST_OPEN_FAILED");
+    string text;
+    char buf[4096];
+    size_t got = 0;
+    while(f->read(sizeof(buf), buf, &got).ok() && got > 0){
+        text.append(buf, got);
+    }
+    delete f;
+
+    size_t crc_pos = text.rfind("crc ");
+    if(crc_pos == string::npos) return Status::Corruption("MANIFEST_CORRUPTED");
+    string body = text.substr(0, crc_pos);
+    if(strtoul(text.c_str() + crc_pos + 4, nullptr, 10) != text_crc(body)){
+        return Status::Corruption("MANIFEST_CORRUPTED");
+    }
+
+    Manifest m;
+    istringstream in(body);
+    string field;
+    uint64_t v;
+    while(in >> field){
+        if(field == "comparator"){
+            in >> m.comparator;
+            continue;
+        }
+        if(!(in >> v)) break;
+        if(field == "next_file") m.next_file = v;
+        else if(field == "log_number") m.log_number = v;
+        else if(field == "last_sequence") m.last_sequence = v;
+        else if(field == "image_number") m.image_number = v;
+        else if(field == "image_sequence") m.image_sequence = v;
+        else if(field == "segment") m.segments.push_back(v);
+    }
+    *out = m;
+    return Status::OK();
+}
+
+Status write_manifest(Env* env, const string &dir, const Manifest &m){
+    ostringstream body;
+    body << "next_file " << m.next_file << "\n";
+    body << "log_number " << m.log_number << "\n";
+    body << "last_sequence " << m.last_sequence << "\n";
+    if(m.image_number != 0){
+        body << "image_number " << m.image_number << "\n";
+        body << "image_sequence " << m.image_sequence << "\n";
+    }
+    if(!m.comparator.empty()){
+        body << "comparator " << m.comparator << "\n";
+    }
+    for(uint64_t seg : m.segments){
+        body << "segment " << seg << "\n";
+    }
+    string text = body.str();
+    text += "crc " + to_string(text_crc(text)) + "\n";
+
+    string tmp = dir + "/MANIFEST.tmp";
+    WritableFile* f = nullptr;
+    if(!env->newWritableFile(tmp, &f).ok()) return Status::IOError("MANIFEST_WRITE_FAILED");
+    Status s = f->append(text.data(), text.size());
+    if(s.ok()) s = f->sync();
+    f->close();
+    delete f;
+    if(!s.ok()) return Status::IOError("MANIFEST_WRITE_FAILED");
+
+    return env->renameFile(tmp, dir + "/MANIFEST");
+}
@@ -0,0 +1,129 @@
+#include "mem_image.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+/*
+    | uint32 magic   |
+    | uint64 seq     |   last sequence number the image contains
+    | uint64 count   |
+    then count records, sorted by key:
+    | uint8  kind    |   1 = value, 2 = tombstone
+    | uint32 key_len |
+    | uint32 val_len |
+    | key bytes      |
+    | value bytes    |
+    and finally
+    | uint32 crc     |   of everything above
+*/
+
+static const uint32_t IMAGE_MAGIC = 0x4b564d31;   // "KVM1"
+static const uint8_t KIND_VALUE = 1;
+static const uint8_t KIND_TOMBSTONE = 2;
+
+static void put_fixed(string &buf, const void* p, size_t n){
+    buf.append(static_cast<const char*>(p), n);
+}
+
+Status write_mem_image(
+    Env* env,
+    const string &path,
+    const unordered_map<string, string> &data,
+    const unordered_set<string> &deleted,
+    uint64_t seq
+){
+    // (key, value or nullptr for a tombstone)
+    vector<pair<const string*, const string*>> entries;
+    entries.reserve(data.size() + deleted.size());
+    size_t bytes = 4 + 8 + 8 + 4;
+    for(const auto &[k, v] : data){
+        entries.emplace_back(&k, &v);
+        bytes += 9 + k.size() + v.size();
+    }
+    for(const auto &k : deleted){
+        entries.emplace_back(&k, nullptr);
+        bytes += 9 + k.size();
+    }
+    sort(entries.begin(), entries.end(), [](const auto &a, const auto &b){ return *a.first < *b.first; });
+
+    string buf;
+    buf.reserve(bytes);
+    uint64_t count = entries.size();
+    put_fixed(buf, &IMAGE_MAGIC, 4);
+    put_fixed(buf, &seq, 8);
+    put_fixed(buf, &count, 8);
+    for(const auto &[k, v] : entries){
+        uint8_t kind = v ? KIND_VALUE : KIND_TOMBSTONE;
+        uint32_t klen = k->size();
+        uint32_t vlen = v ? v->size() : 0;
+        put_fixed(buf, &kind, 1);
+        put_fixed(buf, &klen, 4);
+        put_fixed(buf, &vlen, 4);
+        buf.append(*k);
+        if(v) buf.append(*v);
+    }
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(buf.data()), buf.size());
+    put_fixed(buf, &crc, 4);
+
+    WritableFile* f = nullptr;
+    if(!env->newWritableFile(path, &f).ok()) return Status::IOError("MEM_IMAGE_OPEN_FAILED");
+    Status s = f->append(buf.data(), buf.size());
+    if(s.ok()) s = f->sync();
+    f->close();
+    delete f;
+    return s.ok() ? Status::OK() : Status::IOError("MEM_IMAGE_WRITE_FAILED");
+}
+
+Status read_mem_image(
+    Env* env,
+    const string &path,
+    unordered_map<string, string> *data,
+    unordered_set<string> *deleted,
+    uint64_t *seq
+){
+    uint64_t size = 0;
+    RandomAccessFile* f = nullptr;
+    if(!env->getFileSize(path, &size).ok() || !env->newRandomAccessFile(path, &f).ok()){
+        return Status::IOError("MEM_IMAGE_OPEN_FAILED");
+    }
+    string buf(size, '\0');
+    size_t got = 0;
+    Status s = f->pread(0, size, &buf[0], &got);
+    delete f;
+    if(!s.ok() || got != size || size < 24) return Status::Corruption("MEM_IMAGE_CORRUPTED");
+
+    uint32_t stored_crc, magic;
+    memcpy(&stored_crc, buf.data() + size - 4, 4);
+    memcpy(&magic, buf.data(), 4);
+    if(magic != IMAGE_MAGIC ||
+       crc32(0, reinterpret_cast<const Bytef*>(buf.data()), size - 4) != stored_crc){
+        return Status::Corruption("MEM_IMAGE_CORRUPTED");
+    }
+
+    uint64_t count;
+    memcpy(seq, buf.data() + 4, 8);
+    memcpy(&count, buf.data() + 12, 8);
+    data->reserve(data->size() + count);
+
+    size_t off = 20, end = size - 4;
+    for(uint64_t i = 0; i < count; i++){
+        if(end - off < 9) return Status::Corruption("MEM_IMAGE_CORRUPTED");
+        uint8_t kind = buf[off];
+        uint32_t klen, vlen;
+        memcpy(&klen, buf.data() + off + 1, 4);
+        memcpy(&vlen, buf.data() + off + 5, 4);
+        off += 9;
+        if(end - off < static_cast<uint64_t>(klen) + vlen) return Status::Corruption("MEM_IMAGE_CORRUPTED");
+        string key(buf.data() + off, klen);
+        if(kind == KIND_TOMBSTONE){
+            deleted->insert(move(key));
+        } else {
+            (*data)[move(key)].assign(buf.data() + off + klen, vlen);
+        }
+        off += klen + vlen;
+    }
+    return Status::OK();
+}
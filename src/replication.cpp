@@ -0,0 +1,412 @@
+#include "replication.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+/*
+    Frames in both directions:
+
+    | uint8 type | uint32 len | payload |
+
+    SYNC       follower -> leader   uint64 applied seq
+    RECORDS    leader -> follower   encoded WAL records
+    HEARTBEAT  leader -> follower   (empty), sent when idle
+    SNAP_FILE  leader -> follower   name, uint64 offset, bytes
+    SNAP_END   leader -> follower   (empty); follower installs and reconnects
+*/
+
+static const uint8_t F_SYNC = 1;
+static const uint8_t F_RECORDS = 2;
+static const uint8_t F_HEARTBEAT = 3;
+static const uint8_t F_SNAP_FILE = 4;
+static const uint8_t F_SNAP_END = 5;
+
+static const size_t kChunk = 1 << 20;
+static const int kIdleTimeoutMs = 5000;
+
+/* ---------------- socket helpers ---------------- */
+
+static bool parse_unix(const string &address, sockaddr_un* addr){
+    if(address.compare(0, 5, "unix:") != 0) return false;
+    string path = address.substr(5);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+    return true;
+}
+
+static bool parse_tcp(const string &address, sockaddr_in* addr){
+    size_t colon = address.rfind(':');
+    if(colon == string::npos) return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(address.c_str() + colon + 1));
+    return inet_pton(AF_INET, address.substr(0, colon).c_str(), &addr->sin_addr) == 1;
+}
+
+static int open_listener(const string &address){
+    sockaddr_un ua;
+    sockaddr_in ta;
+    int fd;
+    if(parse_unix(address, &ua)){
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(ua.sun_path);
+        if(fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&ua), sizeof(ua)) != 0){
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+    } else if(parse_tcp(address, &ta)){
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if(fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&ta), sizeof(ta)) != 0){
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    if(listen(fd, 16) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_to(const string &address){
+    sockaddr_un ua;
+    sockaddr_in ta;
+    int fd = -1;
+    int r = -1;
+    if(parse_unix(address, &ua)){
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0) r = connect(fd, reinterpret_cast<sockaddr*>(&ua), sizeof(ua));
+    } else if(parse_tcp(address, &ta)){
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0) r = connect(fd, reinterpret_cast<sockaddr*>(&ta), sizeof(ta));
+        int one = 1;
+        if(r == 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(r != 0){
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_full(int fd, const char* p, size_t n){
+    while(n > 0){
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// Reads exactly n bytes, giving up after timeout_ms without progress or
+// once stop is set.
+static bool read_full(int fd, char* p, size_t n, int timeout_ms, const atomic<bool> &stop){
+    int waited = 0;
+    while(n > 0){
+        if(stop.load()) return false;
+        pollfd pfd = {fd, POLLIN, 0};
+        int r = poll(&pfd, 1, 200);
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 0) return false;
+        if(r == 0){
+            waited += 200;
+            if(waited >= timeout_ms) return false;
+            continue;
+        }
+        ssize_t got = read(fd, p, n);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        p += got;
+        n -= got;
+        waited = 0;
+    }
+    return true;
+}
+
+static bool send_frame(int fd, uint8_t type, const string &payload){
+    char hdr[5];
+    hdr[0] = static_cast<char>(type);
+    uint32_t len = payload.size();
+    memcpy(hdr + 1, &len, 4);
+    return write_full(fd, hdr, 5) && write_full(fd, payload.data(), payload.size());
+}
+
+static bool recv_frame(int fd, uint8_t* type, string* payload, const atomic<bool> &stop){
+    char hdr[5];
+    if(!read_full(fd, hdr, 5, kIdleTimeoutMs, stop)) return false;
+    *type = static_cast<uint8_t>(hdr[0]);
+    uint32_t len;
+    memcpy(&len, hdr + 1, 4);
+    payload->resize(len);
+    return len == 0 || read_full(fd, &(*payload)[0], len, kIdleTimeoutMs, stop);
+}
+
+/* ---------------- leader ---------------- */
+
+class ReplicationServerImpl : public ReplicationServer {
+
+    private:
+        ReplicationSource* source_;
+        int lfd_;
+        atomic<bool> stop_{false};
+        thread accept_thread_;
+
+        struct Follower {
+            thread t;
+            atomic<bool> done{false};
+        };
+
+        mutex mu_;
+        list<Follower> followers_;
+
+        bool send_snapshot(int fd){
+            vector<SnapshotFile> files;
+            if(!source_->snapshot(&files).ok()) return false;
+
+            bool ok = true;
+            string chunk;
+            for(auto &f : files){
+                uint64_t off = 0;
+                do{
+                    size_t want = min<uint64_t>(kChunk, f.size - off);
+                    chunk.resize(want);
+                    size_t got = 0;
+                    if(want > 0 && (!f.file->pread(off, want, &chunk[0], &got).ok() || got != want)){
+                        ok = false;
+                        break;
+                    }
+                    string payload;
+                    uint32_t nlen = f.name.size();
+                    payload.append(reinterpret_cast<const char*>(&nlen), 4);
+                    payload.append(f.name);
+                    payload.append(reinterpret_cast<const char*>(&off), 8);
+                    payload.append(chunk);
+                    if(!send_frame(fd, F_SNAP_FILE, payload)){
+                        ok = false;
+                        break;
+                    }
+                    off += want;
+                }while(off < f.size && !stop_.load());
+                if(!ok) break;
+            }
+            for(auto &f : files) delete f.file;
+            return ok && send_frame(fd, F_SNAP_END, "");
+        }
+
+        void serve(int fd){
+            uint8_t type;
+            string payload;
+            if(!recv_frame(fd, &type, &payload, stop_) || type != F_SYNC || payload.size() != 8){
+                close(fd);
+                return;
+            }
+            uint64_t seq;
+            memcpy(&seq, payload.data(), 8);
+
+            string buf;
+            while(!stop_.load()){
+                uint64_t last = seq;
+                Status s = source_->readBacklog(seq, kChunk, 1000, &buf, &last);
+                if(!s.ok()){
+                    if(s.code() == StatusCode::INCOMPLETE) send_snapshot(fd);
+                    break;
+                }
+                bool sent = buf.empty() ? send_frame(fd, F_HEARTBEAT, "") : send_frame(fd, F_RECORDS, buf);
+                if(!sent) break;
+                seq = last;
+            }
+            close(fd);
+        }
+
+        void accept_loop(){
+            while(!stop_.load()){
+                pollfd pfd = {lfd_, POLLIN, 0};
+                if(poll(&pfd, 1, 200) <= 0) continue;
+                int fd = accept4(lfd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if(fd < 0) continue;
+                lock_guard<mutex> lock(mu_);
+                // reap the sessions that have ended
+                for(auto it = followers_.begin(); it != followers_.end();){
+                    if(!it->done.load()){
+                        ++it;
+                        continue;
+                    }
+                    it->t.join();
+                    it = followers_.erase(it);
+                }
+                Follower &f = followers_.emplace_back();
+                f.t = thread([this, fd, &f](){
+                    serve(fd);
+                    f.done.store(true);
+                });
+            }
+        }
+
+    public:
+        ReplicationServerImpl(ReplicationSource* source, int lfd)
+            :source_(source), lfd_(lfd){
+            accept_thread_ = thread([this](){ accept_loop(); });
+        }
+
+        ~ReplicationServerImpl(){
+            stop_.store(true);
+            accept_thread_.join();
+            lock_guard<mutex> lock(mu_);
+            for(auto &f : followers_) f.t.join();
+            close(lfd_);
+        }
+};
+
+ReplicationServer* StartReplicationServer(ReplicationSource* source, const string &address){
+    int lfd = open_listener(address);
+    if(lfd < 0) return nullptr;
+    return new ReplicationServerImpl(source, lfd);
+}
+
+/* ---------------- follower ---------------- */
+
+class ReplicationClientImpl : public ReplicationClient {
+
+    private:
+        ReplicationSink* sink_;
+        Env* env_;
+        string address_;
+        atomic<bool> stop_{false};
+        atomic<bool> connected_{false};
+        thread thread_;
+
+        mutex mu_;
+        Status status_;
+
+        // Creates the directories above a staged file name.
+        void make_parents(const string &name){
+            string dir = sink_->stagingDir();
+            env_->createDir(dir);
+            size_t pos = 0;
+            while((pos = name.find('/', pos)) != string::npos){
+                env_->createDir(dir + "/" + name.substr(0, pos));
+                pos++;
+            }
+        }
+
+        // Deletes whatever a session staged but did not install.
+        void discard_staged(const vector<string> &names){
+            for(const auto &name : names) env_->deleteFile(sink_->stagingDir() + "/" + name);
+        }
+
+        // OK when the leader hung up; the error otherwise.
+        Status session(int fd){
+            uint64_t seq = sink_->appliedSequence();
+            if(!send_frame(fd, F_SYNC, string(reinterpret_cast<const char*>(&seq), 8))) return Status::OK();
+            connected_.store(true);
+
+            Status s;
+
+            vector<string> names;
+            vector<WritableFile*> staged;
+            uint8_t type;
+            string payload;
+            while(recv_frame(fd, &type, &payload, stop_)){
+                if(type == F_RECORDS){
+                    s = sink_->applyRecords(payload.data(), payload.size());
+                    if(!s.ok()) break;
+                } else if(type == F_SNAP_FILE){
+                    if(payload.size() < 12) break;
+                    uint32_t nlen;
+                    memcpy(&nlen, payload.data(), 4);
+                    if(payload.size() < 12 + static_cast<size_t>(nlen)) break;
+                    string name = payload.substr(4, nlen);
+                    uint64_t off;
+                    memcpy(&off, payload.data() + 4 + nlen, 8);
+                    if(name.find("..") != string::npos) break;
+
+                    if(off == 0){
+                        make_parents(name);
+                        WritableFile* f = nullptr;
+                        s = env_->newWritableFile(sink_->stagingDir() + "/" + name, &f);
+                        if(!s.ok()) break;
+                        names.push_back(name);
+                        staged.push_back(f);
+                    }
+                    if(staged.empty()) break;
+                    const char* data = payload.data() + 12 + nlen;
+                    s = staged.back()->append(data, payload.size() - 12 - nlen);
+                    if(!s.ok()) break;
+                } else if(type == F_SNAP_END){
+                    for(WritableFile* f : staged){
+                        if(s.ok()) s = f->sync();
+                        if(s.ok()) s = f->close();
+                        delete f;
+                    }
+                    staged.clear();
+                    // the sink empties the staging directory itself
+                    if(s.ok()) s = sink_->installSnapshot(names);
+                    else discard_staged(names);
+                    names.clear();
+                    break;
+                }
+            }
+            for(WritableFile* f : staged) delete f;
+            discard_staged(names);
+            connected_.store(false);
+            return s;
+        }
+
+        void run(){
+            while(!stop_.load()){
+                int fd = connect_to(address_);
+                if(fd >= 0){
+                    Status s = session(fd);
+                    close(fd);
+                    lock_guard<mutex> lock(mu_);
+                    status_ = s;
+                }
+                for(int i = 0; i < 5 && !stop_.load(); i++){
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                }
+            }
+        }
+
+    public:
+        ReplicationClientImpl(ReplicationSink* sink, Env* env, const string &address)
+            :sink_(sink), env_(env), address_(address){
+            thread_ = thread([this](){ run(); });
+        }
+
+        ~ReplicationClientImpl(){
+            stop_.store(true);
+            thread_.join();
+        }
+
+        bool connected() override{
+            return connected_.load();
+        }
+
+        Status status() override{
+            lock_guard<mutex> lock(mu_);
+            return status_;
+        }
+};
+
+ReplicationClient* StartReplicationClient(ReplicationSink* sink, Env* env, const string &address){
+    return new ReplicationClientImpl(sink, env, address);
+}
@@ -1,117 +1,919 @@
 #include "segment.h"
-#include <fcntl.h>
-#include <unistd.h>
+#include "key_prefix.h"
 #include <cstring>
 #include <cstdint>
 #include <zlib.h>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 
 
 using namespace std;
 
+static const uint32_t TOMBSTONE = 0xFFFFFFFF;
+static const uint64_t SEGMENT_MAGIC_V2 = 0x3273746e6d676573ull;  // "segmnts2", no meta block
+static const uint64_t SEGMENT_MAGIC_V3 = 0x3373746e6d676573ull;  // "segmnts3", no index prefixes
+static const uint64_t SEGMENT_MAGIC = 0x3473746e6d676573ull;     // "segmnts4"
+static const uint64_t PLAIN_MAGIC = 0x6e69616c70676573ull;       // "segplain"
+static const size_t TRAILER_SIZE = 5;
+static const size_t FOOTER_V2_SIZE = 24;
+static const size_t FOOTER_SIZE = 40;
+static const size_t PLAIN_FOOTER_SIZE = 32;
+static const char* const DICTIONARY_KEY = "zlib.dictionary";
+// zlib only looks back this far
+static const size_t MAX_DICTIONARY = 32 << 10;
+
+/* ---------------- blocks ---------------- */
+
+static void append_record(string* buf, string_view key, string_view value, bool tombstone){
+    uint32_t klen = key.size();
+    uint32_t vlen = tombstone ? TOMBSTONE : value.size();
+    buf->append(reinterpret_cast<const char*>(&klen), sizeof(klen));
+    buf->append(reinterpret_cast<const char*>(&vlen), sizeof(vlen));
+    buf->append(key);
+    if(!tombstone) buf->append(value);
+}
+
+class BlockBuilder {
+    string buf_;
+    vector<uint32_t> offsets_;
+
+    public:
+        void add(string_view key, string_view value, bool tombstone = false){
+            offsets_.push_back(buf_.size());
+            append_record(&buf_, key, value, tombstone);
+        }
+        size_t size() const { return buf_.size() + 4 * offsets_.size() + 4; }
+        bool empty() const { return offsets_.empty(); }
+
+        // prefixed: put the column of key prefixes described in segment.h
+        // before the offsets. Keys must be in bytewise order.
+        string finish(bool prefixed = false){
+            uint32_t n = offsets_.size();
+            if(prefixed) append_prefixes();
+            buf_.append(reinterpret_cast<const char*>(offsets_.data()), 4 * n);
+            buf_.append(reinterpret_cast<const char*>(&n), sizeof(n));
+            string out = move(buf_);
+            buf_.clear();
+            offsets_.clear();
+            return out;
+        }
+
+    private:
+        string_view key(uint32_t i) const {
+            uint32_t klen;
+            memcpy(&klen, buf_.data() + offsets_[i], 4);
+            return string_view(buf_.data() + offsets_[i] + 8, klen);
+        }
+
+        void append_prefixes(){
+            // sorted, so what the first and last keys share all keys share
+            uint32_t shared = 0;
+            if(!offsets_.empty()){
+                string_view first = key(0), last = key(offsets_.size() - 1);
+                while(shared < first.size() && shared < last.size() && first[shared] == last[shared]) shared++;
+            }
+            string column(8 * offsets_.size(), '\0');
+            for(size_t i = 0; i < offsets_.size(); i++){
+                uint64_t p = KeyPrefix(key(i).substr(shared));
+                memcpy(&column[8 * i], &p, 8);
+            }
+            buf_ += column;
+            buf_.append(reinterpret_cast<const char*>(&shared), sizeof(shared));
+        }
+};
+
+// Read access to a finished block; every accessor checks its bounds.
+class BlockReader {
+    string_view b_;
+    uint32_t n_ = 0;
+    size_t records_end_ = 0;
+    size_t offsets_ = 0;
+    const char* prefixes_ = nullptr;
+    uint32_t shared_ = 0;
+
+    public:
+        // prefixed: the block was finished with a prefix column.
+        explicit BlockReader(string_view block, bool prefixed = false) : b_(block){
+            if(b_.size() < 4) return;
+            uint32_t n;
+            memcpy(&n, b_.data() + b_.size() - 4, 4);
+            size_t per_record = prefixed ? 12 : 4, fixed = prefixed ? 8 : 4;
+            if(n > (b_.size() - fixed) / per_record) return;
+            n_ = n;
+            records_end_ = b_.size() - fixed - per_record * static_cast<size_t>(n);
+            offsets_ = b_.size() - 4 - 4 * static_cast<size_t>(n);
+            if(prefixed){
+                prefixes_ = b_.data() + records_end_;
+                memcpy(&shared_, b_.data() + offsets_ - 4, 4);
+            }
+        }
+        uint32_t count() const { return n_; }
+
+        bool key(uint32_t i, string_view* key) const {
+            uint32_t off, klen;
+            memcpy(&off, b_.data() + offsets_ + 4 * static_cast<size_t>(i), 4);
+            if(off > records_end_ || records_end_ - off < 8) return false;
+            memcpy(&klen, b_.data() + off, 4);
+            if(klen > records_end_ - off - 8) return false;
+            *key = string_view(b_.data() + off + 8, klen);
+            return true;
+        }
+
+        bool record(uint32_t i, string* key, string* value, bool* tombstone) const {
+            uint32_t off, klen, vlen;
+            memcpy(&off, b_.data() + offsets_ + 4 * static_cast<size_t>(i), 4);
+            if(off > records_end_ || records_end_ - off < 8) return false;
+            memcpy(&klen, b_.data() + off, 4);
+            memcpy(&vlen, b_.data() + off + 4, 4);
+            *tombstone = vlen == TOMBSTONE;
+            if(*tombstone) vlen = 0;
+            size_t body = off + 8;
+            if(klen > records_end_ - body || vlen > records_end_ - body - klen) return false;
+            key->assign(b_.data() + body, klen);
+            if(value) value->assign(b_.data() + body + klen, vlen);
+            return true;
+        }
+
+        // Index of the first record whose key is >= key, count() if none;
+        // false on a malformed record. With a prefix column, only the keys
+        // whose prefix equals the probe's are compared in full.
+        bool lower_bound(const string &key, const Comparator* cmp, uint32_t* pos) const {
+            uint32_t lo = 0, hi = n_;
+            if(prefixes_ && n_ > 0 && cmp == BytewiseComparator()){
+                string_view first;
+                if(!this->key(0, &first) || shared_ > first.size()) return false;
+                int c = memcmp(key.data(), first.data(), min<size_t>(key.size(), shared_));
+                if(c < 0 || (c == 0 && key.size() < shared_)){
+                    hi = 0;
+                } else if(c > 0){
+                    lo = n_;
+                } else {
+                    uint64_t q = KeyPrefix(string_view(key).substr(shared_));
+                    lo = PrefixLowerBound(prefixes_, n_, q);
+                    if(q != UINT64_MAX) hi = lo + PrefixLowerBound(prefixes_ + 8 * static_cast<size_t>(lo), n_ - lo, q + 1);
+                }
+            }
+            string_view k;
+            while(lo < hi){
+                uint32_t mid = lo + (hi - lo) / 2;
+                if(!this->key(mid, &k)) return false;
+                if(cmp->compare(k, key) < 0) lo = mid + 1;
+                else hi = mid;
+            }
+            *pos = lo;
+            return true;
+        }
+};
+
+struct BlockHandle {
+    uint64_t offset;
+    uint32_t size;     // without the trailer
+};
+
+static const uint8_t BLOCK_RAW = 0;
+static const uint8_t BLOCK_ZLIB = 1;
+static const uint8_t BLOCK_ZLIB_DICT = 2;
+
+// Deflates block behind its uint32 size, primed with dict unless empty.
+static bool compress_block(const string &block, const string &dict, string* out){
+    z_stream z{};
+    if(deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK) return false;
+    bool ok = dict.empty() ||
+              deflateSetDictionary(&z, reinterpret_cast<const Bytef*>(dict.data()), dict.size()) == Z_OK;
+    uint32_t raw_size = block.size();
+    out->resize(4 + deflateBound(&z, block.size()));
+    memcpy(&(*out)[0], &raw_size, 4);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+    z.avail_in = block.size();
+    z.next_out = reinterpret_cast<Bytef*>(&(*out)[4]);
+    z.avail_out = out->size() - 4;
+    ok = ok && deflate(&z, Z_FINISH) == Z_STREAM_END;
+    out->resize(4 + z.total_out);
+    deflateEnd(&z);
+    return ok;
+}
+
+// dict is the segment's dictionary, empty if it has none.
+static bool write_block(WritableFile* f, const string &block, CompressionType compression, const string &dict,
+                        uint64_t* offset, BlockHandle* handle){
+    string compressed;
+    const string* stored = &block;
+    char trailer[TRAILER_SIZE];
+    trailer[0] = BLOCK_RAW;
+    if(compression == CompressionType::ZLIB && compress_block(block, dict, &compressed) &&
+       compressed.size() <= block.size() - block.size() / 8){
+        stored = &compressed;
+        trailer[0] = dict.empty() ? BLOCK_ZLIB : BLOCK_ZLIB_DICT;
+    }
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(stored->data()), stored->size());
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(trailer), 1);
+    memcpy(trailer + 1, &crc, sizeof(crc));
+    if(!f->append(stored->data(), stored->size()).ok()) return false;
+    if(!f->append(trailer, sizeof(trailer)).ok()) return false;
+    handle->offset = *offset;
+    handle->size = stored->size();
+    *offset += stored->size() + TRAILER_SIZE;
+    return true;
+}
+
+// Reads a block as stored, checking its crc.
+static bool read_block(RandomAccessFile* f, const BlockHandle &h, string* out, uint8_t* type){
+    string buf(h.size + TRAILER_SIZE, '\0');
+    size_t got = 0;
+    if(!f->pread(h.offset, buf.size(), &buf[0], &got).ok() || got != buf.size()) return false;
+    uint32_t stored;
+    memcpy(&stored, buf.data() + h.size + 1, sizeof(stored));
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(buf.data()), h.size + 1);
+    if(crc != stored) return false;
+    *type = buf[h.size];
+    buf.resize(h.size);
+    *out = move(buf);
+    return true;
+}
+
+static size_t raw_size(string_view stored){
+    uint32_t n = 0;
+    if(stored.size() >= 4) memcpy(&n, stored.data(), 4);
+    return n;
+}
+
+// Inflates a compressed block; dict is needed (only) for BLOCK_ZLIB_DICT,
+// whose zlib stream asks for it.
+static bool decompress_block(string_view stored, const string* dict, string* out){
+    if(stored.size() < 4) return false;
+    out->resize(raw_size(stored));
+    z_stream z{};
+    if(inflateInit(&z) != Z_OK) return false;
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(stored.data() + 4));
+    z.avail_in = stored.size() - 4;
+    z.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+    z.avail_out = out->size();
+    int r = inflate(&z, Z_FINISH);
+    if(r == Z_NEED_DICT && dict &&
+       inflateSetDictionary(&z, reinterpret_cast<const Bytef*>(dict->data()), dict->size()) == Z_OK){
+        r = inflate(&z, Z_FINISH);
+    }
+    bool ok = r == Z_STREAM_END && z.total_out == out->size();
+    inflateEnd(&z);
+    return ok;
+}
+
+// Turns a stored block into its records.
+static bool decode_block(string stored, uint8_t type, const string* dict, string* out){
+    if(type == BLOCK_RAW){
+        *out = move(stored);
+        return true;
+    }
+    return (type == BLOCK_ZLIB || type == BLOCK_ZLIB_DICT) && decompress_block(stored, dict, out);
+}
+
+// Times the decompression for the cache's statistics.
+static BlockRef decompress_cached(string_view stored, const string* dict, BlockCache* cache){
+    auto start = chrono::steady_clock::now();
+    string raw;
+    bool ok = decompress_block(stored, dict, &raw);
+    cache->recordDecompression(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    return ok ? MakeBlockRef(move(raw)) : nullptr;
+}
+
+// Reads a block through the cache tiers, if there is a cache: uncompressed,
+// compressed, secondary, then the file.
+static BlockRef fetch_block(RandomAccessFile* f, const BlockHandle &h, const string* dict,
+                                            const SegmentReadOptions &options){
+    BlockCache* cache = options.file_id != 0 ? options.cache : nullptr;
+    if(cache){
+        BlockRef b = cache->lookup(options.file_id, h.offset);
+        if(b) return b;
+        bool hot = false;
+        BlockRef c = cache->lookupCompressed(options.file_id, h.offset, &hot);
+        if(c){
+            b = decompress_cached(*c, dict, cache);
+            if(b && hot) cache->insert(options.file_id, h.offset, b, options.spill);
+            return b;
+        }
+        b = cache->lookupSecondary(options.file_id, h.offset);
+        if(b) return b;
+    }
+
+    string stored;
+    uint8_t type;
+    if(!read_block(f, h, &stored, &type)) return nullptr;
+    if(cache && type != BLOCK_RAW && cache->hasCompressedTier()){
+        BlockRef c = MakeBlockRef(move(stored));
+        cache->insertCompressed(options.file_id, h.offset, c, raw_size(*c));
+        return decompress_cached(*c, dict, cache);
+    }
+    string block;
+    if(!decode_block(move(stored), type, dict, &block)) return nullptr;
+    BlockRef b = MakeBlockRef(move(block));
+    if(cache) cache->insert(options.file_id, h.offset, b, options.spill);
+    return b;
+}
+
+static bool read_decoded(RandomAccessFile* f, const BlockHandle &h, const string* dict, string* out){
+    string stored;
+    uint8_t type;
+    return read_block(f, h, &stored, &type) && decode_block(move(stored), type, dict, out);
+}
+
+static bool decode_handle(const string &value, BlockHandle* h){
+    if(value.size() != 12) return false;
+    memcpy(&h->offset, value.data(), 8);
+    memcpy(&h->size, value.data() + 8, 4);
+    return true;
+}
+
+struct Footer {
+    BlockHandle meta{0, 0};     // size 0: no meta block
+    BlockHandle index{0, 0};
+    bool prefixed_index = false;
+};
+
+// Reads the footer; false if the file is not in the block format.
+static bool read_footer(Env* env, const string &path, RandomAccessFile* f, Footer* footer){
+    uint64_t size = 0;
+    if(!env->getFileSize(path, &size).ok() || size < FOOTER_V2_SIZE) return false;
+    char buf[FOOTER_SIZE];
+    size_t n = min<uint64_t>(size, FOOTER_SIZE);
+    size_t got = 0;
+    if(!f->pread(size - n, n, buf, &got).ok() || got != n) return false;
+    uint64_t magic;
+    memcpy(&magic, buf + n - 8, 8);
+    const char* p;
+    if((magic == SEGMENT_MAGIC || magic == SEGMENT_MAGIC_V3) && n == FOOTER_SIZE){
+        footer->prefixed_index = magic == SEGMENT_MAGIC;
+        uint64_t meta_size;
+        memcpy(&footer->meta.offset, buf, 8);
+        memcpy(&meta_size, buf + 8, 8);
+        if(meta_size > UINT32_MAX) return false;
+        footer->meta.size = meta_size;
+        p = buf + 16;
+    } else if(magic == SEGMENT_MAGIC_V2){
+        p = buf + n - FOOTER_V2_SIZE;
+    } else {
+        return false;
+    }
+    uint64_t index_size;
+    memcpy(&footer->index.offset, p, 8);
+    memcpy(&index_size, p + 8, 8);
+    if(index_size > UINT32_MAX) return false;
+    footer->index.size = index_size;
+    return true;
+}
+
+// Looks the dictionary up in the meta block, if there is one. False only
+// if there is a meta block and it cannot be read.
+static bool read_dictionary(RandomAccessFile* f, const Footer &footer, const SegmentReadOptions &options,
+                            string* dict){
+    dict->clear();
+    if(footer.meta.size == 0) return true;
+    BlockRef meta = fetch_block(f, footer.meta, nullptr, options);
+    if(!meta) return false;
+    BlockReader mr(*meta);
+    uint32_t pos;
+    string k;
+    bool tombstone;
+    if(mr.lower_bound(DICTIONARY_KEY, BytewiseComparator(), &pos) && pos < mr.count() &&
+       mr.record(pos, &k, dict, &tombstone) && k != DICTIONARY_KEY){
+        dict->clear();
+    }
+    return true;
+}
+
+// Records spread evenly over the segment, encoded as in a block, so the
+// dictionary holds the byte patterns blocks repeat. Small segments get
+// none: the dictionary is stored with them and costs its size.
+static string sample_dictionary(const vector<SegmentRecord> &records, size_t limit){
+    size_t total = 0;
+    for(const auto &r : records) total += 8 + r.key.size() + (r.tombstone ? 0 : r.value.size());
+    size_t budget = min({limit, MAX_DICTIONARY, total / 16});
+    if(budget < 256) return "";
+
+    size_t picks = max<size_t>(1, budget / max<size_t>(1, total / records.size()));
+    size_t step = max<size_t>(1, records.size() / picks);
+    string dict;
+    for(size_t i = 0; i < records.size() && dict.size() < budget; i += step){
+        append_record(&dict, records[i].key, records[i].value, records[i].tombstone);
+    }
+    dict.resize(min(dict.size(), budget));
+    return dict;
+}
+
+/* ---------------- the format from before blocks ---------------- */
+
 /*
     | uint32 crc     |
     | uint32 key_len |
     | uint32 val_len |
     | key bytes      |
     | value bytes    |
-
 */
 
-static Status write_all(
-    int fd,
-    const void*buf,size_t len
-){
-    const char * p=static_cast<const char*>(buf);
-    while(len>0){
-        ssize_t n = write(fd,p,len);
+static bool read_exact(SequentialFile* f, void* dst, size_t n){
+    char* p = static_cast<char*>(dst);
+    while(n > 0){
+        size_t got = 0;
+        if(!f->read(n, p, &got).ok() || got == 0) return false;
+        p += got;
+        n -= got;
+    }
+    return true;
+}
 
-        if(n<=0){
-            return Status::Error("SEGMENT_WRITE_FAILED");
-        }
-        p+=n;
-        len-=n;
+// Reads the next record; false on EOF, a partial record or a crc mismatch.
+static bool read_record(SequentialFile* f, string* key, string* val, bool* tombstone){
+    uint32_t stored_crc;
+    if(!read_exact(f, &stored_crc, sizeof(stored_crc)))return false;
+
+    uint32_t klen = 0, vlen = 0;
+
+    if(!read_exact(f,&klen,sizeof(klen)))return false;
+    if(!read_exact(f,&vlen,sizeof(vlen)))return false;
+    uint32_t stored_vlen=vlen;
+    *tombstone = vlen==TOMBSTONE;
+    if(*tombstone) vlen=0;
+
+    vector<char>buf(sizeof(klen)+sizeof(vlen)+klen+vlen);
+    size_t off=0;
+    memcpy(buf.data()+off,&klen,sizeof(klen));off+=sizeof(klen);
+    memcpy(buf.data()+off,&stored_vlen,sizeof(vlen));off+=sizeof(vlen);
+
+    if(!read_exact(f,buf.data()+off,klen+vlen))return false;
+
+    uint32_t calc_crc=crc32(
+        0,
+        reinterpret_cast<const Bytef*>(buf.data()),
+        buf.size()
+    );
+
+    if(calc_crc!=stored_crc){
+        return false;
     }
+
+    key->assign(buf.data()+sizeof(klen)+sizeof(vlen),klen);
+    val->assign(buf.data()+sizeof(klen)+sizeof(vlen)+klen,vlen);
+    return true;
+}
+
+// Calls fn for each record of an old-format segment, in file order.
+template <typename Fn>
+static Status scan_old_segment(Env* env, const string &path, Fn fn){
+    SequentialFile* f = nullptr;
+    if(!env->newSequentialFile(path, &f).ok())return Status::IOError("SEGMENT_OPEN_FAILED");
+    string key,val;
+    bool tombstone;
+    while(read_record(f,&key,&val,&tombstone)){
+        if(!fn(key,val,tombstone)) break;
+    }
+    delete f;
     return Status::OK();
 }
 
-Status write_segment(
-    const string &path,
-    const unordered_map<string, string> &data
-){
-    int fd=open (path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
-    if(fd<0)return Status::Error("SEGMENT_OPEN_FAILED");
+/* ---------------- the plain format ---------------- */
 
-    for(const auto&[key,value]:data){
-        uint32_t klen=key.size();
-        uint32_t vlen=value.size();
+struct PlainFooter {
+    uint64_t size;      // of the records
+    uint64_t count;
+    uint32_t crc;
+};
 
-        vector<char>buf(sizeof(klen)+sizeof(vlen)+klen+vlen);
-        size_t off=0;
+// False if the last PLAIN_FOOTER_SIZE bytes of a file of file_size bytes
+// are not a plain footer.
+static bool decode_plain_footer(const char* p, uint64_t file_size, PlainFooter* footer){
+    uint64_t magic;
+    memcpy(&magic, p + 24, 8);
+    if(magic != PLAIN_MAGIC) return false;
+    memcpy(&footer->size, p, 8);
+    memcpy(&footer->count, p + 8, 8);
+    memcpy(&footer->crc, p + 16, 4);
+    return footer->size == file_size - PLAIN_FOOTER_SIZE;
+}
 
-        memcpy(buf.data()+off,&klen,sizeof(klen));off+=sizeof(klen);
-        memcpy(buf.data()+off,&vlen,sizeof(vlen));off+=sizeof(vlen);
-        memcpy(buf.data()+off,key.data(),klen);off+=klen;
-        memcpy(buf.data()+off,value.data(),vlen);
+// Calls fn(offset, key, value, tombstone) for each of the count records in
+// data; false if they do not fill it exactly.
+template <typename Fn>
+static bool walk_plain(string_view data, uint64_t count, Fn fn){
+    uint64_t off = 0;
+    for(uint64_t i = 0; i < count; i++){
+        if(data.size() - off < 8) return false;
+        uint32_t klen, vlen;
+        memcpy(&klen, data.data() + off, 4);
+        memcpy(&vlen, data.data() + off + 4, 4);
+        uint64_t vsize = vlen == TOMBSTONE ? 0 : vlen;
+        if(data.size() - off - 8 < klen + vsize) return false;
+        fn(off, data.substr(off + 8, klen), data.substr(off + 8 + klen, vsize), vlen == TOMBSTONE);
+        off += 8 + klen + vsize;
+    }
+    return off == data.size();
+}
 
-        uint32_t crc=crc32(
-            0,
-            reinterpret_cast<const Bytef*>(buf.data()),
-            buf.size()
-        );
-        if(
-            write(fd,&crc,sizeof(crc))!=sizeof(crc) ||
-            write(fd,buf.data(),buf.size())!= (ssize_t)(buf.size())
+// Tells a plain segment from the rest by the magic in its last 8 bytes.
+static Status read_format(Env* env, const string &path, RandomAccessFile* f, SegmentFormat* format){
+    uint64_t size = 0;
+    if(!env->getFileSize(path, &size).ok()) return Status::IOError("SEGMENT_OPEN_FAILED");
+    uint64_t magic = 0;
+    size_t got = 0;
+    if(size >= 8 && (!f->pread(size - 8, 8, reinterpret_cast<char*>(&magic), &got).ok() || got != 8)){
+        return Status::IOError("SEGMENT_READ_FAILED");
+    }
+    *format = magic == PLAIN_MAGIC ? SegmentFormat::PLAIN : SegmentFormat::BLOCK;
+    return Status::OK();
+}
+
+// The format options gives, or else the one read from the file.
+static Status segment_format(Env* env, const string &path, RandomAccessFile* f, const SegmentReadOptions &options,
+                             SegmentFormat* format){
+    if(!options.format_known) return read_format(env, path, f, format);
+    *format = options.format;
+    return Status::OK();
+}
 
-        ){
-            close(fd);
-            return Status::Error("SEGMENT_WRITE_FAILED");
+// The records of a plain segment through a RandomAccessFile, for callers
+// without one open.
+static Status read_plain(Env* env, const string &path, RandomAccessFile* f, string* records, uint64_t* count){
+    uint64_t size = 0;
+    char buf[PLAIN_FOOTER_SIZE];
+    size_t got = 0;
+    PlainFooter footer;
+    if(!env->getFileSize(path, &size).ok()) return Status::IOError("SEGMENT_OPEN_FAILED");
+    if(size < PLAIN_FOOTER_SIZE ||
+       !f->pread(size - PLAIN_FOOTER_SIZE, PLAIN_FOOTER_SIZE, buf, &got).ok() || got != PLAIN_FOOTER_SIZE ||
+       !decode_plain_footer(buf, size, &footer)){
+        return Status::Corruption("SEGMENT_CORRUPTED");
+    }
+    records->resize(footer.size);
+    if(!f->pread(0, footer.size, &(*records)[0], &got).ok() || got != footer.size ||
+       crc32(0, reinterpret_cast<const Bytef*>(records->data()), records->size()) != footer.crc){
+        return Status::Corruption("SEGMENT_CORRUPTED");
+    }
+    *count = footer.count;
+    return Status::OK();
+}
+
+static Status write_plain(Env* env, const string &path, const vector<SegmentRecord> &records){
+    WritableFile* f = nullptr;
+    if(!env->newWritableFile(path, &f).ok())return Status::IOError("SEGMENT_OPEN_FAILED");
+    string buf;
+    uint64_t size = 0;
+    uint32_t crc = crc32(0, nullptr, 0);
+    bool ok = true;
+    auto drain = [&](){
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(buf.data()), buf.size());
+        size += buf.size();
+        ok = ok && f->append(buf.data(), buf.size()).ok();
+        buf.clear();
+    };
+    for(const auto &r : records){
+        append_record(&buf, r.key, r.value, r.tombstone);
+        if(buf.size() >= (1 << 20)) drain();
+    }
+    drain();
+    char footer[PLAIN_FOOTER_SIZE] = {0};
+    uint64_t count = records.size();
+    memcpy(footer, &size, 8);
+    memcpy(footer + 8, &count, 8);
+    memcpy(footer + 16, &crc, 4);
+    memcpy(footer + 24, &PLAIN_MAGIC, 8);
+    ok = ok && f->append(footer, sizeof(footer)).ok() && f->sync().ok();
+    f->close();
+    delete f;
+    return ok ? Status::OK() : Status::IOError("SEGMENT_WRITE_FAILED");
+}
+
+/*
+    The index is a power-of-two array of at least twice as many slots as
+    records, probed linearly. A slot is 0 when empty, else the top 24 bits
+    of the key's hash over the record's offset + 1, so a probe rarely
+    compares a key that is not the one asked for.
+*/
+class PlainSegmentImpl : public PlainSegment {
+    static const uint64_t OFFSET_MASK = (1ull << 40) - 1;
+
+    unique_ptr<ReadOnlyMmapFile> file_;
+    const char* records_;
+    uint64_t count_;
+    vector<uint64_t> index_;
+    size_t mask_;
+
+    public:
+        PlainSegmentImpl(ReadOnlyMmapFile* file, uint64_t count) : file_(file), records_(file->base()), count_(count) {
+            size_t slots = 1;
+            while(slots < 2 * count) slots <<= 1;
+            index_.assign(slots, 0);
+            mask_ = slots - 1;
+        }
+
+        // Indexes a record; false once the file is too big to point into.
+        bool add(uint64_t offset, string_view key){
+            if(offset + 1 > OFFSET_MASK) return false;
+            uint64_t h = hash<string_view>()(key);
+            size_t i = h & mask_;
+            while(index_[i] != 0) i = (i + 1) & mask_;
+            index_[i] = (h & ~OFFSET_MASK) | (offset + 1);
+            return true;
+        }
+
+        Status get(string_view key, string_view* value) const override{
+            uint64_t h = hash<string_view>()(key);
+            for(size_t i = h & mask_;; i = (i + 1) & mask_){
+                uint64_t slot = index_[i];
+                if(slot == 0) return Status::NotFound();
+                if((slot & ~OFFSET_MASK) != (h & ~OFFSET_MASK)) continue;
+                const char* p = records_ + (slot & OFFSET_MASK) - 1;
+                uint32_t klen, vlen;
+                memcpy(&klen, p, 4);
+                memcpy(&vlen, p + 4, 4);
+                if(string_view(p + 8, klen) != key) continue;
+                if(vlen == TOMBSTONE) return Status::Deleted();
+                *value = string_view(p + 8 + klen, vlen);
+                return Status::OK();
+            }
+        }
+
+        uint64_t count() const override{
+            return count_;
         }
+};
+
+Status ReadSegmentFormat(Env* env, const string &path, SegmentFormat* format){
+    RandomAccessFile* raw = nullptr;
+    if(!env->newRandomAccessFile(path, &raw).ok()) return Status::IOError("SEGMENT_OPEN_FAILED");
+    unique_ptr<RandomAccessFile> f(raw);
+    return read_format(env, path, f.get(), format);
+}
+
+Status OpenPlainSegment(Env* env, const string &path, PlainSegment** out){
+    *out = nullptr;
+    uint64_t size = 0;
+    if(!env->getFileSize(path, &size).ok()) return Status::IOError("SEGMENT_OPEN_FAILED");
+    if(size < PLAIN_FOOTER_SIZE) return Status::NotSupported();
+    // only plain segments are worth mapping
+    RandomAccessFile* f = nullptr;
+    if(!env->newRandomAccessFile(path, &f).ok()) return Status::IOError("SEGMENT_OPEN_FAILED");
+    char buf[PLAIN_FOOTER_SIZE];
+    size_t got = 0;
+    PlainFooter footer;
+    bool plain = f->pread(size - PLAIN_FOOTER_SIZE, PLAIN_FOOTER_SIZE, buf, &got).ok() &&
+                 got == PLAIN_FOOTER_SIZE && decode_plain_footer(buf, size, &footer);
+    delete f;
+    if(!plain) return Status::NotSupported();
+
+    // The file may be gone, or replaced, since its size was read; the
+    // mapping fails rather than cover bytes a shorter file does not have.
+    ReadOnlyMmapFile* raw = nullptr;
+    Status s = env->newReadOnlyMmapFile(path, footer.size + PLAIN_FOOTER_SIZE, &raw);
+    if(!s.ok()) return s;
+    unique_ptr<ReadOnlyMmapFile> file(raw);
+    string_view records(file->base(), footer.size);
+    if(crc32(0, reinterpret_cast<const Bytef*>(records.data()), records.size()) != footer.crc){
+        return Status::Corruption("SEGMENT_CORRUPTED");
     }
-    fsync(fd);
-    close(fd);
+    if(footer.count > footer.size / 8) return Status::Corruption("SEGMENT_CORRUPTED");
+
+    auto segment = make_unique<PlainSegmentImpl>(file.release(), footer.count);
+    bool fits = true;
+    if(!walk_plain(records, footer.count, [&](uint64_t off, string_view key, string_view, bool){
+        fits = fits && segment->add(off, key);
+    })){
+        return Status::Corruption("SEGMENT_CORRUPTED");
+    }
+    if(!fits) return Status::NotSupported("SEGMENT_TOO_LARGE");
+    *out = segment.release();
     return Status::OK();
 }
 
-Status read_segment(
+/* ---------------- segments ---------------- */
+
+Status write_segment(
+    Env* env,
     const string &path,
-    unordered_map<string, string> &out
+    const unordered_map<string, string> &data,
+    const unordered_set<string> *deleted,
+    const SegmentWriteOptions &options
 ){
-    int fd=open(path.c_str(),O_RDONLY);
-    if(fd<0)return Status::Error("SEGMENT_OPEN_FAILED");
-
-    while(true){
-        uint32_t stored_crc;
-        if(read(fd, &stored_crc, sizeof(stored_crc)) != sizeof(stored_crc))break;
+    vector<SegmentRecord> records;
+    records.reserve(data.size() + (deleted ? deleted->size() : 0));
+    for(const auto &[key, value] : data) records.push_back({key, value, false});
+    if(deleted){
+        for(const auto &key : *deleted) records.push_back({key, string_view(), true});
+    }
+    return write_segment(env, path, move(records), options);
+}
 
-        uint32_t klen,vlen;
+Status write_segment(
+    Env* env,
+    const string &path,
+    vector<SegmentRecord> records,
+    const SegmentWriteOptions &options
+){
+    const Comparator* cmp = options.comparator;
+    sort(records.begin(), records.end(), [cmp](const SegmentRecord &a, const SegmentRecord &b){
+        return cmp->compare(a.key, b.key) < 0;
+    });
+    if(options.format == SegmentFormat::PLAIN) return write_plain(env, path, records);
 
-        if(read(fd,&klen,sizeof(klen))!=sizeof(klen))break;
-        if(read(fd,&vlen,sizeof(vlen))!=sizeof(vlen))break;
+    WritableFile* f = nullptr;
+    if(!env->newWritableFile(path, &f).ok())return Status::IOError("SEGMENT_OPEN_FAILED");
 
-        vector<char>buf(sizeof(klen)+sizeof(vlen)+klen+vlen);
-        size_t off=0;
-        memcpy(buf.data()+off,&klen,sizeof(klen));off+=sizeof(klen);
-        memcpy(buf.data()+off,&vlen,sizeof(vlen));off+=sizeof(vlen);
+    string dict;
+    if(options.compression == CompressionType::ZLIB && options.dictionary_bytes > 0 && !records.empty()){
+        dict = sample_dictionary(records, options.dictionary_bytes);
+    }
 
-        if(read(fd,buf.data()+off,klen+vlen)!=(ssize_t)(klen+vlen))break;
+    uint64_t offset = 0;
+    BlockBuilder block, index;
+    bool ok = true;
+    // next_key: first key of the next block, nullptr after the last
+    auto finish_block = [&](string_view last_key, const string_view* next_key){
+        BlockHandle h;
+        if(!write_block(f, block.finish(), options.compression, dict, &offset, &h)) return false;
+        string handle(12, '\0');
+        memcpy(&handle[0], &h.offset, 8);
+        memcpy(&handle[8], &h.size, 4);
+        string sep(last_key);
+        if(next_key) cmp->findShortestSeparator(&sep, *next_key);
+        else cmp->findShortSuccessor(&sep);
+        index.add(sep, handle);
+        return true;
+    };
+    for(size_t i = 0; ok && i < records.size(); i++){
+        block.add(records[i].key, records[i].value, records[i].tombstone);
+        if(block.size() >= options.block_size || i + 1 == records.size()){
+            ok = finish_block(records[i].key, i + 1 < records.size() ? &records[i + 1].key : nullptr);
+        }
+    }
 
-        uint32_t calc_crc=crc32(
-            0,
-            reinterpret_cast<const Bytef*>(buf.data()),
-            buf.size()
-        );
+    // the meta block itself is never compressed
+    BlockHandle meta_handle{0, 0}, index_handle;
+    if(ok && !dict.empty()){
+        BlockBuilder meta;
+        meta.add(DICTIONARY_KEY, dict);
+        ok = write_block(f, meta.finish(), CompressionType::NONE, "", &offset, &meta_handle);
+    }
+    // prefixes only order keys for the bytewise comparator
+    bool prefixed = options.index_prefixes && cmp == BytewiseComparator();
+    if(ok) ok = write_block(f, index.finish(prefixed), options.compression, dict, &offset, &index_handle);
+    if(ok){
+        char footer[FOOTER_SIZE];
+        uint64_t meta_size = meta_handle.size, index_size = index_handle.size;
+        memcpy(footer, &meta_handle.offset, 8);
+        memcpy(footer + 8, &meta_size, 8);
+        memcpy(footer + 16, &index_handle.offset, 8);
+        memcpy(footer + 24, &index_size, 8);
+        memcpy(footer + 32, prefixed ? &SEGMENT_MAGIC : &SEGMENT_MAGIC_V3, 8);
+        ok = f->append(footer, sizeof(footer)).ok();
+    }
+    if(!ok){
+        delete f;
+        return Status::IOError("SEGMENT_WRITE_FAILED");
+    }
+    Status s=f->sync();
+    f->close();
+    delete f;
+    return s.ok() ? Status::OK() : Status::IOError("SEGMENT_WRITE_FAILED");
+}
 
-        if(calc_crc!=stored_crc){
-            break;
+Status read_segment(
+    Env* env,
+    const string &path,
+    unordered_map<string, string> &out,
+    unordered_set<string> *deleted,
+    const SegmentReadOptions &options
+){
+    auto apply = [&](const string &key, const string &val, bool tombstone){
+        if(tombstone){
+            out.erase(key);
+            if(deleted) deleted->insert(key);
+        } else {
+            out[key]=val;
+            if(deleted) deleted->erase(key);
         }
+        return true;
+    };
 
-        string key(buf.data()+sizeof(klen)+sizeof(vlen),klen);
-        string val(buf.data()+sizeof(klen)+sizeof(vlen)+klen,vlen);
+    RandomAccessFile* raw = nullptr;
+    if(!env->newRandomAccessFile(path, &raw).ok())return Status::IOError("SEGMENT_OPEN_FAILED");
+    unique_ptr<RandomAccessFile> f(raw);
+    SegmentFormat format;
+    Status s = segment_format(env, path, f.get(), options, &format);
+    if(!s.ok()) return s;
+    if(format == SegmentFormat::PLAIN){
+        // checked whole before any record merges
+        string records;
+        uint64_t count;
+        s = read_plain(env, path, f.get(), &records, &count);
+        if(!s.ok()) return s;
+        if(!walk_plain(records, count, [&](uint64_t, string_view key, string_view val, bool tombstone){
+            apply(string(key), string(val), tombstone);
+        })){
+            return Status::Corruption("SEGMENT_CORRUPTED");
+        }
+        return Status::OK();
+    }
+    Footer footer;
+    if(!read_footer(env, path, f.get(), &footer)){
+        return scan_old_segment(env, path, apply);
+    }
 
-        out[key]=val;
+    string dict, index;
+    if(!read_dictionary(f.get(), footer, options, &dict)) return Status::Corruption("SEGMENT_CORRUPTED");
+    if(!read_decoded(f.get(), footer.index, &dict, &index)) return Status::Corruption("SEGMENT_CORRUPTED");
+    BlockReader ir(index, footer.prefixed_index);
+    string index_key, handle_bytes, key, val;
+    bool tombstone;
+    for(uint32_t i = 0; i < ir.count(); i++){
+        BlockHandle h;
+        string block;
+        if(!ir.record(i, &index_key, &handle_bytes, &tombstone) || !decode_handle(handle_bytes, &h) ||
+           !read_decoded(f.get(), h, &dict, &block)){
+            return Status::Corruption("SEGMENT_CORRUPTED");
+        }
+        BlockReader br(block);
+        for(uint32_t j = 0; j < br.count(); j++){
+            if(!br.record(j, &key, &val, &tombstone)) return Status::Corruption("SEGMENT_CORRUPTED");
+            apply(key, val, tombstone);
+        }
     }
-    close(fd);
     return Status::OK();
+}
+
+Status search_segment(
+    Env* env,
+    const string &path,
+    const string &key,
+    string* value,
+    const SegmentReadOptions &options
+){
+    RandomAccessFile* raw = nullptr;
+    if(!env->newRandomAccessFile(path, &raw).ok())return Status::IOError("SEGMENT_OPEN_FAILED");
+    unique_ptr<RandomAccessFile> f(raw);
+    SegmentFormat format;
+    Status s = segment_format(env, path, f.get(), options, &format);
+    if(!s.ok()) return s;
+    if(format == SegmentFormat::PLAIN){
+        string records;
+        uint64_t count;
+        s = read_plain(env, path, f.get(), &records, &count);
+        if(!s.ok()) return s;
+        Status result = Status::NotFound();
+        if(!walk_plain(records, count, [&](uint64_t, string_view k, string_view v, bool tombstone){
+            if(k != key) return;
+            if(tombstone){
+                result = Status::Deleted();
+            } else {
+                *value = string(v);
+                result = Status::OK();
+            }
+        })){
+            return Status::Corruption("SEGMENT_CORRUPTED");
+        }
+        return result;
+    }
+    Footer footer;
+    if(!read_footer(env, path, f.get(), &footer)){
+        Status result = Status::NotFound();
+        Status s = scan_old_segment(env, path, [&](const string &k, const string &v, bool tombstone){
+            if(k != key) return true;
+            if(tombstone){
+                result = Status::Deleted();
+            } else {
+                *value = v;
+                result = Status::OK();
+            }
+            return false;
+        });
+        return s.ok() ? result : s;
+    }
 
-}
\ No newline at end of file
+    // A block that fails its crc or does not parse may hold the key, so it
+    // is reported rather than read as not holding it.
+    const Status corrupted = Status::Corruption("SEGMENT_CORRUPTED");
+    string dict;
+    if(!read_dictionary(f.get(), footer, options, &dict)) return corrupted;
+
+    // the first block whose index key is >= key is the only one that can hold it
+    BlockRef index = fetch_block(f.get(), footer.index, &dict, options);
+    if(!index) return corrupted;
+    BlockReader ir(*index, footer.prefixed_index);
+    uint32_t pos;
+    string k, v;
+    bool tombstone;
+    if(!ir.lower_bound(key, options.comparator, &pos)) return corrupted;
+    if(pos == ir.count()) return Status::NotFound();
+    BlockHandle h;
+    if(!ir.record(pos, &k, &v, &tombstone) || !decode_handle(v, &h)) return corrupted;
+
+    BlockRef block = fetch_block(f.get(), h, &dict, options);
+    if(!block) return corrupted;
+    BlockReader br(*block);
+    if(!br.lower_bound(key, options.comparator, &pos)) return corrupted;
+    if(pos == br.count()) return Status::NotFound();
+    if(!br.record(pos, &k, &v, &tombstone)) return corrupted;
+    if(k != key) return Status::NotFound();
+    if(tombstone) return Status::Deleted();
+    *value = move(v);
+    return Status::OK();
+}
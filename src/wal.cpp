@@ -1,47 +1,126 @@
 #include "wal.h"
-#include <fstream>
+#include "write_batch.h"
 #include <mutex>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <algorithm>
 #include <cstring>
-#include <unistd.h>
-#include <fcntl.h>
 #include <functional>
-#include <sys/stat.h>
 #include <zlib.h>
 
 using namespace std;
 
 /*
     | uint32 checksum |
-    | uint8  type     |   (1 = PUT, 2 = DEL)
+    | uint8  type     |   (3 = PUT, 4 = DEL)
+    | uint64 seq      |
     | uint32 key_len  |
     | uint32 val_len  |
     | key bytes       |
     | value bytes     |  (only for PUT)
+
+    Types 1 and 2 are the original PUT/DEL records, which have no seq
+    field; they are still read so old logs replay.
 */
 
-static const uint8_t REC_PUT = 1;
-static const uint8_t REC_DEL = 2;
+static const uint8_t REC_PUT_V1 = 1;
+static const uint8_t REC_DEL_V1 = 2;
+static const uint8_t REC_PUT = 3;
+static const uint8_t REC_DEL = 4;
+
+static size_t header_size(uint8_t type){
+    return (type == REC_PUT_V1 || type == REC_DEL_V1) ? 4 + 1 + 4 + 4 : 4 + 1 + 8 + 4 + 4;
+}
+
+// Parses the record at p. Returns its size, 0 if incomplete, -1 if invalid.
+// With verify false the checksum is left for a later pass.
+static long parse_record(const char* p, size_t avail, uint64_t* seq, uint8_t* type, uint32_t* klen, uint32_t* vlen, const char** kv,
+                         bool verify = true){
+    if(avail < 5) return 0;
+    uint8_t t = static_cast<uint8_t>(p[4]);
+    if(t != REC_PUT && t != REC_DEL && t != REC_PUT_V1 && t != REC_DEL_V1) return -1;
+
+    size_t hdr = header_size(t);
+    if(avail < hdr) return 0;
+
+    size_t off = 5;
+    *seq = 0;
+    if(t == REC_PUT || t == REC_DEL){
+        memcpy(seq, p + off, 8);
+        off += 8;
+    }
+    memcpy(klen, p + off, 4); off += 4;
+    memcpy(vlen, p + off, 4); off += 4;
+
+    uint64_t total = hdr + static_cast<uint64_t>(*klen) + *vlen;
+    if(avail < total) return 0;
+
+    if(verify){
+        uint32_t stored_crc;
+        memcpy(&stored_crc, p, 4);
+        uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(p + 4), total - 4);
+        if(crc != stored_crc) return -1;
+    }
+
+    *type = t;
+    *kv = p + hdr;
+    return total;
+}
+
+size_t DecodeWalRecords(const char* data, size_t len, const WalRecordFn &fn, bool* corrupt){
+    if(corrupt) *corrupt = false;
+    size_t off = 0;
+    string key, value;
+    while(off < len){
+        uint64_t seq;
+        uint8_t type;
+        uint32_t klen, vlen;
+        const char* kv;
+        long n = parse_record(data + off, len - off, &seq, &type, &klen, &vlen, &kv);
+        if(n == 0) break;
+        if(n < 0){
+            if(corrupt) *corrupt = true;
+            break;
+        }
+        key.assign(kv, klen);
+        if(type == REC_PUT || type == REC_PUT_V1){
+            value.assign(kv + klen, vlen);
+            fn(seq, WalOpType::PUT, key, value);
+        }else{
+            fn(seq, WalOpType::DEL, key, "");
+        }
+        off += n;
+    }
+    return off;
+}
 
 class WALImpl:public WAL{
 
     private:
+        Env* env_;
         string path_;
-        int fd_;
+        WritableFile* file_;
+        // Length of the log up to the end of its last synced record. After a
+        // failed append or sync the file may hold a partial record past it,
+        // which would hide every later record from replay.
+        uint64_t good_ = 0;
+        bool broken_ = false;
         mutex mu_;
+        function<void(const char*, size_t)> listener_;
 
-        Status append(uint8_t type, const string &key, const string &value){
-            lock_guard<mutex> lock(mu_);
-
+        // Encodes one record (crc first) onto the end of buf.
+        static void encode(vector<char> &buf, uint8_t type, uint64_t seq, const string &key, const string &value){
             uint32_t klen = key.size();
-            uint32_t vlen = value.size();
+            uint32_t vlen = type == REC_PUT ? value.size() : 0;
 
-            vector<char>buf;
-            buf.resize(1 + 4 + 4 + klen + vlen);
-            
-            size_t off = 0;
+            size_t start = buf.size();
+            buf.resize(start + header_size(type) + klen + vlen);
+
+            size_t off = start + 4;
             buf[off++] = type;
 
+            memcpy(&buf[off], &seq, 8);off +=8;
             memcpy(&buf[off], &klen, 4);off +=4;
             memcpy(&buf[off], &vlen, 4);off +=4;
             memcpy(&buf[off], key.data(), klen);off +=klen;
@@ -50,98 +129,347 @@ class WALImpl:public WAL{
             }
 
             uint32_t crc = crc32(0,
-                reinterpret_cast<const Bytef *>(buf.data()),
-                buf.size() 
+                reinterpret_cast<const Bytef *>(buf.data() + start + 4),
+                buf.size() - start - 4
             );
+            memcpy(&buf[start], &crc, 4);
+        }
 
-            write(fd_, &crc, 4);
-            write(fd_, buf.data(), buf.size());
-
-            fsync(fd_);
+        // Cuts the log back to good_ by copying that prefix over it, then
+        // reopens it for appending. Caller holds mu_.
+        Status repair(){
+            if(file_ != nullptr){
+                file_->close();
+                delete file_;
+                file_ = nullptr;
+            }
+            string tmp = path_ + ".tmp";
+            Status s = CopyFile(env_, path_, tmp, good_);
+            if(s.ok()) s = env_->renameFile(tmp, path_);
+            if(s.ok()) s = env_->newAppendableFile(path_, &file_);
+            if(!s.ok()){
+                env_->deleteFile(tmp);
+                file_ = nullptr;
+                return s;
+            }
+            broken_ = false;
             return Status::OK();
         }
 
+        // Caller holds mu_.
+        Status writeAndSync(const char* data, size_t len){
+            if(broken_){
+                Status s = repair();
+                if(!s.ok()) return s;
+            }
+            if(file_ == nullptr){
+                return Status::Busy("WAL_NOT_OPEN");
+            }
+            Status s = file_->append(data, len);
+            if(s.ok()) s = file_->sync();
+            if(!s.ok()){
+                broken_ = true;
+                return s;
+            }
+            good_ += len;
+            if(listener_) listener_(data, len);
+            return s;
+        }
+
+        Status append(uint8_t type, uint64_t seq, const string &key, const string &value){
+            lock_guard<mutex> lock(mu_);
+            vector<char>buf;
+            encode(buf, type, seq, key, value);
+            return writeAndSync(buf.data(), buf.size());
+        }
+
 
     public:
 
-        WALImpl(const string &path):path_(path), fd_(-1){
-            fd_ = open(path.c_str(), O_CREAT | O_APPEND| O_WRONLY, 0644);
+        WALImpl(Env* env, const string &path):env_(env), path_(path), file_(nullptr){
+            if(!env_->newAppendableFile(path, &file_).ok()){
+                file_ = nullptr;
+            }
+            if(file_ != nullptr && !env_->getFileSize(path, &good_).ok()){
+                good_ = 0;
+            }
+        }
+
+        Status appendPut(uint64_t seq, const string &key ,const string & value) override{
+            return append(REC_PUT, seq, key, value);
+        }
 
+        Status appendDel(uint64_t seq, const string &key) override{
+            return append(REC_DEL, seq, key, "");
         }
 
-        Status appendPut(const string &key ,const string & value) override{
-            return append(REC_PUT, key, value);
+        Status appendBatch(uint64_t first_seq, const WriteBatch &batch) override{
+            lock_guard<mutex> lock(mu_);
+            vector<char>buf;
+            uint64_t seq = first_seq;
+            for(const auto &op : batch.ops()){
+                encode(buf, op.type == WalOpType::PUT ? REC_PUT : REC_DEL, seq++, op.key, op.value);
+            }
+            return writeAndSync(buf.data(), buf.size());
         }
 
-        Status appendDel(const string &key) override{
-            return append(REC_DEL, key, "");
+        void setAppendListener(function<void(const char*, size_t)> fn) override{
+            lock_guard<mutex> lock(mu_);
+            listener_ = move(fn);
         }
 
         Status sync() override{
-            if(fd_<0){
-                return Status::Error("WAL_NOT_OPEN");
+            lock_guard<mutex> lock(mu_);
+            if(broken_){
+                Status s = repair();
+                if(!s.ok()) return s;
             }
-            fsync(fd_);
-            return Status::OK();
+            if(file_ == nullptr){
+                return Status::Busy("WAL_NOT_OPEN");
+            }
+            return file_->sync();
         }
 
-        Status replay(const function<void(WalOpType, const string&, const string&)>& fn) override {
-            
-            int rfd = open(path_.c_str(), O_RDONLY);
-            if (rfd < 0) return Status::OK();
-            while(true){
-                uint32_t stored_crc =0;
-                ssize_t n= read(rfd, &stored_crc, 4);
-                if(n==0)break; //EOF
-                if(n!=4)break; //partial
+        Status replay(const WalRecordFn& fn) override {
 
+            SequentialFile* rf = nullptr;
+            if (!env_->newSequentialFile(path_, &rf).ok()) return Status::OK();
 
-                uint8_t type;
-                uint32_t klen, vlen;
+            // Decoded in chunks; a record split across chunks is carried over.
+            string buf;
+            size_t off = 0;
+            char chunk[64 * 1024];
+            while(true){
+                size_t got = 0;
+                if(!rf->read(sizeof(chunk), chunk, &got).ok() || got == 0) break;
+                buf.erase(0, off);
+                buf.append(chunk, got);
+
+                bool corrupt = false;
+                off = DecodeWalRecords(buf.data(), buf.size(), fn, &corrupt);
+                if(corrupt) break; //corrupted record
+            }
+            delete rf;
+            return Status::OK();
+        }
 
-                if(read(rfd, &type,1)!=1)break;
-                if(read(rfd, &klen,4)!=4)break;
-                if(read(rfd, &vlen,4)!=4)break;
+        ~WALImpl(){
+            if(file_ != nullptr){
+                file_->close();
+                delete file_;
+            }
+        }
+};
 
-                vector<char>buf;
-                buf.resize(1 + 4 + 4 + klen + vlen);
+// Factory Implementation
+WAL* CreateWAL(Env* env, const string &path){
+    return new WALImpl(env, path);
+}
 
-                size_t off =0;
-                buf[off++] = type;
+Status ReadWalRecords(Env* env, const string &path, uint64_t offset, const WalRecordFn &fn, uint64_t* end){
+    *end = offset;
+    SequentialFile* f = nullptr;
+    Status s = env->newSequentialFile(path, &f);
+    if(!s.ok()) return s;
+    if(offset > 0) s = f->skip(offset);
+
+    string buf;
+    size_t off = 0;
+    char chunk[64 * 1024];
+    while(s.ok()){
+        size_t got = 0;
+        s = f->read(sizeof(chunk), chunk, &got);
+        if(!s.ok() || got == 0) break;
+        buf.erase(0, off);
+        buf.append(chunk, got);
+
+        bool corrupt = false;
+        off = DecodeWalRecords(buf.data(), buf.size(), fn, &corrupt);
+        *end += off;
+        if(corrupt) s = Status::Corruption("WAL_CORRUPTED");
+    }
+    delete f;
+    return s;
+}
 
-                memcpy(&buf[off], &klen, 4);off +=4;
-                memcpy(&buf[off], &vlen, 4);off +=4;
+Status ReadWalParallel(Env* env, const string &path, int threads, vector<UpdateRecord>* out){
+    out->clear();
+    uint64_t size = 0;
+    RandomAccessFile* f = nullptr;
+    Status s = env->getFileSize(path, &size);
+    if(s.ok()) s = env->newRandomAccessFile(path, &f);
+    if(!s.ok()) return s;
+    string buf(size, '\0');
+    size_t got = 0;
+    s = size > 0 ? f->pread(0, size, &buf[0], &got) : Status::OK();
+    delete f;
+    if(!s.ok()) return s;
+    buf.resize(got);
+
+    // Record boundaries come from the length fields alone, so this pass is
+    // cheap; checksums and copies are split across the threads below.
+    vector<size_t> offsets;
+    size_t off = 0;
+    while(off < buf.size()){
+        uint64_t seq;
+        uint8_t type;
+        uint32_t klen, vlen;
+        const char* kv;
+        long n = parse_record(buf.data() + off, buf.size() - off, &seq, &type, &klen, &vlen, &kv, false);
+        if(n <= 0) break;
+        offsets.push_back(off);
+        off += n;
+    }
+
+    size_t count = offsets.size();
+    out->resize(count);
+    threads = max(1, min<int>(threads, count / 1024 + 1));
+    vector<size_t> first_bad(threads, count);
+    auto decode = [&](int t){
+        size_t begin = count * t / threads, end = count * (t + 1) / threads;
+        for(size_t i = begin; i < end; i++){
+            const char* p = buf.data() + offsets[i];
+            uint64_t seq;
+            uint8_t type;
+            uint32_t klen, vlen;
+            const char* kv;
+            if(parse_record(p, buf.size() - offsets[i], &seq, &type, &klen, &vlen, &kv) < 0){
+                first_bad[t] = i;
+                return;
+            }
+            UpdateRecord &r = (*out)[i];
+            r.seq = seq;
+            r.key.assign(kv, klen);
+            if(type == REC_PUT || type == REC_PUT_V1){
+                r.type = WalOpType::PUT;
+                r.value.assign(kv + klen, vlen);
+            } else {
+                r.type = WalOpType::DEL;
+            }
+        }
+    };
+    vector<thread> workers;
+    for(int t = 1; t < threads; t++) workers.emplace_back(decode, t);
+    decode(0);
+    for(auto &w : workers) w.join();
+
+    // Like replay, everything from the first bad record on is dropped.
+    out->resize(*min_element(first_bad.begin(), first_bad.end()));
+    return Status::OK();
+}
 
-                if(read(rfd, buf.data()+off, klen + vlen)!=(ssize_t)(klen + vlen))break;
+uint64_t ReadFirstWalSeq(Env* env, const string &path){
+    SequentialFile* f = nullptr;
+    if(!env->newSequentialFile(path, &f).ok()) return 0;
+
+    // crc + type + seq; the rest of the record is not needed.
+    char hdr[13];
+    size_t have = 0;
+    while(have < sizeof(hdr)){
+        size_t got = 0;
+        if(!f->read(sizeof(hdr) - have, hdr + have, &got).ok() || got == 0) break;
+        have += got;
+    }
+    delete f;
+
+    uint64_t seq = 0;
+    if(have == sizeof(hdr) && (hdr[4] == REC_PUT || hdr[4] == REC_DEL)){
+        memcpy(&seq, hdr + 5, 8);
+    }
+    return seq;
+}
 
-                uint32_t crc = crc32(0,
-                    reinterpret_cast<const Bytef *>(buf.data()),
-                    buf.size() 
-                );
+class WalIteratorImpl : public UpdateIterator {
 
-                if(crc != stored_crc){
-                    break; //corrupted record
+    private:
+        Env* env_;
+        vector<string> logs_;
+        uint64_t start_seq_;
+
+        size_t log_idx_ = 0;
+        SequentialFile* file_ = nullptr;
+        string buf_;
+        size_t off_ = 0;
+
+        deque<UpdateRecord> pending_;
+        UpdateRecord rec_;
+        bool valid_ = false;
+        Status status_;
+
+        // Decodes at least one wanted record into pending_; false at the end.
+        bool fill(){
+            char chunk[64 * 1024];
+            while(pending_.empty()){
+                if(file_ == nullptr){
+                    while(log_idx_ + 1 < logs_.size()){
+                        uint64_t next_first = ReadFirstWalSeq(env_, logs_[log_idx_ + 1]);
+                        if(next_first == 0 || next_first > start_seq_) break;
+                        log_idx_++;
+                    }
+                    if(log_idx_ >= logs_.size()) return false;
+                    if(!env_->newSequentialFile(logs_[log_idx_], &file_).ok()){
+                        file_ = nullptr;
+                        status_ = Status::Incomplete("LOG_PURGED");
+                        return false;
+                    }
+                    buf_.clear();
+                    off_ = 0;
                 }
 
-                string key(buf.data() + 9, klen);
-                string value;
-                if(type == REC_PUT){
-                    value.assign(buf.data() + 9 + klen, vlen);
-                    fn(WalOpType::PUT, key, value);
-                }else if(type == REC_DEL){
-                    fn(WalOpType::DEL, key, "");
+                size_t got = 0;
+                if(!file_->read(sizeof(chunk), chunk, &got).ok() || got == 0){
+                    delete file_;
+                    file_ = nullptr;
+                    log_idx_++;
+                    continue;
+                }
+                buf_.erase(0, off_);
+                buf_.append(chunk, got);
+
+                bool corrupt = false;
+                off_ = DecodeWalRecords(buf_.data(), buf_.size(),
+                    [this](uint64_t seq, WalOpType type, const string &key, const string &value){
+                        if(seq == 0 || seq < start_seq_) return;
+                        pending_.push_back(UpdateRecord{seq, type, key, value});
+                    }, &corrupt);
+                if(corrupt){
+                    status_ = Status::Corruption("WAL_CORRUPTED");
+                    return false;
                 }
             }
-            close(rfd);
-            return Status::OK();
+            return true;
         }
 
-        ~WALImpl(){
-            if(fd_ != -1)close(fd_);
+    public:
+        WalIteratorImpl(Env* env, const vector<string> &logs, uint64_t start_seq)
+            :env_(env), logs_(logs), start_seq_(start_seq){
+            next();
+        }
+
+        ~WalIteratorImpl(){
+            delete file_;
+        }
+
+        bool valid() const override{
+            return valid_;
+        }
+
+        const UpdateRecord& record() const override{
+            return rec_;
+        }
+
+        void next() override{
+            valid_ = (!pending_.empty() || fill()) && status_.ok();
+            if(!valid_) return;
+            rec_ = move(pending_.front());
+            pending_.pop_front();
+        }
+
+        Status status() const override{
+            return status_;
         }
 };
 
-// Factory Implementation
-WAL* CreateWAL(const string &path){
-    return new WALImpl(path);
+UpdateIterator* NewWalIterator(Env* env, const vector<string> &logs, uint64_t start_seq){
+    return new WalIteratorImpl(env, logs, start_seq);
 }